@@ -0,0 +1,220 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// thread placement: the topology of the CPUs this process may run on (read from /sys), the order in which a
+// policy hands them out to threads, pinning of the calling thread, and the node a page is on
+//
+// policies:
+//   compact  every hardware thread of a core, then the next core of the same node, then the next node
+//   scatter  one core of each node in turn; the second hardware threads of the cores only once all cores are taken
+//   cores    the first hardware thread of every core, node by node, then the second ones, and so on
+//   nosmt    the first hardware thread of every core only (so fewer threads than CPUs if SMT is on)
+//
+// no libnuma is needed: pages are placed by the kernel on the node of the thread that first touches them, and
+// aad_arena_init() (aad_arena.h) touches them all from the calling (pinned) thread
+//
+
+#ifndef AAD_AFFINITY
+#define AAD_AFFINITY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define AAD_MAX_CPUS 1024
+
+typedef struct
+{
+  int cpu;
+  int node;
+  int package;
+  int core;        // core_id, as numbered by the kernel (unique within a package only)
+  int smt;         // which hardware thread of its core this is (0 for the first one)
+  int core_rank;   // which core of its node this is (0 for the first one)
+}
+aad_cpu_t;
+
+typedef struct
+{
+  const char *policy;
+  int n_cpus;                   // usable by the policy
+  aad_cpu_t cpus[AAD_MAX_CPUS]; // in the order they are handed out to threads
+  int n_nodes;
+  int n_packages;
+  int n_cores;
+  int smt;                      // hardware threads per core (the most seen)
+}
+aad_placement_t;
+
+static int aad_read_int(const char *path)
+{
+  FILE *fp = fopen(path,"r");
+  int value = -1;
+
+  if(fp != NULL)
+  {
+    if(fscanf(fp,"%d",&value) != 1)
+      value = -1;
+    fclose(fp);
+  }
+  return value;
+}
+
+static int aad_cpu_node(int cpu)
+{
+  char path[64];
+  struct dirent *entry;
+  int node = 0;
+
+  snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%d",cpu);
+  DIR *dir = opendir(path);
+  if(dir == NULL)
+    return 0;
+  while((entry = readdir(dir)) != NULL)
+    if(strncmp(entry->d_name,"node",4) == 0 && sscanf(entry->d_name + 4,"%d",&node) == 1)
+      break;
+  closedir(dir);
+  return node;
+}
+
+static uint64_t aad_placement_key(const char *policy,const aad_cpu_t *c)
+{
+  uint64_t node = (uint64_t)c->node,rank = (uint64_t)c->core_rank,smt = (uint64_t)c->smt;
+
+  if(strcmp(policy,"compact") == 0)
+    return (node << 40) | (rank << 20) | smt;
+  if(strcmp(policy,"scatter") == 0)
+    return (smt << 40) | (rank << 20) | node;
+  return (smt << 40) | (node << 20) | rank;  // cores and nosmt
+}
+
+static const char *aad_sort_policy;
+
+static int aad_compare_cpus(const void *a,const void *b)
+{
+  uint64_t ka = aad_placement_key(aad_sort_policy,(const aad_cpu_t *)a);
+  uint64_t kb = aad_placement_key(aad_sort_policy,(const aad_cpu_t *)b);
+
+  return (ka > kb) - (ka < kb);
+}
+
+//
+// reads the topology of the CPUs in the affinity mask of the process and orders them by policy
+// returns 0, or -1 if the policy is unknown or the topology cannot be read
+//
+__attribute__((unused))
+static int aad_placement_init(aad_placement_t *p,const char *policy)
+{
+  unsigned long mask[AAD_MAX_CPUS / (8 * sizeof(unsigned long))];
+  char path[96];
+
+  if(strcmp(policy,"compact") != 0 && strcmp(policy,"scatter") != 0 && strcmp(policy,"cores") != 0 &&
+     strcmp(policy,"nosmt") != 0)
+    return -1;
+  memset(p,0,sizeof(*p));
+  p->policy = policy;
+  memset(mask,0,sizeof(mask));
+  if(syscall(SYS_sched_getaffinity,0,sizeof(mask),mask) < 0)
+    return -1;
+
+  for(int cpu = 0;cpu < AAD_MAX_CPUS;cpu++)
+    if((mask[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long)))) & 1ul)
+    {
+      aad_cpu_t *c = &p->cpus[p->n_cpus++];
+      c->cpu = cpu;
+      c->node = aad_cpu_node(cpu);
+      snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",cpu);
+      c->package = aad_read_int(path);
+      snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%d/topology/core_id",cpu);
+      c->core = aad_read_int(path);
+      if(c->package < 0) c->package = 0;
+      if(c->core < 0) c->core = cpu;  // no topology: every CPU is a core of its own
+    }
+  if(p->n_cpus == 0)
+    return -1;
+
+  // the hardware threads of a core are numbered in CPU order, and the cores of a node in (package, core_id) order
+  for(int i = 0;i < p->n_cpus;i++)
+  {
+    aad_cpu_t *c = &p->cpus[i];
+    for(int j = 0;j < i;j++)
+      if(p->cpus[j].package == c->package && p->cpus[j].core == c->core)
+        c->smt++;
+    if(c->smt + 1 > p->smt)
+      p->smt = c->smt + 1;
+    if(c->smt == 0)
+      p->n_cores++;
+  }
+  for(int i = 0;i < p->n_cpus;i++)
+  {
+    aad_cpu_t *c = &p->cpus[i];
+    for(int j = 0;j < p->n_cpus;j++)
+    {
+      const aad_cpu_t *o = &p->cpus[j];
+      if(o->smt == 0 && o->node == c->node && (o->package < c->package || (o->package == c->package && o->core < c->core)))
+        c->core_rank++;
+    }
+  }
+  for(int i = 0;i < p->n_cpus;i++)
+  {
+    int new_node = 1,new_package = 1;
+    for(int j = 0;j < i;j++)
+    {
+      new_node &= p->cpus[j].node != p->cpus[i].node;
+      new_package &= p->cpus[j].package != p->cpus[i].package;
+    }
+    p->n_nodes += new_node;
+    p->n_packages += new_package;
+  }
+
+  aad_sort_policy = policy;
+  qsort(p->cpus,(size_t)p->n_cpus,sizeof(aad_cpu_t),aad_compare_cpus);
+  if(strcmp(policy,"nosmt") == 0)
+    p->n_cpus = p->n_cores;  // the first hardware threads sort first
+  return 0;
+}
+
+//
+// pins the calling thread to the CPU the placement gives to thread number thread; returns that CPU, or -1
+//
+__attribute__((unused))
+static int aad_pin_thread(const aad_placement_t *p,int thread)
+{
+  unsigned long mask[AAD_MAX_CPUS / (8 * sizeof(unsigned long))];
+  int cpu = p->cpus[thread % p->n_cpus].cpu;
+
+  memset(mask,0,sizeof(mask));
+  mask[cpu / (8 * sizeof(unsigned long))] |= 1ul << (cpu % (8 * sizeof(unsigned long)));
+  return (syscall(SYS_sched_setaffinity,0,sizeof(mask),mask) == 0) ? cpu : -1;
+}
+
+__attribute__((unused))
+static const aad_cpu_t *aad_placement_cpu(const aad_placement_t *p,int thread)
+{
+  return &p->cpus[thread % p->n_cpus];
+}
+
+//
+// the node the page holding p is on (-1 if the kernel does not say)
+//
+__attribute__((unused))
+static int aad_page_node(void *p)
+{
+  void *page = (void *)((uintptr_t)p & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1));
+  int status = -1;
+
+  if(syscall(SYS_move_pages,0,1ul,&page,NULL,&status,0) != 0)
+    return -1;
+  return status;
+}
+
+
+//
+// the end!
+//
+
+#endif
@@ -0,0 +1,227 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// per-thread arenas: one mapping per thread, carved into aligned buffers, and backed by huge pages when the
+// system has them, so that the batch buffers of a thread take one or two TLB entries instead of one per 4 KiB page
+//
+// page modes (each one falls back to the next if the system cannot give it):
+//   hugetlb  explicit huge pages (MAP_HUGETLB), from the pool reserved in /proc/sys/vm/nr_hugepages
+//   thp      transparent huge pages: a huge-page-aligned mapping marked with madvise(MADV_HUGEPAGE)
+//   small    ordinary pages
+//
+// every page is touched by the thread that sets the arena up, so that (the kernel placing pages on the node of
+// the thread that first touches them) a pinned thread gets memory of its own node
+//
+// also here: a counter of the dTLB load misses of the calling thread (perf_event_open, user space only), to see
+// what the huge pages save
+//
+
+#ifndef AAD_ARENA
+#define AAD_ARENA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define AAD_ARENA_SMALL    0
+#define AAD_ARENA_THP      1
+#define AAD_ARENA_HUGETLB  2
+
+typedef struct
+{
+  char *base;
+  size_t size;        // of the mapping
+  size_t used;
+  size_t page_size;   // of the pages that back it
+  int kind;           // AAD_ARENA_SMALL, AAD_ARENA_THP or AAD_ARENA_HUGETLB
+}
+aad_arena_t;
+
+static size_t aad_round_up(size_t x,size_t m)
+{
+  return (x + m - 1) / m * m;
+}
+
+static size_t aad_huge_page_size(void)
+{
+  FILE *fp = fopen("/proc/meminfo","r");
+  char line[128];
+  size_t kb = 0;
+
+  if(fp != NULL)
+  {
+    while(fgets(line,sizeof(line),fp) != NULL)
+      if(sscanf(line,"Hugepagesize: %zu kB",&kb) == 1)
+        break;
+    fclose(fp);
+  }
+  return (kb > 0) ? kb * 1024 : (size_t)2 << 20;
+}
+
+//
+// the bytes of the mapping holding p that the kernel backs with transparent huge pages (from /proc/self/smaps)
+//
+static size_t aad_thp_bytes(const void *p)
+{
+  FILE *fp = fopen("/proc/self/smaps","r");
+  char line[256];
+  unsigned long start,end;
+  size_t kb = 0;
+  int inside = 0;
+
+  if(fp == NULL)
+    return 0;
+  while(fgets(line,sizeof(line),fp) != NULL)
+    if(sscanf(line,"%lx-%lx ",&start,&end) == 2)
+      inside = (uintptr_t)p >= start && (uintptr_t)p < end;
+    else if(inside && sscanf(line,"AnonHugePages: %zu kB",&kb) == 1)
+      break;
+  fclose(fp);
+  return kb * 1024;
+}
+
+//
+// maps an arena of (at least) size bytes with the pages of mode (or of the modes after it) and touches all of
+// it; returns 0, or -1 if the mode is unknown or no memory could be mapped
+//
+__attribute__((unused))
+static int aad_arena_init(aad_arena_t *a,size_t size,const char *mode)
+{
+  const size_t small = (size_t)sysconf(_SC_PAGESIZE),huge = aad_huge_page_size();
+  int first;
+
+  if(strcmp(mode,"hugetlb") == 0)
+    first = AAD_ARENA_HUGETLB;
+  else if(strcmp(mode,"thp") == 0)
+    first = AAD_ARENA_THP;
+  else if(strcmp(mode,"small") == 0)
+    first = AAD_ARENA_SMALL;
+  else
+    return -1;
+  memset(a,0,sizeof(*a));
+#ifdef MAP_HUGETLB
+  if(first >= AAD_ARENA_HUGETLB)
+  {
+    void *p = mmap(NULL,aad_round_up(size,huge),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+    if(p != MAP_FAILED)
+    {
+      a->base = (char *)p;
+      a->size = aad_round_up(size,huge);
+      a->page_size = huge;
+      a->kind = AAD_ARENA_HUGETLB;
+    }
+  }
+#endif
+  if(a->base == NULL && first >= AAD_ARENA_THP)
+  {
+    // the kernel only uses a huge page for an aligned extent, so map one more and trim the ends
+    size_t mapped = aad_round_up(size,huge) + huge;
+    char *p = (char *)mmap(NULL,mapped,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(p != (char *)MAP_FAILED)
+    {
+      char *aligned = (char *)aad_round_up((uintptr_t)p,huge);
+      a->base = aligned;
+      a->size = aad_round_up(size,huge);
+      if(aligned > p)
+        munmap(p,(size_t)(aligned - p));
+      if(aligned + a->size < p + mapped)
+        munmap(aligned + a->size,(size_t)(p + mapped - (aligned + a->size)));
+      a->page_size = huge;
+      a->kind = AAD_ARENA_THP;
+      (void)madvise(a->base,a->size,MADV_HUGEPAGE);
+    }
+  }
+  if(a->base == NULL)
+  {
+    void *p = mmap(NULL,aad_round_up(size,small),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(p == MAP_FAILED)
+      return -1;
+    a->base = (char *)p;
+    a->size = aad_round_up(size,small);
+    a->page_size = small;
+    a->kind = AAD_ARENA_SMALL;
+  }
+  memset(a->base,0,a->size);
+  // transparent huge pages may be off, or none free: the memory is then just made of small pages
+  if(a->kind == AAD_ARENA_THP && aad_thp_bytes(a->base) == 0)
+  {
+    a->page_size = small;
+    a->kind = AAD_ARENA_SMALL;
+  }
+  return 0;
+}
+
+//
+// size bytes of the arena, aligned to alignment (a power of two); NULL if the arena is full
+//
+__attribute__((unused))
+static void *aad_arena_alloc(aad_arena_t *a,size_t size,size_t alignment)
+{
+  size_t offset = (a->used + alignment - 1) & ~(alignment - 1);
+
+  if(offset + size > a->size)
+    return NULL;
+  a->used = offset + size;
+  return a->base + offset;
+}
+
+__attribute__((unused))
+static void aad_arena_free(aad_arena_t *a)
+{
+  if(a->base != NULL)
+    munmap(a->base,a->size);
+  memset(a,0,sizeof(*a));
+}
+
+__attribute__((unused))
+static const char *aad_arena_kind_name(int kind)
+{
+  return (kind == AAD_ARENA_HUGETLB) ? "hugetlb" : (kind == AAD_ARENA_THP) ? "thp" : "small";
+}
+
+//
+// opens a counter of the dTLB load misses of the calling thread; returns its file descriptor, or -1 if there
+// are no perf events (kernel.perf_event_paranoid, a container, or no such hardware event)
+//
+__attribute__((unused))
+static int aad_tlb_counter_open(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr,0,sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+}
+
+//
+// reads and closes the counter; returns the misses counted, or -1
+//
+__attribute__((unused))
+static long long aad_tlb_counter_close(int fd)
+{
+  uint64_t count;
+  long long misses = -1;
+
+  if(fd < 0)
+    return -1;
+  if(read(fd,&count,sizeof(count)) == (ssize_t)sizeof(count))
+    misses = (long long)count;
+  close(fd);
+  return misses;
+}
+
+
+//
+// the end!
+//
+
+#endif
@@ -2,12 +2,26 @@
 #define AAD_DISTRIBUTED_H
 
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "aad_data_types.h"
 
+#if defined(__SSE4_2__)
+# include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+# include <arm_acle.h>
+#endif
+
 
 #define DETI_DEFAULT_PORT 9876
-#define DETI_PROTOCOL_VERSION 1
+#define DETI_PROTOCOL_VERSION 10
 #define WORK_RANGE_SIZE 100000000ULL
+#define DETI_DEFAULT_PROGRESS_INTERVAL 2.0
 
 typedef enum {
   MSG_CLIENT_HELLO = 1,
@@ -19,9 +33,29 @@ typedef enum {
   MSG_NO_WORK = 7,
   MSG_SHUTDOWN = 8,
   MSG_PING = 9,
-  MSG_PONG = 10
+  MSG_PONG = 10,
+  MSG_REPORT_COINS = 11,
+  MSG_PROGRESS = 12,
+  MSG_SHM_ATTACH = 13,
+  MSG_CANCEL_WORK = 14,
+  MSG_CLIENT_INFO = 15
 } message_type_t;
 
+// client_info_t.capabilities: the low bits hold the number of hashing threads, the high bits
+// announce optional protocol features; the server answers with the subset it also supports
+#define DETI_CAP_THREADS_MASK   0x0000FFFFu
+#define DETI_CAP_BATCH_REPORTS  0x00010000u
+#define DETI_CAP_CRC32C         0x00020000u
+#define DETI_CAP_PROGRESS       0x00040000u
+#define DETI_CAP_TEMPLATES      0x00080000u
+#define DETI_CAP_SHM            0x00100000u
+#define DETI_CAP_CANCEL         0x00200000u
+#define DETI_CAP_CLIENT_INFO    0x00400000u
+#define DETI_CAP_SYNTHETIC      0x00800000u   // a load generator, whose coins belong to no lease (dry runs only)
+
+#define DETI_SERVER_CAPABILITIES  (DETI_CAP_BATCH_REPORTS | DETI_CAP_CRC32C | DETI_CAP_PROGRESS | DETI_CAP_TEMPLATES | \
+                                   DETI_CAP_SHM | DETI_CAP_CANCEL | DETI_CAP_CLIENT_INFO)
+
 typedef struct {
   char hostname[64];
   char client_type[32];
@@ -29,6 +63,23 @@ typedef struct {
   uint32_t version;
 } client_info_t;
 
+// the rate the client measured for its kernel at startup, so that its first range is already sized for it; the
+// MSG_CLIENT_HELLO is always a plain client_info_t, and this follows the MSG_SERVER_HELLO as a MSG_CLIENT_INFO once
+// DETI_CAP_CLIENT_INFO has been negotiated (clients of protocol versions 8 and 9 sent it as their MSG_CLIENT_HELLO,
+// which servers still accept)
+typedef struct {
+  client_info_t base;
+  double benchmark_rate;   // nonces per second with every thread, 0 if unknown
+  char isa[16];            // of the kernel, e.g. "AVX2"
+  uint64_t client_id;      // the same after a restart (0 if unknown): the completions replayed from a client's
+                           // spool are only taken for ranges that were leased to the same id (protocol version 10)
+} client_info_ext_t;
+
+typedef struct {
+  uint32_t version;
+  uint32_t capabilities;
+} server_info_t;
+
 typedef struct {
   uint64_t start_nonce;
   uint64_t end_nonce;
@@ -36,6 +87,20 @@ typedef struct {
   uint32_t work_id;
 } work_assignment_t;
 
+// coin layout: "DETI coin 2 " (bytes 0..11), template (bytes 12..43), nonce (bytes 44..53), '\n'
+#define DETI_TEMPLATE_OFFSET 12
+#define DETI_TEMPLATE_BYTES 32
+#define DETI_NONCE_OFFSET 44
+#define DETI_NONCE_DIGITS 10
+
+// sent instead of work_assignment_t once DETI_CAP_TEMPLATES has been negotiated
+typedef struct {
+  work_assignment_t base;
+  uint32_t template_id;
+  uint32_t reserved;
+  u08_t template_bytes[DETI_TEMPLATE_BYTES];
+} work_assignment_ext_t;
+
 typedef struct {
   uint64_t nonce;
   uint32_t zeros;
@@ -44,6 +109,16 @@ typedef struct {
   u32_t hash[5];
 } coin_report_t;
 
+#define MAX_COINS_PER_BATCH 64
+
+typedef struct {
+  uint32_t count;
+  uint32_t reserved;
+  coin_report_t reports[];
+} coin_batch_t;
+
+#define COIN_BATCH_SIZE(n) (sizeof(coin_batch_t) + (size_t)(n) * sizeof(coin_report_t))
+
 typedef struct {
   uint32_t work_id;
   uint64_t nonces_tested;
@@ -51,6 +126,44 @@ typedef struct {
   double elapsed_time;
 } work_completion_t;
 
+// a completion that also names its range, for the server to credit after a reconnect, when the lease it
+// answers is gone (only if it was leased to the same client id); the client sends it whenever the server
+// assigned the template
+typedef struct {
+  work_completion_t base;
+  uint32_t template_id;
+  uint32_t reserved;
+  uint64_t start_nonce;
+} work_completion_ext_t;
+
+// MSG_SHM_ATTACH: a client on the same host as the server names the shared-memory segment it created
+// (see aad_shm_ring.h); the server answers with status 0 if it attached, and from then on both ends send
+// their frames through the segment instead of the socket
+typedef struct {
+  char name[64];
+  uint64_t token;
+  uint32_t status;
+  uint32_t reserved;
+} shm_attach_t;
+
+// MSG_CANCEL_WORK (server to client, if DETI_CAP_CANCEL was negotiated): stop hashing work_id before end_nonce,
+// or as soon as possible if end_nonce is not past its start; the client still sends the MSG_WORK_COMPLETE,
+// with the prefix it did hash
+typedef struct {
+  uint32_t work_id;
+  uint32_t reserved;
+  uint64_t end_nonce;
+} cancel_work_t;
+
+// sent periodically while a range is being hashed; [start_nonce, start_nonce + nonces_done) is done
+typedef struct {
+  uint32_t work_id;
+  uint32_t reserved;
+  uint64_t nonces_done;
+  double hash_rate;
+  double elapsed_time;
+} progress_report_t;
+
 typedef struct {
   uint32_t magic;
   uint16_t version;
@@ -61,6 +174,41 @@ typedef struct {
 
 #define PROTOCOL_MAGIC 0xDEA1C01Eu
 
+// message_header_t.version selects how the payload checksum is computed; the handshake always uses
+// the legacy frame, and both ends switch to CRC32C frames once DETI_CAP_CRC32C has been negotiated
+#define DETI_FRAME_VERSION_LEGACY 1
+#define DETI_FRAME_VERSION_CRC32C 2
+#define DETI_FRAME_VERSION_SHM 3     // no checksum: only used through shared memory, never on the network
+
+//
+// template bytes of a template id: printable ASCII, a bijective mix of the id in the first 10 bytes
+// (so different ids never give the same template) and filler derived from it in the others
+//
+
+static inline uint64_t deti_mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static inline void deti_template_bytes(uint32_t template_id, u08_t bytes[DETI_TEMPLATE_BYTES])
+{
+  uint64_t seed = deti_mix64((uint64_t)template_id + 0x9E3779B97F4A7C15ULL);
+  uint64_t x = seed;
+  
+  for(int i = 0; i < DETI_TEMPLATE_BYTES; i++)
+  {
+    if(i % 10 == 0 && i > 0)
+      x = deti_mix64(seed + (uint64_t)i);
+    bytes[i] = (u08_t)(32u + x % 95u);
+    x /= 95u;
+  }
+}
+
 static inline uint32_t simple_checksum(const void *data, size_t len)
 {
   uint32_t sum = 0;
@@ -70,13 +218,165 @@ static inline uint32_t simple_checksum(const void *data, size_t len)
   return sum;
 }
 
+// CRC32C (Castagnoli polynomial), table-driven fallback, one byte at a time; the table is constant (entry i is
+// i run through the reflected polynomial 0x82F63B78 eight times), so that concurrent callers share it safely
+static inline uint32_t crc32c_sw(const void *data, size_t len)
+{
+  static const uint32_t table[256] =
+  {
+    0x00000000u, 0xF26B8303u, 0xE13B70F7u, 0x1350F3F4u, 0xC79A971Fu, 0x35F1141Cu, 0x26A1E7E8u, 0xD4CA64EBu,
+    0x8AD958CFu, 0x78B2DBCCu, 0x6BE22838u, 0x9989AB3Bu, 0x4D43CFD0u, 0xBF284CD3u, 0xAC78BF27u, 0x5E133C24u,
+    0x105EC76Fu, 0xE235446Cu, 0xF165B798u, 0x030E349Bu, 0xD7C45070u, 0x25AFD373u, 0x36FF2087u, 0xC494A384u,
+    0x9A879FA0u, 0x68EC1CA3u, 0x7BBCEF57u, 0x89D76C54u, 0x5D1D08BFu, 0xAF768BBCu, 0xBC267848u, 0x4E4DFB4Bu,
+    0x20BD8EDEu, 0xD2D60DDDu, 0xC186FE29u, 0x33ED7D2Au, 0xE72719C1u, 0x154C9AC2u, 0x061C6936u, 0xF477EA35u,
+    0xAA64D611u, 0x580F5512u, 0x4B5FA6E6u, 0xB93425E5u, 0x6DFE410Eu, 0x9F95C20Du, 0x8CC531F9u, 0x7EAEB2FAu,
+    0x30E349B1u, 0xC288CAB2u, 0xD1D83946u, 0x23B3BA45u, 0xF779DEAEu, 0x05125DADu, 0x1642AE59u, 0xE4292D5Au,
+    0xBA3A117Eu, 0x4851927Du, 0x5B016189u, 0xA96AE28Au, 0x7DA08661u, 0x8FCB0562u, 0x9C9BF696u, 0x6EF07595u,
+    0x417B1DBCu, 0xB3109EBFu, 0xA0406D4Bu, 0x522BEE48u, 0x86E18AA3u, 0x748A09A0u, 0x67DAFA54u, 0x95B17957u,
+    0xCBA24573u, 0x39C9C670u, 0x2A993584u, 0xD8F2B687u, 0x0C38D26Cu, 0xFE53516Fu, 0xED03A29Bu, 0x1F682198u,
+    0x5125DAD3u, 0xA34E59D0u, 0xB01EAA24u, 0x42752927u, 0x96BF4DCCu, 0x64D4CECFu, 0x77843D3Bu, 0x85EFBE38u,
+    0xDBFC821Cu, 0x2997011Fu, 0x3AC7F2EBu, 0xC8AC71E8u, 0x1C661503u, 0xEE0D9600u, 0xFD5D65F4u, 0x0F36E6F7u,
+    0x61C69362u, 0x93AD1061u, 0x80FDE395u, 0x72966096u, 0xA65C047Du, 0x5437877Eu, 0x4767748Au, 0xB50CF789u,
+    0xEB1FCBADu, 0x197448AEu, 0x0A24BB5Au, 0xF84F3859u, 0x2C855CB2u, 0xDEEEDFB1u, 0xCDBE2C45u, 0x3FD5AF46u,
+    0x7198540Du, 0x83F3D70Eu, 0x90A324FAu, 0x62C8A7F9u, 0xB602C312u, 0x44694011u, 0x5739B3E5u, 0xA55230E6u,
+    0xFB410CC2u, 0x092A8FC1u, 0x1A7A7C35u, 0xE811FF36u, 0x3CDB9BDDu, 0xCEB018DEu, 0xDDE0EB2Au, 0x2F8B6829u,
+    0x82F63B78u, 0x709DB87Bu, 0x63CD4B8Fu, 0x91A6C88Cu, 0x456CAC67u, 0xB7072F64u, 0xA457DC90u, 0x563C5F93u,
+    0x082F63B7u, 0xFA44E0B4u, 0xE9141340u, 0x1B7F9043u, 0xCFB5F4A8u, 0x3DDE77ABu, 0x2E8E845Fu, 0xDCE5075Cu,
+    0x92A8FC17u, 0x60C37F14u, 0x73938CE0u, 0x81F80FE3u, 0x55326B08u, 0xA759E80Bu, 0xB4091BFFu, 0x466298FCu,
+    0x1871A4D8u, 0xEA1A27DBu, 0xF94AD42Fu, 0x0B21572Cu, 0xDFEB33C7u, 0x2D80B0C4u, 0x3ED04330u, 0xCCBBC033u,
+    0xA24BB5A6u, 0x502036A5u, 0x4370C551u, 0xB11B4652u, 0x65D122B9u, 0x97BAA1BAu, 0x84EA524Eu, 0x7681D14Du,
+    0x2892ED69u, 0xDAF96E6Au, 0xC9A99D9Eu, 0x3BC21E9Du, 0xEF087A76u, 0x1D63F975u, 0x0E330A81u, 0xFC588982u,
+    0xB21572C9u, 0x407EF1CAu, 0x532E023Eu, 0xA145813Du, 0x758FE5D6u, 0x87E466D5u, 0x94B49521u, 0x66DF1622u,
+    0x38CC2A06u, 0xCAA7A905u, 0xD9F75AF1u, 0x2B9CD9F2u, 0xFF56BD19u, 0x0D3D3E1Au, 0x1E6DCDEEu, 0xEC064EEDu,
+    0xC38D26C4u, 0x31E6A5C7u, 0x22B65633u, 0xD0DDD530u, 0x0417B1DBu, 0xF67C32D8u, 0xE52CC12Cu, 0x1747422Fu,
+    0x49547E0Bu, 0xBB3FFD08u, 0xA86F0EFCu, 0x5A048DFFu, 0x8ECEE914u, 0x7CA56A17u, 0x6FF599E3u, 0x9D9E1AE0u,
+    0xD3D3E1ABu, 0x21B862A8u, 0x32E8915Cu, 0xC083125Fu, 0x144976B4u, 0xE622F5B7u, 0xF5720643u, 0x07198540u,
+    0x590AB964u, 0xAB613A67u, 0xB831C993u, 0x4A5A4A90u, 0x9E902E7Bu, 0x6CFBAD78u, 0x7FAB5E8Cu, 0x8DC0DD8Fu,
+    0xE330A81Au, 0x115B2B19u, 0x020BD8EDu, 0xF0605BEEu, 0x24AA3F05u, 0xD6C1BC06u, 0xC5914FF2u, 0x37FACCF1u,
+    0x69E9F0D5u, 0x9B8273D6u, 0x88D28022u, 0x7AB90321u, 0xAE7367CAu, 0x5C18E4C9u, 0x4F48173Du, 0xBD23943Eu,
+    0xF36E6F75u, 0x0105EC76u, 0x12551F82u, 0xE03E9C81u, 0x34F4F86Au, 0xC69F7B69u, 0xD5CF889Du, 0x27A40B9Eu,
+    0x79B737BAu, 0x8BDCB4B9u, 0x988C474Du, 0x6AE7C44Eu, 0xBE2DA0A5u, 0x4C4623A6u, 0x5F16D052u, 0xAD7D5351u
+  };
+  const uint8_t *p = (const uint8_t *)data;
+  
+  uint32_t crc = 0xFFFFFFFFu;
+  for(size_t i = 0; i < len; i++)
+    crc = table[(crc ^ p[i]) & 0xFFu] ^ (crc >> 8);
+  return ~crc;
+}
+
+// CRC32C using the crc32 instruction (SSE4.2 or ARMv8), eight bytes at a time
+static inline uint32_t crc32c(const void *data, size_t len)
+{
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t crc = 0xFFFFFFFFu;
+  uint32_t crc32;
+  
+  for(; len >= 8; p += 8, len -= 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+# if defined(__SSE4_2__)
+    crc = _mm_crc32_u64(crc, v);
+# else
+    crc = __crc32cd((uint32_t)crc, v);
+# endif
+  }
+  crc32 = (uint32_t)crc;
+  for(; len > 0; p++, len--)
+# if defined(__SSE4_2__)
+    crc32 = _mm_crc32_u8(crc32, *p);
+# else
+    crc32 = __crc32cb(crc32, *p);
+# endif
+  return ~crc32;
+#else
+  return crc32c_sw(data, len);
+#endif
+}
+
+static inline uint32_t frame_checksum(uint16_t frame_version, const void *data, size_t len)
+{
+  if(frame_version == DETI_FRAME_VERSION_CRC32C)
+    return crc32c(data, len);
+  if(frame_version == DETI_FRAME_VERSION_SHM)
+    return 0;
+  return simple_checksum(data, len);
+}
+
 static inline void init_message_header(message_header_t *hdr, message_type_t type, uint32_t payload_len)
 {
   hdr->magic = PROTOCOL_MAGIC;
-  hdr->version = DETI_PROTOCOL_VERSION;
+  hdr->version = DETI_FRAME_VERSION_LEGACY;
   hdr->type = (uint16_t)type;
   hdr->length = payload_len;
   hdr->checksum = 0;
 }
 
+// sets the frame version and computes the payload checksum accordingly
+static inline void seal_message_header(message_header_t *hdr, uint16_t frame_version, const void *payload)
+{
+  hdr->version = frame_version;
+  hdr->checksum = (payload && hdr->length > 0) ? frame_checksum(frame_version, payload, hdr->length) : 0;
+}
+
+static inline int send_all(int sock, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while(len > 0)
+  {
+    ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// sends two buffers (part2 may be NULL) with one system call, so that a frame header and its payload go out
+// together instead of the payload waiting (Nagle's algorithm) for the acknowledgement of the header
+static inline int send_all2(int sock, const void *part1, size_t len1, const void *part2, size_t len2)
+{
+  struct iovec iov[2] = { { (void *)part1, len1 }, { (void *)part2, (part2 != NULL) ? len2 : 0 } };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+  while(msg.msg_iovlen > 0)
+  {
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    while(msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+    {
+      n -= (ssize_t)msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if(msg.msg_iovlen > 0)
+    {
+      msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= (size_t)n;
+    }
+  }
+  return 0;
+}
+
+// the frames are small and each one is waited for, so they are sent at once rather than coalesced
+static inline void set_tcp_nodelay(int sock)
+{
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 #endif
@@ -0,0 +1,378 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// tests of the pieces of the distributed search that are easy to get subtly wrong: the interval sets that record
+// the coverage of the keyspace, the state file of the server, the check of a coin against its lease, and the CRC32C
+// of the frames
+//
+// the server is included whole (its main() renamed), so that its state can be saved and loaded directly
+//
+
+#define main deti_server_main
+#include "server.c"
+#undef main
+
+
+//
+// random numbers (xorshift64, so that a failure can be reproduced)
+//
+
+static uint64_t test_random_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t test_random(uint64_t n)
+{
+  test_random_state ^= test_random_state << 13;
+  test_random_state ^= test_random_state >> 7;
+  test_random_state ^= test_random_state << 17;
+  return test_random_state % n;
+}
+
+
+//
+// test the interval sets against a bitmap
+//
+
+static void check_interval_set(const aad_interval_set_t *s,const u08_t *bitmap,int size,int n)
+{
+  aad_interval_t gaps[64];
+  uint64_t covered = 0u;
+  size_t n_gaps,i,expected_gaps;
+  int x;
+
+  // the runs are sorted, disjoint and non-adjacent
+  for(i = 0;i < s->n_runs;i++)
+    if(s->runs[i].start >= s->runs[i].end || (i > 0 && s->runs[i - 1].end >= s->runs[i].start))
+    {
+      fprintf(stderr,"interval set failure for n=%d: run %zu is [%lu,%lu)\n",n,i,(unsigned long)s->runs[i].start,(unsigned long)s->runs[i].end);
+      exit(1);
+    }
+  // contains() and covered agree with the bitmap
+  for(x = 0;x < size;x++)
+  {
+    covered += bitmap[x];
+    if(aad_interval_set_contains(s,(uint64_t)x) != bitmap[x])
+    {
+      fprintf(stderr,"aad_interval_set_contains() failure for n=%d, x=%d (bad/good): %d/%d\n",n,x,!bitmap[x],bitmap[x]);
+      exit(1);
+    }
+  }
+  if(covered != s->covered)
+  {
+    fprintf(stderr,"interval set failure for n=%d: %lu integers covered, not %lu\n",n,(unsigned long)s->covered,(unsigned long)covered);
+    exit(1);
+  }
+  // the gaps are the runs of zeros of the bitmap
+  n_gaps = aad_interval_set_gaps(s,0u,(uint64_t)size,gaps,64u);
+  expected_gaps = 0u;
+  for(x = 0;x < size;x++)
+    if(!bitmap[x] && (x == 0 || bitmap[x - 1]))
+    {
+      int end = x;
+      while(end < size && !bitmap[end])
+        end++;
+      if(expected_gaps < 64u && (gaps[expected_gaps].start != (uint64_t)x || gaps[expected_gaps].end != (uint64_t)end))
+      {
+        fprintf(stderr,"aad_interval_set_gaps() failure for n=%d: gap %zu is [%lu,%lu), not [%d,%d)\n",n,expected_gaps,
+                (unsigned long)gaps[expected_gaps].start,(unsigned long)gaps[expected_gaps].end,x,end);
+        exit(1);
+      }
+      expected_gaps++;
+    }
+  if(n_gaps != expected_gaps)
+  {
+    fprintf(stderr,"aad_interval_set_gaps() failure for n=%d: %zu gaps, not %zu\n",n,n_gaps,expected_gaps);
+    exit(1);
+  }
+}
+
+static void test_interval_set(int n_tests)
+{
+# define SIZE 1024
+  static u08_t bitmap[SIZE];
+  aad_interval_set_t s;
+  uint64_t overlap,expected;
+  int n,start,end,x;
+
+  // a few cases by hand: adjacent runs merge, and so do the runs that a new one bridges
+  aad_interval_set_init(&s);
+  if(aad_interval_set_add(&s,10u,20u) != 0u || aad_interval_set_add(&s,20u,30u) != 0u || s.n_runs != 1u ||
+     aad_interval_set_add(&s,40u,50u) != 0u || s.n_runs != 2u || aad_interval_set_add(&s,25u,45u) != 10u ||
+     s.n_runs != 1u || s.runs[0].start != 10u || s.runs[0].end != 50u || s.covered != 40u ||
+     aad_interval_set_contains(&s,9u) || !aad_interval_set_contains(&s,10u) || !aad_interval_set_contains(&s,49u) ||
+     aad_interval_set_contains(&s,50u) || aad_interval_set_add(&s,5u,5u) != 0u || s.covered != 40u)
+  {
+    fprintf(stderr,"interval set failure (merging by hand)\n");
+    exit(1);
+  }
+  aad_interval_set_destroy(&s);
+  // random runs, checked after every addition
+  for(n = 0;n < n_tests;n++)
+  {
+    aad_interval_set_init(&s);
+    memset(bitmap,0,sizeof(bitmap));
+    for(int k = 0;k < 64;k++)
+    {
+      start = (int)test_random(SIZE);
+      end = start + 1 + (int)test_random((k & 1) ? 4u : 64u); // short runs leave gaps, long ones merge them
+      if(end > SIZE)
+        end = SIZE;
+      expected = 0u;
+      for(x = start;x < end;x++)
+      {
+        expected += bitmap[x];
+        bitmap[x] = 1;
+      }
+      overlap = aad_interval_set_add(&s,(uint64_t)start,(uint64_t)end);
+      if(overlap != expected)
+      {
+        fprintf(stderr,"aad_interval_set_add() failure for n=%d, [%d,%d): overlap %lu, not %lu\n",n,start,end,(unsigned long)overlap,(unsigned long)expected);
+        exit(1);
+      }
+      check_interval_set(&s,bitmap,SIZE,n);
+    }
+    aad_interval_set_destroy(&s);
+  }
+  printf("interval sets passed (%d test%s)\n",n_tests,(n_tests == 1) ? "" : "s");
+# undef SIZE
+}
+
+
+//
+// test the state file of the server: what is saved is loaded back (the leases still out as orphans), and a file
+// that does not fit is refused
+//
+
+static void reset_server_state(uint64_t template_span,uint64_t cursor)
+{
+  for(int i = 0;i < g_state.n_templates;i++)
+    aad_interval_set_destroy(&g_state.coverage[i].done);
+  free(g_state.coverage);
+  memset(&g_state,0,sizeof(g_state));
+  snprintf(g_state.campaigns[0].name,sizeof(g_state.campaigns[0].name),"default");
+  g_state.campaigns[0].weight = 1.0;
+  g_state.campaigns[0].cursor = cursor;
+  g_state.n_campaigns = 1;
+  g_state.template_span = template_span;
+  pthread_mutex_init(&g_state.state_lock,NULL);
+}
+
+static void test_state_file(void)
+{
+  static aad_interval_t saved_runs[3][8];
+  size_t saved_n_runs[3];
+  char path[64],bad_path[72];
+  FILE *fp;
+  int i,status;
+  size_t j;
+
+  snprintf(path,sizeof(path),"/tmp/deti_state_test_%d.txt",(int)getpid());
+  snprintf(bad_path,sizeof(bad_path),"%s.bad",path);
+  // templates 0 and 1 are done with (with gaps), template 2 is the current one
+  reset_server_state(1000u,2u * 1000u + 700u);
+  g_state.next_work_id = 1234u;
+  for(i = 0;i < 3;i++)
+  {
+    coverage_t *cov = coverage_for((uint32_t)i,(i == 0) ? 100u : 0u);
+    for(j = 0;j < 5u;j++)
+      aad_interval_set_add(&cov->done,cov->base_nonce + 150u * j + 10u * (uint64_t)i,cov->base_nonce + 150u * j + 100u);
+    cov->duplicate_nonces = 7u * (uint64_t)i;
+    saved_n_runs[i] = cov->done.n_runs;
+    memcpy(saved_runs[i],cov->done.runs,cov->done.n_runs * sizeof(aad_interval_t));
+  }
+  // an orphan, and a lease of a client that is still connected
+  g_state.clients[0].client_id = 77u;
+  g_state.clients[0].leases[0].work_id = 5u;
+  g_state.clients[0].leases[0].template_id = 1u;
+  g_state.clients[0].leases[0].start_nonce = 250u;
+  g_state.clients[0].leases[0].end_nonce = 300u;
+  orphan_lease(&g_state.clients[0],&g_state.clients[0].leases[0]);
+  g_state.clients[1].in_use = 1;
+  g_state.clients[1].client_id = 88u;
+  g_state.clients[1].leases[2].active = 1;
+  g_state.clients[1].leases[2].work_id = 6u;
+  g_state.clients[1].leases[2].template_id = 2u;
+  g_state.clients[1].leases[2].start_nonce = 600u;
+  g_state.clients[1].leases[2].end_nonce = 700u;
+  if(save_state(path) != 0)
+  {
+    fprintf(stderr,"save_state() failed\n");
+    exit(1);
+  }
+  // round trip
+  reset_server_state(1000u,0u);
+  status = load_state(path);
+  if(status != 1 || g_state.campaigns[0].cursor != 2u * 1000u + 700u || g_state.next_work_id != 1234u || g_state.n_templates != 3)
+  {
+    fprintf(stderr,"load_state() failure: status %d, cursor %lu, %d templates\n",status,(unsigned long)g_state.campaigns[0].cursor,g_state.n_templates);
+    exit(1);
+  }
+  for(i = 0;i < 3;i++)
+  {
+    coverage_t *cov = coverage_for((uint32_t)i,0u);
+    if(cov->base_nonce != ((i == 0) ? 100u : 0u) || cov->duplicate_nonces != 7u * (uint64_t)i ||
+       cov->next_nonce != ((i < 2) ? 1000u : 700u) || cov->done.n_runs != saved_n_runs[i] ||
+       memcmp(cov->done.runs,saved_runs[i],saved_n_runs[i] * sizeof(aad_interval_t)) != 0)
+    {
+      fprintf(stderr,"load_state() failure: template %d differs from the one saved\n",i);
+      exit(1);
+    }
+  }
+  if(g_state.n_orphans != 2 || find_orphan(77u,5u) == NULL || find_orphan(77u,5u)->start_nonce != 250u ||
+     find_orphan(88u,6u) == NULL || find_orphan(88u,6u)->template_id != 2u || find_orphan(88u,6u)->end_nonce != 700u)
+  {
+    fprintf(stderr,"load_state() failure: %d orphaned leases, not the 2 saved\n",g_state.n_orphans);
+    exit(1);
+  }
+  // saved with another template span
+  reset_server_state(2000u,0u);
+  if(load_state(path) != -1)
+  {
+    fprintf(stderr,"load_state() failure: a state file with another template span was accepted\n");
+    exit(1);
+  }
+  // a run past the nonces handed out of its template
+  fp = fopen(bad_path,"w");
+  if(fp == NULL)
+  {
+    perror(bad_path);
+    exit(1);
+  }
+  fprintf(fp,"%s %d\ntemplate_span 1000\ncurrent_template 0\nnext_nonce 500\ntemplate 0 0 500 0 1\n400 600\nend\n",STATE_FILE_MAGIC,STATE_FILE_VERSION);
+  fclose(fp);
+  reset_server_state(1000u,0u);
+  if(load_state(bad_path) != -1)
+  {
+    fprintf(stderr,"load_state() failure: a run past the end of its template was accepted\n");
+    exit(1);
+  }
+  reset_server_state(1000u,0u);
+  unlink(path);
+  unlink(bad_path);
+  printf("state file passed\n");
+}
+
+
+//
+// test the check of a coin against the lease it was reported for, with a genuine coin (of the vault) whose template
+// and nonce are taken to be those of the lease
+//
+
+static void expect_coin_check(const verify_item_t *item,u32_t hash[5][VERIFY_LANES],const char *expected,const char *what)
+{
+  const char *reason = check_coin(item,hash,0);
+
+  if((reason == NULL) != (expected == NULL) || (reason != NULL && strcmp(reason,expected) != 0))
+  {
+    fprintf(stderr,"check_coin() failure (%s): \"%s\", not \"%s\"\n",what,(reason != NULL) ? reason : "genuine",
+            (expected != NULL) ? expected : "genuine");
+    exit(1);
+  }
+}
+
+static void test_coin_check(void)
+{
+  static const char coin[] = "DETI coin 2 251411332825141133282514113328251411332825\n";
+  static u32_t hash[5][VERIFY_LANES];
+  verify_item_t item,bad;
+  u08_t *bytes = (u08_t *)item.report.coin_data;
+  unsigned int zeros;
+  int i;
+
+  memset(&item,0,sizeof(item));
+  for(i = 0;i < 55;i++)
+    bytes[i ^ 3] = (u08_t)coin[i];
+  bytes[55 ^ 3] = 0x80;
+  sha1(item.report.coin_data,item.report.hash);
+  for(i = 0;i < 5;i++)
+    hash[i][0] = item.report.hash[i];
+  for(zeros = 0u;zeros < 128u;zeros++)
+    if(((item.report.hash[1u + zeros / 32u] >> (31u - zeros % 32u)) & 1u) != 0u)
+      break;
+  item.report.zeros = (zeros > MAX_COIN_POWER) ? MAX_COIN_POWER : zeros;
+  for(i = DETI_NONCE_DIGITS - 1;i >= 0;i--)
+    item.report.nonce = item.report.nonce * 95u + (uint64_t)(coin[DETI_NONCE_OFFSET + i] - 32);
+  item.leased = 1;
+  item.template_id = 7u;
+  item.template_known = 1;
+  memcpy(item.template_bytes,&coin[DETI_TEMPLATE_OFFSET],DETI_TEMPLATE_BYTES);
+  item.start_nonce = item.report.nonce;
+  item.end_nonce = item.report.nonce + 1u;
+  expect_coin_check(&item,hash,NULL,"the coin of its lease");
+  bad = item;
+  bad.leased = 0;
+  expect_coin_check(&bad,hash,"work not leased to the client","no lease");
+  bad.synthetic = 1;
+  expect_coin_check(&bad,hash,NULL,"synthetic");
+  bad = item;
+  bad.template_bytes[DETI_TEMPLATE_BYTES - 1] ^= 1;
+  expect_coin_check(&bad,hash,"wrong template","another template");
+  bad.template_known = 0;
+  expect_coin_check(&bad,hash,NULL,"unknown template");
+  bad = item;
+  bad.report.nonce++;
+  bad.end_nonce++;
+  expect_coin_check(&bad,hash,"wrong nonce","another nonce than the encoded one");
+  bad = item;
+  bad.start_nonce++;
+  bad.end_nonce++;
+  expect_coin_check(&bad,hash,"wrong nonce","a nonce before the lease");
+  bad = item;
+  bad.end_nonce--;
+  expect_coin_check(&bad,hash,"wrong nonce","a nonce at the end of the lease");
+  printf("coin check passed\n");
+}
+
+
+//
+// test the CRC32C of the frames (the check value of "123456789" is 0xE3069283), and the crc32 instruction
+// against the table, for every length (and so for every tail after the eight byte steps)
+//
+
+static void test_crc32c(int n_tests)
+{
+  static u08_t data[256];
+  uint32_t sw,hw;
+  int n,len,i;
+
+  sw = crc32c_sw("123456789",9u);
+  hw = crc32c("123456789",9u);
+  if(sw != 0xE3069283u || hw != 0xE3069283u)
+  {
+    fprintf(stderr,"crc32c failure for \"123456789\" (software/hardware/good): %08X/%08X/E3069283\n",sw,hw);
+    exit(1);
+  }
+  for(n = 0;n < n_tests;n++)
+    for(len = 0;len <= (int)sizeof(data);len++)
+    {
+      for(i = 0;i < len;i++)
+        data[i] = (u08_t)test_random(256u);
+      sw = crc32c_sw(data,(size_t)len);
+      hw = crc32c(data,(size_t)len);
+      if(sw != hw)
+      {
+        fprintf(stderr,"crc32c failure for n=%d, len=%d (software/hardware): %08X/%08X\n",n,len,sw,hw);
+        exit(1);
+      }
+    }
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+  printf("crc32c passed (%d test%s, crc32 instruction and table)\n",n_tests,(n_tests == 1) ? "" : "s");
+#else
+  printf("crc32c passed (%d test%s, table only: no crc32 instruction)\n",n_tests,(n_tests == 1) ? "" : "s");
+#endif
+}
+
+
+//
+// main program
+//
+
+int main(void)
+{
+  int n_tests = 1000;
+
+  test_interval_set(n_tests);
+  test_state_file();
+  test_coin_check();
+  test_crc32c(n_tests);
+  return 0;
+}
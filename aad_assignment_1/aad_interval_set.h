@@ -0,0 +1,179 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// set of 64-bit integers stored as a sorted array of disjoint half-open runs [start,end)
+//
+// adjacent and overlapping runs are merged as they are added, so a keyspace that is searched
+// mostly in order collapses into a handful of runs; lookups are binary searches (O(log n))
+//
+
+#ifndef AAD_INTERVAL_SET
+#define AAD_INTERVAL_SET
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+  uint64_t start;
+  uint64_t end;
+}
+aad_interval_t;
+
+typedef struct
+{
+  aad_interval_t *runs;  // sorted by start, disjoint and non-adjacent
+  size_t n_runs;
+  size_t capacity;
+  uint64_t covered;      // total number of integers in the set
+}
+aad_interval_set_t;
+
+__attribute__((unused))
+static void aad_interval_set_init(aad_interval_set_t *s)
+{
+  memset(s,0,sizeof(*s));
+}
+
+__attribute__((unused))
+static void aad_interval_set_destroy(aad_interval_set_t *s)
+{
+  free(s->runs);
+  memset(s,0,sizeof(*s));
+}
+
+//
+// index of the first run whose end is at least x (n_runs if there is none)
+//
+__attribute__((unused))
+static size_t aad_interval_set_lower_bound(const aad_interval_set_t *s,uint64_t x)
+{
+  size_t lo = 0u,hi = s->n_runs;
+
+  while(lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2u;
+    if(s->runs[mid].end < x)
+      lo = mid + 1u;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+//
+// number of integers of [start,end) that are already in the set
+//
+__attribute__((unused))
+static uint64_t aad_interval_set_overlap(const aad_interval_set_t *s,uint64_t start,uint64_t end)
+{
+  uint64_t overlap = 0u;
+
+  for(size_t i = aad_interval_set_lower_bound(s,start);i < s->n_runs && s->runs[i].start < end;i++)
+  {
+    uint64_t lo = (s->runs[i].start > start) ? s->runs[i].start : start;
+    uint64_t hi = (s->runs[i].end < end) ? s->runs[i].end : end;
+    if(hi > lo)
+      overlap += hi - lo;
+  }
+  return overlap;
+}
+
+__attribute__((unused))
+static int aad_interval_set_contains(const aad_interval_set_t *s,uint64_t x)
+{
+  size_t i = aad_interval_set_lower_bound(s,x + 1u);
+
+  return i < s->n_runs && s->runs[i].start <= x;
+}
+
+//
+// adds [start,end) to the set, merging it with every run it overlaps or touches
+// returns the number of integers that were already in the set, or UINT64_MAX if out of memory
+//
+__attribute__((unused))
+static uint64_t aad_interval_set_add(aad_interval_set_t *s,uint64_t start,uint64_t end)
+{
+  if(start >= end)
+    return 0u;
+
+  uint64_t overlap = aad_interval_set_overlap(s,start,end);
+  uint64_t added = (end - start) - overlap;
+  size_t i = aad_interval_set_lower_bound(s,start);
+  size_t j = i;
+
+  while(j < s->n_runs && s->runs[j].start <= end)
+    j++;
+  if(i == j)
+  { // no run touches [start,end): insert a new one at position i
+    if(s->n_runs == s->capacity)
+    {
+      size_t capacity = (s->capacity == 0u) ? 16u : 2u * s->capacity;
+      aad_interval_t *runs = (aad_interval_t *)realloc(s->runs,capacity * sizeof(aad_interval_t));
+      if(runs == NULL)
+        return UINT64_MAX;
+      s->runs = runs;
+      s->capacity = capacity;
+    }
+    memmove(&s->runs[i + 1u],&s->runs[i],(s->n_runs - i) * sizeof(aad_interval_t));
+    s->runs[i].start = start;
+    s->runs[i].end = end;
+    s->n_runs++;
+  }
+  else
+  { // runs i..j-1 collapse into run i
+    if(s->runs[i].start < start)
+      start = s->runs[i].start;
+    if(s->runs[j - 1u].end > end)
+      end = s->runs[j - 1u].end;
+    s->runs[i].start = start;
+    s->runs[i].end = end;
+    memmove(&s->runs[i + 1u],&s->runs[j],(s->n_runs - j) * sizeof(aad_interval_t));
+    s->n_runs -= j - i - 1u;
+  }
+  s->covered += added;
+  return overlap;
+}
+
+//
+// the gaps of the set inside [lo,hi); at most max_gaps are stored, the total number is returned
+//
+__attribute__((unused))
+static size_t aad_interval_set_gaps(const aad_interval_set_t *s,uint64_t lo,uint64_t hi,aad_interval_t *gaps,size_t max_gaps)
+{
+  size_t n_gaps = 0u;
+  uint64_t cursor = lo;
+
+  for(size_t i = aad_interval_set_lower_bound(s,lo);i < s->n_runs && cursor < hi;i++)
+  {
+    if(s->runs[i].start > cursor)
+    {
+      if(n_gaps < max_gaps)
+      {
+        gaps[n_gaps].start = cursor;
+        gaps[n_gaps].end = (s->runs[i].start < hi) ? s->runs[i].start : hi;
+      }
+      n_gaps++;
+    }
+    if(s->runs[i].end > cursor)
+      cursor = s->runs[i].end;
+  }
+  if(cursor < hi)
+  {
+    if(n_gaps < max_gaps)
+    {
+      gaps[n_gaps].start = cursor;
+      gaps[n_gaps].end = hi;
+    }
+    n_gaps++;
+  }
+  return n_gaps;
+}
+
+
+//
+// the end!
+//
+
+#endif
@@ -0,0 +1,167 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// asynchronous logger: any thread formats a line into a lock-free queue and returns; a single logger
+// thread writes the lines out
+//
+// ordinary lines are rate limited (a token bucket refilled at max_lines_per_second) and dropped when
+// the queue is full; the number of lines lost is written out instead of them
+// lines logged with always set (errors, coins, status reports) bypass the rate limit
+//
+
+#ifndef AAD_LOG
+#define AAD_LOG
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "aad_queue.h"
+
+#define AAD_LOG_LINE_SIZE  240
+
+typedef struct
+{
+  FILE *stream;
+  int always;
+  char text[AAD_LOG_LINE_SIZE];
+}
+aad_log_line_t;
+
+static struct
+{
+  aad_queue_t queue;
+  sem_t wakeup;
+  pthread_t thread;
+  int running;
+  double max_lines_per_second;
+  unsigned long dropped;   // by the producers (queue full)
+}
+aad_log;
+
+static double aad_log_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec + 1.0e-9 * (double)ts.tv_nsec;
+}
+
+static void *aad_log_thread(void *arg)
+{
+  aad_log_line_t line;
+  double tokens = aad_log.max_lines_per_second;
+  double last_refill = aad_log_time();
+  unsigned long suppressed = 0ul,reported = 0ul;
+
+  (void)arg;
+  for(;;)
+  {
+    int n_written = 0;
+
+    while(aad_queue_pop(&aad_log.queue,&line) == 0)
+    {
+      double now = aad_log_time();
+
+      tokens += (now - last_refill) * aad_log.max_lines_per_second;
+      if(tokens > aad_log.max_lines_per_second)
+        tokens = aad_log.max_lines_per_second;
+      last_refill = now;
+      if(!line.always && tokens < 1.0)
+      {
+        suppressed++;
+        continue;
+      }
+      if(!line.always)
+        tokens -= 1.0;
+      fputs(line.text,line.stream);
+      n_written++;
+    }
+
+    unsigned long dropped = __atomic_load_n(&aad_log.dropped,__ATOMIC_RELAXED);
+    if(suppressed + dropped > reported)
+    {
+      fprintf(stderr,"[log] %lu lines dropped\n",suppressed + dropped - reported);
+      reported = suppressed + dropped;
+      n_written++;
+    }
+    if(n_written > 0)
+    {
+      fflush(stdout);
+      fflush(stderr);
+    }
+    if(!__atomic_load_n(&aad_log.running,__ATOMIC_ACQUIRE) && aad_queue_size(&aad_log.queue) == 0u)
+      break;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_nsec += 100000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    sem_timedwait(&aad_log.wakeup,&deadline);
+  }
+  return NULL;
+}
+
+__attribute__((unused))
+static int aad_log_init(size_t capacity,double max_lines_per_second)
+{
+  if(aad_queue_init(&aad_log.queue,capacity,sizeof(aad_log_line_t)) < 0)
+    return -1;
+  sem_init(&aad_log.wakeup,0,0);
+  aad_log.max_lines_per_second = max_lines_per_second;
+  aad_log.dropped = 0ul;
+  __atomic_store_n(&aad_log.running,1,__ATOMIC_RELEASE);
+  if(pthread_create(&aad_log.thread,NULL,aad_log_thread,NULL) != 0)
+  {
+    aad_queue_destroy(&aad_log.queue);
+    return -1;
+  }
+  return 0;
+}
+
+// writes out whatever is still queued and stops the logger thread (the queue is not freed, as a late
+// producer may still be pushing to it)
+__attribute__((unused))
+static void aad_log_shutdown(void)
+{
+  __atomic_store_n(&aad_log.running,0,__ATOMIC_RELEASE);
+  sem_post(&aad_log.wakeup);
+  pthread_join(aad_log.thread,NULL);
+}
+
+__attribute__((unused,format(printf,3,4)))
+static void aad_log_printf(FILE *stream,int always,const char *format,...)
+{
+  aad_log_line_t line;
+  va_list ap;
+
+  va_start(ap,format);
+  if(!__atomic_load_n(&aad_log.running,__ATOMIC_ACQUIRE))
+  { // before aad_log_init() and after aad_log_shutdown() lines are written directly
+    vfprintf(stream,format,ap);
+    va_end(ap);
+    return;
+  }
+  line.stream = stream;
+  line.always = always;
+  vsnprintf(line.text,sizeof(line.text),format,ap);
+  va_end(ap);
+  if(aad_queue_push(&aad_log.queue,&line) < 0)
+  {
+    __atomic_fetch_add(&aad_log.dropped,1ul,__ATOMIC_RELAXED);
+    return;
+  }
+  sem_post(&aad_log.wakeup);
+}
+
+
+//
+// the end!
+//
+
+#endif
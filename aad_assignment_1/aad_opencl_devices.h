@@ -0,0 +1,250 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// every OpenCL device of every platform (a POCL CPU device included), each with its own context, queue and
+// build of the search kernel of opencl_search_kernel.cl, for a program that drives them next to its own CPU
+// threads, one host thread per device
+//
+// setting a device up may fail (the device is then skipped); once it is up, an OpenCL error is fatal, as in
+// opencl_search.c
+//
+
+#ifndef AAD_OPENCL_DEVICES
+#define AAD_OPENCL_DEVICES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+
+#define AAD_OPENCL_MAX_PLATFORMS  8
+#define AAD_OPENCL_MAX_DEVICES    8
+#define AAD_OPENCL_LOCAL_SIZE     256
+#define AAD_OPENCL_MAX_FOUND      1024   // coins copied back per launch
+
+typedef struct
+{
+  char name[128];
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem static_words;        // the 14 message words (the kernel fills in the nonce, bytes 44..53)
+  cl_mem found_coins;         // AAD_OPENCL_MAX_FOUND coins of 14 words
+  cl_mem found_count;
+  size_t local_size;
+  int words_loaded;
+  u32_t loaded_words[14];     // what static_words holds, so that it is only written when the template changes
+  u32_t *found;               // host copy of found_coins
+  double rate;                // nonces per second, as measured by the program driving the device
+}
+aad_opencl_device_t;
+
+
+//
+// CL_CALL --- calls an OpenCL function that returns an error code, and terminates the program if it failed
+//
+
+#define CL_CALL(f_name,args)                                                                \
+  do                                                                                        \
+  {                                                                                         \
+    cl_int e = f_name args;                                                                 \
+    if(e != CL_SUCCESS)                                                                     \
+    { /* the call failed, terminate the program */                                          \
+      fprintf(stderr,"" # f_name "() returned %d (file %s, line %d)\n",(int)e,__FILE__,__LINE__); \
+      exit(1);                                                                              \
+    }                                                                                       \
+  }                                                                                         \
+  while(0)
+
+
+static void aad_opencl_release(aad_opencl_device_t *d)
+{
+  if(d->found_count != NULL) clReleaseMemObject(d->found_count);
+  if(d->found_coins != NULL) clReleaseMemObject(d->found_coins);
+  if(d->static_words != NULL) clReleaseMemObject(d->static_words);
+  if(d->kernel != NULL) clReleaseKernel(d->kernel);
+  if(d->program != NULL) clReleaseProgram(d->program);
+  if(d->queue != NULL) clReleaseCommandQueue(d->queue);
+  if(d->context != NULL) clReleaseContext(d->context);
+  free(d->found);
+  memset(d,0,sizeof(*d));
+}
+
+//
+// sets device up with the kernel source; returns 0, or -1 (with the failing step printed)
+//
+static int aad_opencl_setup(aad_opencl_device_t *d,cl_device_id device,const char *source)
+{
+  const char *step = "clCreateContext";
+  size_t source_size = strlen(source),max_local = 0;
+  cl_int e;
+
+  memset(d,0,sizeof(*d));
+  d->device = device;
+  clGetDeviceInfo(device,CL_DEVICE_NAME,sizeof(d->name) - 1,d->name,NULL);
+  d->context = clCreateContext(NULL,1,&device,NULL,NULL,&e);
+  if(e == CL_SUCCESS)
+  {
+    step = "clCreateCommandQueue";
+#ifdef CL_VERSION_2_0
+    d->queue = clCreateCommandQueueWithProperties(d->context,device,NULL,&e);
+#else
+    d->queue = clCreateCommandQueue(d->context,device,0,&e);
+#endif
+  }
+  if(e == CL_SUCCESS)
+  {
+    step = "clCreateProgramWithSource";
+    d->program = clCreateProgramWithSource(d->context,1,&source,&source_size,&e);
+  }
+  if(e == CL_SUCCESS)
+  {
+    step = "clBuildProgram";
+    e = clBuildProgram(d->program,1,&device,NULL,NULL,NULL);
+    if(e != CL_SUCCESS)
+    {
+      size_t log_size = 0;
+      clGetProgramBuildInfo(d->program,device,CL_PROGRAM_BUILD_LOG,0,NULL,&log_size);
+      char *log = (char *)malloc(log_size + 1);
+      if(log != NULL && clGetProgramBuildInfo(d->program,device,CL_PROGRAM_BUILD_LOG,log_size,log,NULL) == CL_SUCCESS)
+      {
+        log[log_size] = '\0';
+        fprintf(stderr,"%s: kernel compilation error:\n%s\n",d->name,log);
+      }
+      free(log);
+    }
+  }
+  if(e == CL_SUCCESS)
+  {
+    step = "clCreateKernel";
+    d->kernel = clCreateKernel(d->program,"search_coins_kernel",&e);
+  }
+  if(e == CL_SUCCESS)
+  {
+    step = "clCreateBuffer";
+    d->static_words = clCreateBuffer(d->context,CL_MEM_READ_ONLY,14 * sizeof(u32_t),NULL,&e);
+  }
+  if(e == CL_SUCCESS)
+    d->found_coins = clCreateBuffer(d->context,CL_MEM_WRITE_ONLY,AAD_OPENCL_MAX_FOUND * 14 * sizeof(u32_t),NULL,&e);
+  if(e == CL_SUCCESS)
+    d->found_count = clCreateBuffer(d->context,CL_MEM_READ_WRITE,sizeof(cl_int),NULL,&e);
+  if(e == CL_SUCCESS)
+  {
+    step = "malloc";
+    d->found = (u32_t *)malloc(AAD_OPENCL_MAX_FOUND * 14 * sizeof(u32_t));
+    if(d->found == NULL)
+      e = CL_OUT_OF_HOST_MEMORY;
+  }
+  if(e != CL_SUCCESS)
+  {
+    fprintf(stderr,"OpenCL device %s skipped: %s() returned %d\n",(d->name[0] != '\0') ? d->name : "?",step,(int)e);
+    aad_opencl_release(d);
+    return -1;
+  }
+
+  // some devices cannot take work groups as large as the GPUs'
+  d->local_size = AAD_OPENCL_LOCAL_SIZE;
+  if(clGetKernelWorkGroupInfo(d->kernel,device,CL_KERNEL_WORK_GROUP_SIZE,sizeof(max_local),&max_local,NULL) == CL_SUCCESS &&
+     max_local > 0 && max_local < d->local_size)
+    d->local_size = max_local;
+  return 0;
+}
+
+//
+// opens every device of every platform, up to max_devices of them; returns how many were opened
+//
+__attribute__((unused))
+static int aad_opencl_open_devices(const char *kernel_file,aad_opencl_device_t *devices,int max_devices)
+{
+  cl_platform_id platforms[AAD_OPENCL_MAX_PLATFORMS];
+  cl_device_id ids[AAD_OPENCL_MAX_DEVICES];
+  cl_uint n_platforms = 0,n_ids;
+  int n_devices = 0;
+
+  FILE *fp = fopen(kernel_file,"r");
+  if(fp == NULL)
+  {
+    fprintf(stderr,"Failed to open kernel file: %s\n",kernel_file);
+    return 0;
+  }
+  fseek(fp,0,SEEK_END);
+  long file_size = ftell(fp);
+  rewind(fp);
+  char *source = (file_size >= 0) ? (char *)malloc((size_t)file_size + 1) : NULL;
+  if(source == NULL)
+  {
+    fclose(fp);
+    return 0;
+  }
+  source[fread(source,1,(size_t)file_size,fp)] = '\0';
+  fclose(fp);
+
+  if(clGetPlatformIDs(AAD_OPENCL_MAX_PLATFORMS,platforms,&n_platforms) != CL_SUCCESS)
+    n_platforms = 0;
+  if(n_platforms > AAD_OPENCL_MAX_PLATFORMS)
+    n_platforms = AAD_OPENCL_MAX_PLATFORMS;
+  for(cl_uint p = 0;p < n_platforms;p++)
+  {
+    if(clGetDeviceIDs(platforms[p],CL_DEVICE_TYPE_ALL,AAD_OPENCL_MAX_DEVICES,ids,&n_ids) != CL_SUCCESS)
+      continue;
+    if(n_ids > AAD_OPENCL_MAX_DEVICES)
+      n_ids = AAD_OPENCL_MAX_DEVICES;
+    for(cl_uint k = 0;k < n_ids && n_devices < max_devices;k++)
+      if(aad_opencl_setup(&devices[n_devices],ids[k],source) == 0)
+        n_devices++;
+  }
+  free(source);
+  return n_devices;
+}
+
+//
+// hashes the count nonces that start at first_nonce under the message words and copies the coins found to
+// d->found; returns how many were found (only the first AAD_OPENCL_MAX_FOUND of them are copied)
+//
+__attribute__((unused))
+static int aad_opencl_search(aad_opencl_device_t *d,const u32_t words[14],uint64_t first_nonce,uint64_t count)
+{
+  cl_ulong base_nonce = (cl_ulong)first_nonce,num_coins = (cl_ulong)count;
+  cl_int zero = 0,found = 0;
+  int max_found = AAD_OPENCL_MAX_FOUND;
+  size_t global_size = (size_t)((count + d->local_size - 1) / d->local_size) * d->local_size;
+
+  // the queue is in order, and the last read blocks, so the host data written here is not needed afterwards
+  if(!d->words_loaded || memcmp(words,d->loaded_words,sizeof(d->loaded_words)) != 0)
+  {
+    memcpy(d->loaded_words,words,sizeof(d->loaded_words));
+    CL_CALL(clEnqueueWriteBuffer,(d->queue,d->static_words,CL_FALSE,0,sizeof(d->loaded_words),d->loaded_words,0,NULL,NULL));
+    d->words_loaded = 1;
+  }
+  CL_CALL(clEnqueueWriteBuffer,(d->queue,d->found_count,CL_FALSE,0,sizeof(zero),&zero,0,NULL,NULL));
+  CL_CALL(clSetKernelArg,(d->kernel,0,sizeof(cl_ulong),&base_nonce));
+  CL_CALL(clSetKernelArg,(d->kernel,1,sizeof(cl_ulong),&num_coins));
+  CL_CALL(clSetKernelArg,(d->kernel,2,sizeof(cl_mem),&d->static_words));
+  CL_CALL(clSetKernelArg,(d->kernel,3,sizeof(cl_mem),&d->found_coins));
+  CL_CALL(clSetKernelArg,(d->kernel,4,sizeof(cl_mem),&d->found_count));
+  CL_CALL(clSetKernelArg,(d->kernel,5,sizeof(int),&max_found));
+  CL_CALL(clEnqueueNDRangeKernel,(d->queue,d->kernel,1,NULL,&global_size,&d->local_size,0,NULL,NULL));
+  CL_CALL(clEnqueueReadBuffer,(d->queue,d->found_count,CL_TRUE,0,sizeof(found),&found,0,NULL,NULL));
+  if(found > 0)
+    CL_CALL(clEnqueueReadBuffer,(d->queue,d->found_coins,CL_TRUE,0,
+                                 (size_t)((found < max_found) ? found : max_found) * 14 * sizeof(u32_t),d->found,0,NULL,NULL));
+  return (int)found;
+}
+
+__attribute__((unused))
+static void aad_opencl_close_devices(aad_opencl_device_t *devices,int n_devices)
+{
+  for(int k = 0;k < n_devices;k++)
+    aad_opencl_release(&devices[k]);
+}
+
+
+//
+// the end!
+//
+
+#endif
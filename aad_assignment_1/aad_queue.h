@@ -0,0 +1,135 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// bounded lock-free queue of fixed-size records (multiple producers, multiple consumers)
+//
+// each cell carries a sequence number; a producer claims a cell by advancing the enqueue position
+// with a compare-and-swap and publishes it by storing the next sequence number (D. Vyukov's design)
+// neither side ever waits for the other, so a hashing thread that pushes a record never stalls
+// on whoever drains the queue
+//
+
+#ifndef AAD_QUEUE
+#define AAD_QUEUE
+
+#include <stdlib.h>
+#include <string.h>
+#include "aad_data_types.h"
+
+#define AAD_CACHE_LINE  64
+
+typedef struct
+{
+  size_t mask;        // capacity - 1 (the capacity is a power of two)
+  size_t elem_size;   // size of each record, in bytes
+  size_t cell_size;   // size of each cell (sequence number + record), in bytes
+  u08_t *cells;
+  size_t enqueue_pos __attribute__((aligned(AAD_CACHE_LINE)));
+  size_t dequeue_pos __attribute__((aligned(AAD_CACHE_LINE)));
+}
+aad_queue_t;
+
+#define AAD_QUEUE_SEQ(q,pos)  ((size_t *)&(q)->cells[((pos) & (q)->mask) * (q)->cell_size])
+
+__attribute__((unused))
+static int aad_queue_init(aad_queue_t *q,size_t capacity,size_t elem_size)
+{
+  size_t c = 2u;
+
+  while(c < capacity)
+    c <<= 1;
+  memset(q,0,sizeof(*q));
+  q->mask = c - 1u;
+  q->elem_size = elem_size;
+  q->cell_size = (sizeof(size_t) + elem_size + 7u) & ~(size_t)7u;
+  q->cells = (u08_t *)aligned_alloc(AAD_CACHE_LINE,(c * q->cell_size + AAD_CACHE_LINE - 1u) & ~(size_t)(AAD_CACHE_LINE - 1u));
+  if(q->cells == NULL)
+    return -1;
+  for(size_t i = 0u;i < c;i++)
+    *AAD_QUEUE_SEQ(q,i) = i;
+  return 0;
+}
+
+__attribute__((unused))
+static void aad_queue_destroy(aad_queue_t *q)
+{
+  free(q->cells);
+  q->cells = NULL;
+}
+
+//
+// returns 0 on success and -1 if the queue is full
+//
+__attribute__((unused))
+static int aad_queue_push(aad_queue_t *q,const void *elem)
+{
+  size_t pos = __atomic_load_n(&q->enqueue_pos,__ATOMIC_RELAXED);
+
+  for(;;)
+  {
+    size_t seq = __atomic_load_n(AAD_QUEUE_SEQ(q,pos),__ATOMIC_ACQUIRE);
+    long diff = (long)seq - (long)pos;
+
+    if(diff == 0)
+    {
+      if(__atomic_compare_exchange_n(&q->enqueue_pos,&pos,pos + 1u,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+        break;
+    }
+    else if(diff < 0)
+      return -1;
+    else
+      pos = __atomic_load_n(&q->enqueue_pos,__ATOMIC_RELAXED);
+  }
+  memcpy((u08_t *)AAD_QUEUE_SEQ(q,pos) + sizeof(size_t),elem,q->elem_size);
+  __atomic_store_n(AAD_QUEUE_SEQ(q,pos),pos + 1u,__ATOMIC_RELEASE);
+  return 0;
+}
+
+//
+// returns 0 on success and -1 if the queue is empty
+//
+__attribute__((unused))
+static int aad_queue_pop(aad_queue_t *q,void *elem)
+{
+  size_t pos = __atomic_load_n(&q->dequeue_pos,__ATOMIC_RELAXED);
+
+  for(;;)
+  {
+    size_t seq = __atomic_load_n(AAD_QUEUE_SEQ(q,pos),__ATOMIC_ACQUIRE);
+    long diff = (long)seq - (long)(pos + 1u);
+
+    if(diff == 0)
+    {
+      if(__atomic_compare_exchange_n(&q->dequeue_pos,&pos,pos + 1u,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+        break;
+    }
+    else if(diff < 0)
+      return -1;
+    else
+      pos = __atomic_load_n(&q->dequeue_pos,__ATOMIC_RELAXED);
+  }
+  memcpy(elem,(u08_t *)AAD_QUEUE_SEQ(q,pos) + sizeof(size_t),q->elem_size);
+  __atomic_store_n(AAD_QUEUE_SEQ(q,pos),pos + q->mask + 1u,__ATOMIC_RELEASE);
+  return 0;
+}
+
+//
+// approximate number of queued records (exact when no other thread is using the queue)
+//
+__attribute__((unused))
+static size_t aad_queue_size(aad_queue_t *q)
+{
+  size_t head = __atomic_load_n(&q->dequeue_pos,__ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&q->enqueue_pos,__ATOMIC_RELAXED);
+
+  return (tail > head) ? tail - head : 0u;
+}
+
+#undef AAD_QUEUE_SEQ
+
+
+//
+// the end!
+//
+
+#endif
@@ -0,0 +1,247 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// shared-memory transport between two processes of the same host: a segment in /dev/shm holding two
+// single-producer single-consumer byte rings, one per direction, that carry the same frames as a socket
+//
+// the producer copies a frame in and publishes it by advancing head; the consumer copies it out and
+// advances tail; neither side makes a system call unless the ring is empty (consumer) or full (producer),
+// and then it sleeps on a futex that the other side only wakes if the sleeper said it was waiting
+//
+
+#ifndef AAD_SHM_RING
+#define AAD_SHM_RING
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define AAD_SHM_RING_SIZE  65536u                 // bytes per direction (a power of two)
+#define AAD_SHM_MAGIC      0x314D485349544544ULL  // "DETISHM1"
+#define AAD_SHM_NAME_SIZE  64
+
+#define AAD_SHM_TO_SERVER  0
+#define AAD_SHM_TO_CLIENT  1
+
+typedef struct
+{
+  uint32_t head __attribute__((aligned(64)));  // bytes ever written (it wraps around); the consumer sleeps on it
+  uint32_t consumer_waiting;
+  uint32_t tail __attribute__((aligned(64)));  // bytes ever read; the producer sleeps on it
+  uint32_t producer_waiting;
+  uint32_t closed __attribute__((aligned(64)));
+  uint8_t data[AAD_SHM_RING_SIZE] __attribute__((aligned(64)));
+}
+aad_shm_ring_t;
+
+typedef struct
+{
+  uint64_t magic;
+  uint64_t token;           // random, so that a stale segment that happens to have the same name is not used
+  aad_shm_ring_t ring[2];   // indexed by AAD_SHM_TO_SERVER and AAD_SHM_TO_CLIENT
+}
+aad_shm_segment_t;
+
+static long aad_futex(uint32_t *word,int op,uint32_t value,const struct timespec *timeout)
+{
+  return syscall(SYS_futex,word,op,value,timeout,NULL,0);
+}
+
+//
+// sleeps until *word is no longer value, the ring is closed, or timeout_ms milliseconds pass
+// (the waiting flag is raised before *word is checked again, and the other side changes *word before it
+// looks at the flag, so a wakeup cannot be missed)
+//
+static void aad_shm_sleep(aad_shm_ring_t *r,uint32_t *word,uint32_t *waiting,uint32_t value,int timeout_ms)
+{
+  struct timespec timeout = { timeout_ms / 1000,(long)(timeout_ms % 1000) * 1000000L };
+
+  __atomic_store_n(waiting,1u,__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(word,__ATOMIC_SEQ_CST) == value && !__atomic_load_n(&r->closed,__ATOMIC_SEQ_CST))
+    aad_futex(word,FUTEX_WAIT,value,&timeout);
+  __atomic_store_n(waiting,0u,__ATOMIC_RELAXED);
+}
+
+static void aad_shm_wake(uint32_t *word,uint32_t *waiting)
+{
+  if(__atomic_load_n(waiting,__ATOMIC_SEQ_CST))
+    aad_futex(word,FUTEX_WAKE,INT32_MAX,NULL);
+}
+
+//
+// copies len1 + len2 bytes in and publishes them at once
+// returns 0, 1 if the ring stayed too full for timeout_ms milliseconds, or -1 if it is closed
+//
+__attribute__((unused))
+static int aad_shm_send(aad_shm_ring_t *r,const void *part1,size_t len1,const void *part2,size_t len2,int timeout_ms)
+{
+  uint32_t head = r->head;  // only the producer writes it
+  uint32_t len = (uint32_t)(len1 + len2);
+
+  if(len1 + len2 > AAD_SHM_RING_SIZE)
+    return -1;
+  for(int slept = 0;;slept = 1)
+  {
+    uint32_t tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&r->closed,__ATOMIC_ACQUIRE))
+      return -1;
+    if(AAD_SHM_RING_SIZE - (head - tail) >= len)
+      break;
+    if(slept)
+      return 1;
+    aad_shm_sleep(r,&r->tail,&r->producer_waiting,tail,timeout_ms);
+  }
+
+  const uint8_t *parts[2] = { (const uint8_t *)part1,(const uint8_t *)part2 };
+  size_t lens[2] = { len1,len2 };
+  uint32_t pos = head;
+  for(int k = 0;k < 2;k++)
+  {
+    uint32_t offset = pos & (AAD_SHM_RING_SIZE - 1u);
+    size_t first = (lens[k] < AAD_SHM_RING_SIZE - offset) ? lens[k] : AAD_SHM_RING_SIZE - offset;
+    if(lens[k] == 0u)
+      continue;
+    memcpy(&r->data[offset],parts[k],first);
+    memcpy(&r->data[0],parts[k] + first,lens[k] - first);
+    pos += (uint32_t)lens[k];
+  }
+  __atomic_store_n(&r->head,head + len,__ATOMIC_SEQ_CST);
+  aad_shm_wake(&r->head,&r->consumer_waiting);
+  return 0;
+}
+
+//
+// copies exactly len bytes out
+// returns 0, 1 if they did not all arrive within timeout_ms milliseconds (nothing is consumed then), or -1
+// if the ring is closed and they never will
+//
+__attribute__((unused))
+static int aad_shm_recv(aad_shm_ring_t *r,void *data,size_t len,int timeout_ms)
+{
+  uint32_t tail = r->tail;  // only the consumer writes it
+
+  if(len > AAD_SHM_RING_SIZE)
+    return -1;
+  for(int slept = 0;;slept = 1)
+  {
+    uint32_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+    if(head - tail >= len)
+      break;
+    if(__atomic_load_n(&r->closed,__ATOMIC_ACQUIRE))
+      return -1;
+    if(slept)
+      return 1;
+    aad_shm_sleep(r,&r->head,&r->consumer_waiting,head,timeout_ms);
+  }
+
+  uint32_t offset = tail & (AAD_SHM_RING_SIZE - 1u);
+  size_t first = (len < AAD_SHM_RING_SIZE - offset) ? len : AAD_SHM_RING_SIZE - offset;
+  memcpy(data,&r->data[offset],first);
+  memcpy((uint8_t *)data + first,&r->data[0],len - first);
+  __atomic_store_n(&r->tail,tail + (uint32_t)len,__ATOMIC_SEQ_CST);
+  aad_shm_wake(&r->tail,&r->producer_waiting);
+  return 0;
+}
+
+//
+// creates a new segment and stores its name (of the form "/deti-<pid>-<n>"); returns NULL on failure
+// the creator unlinks the name once the other side has attached (or failed to), see aad_shm_unlink()
+//
+__attribute__((unused))
+static aad_shm_segment_t *aad_shm_create(char name[AAD_SHM_NAME_SIZE])
+{
+  static uint32_t counter = 0u;
+  struct timespec ts;
+
+  snprintf(name,AAD_SHM_NAME_SIZE,"/deti-%d-%u",(int)getpid(),__atomic_fetch_add(&counter,1u,__ATOMIC_RELAXED));
+  int fd = shm_open(name,O_CREAT | O_EXCL | O_RDWR,0600);
+  if(fd < 0)
+    return NULL;
+  if(ftruncate(fd,(off_t)sizeof(aad_shm_segment_t)) != 0)
+  {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  void *p = mmap(NULL,sizeof(aad_shm_segment_t),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(p == MAP_FAILED)
+  {
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // the new pages are zero filled, so the rings are already empty
+  aad_shm_segment_t *seg = (aad_shm_segment_t *)p;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  seg->token = ((uint64_t)ts.tv_nsec << 32) ^ (uint64_t)ts.tv_sec ^ ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)p;
+  __atomic_store_n(&seg->magic,AAD_SHM_MAGIC,__ATOMIC_RELEASE);
+  return seg;
+}
+
+//
+// maps a segment created by the other side; returns NULL if it does not exist or is not the expected one
+//
+__attribute__((unused))
+static aad_shm_segment_t *aad_shm_attach(const char *name,uint64_t token)
+{
+  struct stat st;
+
+  if(name[0] != '/' || memchr(name,'\0',AAD_SHM_NAME_SIZE) == NULL || strchr(name + 1,'/') != NULL)
+    return NULL;
+  int fd = shm_open(name,O_RDWR,0);
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd,&st) != 0 || st.st_size != (off_t)sizeof(aad_shm_segment_t))
+  {
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL,sizeof(aad_shm_segment_t),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(p == MAP_FAILED)
+    return NULL;
+
+  aad_shm_segment_t *seg = (aad_shm_segment_t *)p;
+  if(__atomic_load_n(&seg->magic,__ATOMIC_ACQUIRE) != AAD_SHM_MAGIC || seg->token != token)
+  {
+    munmap(p,sizeof(aad_shm_segment_t));
+    return NULL;
+  }
+  return seg;
+}
+
+__attribute__((unused))
+static void aad_shm_unlink(const char *name)
+{
+  shm_unlink(name);
+}
+
+//
+// closes both rings (whoever is waiting on them is woken up) and unmaps the segment
+//
+__attribute__((unused))
+static void aad_shm_close(aad_shm_segment_t *seg)
+{
+  for(int k = 0;k < 2;k++)
+  {
+    __atomic_store_n(&seg->ring[k].closed,1u,__ATOMIC_SEQ_CST);
+    aad_futex(&seg->ring[k].head,FUTEX_WAKE,INT32_MAX,NULL);
+    aad_futex(&seg->ring[k].tail,FUTEX_WAKE,INT32_MAX,NULL);
+  }
+  munmap(seg,sizeof(aad_shm_segment_t));
+}
+
+
+//
+// the end!
+//
+
+#endif
@@ -0,0 +1,126 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// per-host tuning profiles: what the tuning mode of a search program found to be fastest on this host, kept as
+// "program.key value" lines in deti_tuning_<hostname>.txt (in the current directory), and read back by the later
+// runs of the program
+//
+// several programs share one file; saving a key keeps the lines of the others
+//
+
+#ifndef AAD_TUNING
+#define AAD_TUNING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define AAD_PROFILE_LINE       128
+#define AAD_PROFILE_MAX_LINES  64
+
+static void aad_profile_path(char *path,size_t size)
+{
+  char host[64];
+
+  if(gethostname(host,sizeof(host)) != 0)
+    strcpy(host,"localhost");
+  host[sizeof(host) - 1] = '\0';
+  snprintf(path,size,"deti_tuning_%s.txt",host);
+}
+
+//
+// the value of program.key in the profile of this host; returns 1 if it is there, 0 if not (value unchanged)
+//
+__attribute__((unused))
+static int aad_profile_get(const char *program,const char *key,long *value)
+{
+  char path[96],line[AAD_PROFILE_LINE],name[AAD_PROFILE_LINE];
+  long v;
+  int found = 0;
+
+  aad_profile_path(path,sizeof(path));
+  snprintf(name,sizeof(name),"%s.%s",program,key);
+  FILE *fp = fopen(path,"r");
+  if(fp == NULL)
+    return 0;
+  while(fgets(line,sizeof(line),fp) != NULL)
+  {
+    size_t len = strlen(name);
+    if(strncmp(line,name,len) == 0 && line[len] == ' ' && sscanf(&line[len + 1],"%ld",&v) == 1)
+    {
+      *value = v;
+      found = 1;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+//
+// sets program.key to value in the profile of this host (written to a temporary file, then renamed over the
+// old one); returns 0, or -1 on failure
+//
+__attribute__((unused))
+static int aad_profile_set(const char *program,const char *key,long value)
+{
+  char path[96],temp[112],name[AAD_PROFILE_LINE];
+  static char lines[AAD_PROFILE_MAX_LINES][AAD_PROFILE_LINE];
+  int n_lines = 0,replaced = 0;
+
+  aad_profile_path(path,sizeof(path));
+  snprintf(temp,sizeof(temp),"%s.tmp",path);
+  snprintf(name,sizeof(name),"%s.%s",program,key);
+  size_t len = strlen(name);
+  FILE *fp = fopen(path,"r");
+  if(fp != NULL)
+  {
+    while(n_lines < AAD_PROFILE_MAX_LINES && fgets(lines[n_lines],AAD_PROFILE_LINE,fp) != NULL)
+      if(strncmp(lines[n_lines],name,len) == 0 && lines[n_lines][len] == ' ')
+      {
+        if(!replaced)
+          snprintf(lines[n_lines++],AAD_PROFILE_LINE,"%s %ld\n",name,value);
+        replaced = 1;
+      }
+      else
+        n_lines++;
+    fclose(fp);
+  }
+  if(!replaced)
+  {
+    if(n_lines == AAD_PROFILE_MAX_LINES)
+      return -1;
+    snprintf(lines[n_lines++],AAD_PROFILE_LINE,"%s %ld\n",name,value);
+  }
+
+  fp = fopen(temp,"w");
+  if(fp == NULL)
+    return -1;
+  for(int i = 0;i < n_lines;i++)
+    fputs(lines[i],fp);
+  if(fclose(fp) != 0 || rename(temp,path) != 0)
+  {
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+//
+// the name of the profile of this host, for messages
+//
+__attribute__((unused))
+static const char *aad_profile_name(void)
+{
+  static char path[96];
+
+  aad_profile_path(path,sizeof(path));
+  return path;
+}
+
+
+//
+// the end!
+//
+
+#endif
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+//
+// end-to-end benchmark of the distributed search on localhost: runs simd_openmp_search with all the
+// threads as a baseline, then a server and N clients with the same threads in total, and reports how
+// much of the standalone throughput survives the protocol
+//
+
+#define DEFAULT_N_CLIENTS 2
+#define DEFAULT_THREADS_PER_CLIENT 1
+#define DEFAULT_SECONDS 20.0
+#define DEFAULT_RANGE_SECONDS 2.0
+#define DEFAULT_PORT 9870
+#define RESULTS_FILE "bench_cluster_results.csv"
+#define MAX_CLIENTS 64
+
+typedef struct {
+  unsigned long nonces;
+  double seconds;
+  double hashing_seconds;
+  double idle_seconds;
+  unsigned int ranges;
+  unsigned long messages_sent;
+  unsigned long messages_received;
+  double rate;
+} client_summary_t;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// fork + exec with stdout and stderr going to log_path; extra_env is a NAME=value string or NULL
+static pid_t spawn(char *const argv[], const char *log_path, const char *extra_env)
+{
+  pid_t pid = fork();
+  if(pid < 0)
+  {
+    perror("fork");
+    exit(1);
+  }
+  if(pid == 0)
+  {
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0)
+    {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    if(extra_env != NULL)
+      putenv((char *)extra_env);
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+// waits up to timeout seconds for the process to exit; if it does not, it is killed
+static int wait_for(pid_t pid, double timeout)
+{
+  double deadline = now_seconds() + timeout;
+  int status;
+
+  while(now_seconds() < deadline)
+  {
+    if(waitpid(pid, &status, WNOHANG) == pid)
+      return status;
+    usleep(20000);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  return -1;
+}
+
+static int wait_for_port(int port, double timeout)
+{
+  double deadline = now_seconds() + timeout;
+  struct sockaddr_in addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  while(now_seconds() < deadline)
+  {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int ok = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(sock);
+    if(ok)
+      return 0;
+    usleep(20000);
+  }
+  return -1;
+}
+
+// user + system CPU seconds of a process, from /proc/<pid>/stat (negative if unavailable)
+static double process_cpu_seconds(pid_t pid)
+{
+  char path[64], text[1024];
+  unsigned long utime, stime;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    return -1.0;
+  size_t len = fread(text, 1, sizeof(text) - 1, fp);
+  fclose(fp);
+  text[len] = '\0';
+
+  char *p = strrchr(text, ')');
+  if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1.0;
+  return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+// the value that follows prefix on the first line of the log that contains it (negative if none)
+static double find_value(const char *log_path, const char *prefix)
+{
+  FILE *fp = fopen(log_path, "r");
+  char line[1024];
+  double value = -1.0;
+
+  if(fp == NULL)
+    return -1.0;
+  while(value < 0.0 && fgets(line, sizeof(line), fp) != NULL)
+  {
+    char *p = strstr(line, prefix);
+    if(p != NULL)
+      value = atof(p + strlen(prefix));
+  }
+  fclose(fp);
+  return value;
+}
+
+static int read_client_summary(const char *log_path, client_summary_t *s)
+{
+  FILE *fp = fopen(log_path, "r");
+  char line[1024];
+  int found = 0;
+
+  if(fp == NULL)
+    return -1;
+  while(fgets(line, sizeof(line), fp) != NULL)
+    if(sscanf(line, "Summary: nonces=%lu seconds=%lf hashing_seconds=%lf idle_seconds=%lf ranges=%u "
+                    "messages_sent=%lu messages_received=%lu rate=%lf", &s->nonces, &s->seconds, &s->hashing_seconds,
+              &s->idle_seconds, &s->ranges, &s->messages_sent, &s->messages_received, &s->rate) == 8)
+      found = 1;
+  fclose(fp);
+  return found ? 0 : -1;
+}
+
+// MH/s of simd_openmp_search with n_threads OpenMP threads, run for the given number of seconds
+static double run_standalone(int n_threads, double seconds, const char *log_path)
+{
+  char env[64];
+  char *argv[] = { "./simd_openmp_search", NULL };
+
+  snprintf(env, sizeof(env), "OMP_NUM_THREADS=%d", n_threads);
+  pid_t pid = spawn(argv, log_path, env);
+  usleep((useconds_t)(seconds * 1e6));
+  kill(pid, SIGINT);
+  wait_for(pid, 10.0);
+  return find_value(log_path, "Average speed:");
+}
+
+int main(int argc, char **argv)
+{
+  int n_clients = DEFAULT_N_CLIENTS;
+  int threads_per_client = DEFAULT_THREADS_PER_CLIENT;
+  double seconds = DEFAULT_SECONDS;
+  double range_seconds = DEFAULT_RANGE_SECONDS;
+  unsigned long nonce_budget = 0;
+  int port = DEFAULT_PORT;
+  int skip_standalone = 0;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      n_clients = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      threads_per_client = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+      seconds = atof(argv[++i]);
+    else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      range_seconds = atof(argv[++i]);
+    else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+      nonce_budget = strtoul(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      port = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-n") == 0)
+      skip_standalone = 1;
+    else
+    {
+      printf("Usage: %s [-c clients] [-t threads per client] [-T seconds] [-r range seconds] [-e nonce budget]\n"
+             "          [-p port] [-n (skip the standalone run)]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(n_clients < 1 || n_clients > MAX_CLIENTS || threads_per_client < 1 || seconds <= 0.0)
+  {
+    fprintf(stderr, "Bad arguments\n");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int n_threads = n_clients * threads_per_client;
+  char log_path[256];
+  printf("Cluster benchmark: %d clients x %d threads, %.0f s%s\n", n_clients, threads_per_client, seconds,
+         nonce_budget ? " or the nonce budget" : "");
+
+  double standalone = -1.0;
+  if(!skip_standalone)
+  {
+    snprintf(log_path, sizeof(log_path), "/tmp/bench_cluster_%d_standalone.log", (int)getpid());
+    standalone = run_standalone(n_threads, seconds, log_path);
+    if(standalone < 0.0)
+      fprintf(stderr, "No result from simd_openmp_search (see %s)\n", log_path);
+    else
+      printf("  standalone simd_openmp_search, %d threads: %.2f MH/s\n", n_threads, standalone);
+  }
+
+  // a fresh search each time, in dry-run mode so nothing is added to the vault
+  char state_path[256], port_arg[16], range_arg[32], end_arg[32];
+  snprintf(state_path, sizeof(state_path), "/tmp/bench_cluster_%d_state.txt", (int)getpid());
+  unlink(state_path);
+  snprintf(port_arg, sizeof(port_arg), "%d", port);
+  snprintf(range_arg, sizeof(range_arg), "%g", range_seconds);
+  snprintf(end_arg, sizeof(end_arg), "%lu", nonce_budget);
+  char *server_argv[16];
+  int k = 0;
+  server_argv[k++] = "./server";
+  server_argv[k++] = port_arg;
+  server_argv[k++] = "-D";
+  server_argv[k++] = "-S";
+  server_argv[k++] = state_path;
+  server_argv[k++] = "-t";
+  server_argv[k++] = range_arg;
+  if(nonce_budget > 0)
+  {
+    server_argv[k++] = "-e";
+    server_argv[k++] = end_arg;
+  }
+  server_argv[k] = NULL;
+
+  char server_log[256];
+  snprintf(server_log, sizeof(server_log), "/tmp/bench_cluster_%d_server.log", (int)getpid());
+  pid_t server = spawn(server_argv, server_log, NULL);
+  if(wait_for_port(port, 5.0) < 0)
+  {
+    fprintf(stderr, "The server did not start (see %s)\n", server_log);
+    kill(server, SIGKILL);
+    return 1;
+  }
+  double server_cpu0 = process_cpu_seconds(server);
+
+  pid_t clients[MAX_CLIENTS];
+  char threads_arg[16], budget_arg[32];
+  snprintf(threads_arg, sizeof(threads_arg), "%d", threads_per_client);
+  snprintf(budget_arg, sizeof(budget_arg), "%g", seconds);
+  double t0 = now_seconds();
+  for(int i = 0; i < n_clients; i++)
+  {
+    char *client_argv[] = { "./client", "127.0.0.1", port_arg, threads_arg, "-T", budget_arg, NULL };
+    snprintf(log_path, sizeof(log_path), "/tmp/bench_cluster_%d_client%d.log", (int)getpid(), i);
+    clients[i] = spawn(client_argv, log_path, NULL);
+  }
+  for(int i = 0; i < n_clients; i++)
+    wait_for(clients[i], seconds + 30.0);
+  double wall = now_seconds() - t0;
+  double server_cpu = process_cpu_seconds(server) - server_cpu0;
+  kill(server, SIGKILL);
+  waitpid(server, NULL, 0);
+  unlink(state_path);
+
+  client_summary_t total;
+  memset(&total, 0, sizeof(total));
+  double client_seconds = 0.0;
+  int n_reported = 0;
+  for(int i = 0; i < n_clients; i++)
+  {
+    client_summary_t s;
+    snprintf(log_path, sizeof(log_path), "/tmp/bench_cluster_%d_client%d.log", (int)getpid(), i);
+    if(read_client_summary(log_path, &s) < 0)
+    {
+      fprintf(stderr, "No summary from client %d (see %s)\n", i, log_path);
+      continue;
+    }
+    printf("  client %d: %.2f MH/s, %u ranges, %.3f s between ranges, %lu messages\n", i, s.rate / 1e6, s.ranges,
+           s.idle_seconds, s.messages_sent + s.messages_received);
+    total.nonces += s.nonces;
+    total.hashing_seconds += s.hashing_seconds;
+    total.idle_seconds += s.idle_seconds;
+    total.ranges += s.ranges;
+    total.messages_sent += s.messages_sent;
+    total.messages_received += s.messages_received;
+    if(s.seconds > client_seconds)
+      client_seconds = s.seconds;
+    n_reported++;
+  }
+  if(n_reported == 0)
+    return 1;
+
+  // the aggregate rate counts the time between ranges; the hashing rate only the time spent hashing
+  double cluster = (double)total.nonces / client_seconds / 1e6;
+  double hashing = (double)total.nonces / (total.hashing_seconds / (double)n_reported) / 1e6;
+  double efficiency = (standalone > 0.0) ? cluster / standalone : -1.0;
+  unsigned long messages = total.messages_sent + total.messages_received;
+  double idle_per_range = (total.ranges > 0) ? total.idle_seconds / (double)total.ranges : 0.0;
+  // client time not spent hashing (waiting for assignments, handshakes, draining reports), per message; unlike
+  // the efficiency, this does not depend on how the client kernel compares with the standalone one
+  double overhead_per_message = (messages > 0) ? total.idle_seconds / (double)messages : 0.0;
+
+  printf("\nResults\n");
+  printf("  aggregate rate:       %.2f MH/s (%.2f MH/s while hashing)\n", cluster, hashing);
+  printf("  protocol efficiency:  %.1f%% of the time spent hashing\n", 100.0 * cluster / hashing);
+  if(standalone > 0.0)
+    printf("  efficiency:           %.1f%% of standalone\n", 100.0 * efficiency);
+  printf("  ranges:               %u (%.3f s between ranges on average)\n", total.ranges, idle_per_range);
+  printf("  messages:             %lu (%.1f/s)\n", messages, (double)messages / wall);
+  printf("  overhead per message: %.1f us of client time\n", 1e6 * overhead_per_message);
+  printf("  server CPU:           %.2f s (%.1f%% of one core)\n", server_cpu, 100.0 * server_cpu / wall);
+
+  FILE *csv = fopen(RESULTS_FILE, "a");
+  if(csv == NULL)
+  {
+    perror(RESULTS_FILE);
+    return 1;
+  }
+  if(ftell(csv) == 0)
+    fprintf(csv, "Clients,ThreadsPerClient,Seconds,NonceBudget,StandaloneMHs,ClusterMHs,HashingMHs,Efficiency,"
+                 "Ranges,IdleSecondsPerRange,Messages,OverheadUsPerMessage,ServerCpuPercent\n");
+  fprintf(csv, "%d,%d,%.3f,%lu,%.2f,%.2f,%.2f,%.4f,%u,%.4f,%lu,%.1f,%.2f\n", n_clients, threads_per_client, client_seconds,
+          nonce_budget, standalone, cluster, hashing, efficiency, total.ranges, idle_per_range, messages,
+          1e6 * overhead_per_message, 100.0 * server_cpu / wall);
+  fclose(csv);
+  printf("Results appended to %s\n", RESULTS_FILE);
+  return 0;
+}
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "aad_data_types.h"
+#include "aad_utilities.h"
+#include "aad_sha1_cpu.h"
+#include "aad_distributed.h"
+#include "aad_shm_ring.h"
+
+#define DEFAULT_N_REPORTS 200000
+#define N_ROUND_TRIPS 20000
+
+typedef enum {
+  MODE_SINGLE,     // one MSG_REPORT_COIN per send, as the client used to do
+  MODE_COALESCED,  // MAX_COINS_PER_BATCH MSG_REPORT_COIN frames per write
+  MODE_BATCHED     // one MSG_REPORT_COINS message per MAX_COINS_PER_BATCH reports
+} report_mode_t;
+
+static const char *mode_names[] = { "single", "coalesced", "batched" };
+static const char *checksum_names[] = { "", "legacy", "crc32c", "shm" };
+
+typedef struct {
+  int listen_sock;
+  aad_shm_ring_t *ring;   // instead of the socket, for DETI_FRAME_VERSION_SHM
+  uint64_t n_received;
+  uint64_t n_messages;
+  uint64_t n_lock_acquisitions;
+} receiver_t;
+
+static pthread_mutex_t g_vault_lock = PTHREAD_MUTEX_INITIALIZER;
+static u32_t g_vault[1024][14];
+static u32_t g_vault_n = 0;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// what the server does with each group of reports: take the lock, hash and store every coin
+static void store_reports(receiver_t *r, coin_report_t *reports, uint32_t n)
+{
+  pthread_mutex_lock(&g_vault_lock);
+  for(uint32_t i = 0; i < n; i++)
+  {
+    u32_t hash[5];
+    sha1(reports[i].coin_data, hash);
+    memcpy(g_vault[g_vault_n++ & 1023u], reports[i].coin_data, sizeof(reports[i].coin_data));
+  }
+  pthread_mutex_unlock(&g_vault_lock);
+  r->n_lock_acquisitions++;
+  r->n_received += n;
+}
+
+// either end of a transport: a socket, or a shared-memory ring when one is given
+static int transport_write(int sock, aad_shm_ring_t *ring, const void *data, size_t len)
+{
+  int status;
+
+  if(ring == NULL)
+    return send_all(sock, data, len);
+  while((status = aad_shm_send(ring, data, len, NULL, 0, 1000)) == 1)
+    ;
+  return status;
+}
+
+static int transport_read(int sock, aad_shm_ring_t *ring, void *data, size_t len)
+{
+  int status;
+
+  if(ring == NULL)
+    return (recv(sock, data, len, MSG_WAITALL) == (ssize_t)len) ? 0 : -1;
+  while((status = aad_shm_recv(ring, data, len, 1000)) == 1)
+    ;
+  return status;
+}
+
+static void *receiver_thread(void *arg)
+{
+  receiver_t *r = (receiver_t *)arg;
+  int sock = (r->ring != NULL) ? -1 : accept(r->listen_sock, NULL, NULL);
+  char buffer[8192] __attribute__((aligned(8)));
+  message_header_t hdr;
+
+  if(sock < 0 && r->ring == NULL)
+  {
+    perror("accept");
+    return NULL;
+  }
+
+  for(;;)
+  {
+    if(transport_read(sock, r->ring, &hdr, sizeof(hdr)) < 0 || hdr.magic != PROTOCOL_MAGIC ||
+       hdr.length > sizeof(buffer))
+      break;
+    if(hdr.length > 0)
+    {
+      if(transport_read(sock, r->ring, buffer, hdr.length) < 0)
+        break;
+      if(frame_checksum(hdr.version, buffer, hdr.length) != hdr.checksum)
+      {
+        fprintf(stderr, "Checksum mismatch\n");
+        break;
+      }
+    }
+    r->n_messages++;
+
+    if(hdr.type == MSG_REPORT_COIN)
+      store_reports(r, (coin_report_t *)buffer, 1);
+    else if(hdr.type == MSG_REPORT_COINS)
+    {
+      coin_batch_t *batch = (coin_batch_t *)buffer;
+      store_reports(r, batch->reports, batch->count);
+    }
+    else if(hdr.type == MSG_SHUTDOWN)
+      break;
+  }
+
+  if(sock >= 0)
+    close(sock);
+  return NULL;
+}
+
+static size_t frame_reports(u08_t *buffer, report_mode_t mode, uint16_t frame_version, coin_report_t *reports, int n)
+{
+  message_header_t hdr;
+  size_t len = 0;
+
+  if(mode == MODE_BATCHED)
+  {
+    coin_batch_t *batch = (coin_batch_t *)&buffer[sizeof(hdr)];
+    batch->count = (uint32_t)n;
+    batch->reserved = 0;
+    memcpy(batch->reports, reports, (size_t)n * sizeof(coin_report_t));
+    init_message_header(&hdr, MSG_REPORT_COINS, (uint32_t)COIN_BATCH_SIZE(n));
+    seal_message_header(&hdr, frame_version, batch);
+    memcpy(buffer, &hdr, sizeof(hdr));
+    return sizeof(hdr) + COIN_BATCH_SIZE(n);
+  }
+
+  for(int i = 0; i < n; i++)
+  {
+    init_message_header(&hdr, MSG_REPORT_COIN, sizeof(coin_report_t));
+    seal_message_header(&hdr, frame_version, &reports[i]);
+    memcpy(&buffer[len], &hdr, sizeof(hdr));
+    len += sizeof(hdr);
+    memcpy(&buffer[len], &reports[i], sizeof(coin_report_t));
+    len += sizeof(coin_report_t);
+  }
+  return len;
+}
+
+// a connected pair of loopback TCP sockets (*client_sock, *server_sock), or of shared-memory rings
+// (ring[AAD_SHM_TO_SERVER] and ring[AAD_SHM_TO_CLIENT]) if use_shm is set
+static aad_shm_segment_t *open_transport(int use_shm, int *client_sock, int *listen_sock)
+{
+  if(use_shm)
+  {
+    char name[AAD_SHM_NAME_SIZE];
+    aad_shm_segment_t *seg = aad_shm_create(name);
+    if(seg == NULL)
+    {
+      perror("shm_open");
+      exit(1);
+    }
+    aad_shm_unlink(name);
+    *client_sock = *listen_sock = -1;
+    return seg;
+  }
+
+  *listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if(bind(*listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(*listen_sock, 1) < 0 ||
+     getsockname(*listen_sock, (struct sockaddr *)&addr, &addr_len) < 0)
+  {
+    perror("bind");
+    exit(1);
+  }
+
+  *client_sock = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(*client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if(connect(*client_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror("connect");
+    exit(1);
+  }
+  return NULL;
+}
+
+static void run_mode(report_mode_t mode, uint16_t frame_version, coin_report_t *fixtures, int n_fixtures, uint64_t n_reports, FILE *csv)
+{
+  receiver_t r;
+  int sock;
+  memset(&r, 0, sizeof(r));
+
+  aad_shm_segment_t *seg = open_transport(frame_version == DETI_FRAME_VERSION_SHM, &sock, &r.listen_sock);
+  aad_shm_ring_t *ring = (seg != NULL) ? &seg->ring[AAD_SHM_TO_SERVER] : NULL;
+  r.ring = ring;
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, receiver_thread, &r);
+
+  u08_t buffer[MAX_COINS_PER_BATCH * (sizeof(message_header_t) + sizeof(coin_report_t))] __attribute__((aligned(8)));
+  coin_report_t reports[MAX_COINS_PER_BATCH];
+  int group = (mode == MODE_SINGLE) ? 1 : MAX_COINS_PER_BATCH;
+  uint64_t sent = 0;
+  uint64_t bytes = 0;
+
+  double t0 = now_seconds();
+  while(sent < n_reports)
+  {
+    int n = 0;
+    while(n < group && sent + (uint64_t)n < n_reports)
+    {
+      reports[n] = fixtures[(sent + (uint64_t)n) % (uint64_t)n_fixtures];
+      n++;
+    }
+    size_t len = frame_reports(buffer, mode, frame_version, reports, n);
+    if(mode == MODE_SINGLE)
+    {
+      if(transport_write(sock, ring, buffer, sizeof(message_header_t)) < 0 ||
+         transport_write(sock, ring, buffer + sizeof(message_header_t), len - sizeof(message_header_t)) < 0)
+        break;
+    }
+    else if(transport_write(sock, ring, buffer, len) < 0)
+      break;
+    sent += (uint64_t)n;
+    bytes += len;
+  }
+  message_header_t hdr;
+  init_message_header(&hdr, MSG_SHUTDOWN, 0);
+  transport_write(sock, ring, &hdr, sizeof(hdr));
+  pthread_join(thread, NULL);
+  double elapsed = now_seconds() - t0;
+
+  if(seg != NULL)
+    aad_shm_close(seg);
+  else
+  {
+    close(sock);
+    close(r.listen_sock);
+  }
+
+  printf("  %-10s %-6s %10lu reports in %7.3fs: %12.0f reports/s, %10lu messages, %10lu lock acquisitions, %5.1f bytes/report\n",
+         mode_names[mode], checksum_names[frame_version], (unsigned long)r.n_received, elapsed, (double)r.n_received / elapsed,
+         (unsigned long)r.n_messages, (unsigned long)r.n_lock_acquisitions, (double)bytes / (double)sent);
+  fprintf(csv, "%s,%s,%lu,%.6f,%.0f,%lu,%lu,%.1f\n", mode_names[mode], checksum_names[frame_version],
+          (unsigned long)r.n_received, elapsed,
+          (double)r.n_received / elapsed, (unsigned long)r.n_messages, (unsigned long)r.n_lock_acquisitions,
+          (double)bytes / (double)sent);
+}
+
+typedef struct {
+  int listen_sock;
+  aad_shm_segment_t *seg;
+  uint16_t frame_version;
+} assigner_t;
+
+// answers every MSG_REQUEST_WORK with a MSG_WORK_ASSIGNMENT, as the server does
+static void *assigner_thread(void *arg)
+{
+  assigner_t *a = (assigner_t *)arg;
+  aad_shm_ring_t *rx = (a->seg != NULL) ? &a->seg->ring[AAD_SHM_TO_SERVER] : NULL;
+  aad_shm_ring_t *tx = (a->seg != NULL) ? &a->seg->ring[AAD_SHM_TO_CLIENT] : NULL;
+  int sock = (a->seg != NULL) ? -1 : accept(a->listen_sock, NULL, NULL);
+  u08_t frame[sizeof(message_header_t) + sizeof(work_assignment_ext_t)] __attribute__((aligned(8)));
+  work_assignment_ext_t *ext = (work_assignment_ext_t *)&frame[sizeof(message_header_t)];
+  message_header_t hdr;
+  uint64_t next_nonce = 0;
+
+  memset(frame, 0, sizeof(frame));
+  if(sock >= 0)
+  {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  while(transport_read(sock, rx, &hdr, sizeof(hdr)) == 0 && hdr.type == MSG_REQUEST_WORK)
+  {
+    ext->base.start_nonce = next_nonce;
+    ext->base.end_nonce = next_nonce += WORK_RANGE_SIZE;
+    ext->base.work_id++;
+    deti_template_bytes(0, ext->template_bytes);
+    init_message_header(&hdr, MSG_WORK_ASSIGNMENT, sizeof(*ext));
+    seal_message_header(&hdr, a->frame_version, ext);
+    memcpy(frame, &hdr, sizeof(hdr));
+    if(transport_write(sock, tx, frame, sizeof(frame)) < 0)
+      break;
+  }
+  if(sock >= 0)
+    close(sock);
+  return NULL;
+}
+
+// request/assignment round trips, what a client waits for between two ranges
+static void bench_round_trips(uint16_t frame_version, int n, FILE *csv)
+{
+  assigner_t a;
+  int sock;
+  message_header_t hdr;
+  u08_t payload[sizeof(work_assignment_ext_t)] __attribute__((aligned(8)));
+
+  a.frame_version = frame_version;
+  a.seg = open_transport(frame_version == DETI_FRAME_VERSION_SHM, &sock, &a.listen_sock);
+  aad_shm_ring_t *tx = (a.seg != NULL) ? &a.seg->ring[AAD_SHM_TO_SERVER] : NULL;
+  aad_shm_ring_t *rx = (a.seg != NULL) ? &a.seg->ring[AAD_SHM_TO_CLIENT] : NULL;
+  pthread_t thread;
+  pthread_create(&thread, NULL, assigner_thread, &a);
+
+  double t0 = now_seconds();
+  int done;
+  for(done = 0; done < n; done++)
+  {
+    init_message_header(&hdr, MSG_REQUEST_WORK, 0);
+    seal_message_header(&hdr, frame_version, NULL);
+    if(transport_write(sock, tx, &hdr, sizeof(hdr)) < 0 || transport_read(sock, rx, &hdr, sizeof(hdr)) < 0 ||
+       hdr.length != sizeof(payload) || transport_read(sock, rx, payload, hdr.length) < 0 ||
+       frame_checksum(hdr.version, payload, hdr.length) != hdr.checksum)
+      break;
+  }
+  double elapsed = now_seconds() - t0;
+  init_message_header(&hdr, MSG_SHUTDOWN, 0);
+  transport_write(sock, tx, &hdr, sizeof(hdr));
+  pthread_join(thread, NULL);
+
+  if(a.seg != NULL)
+    aad_shm_close(a.seg);
+  else
+  {
+    close(sock);
+    close(a.listen_sock);
+  }
+  printf("  %-6s %8d round trips in %7.3fs: %8.2f us each\n", checksum_names[frame_version], done, elapsed,
+         1e6 * elapsed / (double)done);
+  fprintf(csv, "round_trip,%s,%d,%.6f,%.3f\n", checksum_names[frame_version], done, elapsed, 1e6 * elapsed / (double)done);
+}
+
+// cost of checksumming one payload of each batched message size, with each checksum function
+static void bench_checksums(FILE *csv)
+{
+  static u08_t payload[COIN_BATCH_SIZE(MAX_COINS_PER_BATCH)];
+  const int batch_sizes[] = { 1, 8, MAX_COINS_PER_BATCH };
+  const char *names[] = { "simple_checksum", "crc32c_sw", "crc32c" };
+  volatile uint32_t sink = 0;
+
+  for(size_t i = 0; i < sizeof(payload); i++)
+    payload[i] = random_byte();
+
+  printf("\nChecksum cost per message\n");
+  for(int b = 0; b < 3; b++)
+  {
+    size_t len = COIN_BATCH_SIZE(batch_sizes[b]);
+    int iterations = (int)(200000000 / len);
+
+    for(int f = 0; f < 3; f++)
+    {
+      double t0 = now_seconds();
+      for(int it = 0; it < iterations; it++)
+      {
+        payload[0] = (u08_t)it;
+        if(f == 0)
+          sink += simple_checksum(payload, len);
+        else if(f == 1)
+          sink += crc32c_sw(payload, len);
+        else
+          sink += crc32c(payload, len);
+      }
+      double elapsed = now_seconds() - t0;
+      double ns = elapsed * 1e9 / iterations;
+      printf("  %2d coins (%5zu bytes)  %-16s %9.1f ns/message  %6.2f GB/s\n",
+             batch_sizes[b], len, names[f], ns, (double)len / ns);
+      fprintf(csv, "checksum,%s,%d,%zu,%.1f,%.2f\n", names[f], batch_sizes[b], len, ns, (double)len / ns);
+    }
+  }
+  (void)sink;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t n_reports = DEFAULT_N_REPORTS;
+
+  if(argc > 1)
+    n_reports = strtoull(argv[1], NULL, 10);
+
+  coin_report_t fixtures[256];
+  for(int i = 0; i < 256; i++)
+  {
+    u08_t *coin = (u08_t *)fixtures[i].coin_data;
+    const char *hdr = "DETI coin 2 ";
+    for(int k = 0; k < 12; k++)
+      coin[k ^ 3] = (u08_t)hdr[k];
+    for(int k = 12; k < 54; k++)
+      coin[k ^ 3] = (u08_t)(32 + random_byte() % 95);
+    coin[54 ^ 3] = (u08_t)'\n';
+    coin[55 ^ 3] = (u08_t)0x80;
+    sha1(fixtures[i].coin_data, fixtures[i].hash);
+    fixtures[i].nonce = (uint64_t)i;
+    fixtures[i].zeros = 0;
+    fixtures[i].work_id = 0;
+  }
+
+  printf("Coin report throughput over TCP loopback and shared memory (%lu reports per mode)\n", (unsigned long)n_reports);
+
+  FILE *csv = fopen("bench_protocol_results.csv", "w");
+  if(csv == NULL)
+  {
+    perror("bench_protocol_results.csv");
+    return 1;
+  }
+  fprintf(csv, "Mode,Checksum,Reports,Seconds,Reports/Second,Messages,LockAcquisitions,BytesPerReport\n");
+
+  run_mode(MODE_SINGLE, DETI_FRAME_VERSION_LEGACY, fixtures, 256, n_reports, csv);
+  run_mode(MODE_COALESCED, DETI_FRAME_VERSION_LEGACY, fixtures, 256, n_reports, csv);
+  run_mode(MODE_BATCHED, DETI_FRAME_VERSION_LEGACY, fixtures, 256, n_reports, csv);
+  run_mode(MODE_BATCHED, DETI_FRAME_VERSION_CRC32C, fixtures, 256, n_reports, csv);
+  run_mode(MODE_SINGLE, DETI_FRAME_VERSION_SHM, fixtures, 256, n_reports, csv);
+  run_mode(MODE_BATCHED, DETI_FRAME_VERSION_SHM, fixtures, 256, n_reports, csv);
+
+  printf("\nWork request round trips\n");
+  fprintf(csv, "Section,Transport,RoundTrips,Seconds,MicrosecondsPerRoundTrip\n");
+  bench_round_trips(DETI_FRAME_VERSION_CRC32C, N_ROUND_TRIPS, csv);
+  bench_round_trips(DETI_FRAME_VERSION_SHM, N_ROUND_TRIPS, csv);
+
+  fprintf(csv, "Section,Function,Coins,Bytes,NsPerMessage,GBPerSecond\n");
+  bench_checksums(csv);
+
+  fclose(csv);
+  printf("Results saved to bench_protocol_results.csv\n");
+  return 0;
+}
@@ -1,73 +1,211 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <omp.h>
 
 #include "aad_data_types.h"
 #include "aad_utilities.h"
 #include "aad_sha1_cpu.h"
 #include "aad_distributed.h"
+#include "aad_queue.h"
+#include "aad_shm_ring.h"
+#ifdef DETI_WITH_OPENCL
+# include "aad_opencl_devices.h"
+#endif
 
 #if defined(__AVX2__)
 # define N_LANES 8
 # define USE_AVX2 1
 # define CLIENT_TYPE "SIMD+OpenMP(AVX2)"
+# define CLIENT_ISA "AVX2"
 #elif defined(__AVX__)
 # define N_LANES 4
 # define USE_AVX 1
 # define CLIENT_TYPE "SIMD+OpenMP(AVX)"
+# define CLIENT_ISA "AVX"
 #elif defined(__ARM_NEON)
 # define N_LANES 4
 # define USE_NEON 1
 # define CLIENT_TYPE "SIMD+OpenMP(NEON)"
+# define CLIENT_ISA "NEON"
 #else
 # define N_LANES 1
 # define CLIENT_TYPE "CPU+OpenMP"
+# define CLIENT_ISA "scalar"
 #endif
 
+#define COIN_QUEUE_CAPACITY 4096
+#define CHUNK_BATCHES 1000
+#define BENCHMARK_SECONDS 0.25
+#define SHM_POLL_MS 1000
+#define CANCEL_POLL_MS 10
+#define CONNECT_TIMEOUT 5
+#define RECONNECT_MIN_DELAY 1.0
+#define RECONNECT_MAX_DELAY 60.0
+#define SPOOL_DEFAULT_PATH "deti_client.spool"
+#define SPOOL_MAX_PAYLOAD 256
+#define OPENCL_KERNEL_FILE "opencl_search_kernel.cl"
+#define DEVICE_SLICE_SECONDS 0.05
+#define BENCHMARK_WORK_ID UINT32_MAX   // of the ranges of the benchmark, which no server leased
+
 static volatile sig_atomic_t g_stop_requested = 0;
 
+static aad_queue_t g_coin_queue;
+static sem_t g_coin_wakeup;
+static pthread_mutex_t g_send_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_recv_lock = PTHREAD_MUTEX_INITIALIZER;   // held by the main thread, except while hashing
+static int g_io_running = 0;
+static uint32_t g_features = 0;
+static uint16_t g_frame_version = DETI_FRAME_VERSION_LEGACY;
+static double g_progress_interval = DETI_DEFAULT_PROGRESS_INTERVAL;
+static double g_deadline = 0.0;   // the client stops at this time (0 for no time budget)
+static aad_shm_segment_t *g_shm = NULL;   // replaces the socket once the server has attached it (-M)
+static int g_n_devices = 0;   // OpenCL devices hashing next to the CPU threads (-G)
+static double g_cpu_rate = 0.0;   // nonces per second of the CPU threads, measured at startup
+#ifdef DETI_WITH_OPENCL
+static aad_opencl_device_t g_devices[AAD_OPENCL_MAX_DEVICES];
+#endif
+
+// the connection to the server; while it is down, coin reports and completions go to the spool instead
+// (only the main thread replaces it, and it holds the send lock while doing so)
+static int g_sock = -1;
+static int g_connected = 0;
+
+// frames that could not be sent, appended to a file and replayed once the server is back; a spool left
+// behind by a client that was stopped during an outage is replayed when it next connects
+static struct {
+  char path[256];
+  int fd;
+  uint64_t pending;   // records in the file
+} g_spool = { "", -1, 0 };
+
+// what the client did, for the summary printed when it exits
+static struct {
+  uint64_t nonces;
+  double hashing_seconds;
+  uint32_t ranges;
+  uint64_t messages_sent;
+  uint64_t messages_received;
+} g_totals;
+
+// the chunks of the range being hashed: next is the first one not claimed yet, and in_flight[t] is never past the
+// first chunk that worker t has claimed but not finished (UINT64_MAX when it holds none), so that every chunk
+// before the smallest of them all is done, whatever order the workers finish their chunks in
+typedef struct {
+  uint64_t next;
+  uint64_t range;        // nonces of the range
+  int n_workers;
+  uint64_t *in_flight;
+} chunk_claims_t;
+
+// the range being hashed: written by the main thread, counted by the workers, read by the I/O thread
+static struct {
+  int active;
+  uint32_t work_id;
+  uint64_t nonces_done;  // summed over the workers, so not a prefix of the range until it is finished
+  uint64_t stop_nonce;   // set by the I/O thread when the server cancels the rest of the range
+  chunk_claims_t claims;
+  double start_time;
+} g_progress;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 static void handle_sigint(int sig)
 {
   (void)sig;
   g_stop_requested = 1;
 }
 
-static int send_message(int sock, message_type_t type, const void *payload, uint32_t payload_len)
+// a server that went away leaves the socket readable, with nothing to read
+static int peer_alive(int sock)
 {
-  message_header_t hdr;
-  init_message_header(&hdr, type, payload_len);
-  
-  if(payload && payload_len > 0)
-    hdr.checksum = simple_checksum(payload, payload_len);
+  struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+  char byte;
   
-  if(send(sock, &hdr, sizeof(hdr), 0) != sizeof(hdr))
-    return -1;
-  
-  if(payload && payload_len > 0)
+  if(poll(&pfd, 1, 0) <= 0)
+    return 1;
+  return recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+// writes whole frames (part2 may be NULL) to the socket or, once attached, to the shared-memory ring
+// (the caller holds the send lock, so the ring has a single producer)
+static int write_frames(int sock, const void *part1, size_t len1, const void *part2, size_t len2)
+{
+  if(g_shm == NULL)
+    return send_all2(sock, part1, len1, part2, len2);
+  for(;;)
+  {
+    int status = aad_shm_send(&g_shm->ring[AAD_SHM_TO_SERVER], part1, len1, part2, (part2 != NULL) ? len2 : 0, SHM_POLL_MS);
+    if(status <= 0)
+      return status;
+    if(!peer_alive(sock))
+      return -1;
+  }
+}
+
+static int read_bytes(int sock, void *data, size_t len)
+{
+  if(g_shm == NULL)
+    return (recv(sock, data, len, MSG_WAITALL) == (ssize_t)len) ? 0 : -1;
+  for(;;)
   {
-    if(send(sock, payload, payload_len, 0) != (ssize_t)payload_len)
+    int status = aad_shm_recv(&g_shm->ring[AAD_SHM_TO_CLIENT], data, len, SHM_POLL_MS);
+    if(status <= 0)
+      return status;
+    if(!peer_alive(sock))
       return -1;
   }
+}
+
+// the caller holds the send lock
+static int write_message(int sock, message_type_t type, const void *payload, uint32_t payload_len)
+{
+  message_header_t hdr;
+  init_message_header(&hdr, type, payload_len);
+  seal_message_header(&hdr, g_frame_version, payload);
+  g_totals.messages_sent++;
+  return write_frames(sock, &hdr, sizeof(hdr), payload, payload_len);
+}
+
+static int send_message(int sock, message_type_t type, const void *payload, uint32_t payload_len)
+{
+  pthread_mutex_lock(&g_send_lock);
+  int status = write_message(sock, type, payload, payload_len);
+  pthread_mutex_unlock(&g_send_lock);
   
-  return 0;
+  return status;
 }
 
+// shared-memory frames carry no checksum, and are only accepted from the ring
 static int recv_message(int sock, message_header_t *hdr, void *payload, uint32_t max_payload)
 {
-  ssize_t n = recv(sock, hdr, sizeof(*hdr), MSG_WAITALL);
-  if(n != sizeof(*hdr))
+  if(read_bytes(sock, hdr, sizeof(*hdr)) < 0)
     return -1;
   
-  if(hdr->magic != PROTOCOL_MAGIC || hdr->version != DETI_PROTOCOL_VERSION)
+  if(hdr->magic != PROTOCOL_MAGIC)
+    return -1;
+  if(g_shm != NULL ? hdr->version != DETI_FRAME_VERSION_SHM
+                   : hdr->version < DETI_FRAME_VERSION_LEGACY || hdr->version > DETI_FRAME_VERSION_CRC32C)
     return -1;
   
   if(hdr->length > 0)
@@ -75,11 +213,10 @@ static int recv_message(int sock, message_header_t *hdr, void *payload, uint32_t
     if(hdr->length > max_payload)
       return -1;
     
-    n = recv(sock, payload, hdr->length, MSG_WAITALL);
-    if(n != (ssize_t)hdr->length)
+    if(read_bytes(sock, payload, hdr->length) < 0)
       return -1;
     
-    uint32_t check = simple_checksum(payload, hdr->length);
+    uint32_t check = frame_checksum(hdr->version, payload, hdr->length);
     if(check != hdr->checksum)
       return -1;
   }
@@ -87,24 +224,571 @@ static int recv_message(int sock, message_header_t *hdr, void *payload, uint32_t
   return 0;
 }
 
-static void process_work(int sock, const work_assignment_t *work, int n_threads, const char *custom_string)
+//
+// the spool: each record is a CRC32C frame, so that one torn by a crash is recognized and dropped
+//
+
+// returns 1 for a record, 0 at the end of the file and -1 for a torn record
+static int spool_next(message_header_t *hdr, u08_t payload[SPOOL_MAX_PAYLOAD])
 {
-  printf("Processing work %u: nonces %lu to %lu (%lu total)\n",
-         work->work_id, (unsigned long)work->start_nonce, (unsigned long)work->end_nonce,
-         (unsigned long)(work->end_nonce - work->start_nonce));
+  ssize_t n = read(g_spool.fd, hdr, sizeof(*hdr));
+  
+  if(n == 0)
+    return 0;
+  if(n != (ssize_t)sizeof(*hdr) || hdr->magic != PROTOCOL_MAGIC || hdr->version != DETI_FRAME_VERSION_CRC32C ||
+     hdr->length > SPOOL_MAX_PAYLOAD || read(g_spool.fd, payload, hdr->length) != (ssize_t)hdr->length ||
+     frame_checksum(hdr->version, payload, hdr->length) != hdr->checksum)
+    return -1;
+  return 1;
+}
+
+// opens the spool file and counts what an earlier run left in it; if another client of this machine holds
+// it, this one spools to a file of its own (path.pid)
+static int spool_open(const char *path)
+{
+  message_header_t hdr;
+  u08_t payload[SPOOL_MAX_PAYLOAD] __attribute__((aligned(8)));
+  
+  snprintf(g_spool.path, sizeof(g_spool.path), "%s", path);
+  for(int attempt = 0; g_spool.fd < 0; attempt++)
+  {
+    int fd = open(g_spool.path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if(fd < 0)
+    {
+      perror(g_spool.path);
+      return -1;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) == 0)
+      g_spool.fd = fd;
+    else
+    {
+      close(fd);
+      if(attempt > 0)
+        return -1;
+      snprintf(g_spool.path, sizeof(g_spool.path), "%s.%d", path, (int)getpid());
+    }
+  }
+  
+  off_t good = 0;
+  int status;
+  while((status = spool_next(&hdr, payload)) > 0)
+  {
+    g_spool.pending++;
+    good = lseek(g_spool.fd, 0, SEEK_CUR);
+  }
+  if(status < 0)
+  {
+    fprintf(stderr, "Dropping a torn record at the end of %s\n", g_spool.path);
+    if(ftruncate(g_spool.fd, good) != 0)
+      perror("ftruncate");
+  }
+  return 0;
+}
+
+// the id the server knows this client by across restarts, from the host and the absolute path of the spool (the
+// completions replayed from the spool are only taken for ranges that were leased to the same id)
+static uint64_t spool_client_id(const char *hostname, size_t hostname_size)
+{
+  char path[PATH_MAX];
+  uint64_t id = 0;
+  
+  if(realpath(g_spool.path, path) == NULL)
+    snprintf(path, sizeof(path), "%s", g_spool.path);
+  for(size_t i = 0; i < hostname_size && hostname[i] != '\0'; i++)
+    id = deti_mix64(id ^ (u08_t)hostname[i]);
+  id = deti_mix64(id ^ (u08_t)'\n');
+  for(size_t i = 0; path[i] != '\0'; i++)
+    id = deti_mix64(id ^ (u08_t)path[i]);
+  return (id != 0) ? id : 1;
+}
+
+// the caller holds the send lock
+static int spool_append(message_type_t type, const void *payload, uint32_t payload_len)
+{
+  u08_t record[sizeof(message_header_t) + SPOOL_MAX_PAYLOAD] __attribute__((aligned(8)));
+  message_header_t hdr;
+  
+  if(g_spool.fd < 0 || payload_len > SPOOL_MAX_PAYLOAD)
+    return -1;
+  init_message_header(&hdr, type, payload_len);
+  seal_message_header(&hdr, DETI_FRAME_VERSION_CRC32C, payload);
+  memcpy(record, &hdr, sizeof(hdr));
+  if(payload_len > 0)
+    memcpy(&record[sizeof(hdr)], payload, payload_len);
+  if(write(g_spool.fd, record, sizeof(hdr) + payload_len) != (ssize_t)(sizeof(hdr) + payload_len))
+  {
+    perror(g_spool.path);
+    return -1;
+  }
+  g_spool.pending++;
+  return 0;
+}
+
+// sends every spooled record over a new connection and empties the spool (the caller holds the send lock)
+static int spool_replay(int sock)
+{
+  message_header_t hdr;
+  u08_t payload[SPOOL_MAX_PAYLOAD] __attribute__((aligned(8)));
+  unsigned long n = 0;
+  
+  if(g_spool.fd < 0 || g_spool.pending == 0)
+    return 0;
+  lseek(g_spool.fd, 0, SEEK_SET);
+  while(spool_next(&hdr, payload) > 0)
+  {
+    if(write_message(sock, (message_type_t)hdr.type, payload, hdr.length) < 0)
+      return -1;
+    n++;
+  }
+  if(ftruncate(g_spool.fd, 0) != 0)
+    perror("ftruncate");
+  g_spool.pending = 0;
+  printf("Replayed %lu spooled messages\n", n);
+  return 0;
+}
+
+// the caller holds the send lock
+static void link_lost(void)
+{
+  if(!g_connected)
+    return;
+  __atomic_store_n(&g_connected, 0, __ATOMIC_RELEASE);
+  fprintf(stderr, "Connection lost, results go to %s until the server is back\n", g_spool.path);
+}
+
+// sends a message over the current connection; when there is none (or it fails now) the message is appended to
+// the spool if spool is set, and dropped otherwise
+static int send_or_spool(message_type_t type, const void *payload, uint32_t payload_len, int spool)
+{
+  int status = -1;
+  
+  pthread_mutex_lock(&g_send_lock);
+  if(g_connected && (status = write_message(g_sock, type, payload, payload_len)) < 0)
+    link_lost();
+  if(status < 0 && spool)
+    status = spool_append(type, payload, payload_len);
+  pthread_mutex_unlock(&g_send_lock);
+  
+  return status;
+}
+
+// creates a shared-memory segment and asks the server to attach it; on success every later frame goes
+// through it, otherwise the client carries on over the socket
+static void attach_shared_memory(int sock)
+{
+  shm_attach_t attach;
+  message_header_t hdr;
+  char buffer[256] __attribute__((aligned(8)));
+  
+  memset(&attach, 0, sizeof(attach));
+  aad_shm_segment_t *seg = aad_shm_create(attach.name);
+  if(seg == NULL)
+  {
+    perror("shm_open");
+    return;
+  }
+  attach.token = seg->token;
+  
+  int status = -1;
+  if(send_message(sock, MSG_SHM_ATTACH, &attach, sizeof(attach)) == 0 &&
+     recv_message(sock, &hdr, buffer, sizeof(buffer)) == 0 && hdr.type == MSG_SHM_ATTACH &&
+     hdr.length == sizeof(shm_attach_t))
+    status = (int)((shm_attach_t *)buffer)->status;
+  aad_shm_unlink(attach.name);
+  
+  if(status != 0)
+  {
+    printf("The server could not attach shared memory, staying on TCP\n");
+    aad_shm_close(seg);
+    return;
+  }
+  g_shm = seg;
+  g_frame_version = DETI_FRAME_VERSION_SHM;
+  printf("Using shared memory %s\n", attach.name);
+}
+
+// sends every queued coin report, up to MAX_COINS_PER_BATCH of them in a single write (one
+// MSG_REPORT_COINS message if the server supports it, otherwise back-to-back MSG_REPORT_COIN frames)
+// the send lock is held while popping, so anything popped is on the wire (or in the spool) before the next
+// message
+static int drain_coin_reports(void)
+{
+  u08_t buffer[MAX_COINS_PER_BATCH * (sizeof(message_header_t) + sizeof(coin_report_t))] __attribute__((aligned(8)));
+  coin_report_t reports[MAX_COINS_PER_BATCH];
+  int status = 0;
+  
+  pthread_mutex_lock(&g_send_lock);
+  for(;;)
+  {
+    message_header_t hdr;
+    size_t len = 0;
+    int n = 0;
+    
+    while(n < MAX_COINS_PER_BATCH && aad_queue_pop(&g_coin_queue, &reports[n]) == 0)
+    {
+      printf("FOUND COIN: nonce=%lu zeros=%u\n", (unsigned long)reports[n].nonce, reports[n].zeros);
+      n++;
+    }
+    
+    if(n == 0)
+      break;
+    
+    if(g_features & DETI_CAP_BATCH_REPORTS)
+    {
+      coin_batch_t *batch = (coin_batch_t *)&buffer[sizeof(hdr)];
+      batch->count = (uint32_t)n;
+      batch->reserved = 0;
+      memcpy(batch->reports, reports, (size_t)n * sizeof(coin_report_t));
+      init_message_header(&hdr, MSG_REPORT_COINS, (uint32_t)COIN_BATCH_SIZE(n));
+      seal_message_header(&hdr, g_frame_version, batch);
+      memcpy(buffer, &hdr, sizeof(hdr));
+      len = sizeof(hdr) + COIN_BATCH_SIZE(n);
+    }
+    else
+    {
+      for(int i = 0; i < n; i++)
+      {
+        init_message_header(&hdr, MSG_REPORT_COIN, sizeof(coin_report_t));
+        seal_message_header(&hdr, g_frame_version, &reports[i]);
+        memcpy(&buffer[len], &hdr, sizeof(hdr));
+        len += sizeof(hdr);
+        memcpy(&buffer[len], &reports[i], sizeof(coin_report_t));
+        len += sizeof(coin_report_t);
+      }
+    }
+    
+    if(g_connected && write_frames(g_sock, buffer, len, NULL, 0) == 0)
+      g_totals.messages_sent += (g_features & DETI_CAP_BATCH_REPORTS) ? 1 : (uint64_t)n;
+    else
+    { // spooled one by one, as the next server may not take batches
+      link_lost();
+      for(int i = 0; i < n; i++)
+        if(spool_append(MSG_REPORT_COIN, &reports[i], sizeof(coin_report_t)) < 0)
+          status = -1;
+    }
+  }
+  pthread_mutex_unlock(&g_send_lock);
+  
+  return status;
+}
+
+// the nonces from the start of the range up to the first one that is not done yet (next is read before the
+// workers' chunks, so that a chunk claimed meanwhile is either below next or already in its worker's slot)
+static uint64_t claims_prefix(chunk_claims_t *claims)
+{
+  const uint64_t chunk_nonces = (uint64_t)CHUNK_BATCHES * N_LANES;
+  uint64_t first = __atomic_load_n(&claims->next, __ATOMIC_SEQ_CST);
+  
+  for(int t = 0; t < claims->n_workers; t++)
+  {
+    uint64_t chunk = __atomic_load_n(&claims->in_flight[t], __ATOMIC_SEQ_CST);
+    if(chunk < first)
+      first = chunk;
+  }
+  return (first * chunk_nonces < claims->range) ? first * chunk_nonces : claims->range;
+}
+
+static void claims_reset(chunk_claims_t *claims, uint64_t range)
+{
+  claims->range = range;
+  for(int t = 0; t < claims->n_workers; t++)
+    __atomic_store_n(&claims->in_flight[t], UINT64_MAX, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&claims->next, 0, __ATOMIC_SEQ_CST);
+}
+
+// sends a MSG_PROGRESS once every g_progress_interval seconds while a range is being hashed; it reports the prefix of
+// the range that is done (the server takes it as searched), and the rate from all the nonces hashed
+// (they are not spooled, as they would be stale by the time the server is back)
+static void send_progress(uint32_t *last_work_id, uint64_t *last_done, double *last_time)
+{
+  if(g_progress_interval <= 0.0 || !(g_features & DETI_CAP_PROGRESS) || !__atomic_load_n(&g_connected, __ATOMIC_ACQUIRE) ||
+     !__atomic_load_n(&g_progress.active, __ATOMIC_ACQUIRE))
+    return;
+  
+  uint32_t work_id = __atomic_load_n(&g_progress.work_id, __ATOMIC_ACQUIRE);
+  uint64_t done = __atomic_load_n(&g_progress.nonces_done, __ATOMIC_RELAXED);
+  uint64_t prefix = claims_prefix(&g_progress.claims);
+  double now = now_seconds();
+  
+  if(work_id != *last_work_id || done < *last_done)
+  {
+    *last_work_id = work_id;
+    *last_done = 0;
+    *last_time = g_progress.start_time;
+  }
+  if(now - *last_time < g_progress_interval)
+    return;
+  
+  progress_report_t progress;
+  progress.work_id = work_id;
+  progress.reserved = 0;
+  progress.nonces_done = prefix;
+  progress.hash_rate = (double)(done - *last_done) / (now - *last_time);
+  progress.elapsed_time = now - g_progress.start_time;
+  
+  send_or_spool(MSG_PROGRESS, &progress, sizeof(progress), 0);
+  
+  *last_done = done;
+  *last_time = now;
+}
+
+// whether the server sent something (or went away, which reading notices)
+static int message_waiting(void)
+{
+  struct pollfd pfd = { .fd = g_sock, .events = POLLIN, .revents = 0 };
+  
+  if(g_shm != NULL)
+    return __atomic_load_n(&g_shm->ring[AAD_SHM_TO_CLIENT].head, __ATOMIC_ACQUIRE) != g_shm->ring[AAD_SHM_TO_CLIENT].tail ||
+           !peer_alive(g_sock);
+  return poll(&pfd, 1, 0) > 0;
+}
+
+// while a range is being hashed the main thread lets go of the connection, and the I/O thread reads from it: the
+// server may cancel the rest of the range, and the workers then stop at their next chunk
+static void watch_server(void)
+{
+  message_header_t hdr;
+  char buffer[256] __attribute__((aligned(8)));
+  
+  if(!__atomic_load_n(&g_progress.active, __ATOMIC_ACQUIRE) || pthread_mutex_trylock(&g_recv_lock) != 0)
+    return;
+  if(__atomic_load_n(&g_progress.active, __ATOMIC_ACQUIRE) && __atomic_load_n(&g_connected, __ATOMIC_ACQUIRE) &&
+     message_waiting())
+  {
+    if(recv_message(g_sock, &hdr, buffer, sizeof(buffer)) < 0 || hdr.type == MSG_SHUTDOWN)
+    {
+      pthread_mutex_lock(&g_send_lock);
+      link_lost();
+      pthread_mutex_unlock(&g_send_lock);
+    }
+    else
+    {
+      cancel_work_t *cancel = (cancel_work_t *)buffer;
+      g_totals.messages_received++;
+      if(hdr.type == MSG_CANCEL_WORK && hdr.length == sizeof(cancel_work_t) && cancel->work_id == g_progress.work_id &&
+         cancel->end_nonce < __atomic_load_n(&g_progress.stop_nonce, __ATOMIC_RELAXED))
+      {
+        __atomic_store_n(&g_progress.stop_nonce, cancel->end_nonce, __ATOMIC_RELAXED);
+        printf("Work %u cancelled from nonce %lu on\n", cancel->work_id, (unsigned long)cancel->end_nonce);
+      }
+    }
+  }
+  pthread_mutex_unlock(&g_recv_lock);
+}
+
+static void *coin_io_thread(void *arg)
+{
+  (void)arg;
+  uint32_t last_work_id = UINT32_MAX;
+  uint64_t last_done = 0;
+  double last_time = 0.0;
+  
+  while(__atomic_load_n(&g_io_running, __ATOMIC_ACQUIRE))
+  {
+    // a cancel is noticed within CANCEL_POLL_MS, while a range is being hashed
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += __atomic_load_n(&g_progress.active, __ATOMIC_ACQUIRE) ? CANCEL_POLL_MS * 1000000L : 100000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    sem_timedwait(&g_coin_wakeup, &deadline);
+    
+    // the workers notice at their next chunk, and the partial range is reported as usual
+    if(g_deadline > 0.0 && now_seconds() >= g_deadline)
+      g_stop_requested = 1;
+    if(drain_coin_reports() < 0)
+      fprintf(stderr, "Failed to send or spool coin reports\n");
+    send_progress(&last_work_id, &last_done, &last_time);
+    watch_server();
+  }
+  
+  return NULL;
+}
+
+// the last three message words: the nonce in base 95 (10 printable characters), '\n' and the padding byte
+static inline void encode_nonce(uint64_t nonce, u32_t *w11, u32_t *w12, u32_t *w13)
+{
+  u32_t d[DETI_NONCE_DIGITS];
+  
+  for(int j = 0; j < DETI_NONCE_DIGITS; j++)
+  {
+    d[j] = 32u + (u32_t)(nonce % 95ULL);
+    nonce /= 95ULL;
+  }
+  *w11 = (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+  *w12 = (d[4] << 24) | (d[5] << 16) | (d[6] << 8) | d[7];
+  *w13 = (d[8] << 24) | (d[9] << 16) | ((u32_t)'\n' << 8) | 0x80u;
+}
+
+// hands a coin (its message and SHA1 hash) over to the I/O thread; a coin of the benchmark is only printed, as
+// the server would not take a coin of a range it did not lease
+static void queue_coin(uint32_t work_id, uint64_t nonce, const u32_t coin[14], const u32_t hash[5])
+{
+  coin_report_t report;
+  unsigned int zeros;
+  
+  if(work_id == BENCHMARK_WORK_ID)
+  {
+    char text[55];
+    for(int b = 0; b < 54; b++)
+      text[b] = (char)((const u08_t *)coin)[b ^ 3];
+    text[54] = '\0';
+    printf("Coin found by the benchmark (not reported): %s\n", text);
+    return;
+  }
+  for(zeros = 0u; zeros < 128u; zeros++)
+    if(((hash[1u + zeros / 32u] >> (31u - zeros % 32u)) & 1u) != 0u)
+      break;
+  if(zeros > 99u) zeros = 99u;
+  
+  report.nonce = nonce;
+  report.zeros = zeros;
+  report.work_id = work_id;
+  memcpy(report.coin_data, coin, sizeof(report.coin_data));
+  memcpy(report.hash, hash, sizeof(report.hash));
+  while(aad_queue_push(&g_coin_queue, &report) < 0)
+    sched_yield();
+  sem_post(&g_coin_wakeup);
+}
+
+// claims, for worker, up to claim chunks of the range from claims->next on, but none at or past n_chunks nor at or
+// past the chunk of *stop_nonce (which the I/O thread lowers when the server cancels the rest of the range); returns
+// the number of chunks claimed (0 when there are none left), the first one in *first
+// a claimed chunk is always hashed, cancelled or not, so once the workers are done the chunks done are exactly
+// those claimed: a prefix (and, meanwhile, those before claims_prefix())
+// the worker's slot is set before the claim is published, as the chunks it held until now are finished
+static uint64_t claim_chunks(const work_assignment_t *work, chunk_claims_t *claims, int worker, uint64_t n_chunks,
+                             uint64_t claim, const uint64_t *stop_nonce, uint64_t *first)
+{
+  const uint64_t chunk_nonces = (uint64_t)CHUNK_BATCHES * N_LANES;
+  uint64_t chunk = __atomic_load_n(&claims->next, __ATOMIC_SEQ_CST);
+  
+  for(;;)
+  {
+    uint64_t stop = __atomic_load_n(stop_nonce, __ATOMIC_RELAXED);
+    uint64_t limit = n_chunks;
+    if(stop < work->end_nonce)
+      limit = (stop > work->start_nonce) ? (stop - work->start_nonce + chunk_nonces - 1) / chunk_nonces : 0;
+    if(chunk >= limit)
+    {
+      __atomic_store_n(&claims->in_flight[worker], UINT64_MAX, __ATOMIC_SEQ_CST);
+      return 0;
+    }
+    if(claim > limit - chunk)
+      claim = limit - chunk;
+    __atomic_store_n(&claims->in_flight[worker], chunk, __ATOMIC_SEQ_CST);
+    if(__atomic_compare_exchange_n(&claims->next, &chunk, chunk + claim, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+      *first = chunk;
+      return claim;
+    }
+  }
+}
+
+#ifdef DETI_WITH_OPENCL
+// feeds an OpenCL device from the chunks of search_range(), so that the nonces done still form a prefix of the
+// range; a claim is DEVICE_SLICE_SECONDS worth of the device's rate, but never more than its share (by rate) of
+// the chunks left, so that all the devices and the CPU threads finish the range at about the same time
+static uint32_t device_search(aad_opencl_device_t *dev, const work_assignment_t *work, const u32_t words[14],
+                              chunk_claims_t *claims, int worker, uint64_t n_chunks, double total_rate,
+                              uint64_t *nonces_done, const uint64_t *stop_nonce)
+{
+  const uint64_t chunk_nonces = (uint64_t)CHUNK_BATCHES * N_LANES;
+  uint64_t range = work->end_nonce - work->start_nonce;
+  uint32_t coins_found = 0;
   
+  while(!g_stop_requested)
+  {
+    uint64_t claimed = __atomic_load_n(&claims->next, __ATOMIC_RELAXED);
+    uint64_t left = (claimed < n_chunks) ? n_chunks - claimed : 0;
+    uint64_t claim = left;
+    if(dev->rate > 0.0)
+    { // (until it has been measured, the device takes everything)
+      uint64_t slice = (uint64_t)(dev->rate * DEVICE_SLICE_SECONDS) / chunk_nonces;
+      uint64_t share = (total_rate > 0.0) ? (uint64_t)((double)left * dev->rate / total_rate) : left;
+      claim = (slice < share) ? slice : share;
+    }
+    if(claim == 0)
+      claim = 1;
+    
+    uint64_t chunk;
+    claim = claim_chunks(work, claims, worker, n_chunks, claim, stop_nonce, &chunk);
+    if(claim == 0)
+      break;
+    uint64_t first = chunk * chunk_nonces;
+    uint64_t last = (chunk + claim < n_chunks) ? (chunk + claim) * chunk_nonces : range;
+    
+    double start_time = now_seconds();
+    int found = aad_opencl_search(dev, words, work->start_nonce + first, last - first);
+    double elapsed = now_seconds() - start_time;
+    if(elapsed > 0.0)
+      dev->rate = (dev->rate > 0.0) ? 0.75 * dev->rate + 0.25 * (double)(last - first) / elapsed
+                                    : (double)(last - first) / elapsed;
+    
+    // the kernel only looks at the first hash word; the rest is checked here, and the nonce decoded back
+    if(found > AAD_OPENCL_MAX_FOUND)
+    {
+      fprintf(stderr, "%s: %d coins in one launch, only %d kept\n", dev->name, found, AAD_OPENCL_MAX_FOUND);
+      found = AAD_OPENCL_MAX_FOUND;
+    }
+    for(int i = 0; i < found; i++)
+    {
+      u32_t *coin = &dev->found[i * 14];
+      const u08_t *bytes = (const u08_t *)coin;
+      u32_t hash[5];
+      uint64_t nonce = 0;
+      
+      sha1(coin, hash);
+      for(int j = DETI_NONCE_DIGITS - 1; j >= 0; j--)
+        nonce = nonce * 95ULL + (uint64_t)(bytes[(DETI_NONCE_OFFSET + j) ^ 3] - 32u);
+      if(hash[0] != 0xAAD20250u || nonce < work->start_nonce + first || nonce >= work->start_nonce + last)
+        continue;
+      queue_coin(work->work_id, nonce, coin, hash);
+      coins_found++;
+    }
+    __atomic_fetch_add(nonces_done, last - first, __ATOMIC_RELAXED);
+  }
+  
+  return coins_found;
+}
+#endif
+
+// hashes the nonces of work with n_threads CPU threads and the n_devices OpenCL devices from first_device on,
+// queueing the coins found; template_bytes is the server's template, or NULL if the server does not hand out
+// templates (then every thread searches its own random one)
+// the nonces done are added to *nonces_done as the chunks finish, the chunks are handed out through claims (reset
+// for the range, and with a slot for each of the n_threads + n_devices workers), and no chunk at or past *stop_nonce
+// is claimed; returns the number of coins found
+static uint32_t search_range(const work_assignment_t *work, const u08_t *template_bytes, int n_threads,
+                             int first_device, int n_devices, const char *custom_string, uint64_t *nonces_done,
+                             chunk_claims_t *claims, const uint64_t *stop_nonce)
+{
   const char *hdr = "DETI coin 2 ";
   uint64_t range = work->end_nonce - work->start_nonce;
   uint32_t coins_found = 0;
-  struct timespec ts_start;
-  clock_gettime(CLOCK_MONOTONIC, &ts_start);
-  double start_time = ts_start.tv_sec + ts_start.tv_nsec * 1e-9;
   
-  omp_set_num_threads(n_threads);
+  // batches are handed out in chunks of CHUNK_BATCHES, in increasing order (a device claims several at once);
+  // a worker only claims chunks when it is going to hash them, so the nonces done always form a prefix of the range
+  const uint64_t n_batches = (range + N_LANES - 1) / N_LANES;
+  const uint64_t n_chunks = (n_batches + CHUNK_BATCHES - 1) / CHUNK_BATCHES;
+  
+  // the first n_devices threads of the team only feed the devices
+#ifdef DETI_WITH_OPENCL
+  double total_rate = (n_threads > 0) ? g_cpu_rate : 0.0;
+  for(int d = first_device; d < first_device + n_devices; d++)
+    total_rate += g_devices[d].rate;
+#else
+  (void)first_device;
+  n_devices = 0;
+#endif
+  omp_set_num_threads(n_threads + n_devices);
   
   #pragma omp parallel reduction(+:coins_found)
   {
-    union { u08_t c[14 * 4]; u32_t i[14]; } data[N_LANES];
+    union { u08_t c[14 * 4]; u32_t i[14]; } data;
     u32_t interleaved_data[14][N_LANES] __attribute__((aligned(64)));
     u32_t interleaved_hash[5][N_LANES] __attribute__((aligned(64)));
     u08_t ascii95_lut[256];
@@ -118,106 +802,308 @@ static void process_work(int sock, const work_assignment_t *work, int n_threads,
       random_space[i] = ascii95_lut[(u08_t)seed];
     }
 
-    if (custom_string != NULL) {
+    if (template_bytes != NULL) {
+        memcpy(random_space, template_bytes, DETI_TEMPLATE_BYTES);
+    } else if (custom_string != NULL) {
         size_t len = strlen(custom_string);
 
         if (len > 42) len = 42; 
         memcpy(random_space, custom_string, len);
     }
     
-    #pragma omp for schedule(dynamic, 1000)
-    for(uint64_t batch = 0; batch < range / N_LANES; batch++)
+    // bytes 0..43 are the same in every message of this thread, so words 0..10 are set up once
+    for(int k = 0; k < 12; k++)
+      data.c[k ^ 3] = (u08_t)hdr[k];
+    for(int j = 0; j < DETI_NONCE_OFFSET - DETI_TEMPLATE_OFFSET; ++j)
+      data.c[(DETI_TEMPLATE_OFFSET + j) ^ 3] = random_space[j];
+    for(int idx = 0; idx < DETI_NONCE_OFFSET / 4; idx++)
+      for(int lane = 0; lane < N_LANES; lane++)
+        interleaved_data[idx][lane] = data.i[idx];
+    
+    int thread = omp_get_thread_num();
+#ifdef DETI_WITH_OPENCL
+    if(thread < n_devices)
     {
-      if(g_stop_requested)
-        continue;
+      u32_t words[14];
+      memcpy(words, data.i, DETI_NONCE_OFFSET);
+      words[11] = words[12] = 0u;
+      words[13] = ((u32_t)'\n' << 8) | 0x80u;
+      coins_found += device_search(&g_devices[first_device + thread], work, words, claims, thread, n_chunks,
+                                   total_rate, nonces_done, stop_nonce);
+    }
+    else
+#endif
+    while(!g_stop_requested)
+    {
+      uint64_t chunk;
+      if(claim_chunks(work, claims, thread, n_chunks, 1, stop_nonce, &chunk) == 0)
+        break;
+      uint64_t first_batch = chunk * CHUNK_BATCHES;
+      uint64_t last_batch = (first_batch + CHUNK_BATCHES < n_batches) ? first_batch + CHUNK_BATCHES : n_batches;
       
-      for(int lane = 0; lane < N_LANES; lane++)
+      for(uint64_t batch = first_batch; batch < last_batch; batch++)
       {
-        uint64_t nonce = work->start_nonce + batch * N_LANES + lane;
-        
-        for(int k = 0; k < 12; k++)
-          data[lane].c[k ^ 3] = (u08_t)hdr[k];
-        
-        for(int j = 0; j < 42; ++j)
-          data[lane].c[(12 + j) ^ 3] = random_space[j];
-        
-        unsigned long long tnonce = nonce;
-        for(int j = 0; j < 10; ++j)
-        {
-          u08_t byte_val = (u08_t)(32 + (tnonce % 95ULL));
-          data[lane].c[(44 + j) ^ 3] = byte_val;
-          tnonce /= 95ULL;
-          if (tnonce == 0) break;
-        }
-        
-        data[lane].c[54 ^ 3] = (u08_t)'\n';
-        data[lane].c[55 ^ 3] = (u08_t)0x80;
-      }
-      
-      for(int idx = 0; idx < 14; idx++)
         for(int lane = 0; lane < N_LANES; lane++)
-          interleaved_data[idx][lane] = data[lane].i[idx];
+          encode_nonce(work->start_nonce + batch * N_LANES + lane,
+                       &interleaved_data[11][lane], &interleaved_data[12][lane], &interleaved_data[13][lane]);
       
 #if defined(USE_AVX2)
-      sha1_avx2((v8si *)&interleaved_data[0], (v8si *)&interleaved_hash[0]);
+        sha1_avx2((v8si *)&interleaved_data[0], (v8si *)&interleaved_hash[0]);
 #elif defined(USE_AVX)
-      sha1_avx((v4si *)&interleaved_data[0], (v4si *)&interleaved_hash[0]);
+        sha1_avx((v4si *)&interleaved_data[0], (v4si *)&interleaved_hash[0]);
 #elif defined(USE_NEON)
-      sha1_neon((uint32x4_t *)&interleaved_data[0], (uint32x4_t *)&interleaved_hash[0]);
+        sha1_neon((uint32x4_t *)&interleaved_data[0], (uint32x4_t *)&interleaved_hash[0]);
 #else
-      for(int lane = 0; lane < N_LANES; lane++)
-        sha1(data[lane].i, &interleaved_hash[0][lane]);
+        sha1(&interleaved_data[0][0], &interleaved_hash[0][0]);
 #endif
       
-      for(int lane = 0; lane < N_LANES; lane++)
-      {
-        if(interleaved_hash[0][lane] == 0xAAD20250u)
+        for(int lane = 0; lane < N_LANES; lane++)
         {
-          u32_t hash[5];
-          for(int t = 0; t < 5; t++)
-            hash[t] = interleaved_hash[t][lane];
-          
-          unsigned int zeros = 0u;
-          for(zeros = 0u; zeros < 128u; zeros++)
-            if(((hash[1u + zeros / 32u] >> (31u - zeros % 32u)) & 1u) != 0u)
-              break;
-          if(zeros > 99u) zeros = 99u;
-          
-          uint64_t found_nonce = work->start_nonce + batch * N_LANES + lane;
-          
-          #pragma omp critical
+          if(interleaved_hash[0][lane] == 0xAAD20250u && batch * N_LANES + lane < range)
           {
-            coin_report_t report;
-            report.nonce = found_nonce;
-            report.zeros = zeros;
-            report.work_id = work->work_id;
-            memcpy(report.coin_data, data[lane].i, sizeof(report.coin_data));
-            memcpy(report.hash, hash, sizeof(report.hash));
-            
-            printf("FOUND COIN: nonce=%lu zeros=%u\n", (unsigned long)found_nonce, zeros);
-            send_message(sock, MSG_REPORT_COIN, &report, sizeof(report));
+            u32_t coin[14], hash[5];
+            for(int idx = 0; idx < 14; idx++)
+              coin[idx] = interleaved_data[idx][lane];
+            for(int t = 0; t < 5; t++)
+              hash[t] = interleaved_hash[t][lane];
+            queue_coin(work->work_id, work->start_nonce + batch * N_LANES + lane, coin, hash);
             coins_found++;
           }
         }
       }
+      
+      uint64_t chunk_end = (last_batch * N_LANES < range) ? last_batch * N_LANES : range;
+      __atomic_fetch_add(nonces_done, chunk_end - first_batch * N_LANES, __ATOMIC_RELAXED);
     }
   }
   
-  struct timespec ts_end;
-  clock_gettime(CLOCK_MONOTONIC, &ts_end);
-  double end_time = ts_end.tv_sec + ts_end.tv_nsec * 1e-9;
-  double elapsed = end_time - start_time;
+  return coins_found;
+}
+
+// hashes size more nonces (under random templates) and returns how long that took
+static double timed_search(work_assignment_t *work, uint64_t size, int n_threads, int first_device, int n_devices,
+                           double *rate)
+{
+  uint64_t done = 0, no_stop = UINT64_MAX;
+  
+  work->start_nonce = work->end_nonce;
+  work->end_nonce = work->start_nonce + size;
+  claims_reset(&g_progress.claims, size);
+  double start_time = now_seconds();
+  search_range(work, NULL, n_threads, first_device, n_devices, NULL, &done, &g_progress.claims, &no_stop);
+  double elapsed = now_seconds() - start_time;
+  if(elapsed > 0.0)
+    *rate = (double)done / elapsed;
+  return elapsed;
+}
+
+// hashes with n_threads threads (or with n_devices devices) for about BENCHMARK_SECONDS, after growing the range
+// until a run is long enough for the startup not to count (the coins found meanwhile are genuine, but only
+// printed); returns nonces per second
+static double benchmark_kernel(int n_threads, int first_device, int n_devices)
+{
+  work_assignment_t work;
+  uint64_t size = (uint64_t)(n_threads + n_devices) * CHUNK_BATCHES * N_LANES;
+  double elapsed = 0.0, rate = 0.0;
+  
+  memset(&work, 0, sizeof(work));
+  work.work_id = BENCHMARK_WORK_ID;
+  for(; !g_stop_requested && elapsed < BENCHMARK_SECONDS / 8.0; size *= 4)
+    elapsed = timed_search(&work, size, n_threads, first_device, n_devices, &rate);
+  if(!g_stop_requested && rate > 0.0)
+    timed_search(&work, (uint64_t)(rate * BENCHMARK_SECONDS), n_threads, first_device, n_devices, &rate);
+  return rate;
+}
+
+// if the connection is lost meanwhile, the range is still finished and its results are spooled
+static void process_work(const work_assignment_t *work, uint32_t template_id, const u08_t *template_bytes, int n_threads,
+                         const char *custom_string)
+{
+  printf("Processing work %u: nonces %lu to %lu (%lu total)\n",
+         work->work_id, (unsigned long)work->start_nonce, (unsigned long)work->end_nonce,
+         (unsigned long)(work->end_nonce - work->start_nonce));
+  
+  double start_time = now_seconds();
+  __atomic_store_n(&g_progress.active, 0, __ATOMIC_RELEASE);
+  g_progress.start_time = start_time;
+  __atomic_store_n(&g_progress.nonces_done, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_progress.stop_nonce, UINT64_MAX, __ATOMIC_RELAXED);
+  claims_reset(&g_progress.claims, work->end_nonce - work->start_nonce);
+  __atomic_store_n(&g_progress.work_id, work->work_id, __ATOMIC_RELEASE);
+  __atomic_store_n(&g_progress.active, 1, __ATOMIC_RELEASE);
+  
+  uint32_t coins_found = search_range(work, template_bytes, n_threads, 0, g_n_devices, custom_string,
+                                      &g_progress.nonces_done, &g_progress.claims, &g_progress.stop_nonce);
+  
+  double elapsed = now_seconds() - start_time;
+  uint64_t nonces_done = __atomic_load_n(&g_progress.nonces_done, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_progress.active, 0, __ATOMIC_RELEASE);
   
-  work_completion_t completion;
-  completion.work_id = work->work_id;
-  completion.nonces_tested = range;
-  completion.coins_found = coins_found;
-  completion.elapsed_time = elapsed;
+  if(drain_coin_reports() < 0)
+    fprintf(stderr, "Failed to send or spool coin reports\n");
   
-  send_message(sock, MSG_WORK_COMPLETE, &completion, sizeof(completion));
+  work_completion_ext_t completion;
+  memset(&completion, 0, sizeof(completion));
+  completion.base.work_id = work->work_id;
+  completion.base.nonces_tested = nonces_done;
+  completion.base.coins_found = coins_found;
+  completion.base.elapsed_time = elapsed;
+  completion.template_id = template_id;
+  completion.start_nonce = work->start_nonce;
+  
+  if(send_or_spool(MSG_WORK_COMPLETE, &completion,
+                   (template_bytes != NULL) ? sizeof(work_completion_ext_t) : sizeof(work_completion_t), 1) < 0)
+    fprintf(stderr, "Failed to send or spool the completion of work %u\n", work->work_id);
+  g_totals.nonces += nonces_done;
+  g_totals.hashing_seconds += elapsed;
+  g_totals.ranges++;
   
   printf("Work %u complete: %.0f nonces/sec, %u coins\n",
-         work->work_id, range / elapsed, coins_found);
+         work->work_id, nonces_done / elapsed, coins_found);
+}
+
+// connects and shakes hands; returns the socket, or -1 (with the reason printed)
+static int connect_to_server(const char *server_host, int server_port, const client_info_ext_t *client_info, int use_shm)
+{
+  struct hostent *he = gethostbyname(server_host);
+  if(!he)
+  {
+    fprintf(stderr, "Unknown host: %s\n", server_host);
+    return -1;
+  }
+  
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(sock < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server_port);
+  memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
+  
+  // an unreachable server makes connect() give up after CONNECT_TIMEOUT seconds instead of minutes
+  struct timeval timeout = { CONNECT_TIMEOUT, 0 }, no_timeout = { 0, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  printf("Connecting to %s:%d...\n", server_host, server_port);
+  if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror("connect");
+    close(sock);
+    return -1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &no_timeout, sizeof(no_timeout));
+  set_tcp_nodelay(sock);
+  
+  printf("Connected!\n\n");
+  
+  g_frame_version = DETI_FRAME_VERSION_LEGACY;
+  g_features = 0;
+  if(send_message(sock, MSG_CLIENT_HELLO, &client_info->base, sizeof(client_info->base)) < 0)
+  {
+    fprintf(stderr, "Failed to send CLIENT_HELLO\n");
+    close(sock);
+    return -1;
+  }
+  
+  message_header_t hdr;
+  char buffer[4096] __attribute__((aligned(8)));
+  if(recv_message(sock, &hdr, buffer, sizeof(buffer)) < 0 || hdr.type != MSG_SERVER_HELLO)
+  {
+    fprintf(stderr, "Failed to receive SERVER_HELLO\n");
+    close(sock);
+    return -1;
+  }
+  
+  if(hdr.length >= sizeof(server_info_t))
+  {
+    server_info_t *server_info = (server_info_t *)buffer;
+    g_features = server_info->capabilities & client_info->base.capabilities & ~DETI_CAP_THREADS_MASK;
+  }
+  if(g_features & DETI_CAP_BATCH_REPORTS)
+    printf("Server supports batched coin reports\n");
+  if(g_features & DETI_CAP_CRC32C)
+  {
+    printf("Server supports CRC32C frames\n");
+    g_frame_version = DETI_FRAME_VERSION_CRC32C;
+  }
+  if(g_features & DETI_CAP_TEMPLATES)
+    printf("Server assigns message templates\n");
+  // the benchmark only goes to a server that asked for it (older ones take nothing but the plain hello)
+  if((g_features & DETI_CAP_CLIENT_INFO) && send_message(sock, MSG_CLIENT_INFO, client_info, sizeof(*client_info)) < 0)
+  {
+    fprintf(stderr, "Failed to send CLIENT_INFO\n");
+    close(sock);
+    return -1;
+  }
+  
+  if(use_shm && (g_features & DETI_CAP_SHM))
+    attach_shared_memory(sock);
+  else if(use_shm)
+    printf("Server does not support shared memory, staying on TCP\n");
+  
+  return sock;
+}
+
+// the caller holds the send lock
+static void close_link(void)
+{
+  __atomic_store_n(&g_connected, 0, __ATOMIC_RELEASE);
+  if(g_shm != NULL)
+    aad_shm_close(g_shm);
+  g_shm = NULL;
+  if(g_sock >= 0)
+    close(g_sock);
+  g_sock = -1;
+}
+
+// returns 0 once the client has to stop (SIGINT or the end of its time budget)
+static int keep_going(void)
+{
+  return !g_stop_requested && (g_deadline == 0.0 || now_seconds() < g_deadline);
+}
+
+// after an outage: retries with exponential backoff (jittered, so that the clients of a restarted server do
+// not all come back at once), then replays the spool before anything else is sent
+static int reconnect(const char *server_host, int server_port, const client_info_ext_t *client_info, int use_shm)
+{
+  double delay = RECONNECT_MIN_DELAY;
+  
+  pthread_mutex_lock(&g_send_lock);
+  close_link();
+  pthread_mutex_unlock(&g_send_lock);
+  while(keep_going())
+  {
+    double wait = delay * (0.5 + 0.5 * drand48());
+    printf("Reconnecting in %.1f s (%lu messages spooled)...\n", wait, (unsigned long)g_spool.pending);
+    for(double until = now_seconds() + wait; keep_going() && now_seconds() < until;)
+      usleep(100000);
+    if(!keep_going())
+      break;
+    
+    int sock = connect_to_server(server_host, server_port, client_info, use_shm);
+    if(sock >= 0)
+    {
+      pthread_mutex_lock(&g_send_lock);
+      g_sock = sock;
+      int status = spool_replay(sock);
+      if(status == 0)
+        __atomic_store_n(&g_connected, 1, __ATOMIC_RELEASE);
+      else
+        close_link();
+      pthread_mutex_unlock(&g_send_lock);
+      if(status == 0)
+      {
+        printf("Reconnected\n\n");
+        return 0;
+      }
+    }
+    delay = (2.0 * delay < RECONNECT_MAX_DELAY) ? 2.0 * delay : RECONNECT_MAX_DELAY;
+  }
+  return -1;
 }
 
 int main(int argc, char **argv)
@@ -226,10 +1112,47 @@ int main(int argc, char **argv)
   int server_port = DETI_DEFAULT_PORT;
   int n_threads = omp_get_max_threads();
   const char *custom_string = NULL;
+  double time_budget = 0.0;
+  int use_shm = 0;
+  int use_opencl = 0;
+  const char *spool_path = SPOOL_DEFAULT_PATH;
 
   int pos_arg_index = 0;
   for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-s") == 0) {
+    if (strcmp(argv[i], "-p") == 0) {
+      if (i + 1 < argc) {
+        g_progress_interval = atof(argv[i+1]);
+        i++;
+      } else {
+        fprintf(stderr, "Error: -p requires the progress interval in seconds\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-T") == 0) {
+      if (i + 1 < argc) {
+        time_budget = atof(argv[i+1]);
+        i++;
+      } else {
+        fprintf(stderr, "Error: -T requires the time budget in seconds\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-M") == 0) {
+      use_shm = 1;
+    } else if (strcmp(argv[i], "-G") == 0) {
+#ifdef DETI_WITH_OPENCL
+      use_opencl = 1;
+#else
+      fprintf(stderr, "Error: -G needs a client built with OpenCL (make client_opencl)\n");
+      return 1;
+#endif
+    } else if (strcmp(argv[i], "-S") == 0) {
+      if (i + 1 < argc) {
+        spool_path = argv[i+1];
+        i++;
+      } else {
+        fprintf(stderr, "Error: -S requires the spool file\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-s") == 0) {
       if (i + 1 < argc) {
         custom_string = argv[i+1];
         i++;
@@ -251,86 +1174,149 @@ int main(int argc, char **argv)
   printf("Threads: %d\n", n_threads);
   printf("SIMD lanes: %d\n", N_LANES);
   if(custom_string) printf("Custom String: \"%s\"\n", custom_string);
+  if(time_budget > 0.0) printf("Time budget: %.0f s\n", time_budget);
+  if(use_shm) printf("Shared memory: requested\n");
+  if(use_opencl) printf("OpenCL devices: all\n");
+  printf("Spool file: %s\n", spool_path);
   printf("\n");
   
   signal(SIGINT, handle_sigint);
   signal(SIGPIPE, SIG_IGN);
+  srand48((long)time(NULL) ^ (long)getpid());
   
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  if(sock < 0)
+  if(spool_open(spool_path) < 0)
+    fprintf(stderr, "No spool file, results found during an outage will be lost\n");
+  else if(g_spool.pending > 0)
+    printf("%lu spooled messages from an earlier run in %s\n", (unsigned long)g_spool.pending, g_spool.path);
+  
+  // the coin queue (and the semaphore that wakes up its consumer) is needed by the benchmark already
+  if(aad_queue_init(&g_coin_queue, COIN_QUEUE_CAPACITY, sizeof(coin_report_t)) < 0)
   {
-    perror("socket");
+    fprintf(stderr, "Failed to allocate the coin queue\n");
     return 1;
   }
+  sem_init(&g_coin_wakeup, 0, 0);
   
-  struct hostent *he = gethostbyname(server_host);
-  if(!he)
+  // each device takes one of the threads to feed it, the others hash on the CPU
+#ifdef DETI_WITH_OPENCL
+  if(use_opencl)
   {
-    fprintf(stderr, "Unknown host: %s\n", server_host);
-    return 1;
+    g_n_devices = aad_opencl_open_devices(OPENCL_KERNEL_FILE, g_devices, AAD_OPENCL_MAX_DEVICES);
+    if(g_n_devices == 0)
+    {
+      fprintf(stderr, "No OpenCL device could be opened\n");
+      sem_destroy(&g_coin_wakeup);
+      aad_queue_destroy(&g_coin_queue);
+      return 1;
+    }
   }
-  
-  struct sockaddr_in addr;
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(server_port);
-  memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
-  
-  printf("Connecting to %s:%d...\n", server_host, server_port);
-  if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+#endif
+  int n_cpu_threads = (n_threads > g_n_devices) ? n_threads - g_n_devices : 0;
+  g_progress.claims.n_workers = (n_cpu_threads + g_n_devices > 0) ? n_cpu_threads + g_n_devices : 1;
+  g_progress.claims.in_flight = (uint64_t *)malloc((size_t)g_progress.claims.n_workers * sizeof(uint64_t));
+  if(g_progress.claims.in_flight == NULL)
   {
-    perror("connect");
-    close(sock);
+    fprintf(stderr, "Failed to allocate the chunk claims\n");
+    sem_destroy(&g_coin_wakeup);
+    aad_queue_destroy(&g_coin_queue);
     return 1;
   }
   
-  printf("Connected!\n\n");
-  
-  client_info_t client_info;
+  client_info_ext_t client_info;
   memset(&client_info, 0, sizeof(client_info));
-  gethostname(client_info.hostname, sizeof(client_info.hostname));
-  strncpy(client_info.client_type, CLIENT_TYPE, sizeof(client_info.client_type) - 1);
-  client_info.capabilities = n_threads;
-  client_info.version = DETI_PROTOCOL_VERSION;
-  
-  if(send_message(sock, MSG_CLIENT_HELLO, &client_info, sizeof(client_info)) < 0)
+  gethostname(client_info.base.hostname, sizeof(client_info.base.hostname));
+  snprintf(client_info.base.client_type, sizeof(client_info.base.client_type), "%s%s", CLIENT_TYPE,
+           (g_n_devices > 0) ? "+OpenCL" : "");
+  client_info.base.capabilities = ((uint32_t)n_threads & DETI_CAP_THREADS_MASK) | DETI_CAP_BATCH_REPORTS | DETI_CAP_CRC32C |
+                                  DETI_CAP_PROGRESS | DETI_CAP_TEMPLATES | DETI_CAP_CANCEL | DETI_CAP_CLIENT_INFO |
+                                  (use_shm ? DETI_CAP_SHM : 0u);
+  client_info.base.version = DETI_PROTOCOL_VERSION;
+  strncpy(client_info.isa, CLIENT_ISA, sizeof(client_info.isa) - 1);
+  client_info.client_id = spool_client_id(client_info.base.hostname, sizeof(client_info.base.hostname));
+  if(n_cpu_threads > 0)
+    g_cpu_rate = benchmark_kernel(n_cpu_threads, 0, 0);
+  printf("Benchmark: %.2f MH/s (%s, %d threads)\n", g_cpu_rate / 1e6, CLIENT_ISA, n_cpu_threads);
+  client_info.benchmark_rate = g_cpu_rate;
+#ifdef DETI_WITH_OPENCL
+  for(int d = 0; d < g_n_devices; d++)
   {
-    fprintf(stderr, "Failed to send CLIENT_HELLO\n");
-    close(sock);
-    return 1;
+    g_devices[d].rate = benchmark_kernel(0, d, 1);
+    printf("Benchmark: %.2f MH/s (OpenCL device %d, %s)\n", g_devices[d].rate / 1e6, d, g_devices[d].name);
+    client_info.benchmark_rate += g_devices[d].rate;
   }
+#endif
+  printf("\n");
   
-  message_header_t hdr;
-  char buffer[4096];
-  if(recv_message(sock, &hdr, buffer, sizeof(buffer)) < 0 || hdr.type != MSG_SERVER_HELLO)
+  g_sock = connect_to_server(server_host, server_port, &client_info, use_shm);
+  if(g_sock < 0)
   {
-    fprintf(stderr, "Failed to receive SERVER_HELLO\n");
-    close(sock);
+    sem_destroy(&g_coin_wakeup);
+    aad_queue_destroy(&g_coin_queue);
+    free(g_progress.claims.in_flight);
     return 1;
   }
+  if((g_features & DETI_CAP_TEMPLATES) && custom_string != NULL)
+    printf("Custom string ignored, the server chooses the templates\n");
+  if(spool_replay(g_sock) < 0)
+    fprintf(stderr, "Failed to replay the spool, trying again after a reconnect\n");
+  else
+    g_connected = 1;
   
   printf("Handshake complete, requesting work...\n\n");
   
+  __atomic_store_n(&g_io_running, 1, __ATOMIC_RELEASE);
+  double work_start = now_seconds();
+  if(time_budget > 0.0)
+    g_deadline = work_start + time_budget;
+  pthread_t io_thread;
+  pthread_create(&io_thread, NULL, coin_io_thread, NULL);
+  
+  message_header_t hdr;
+  char buffer[4096] __attribute__((aligned(8)));
+  pthread_mutex_lock(&g_recv_lock);
   while(!g_stop_requested)
   {
-    if(send_message(sock, MSG_REQUEST_WORK, NULL, 0) < 0)
+    // a server that went away (or said it is shutting down, as it does before a restart) is waited for
+    // (with the rate measured on the ranges hashed so far, rather than the benchmark's)
+    if(!__atomic_load_n(&g_connected, __ATOMIC_ACQUIRE))
     {
-      fprintf(stderr, "Failed to request work\n");
-      break;
+      if(g_totals.hashing_seconds > 0.0)
+        client_info.benchmark_rate = (double)g_totals.nonces / g_totals.hashing_seconds;
+      if(reconnect(server_host, server_port, &client_info, use_shm) < 0)
+        break;
     }
     
-    if(recv_message(sock, &hdr, buffer, sizeof(buffer)) < 0)
+    if(send_or_spool(MSG_REQUEST_WORK, NULL, 0, 0) < 0)
+      continue;
+    
+    // (a cancel that crossed the completion of its range is of no use any more)
+    int status;
+    while((status = recv_message(g_sock, &hdr, buffer, sizeof(buffer))) == 0 && hdr.type == MSG_CANCEL_WORK)
+      g_totals.messages_received++;
+    if(status < 0)
     {
-      fprintf(stderr, "Connection lost\n");
-      break;
+      pthread_mutex_lock(&g_send_lock);
+      link_lost();
+      pthread_mutex_unlock(&g_send_lock);
+      continue;
     }
+    g_totals.messages_received++;
     
-    if(hdr.type == MSG_SHUTDOWN || hdr.type == MSG_NO_WORK)
+    if(hdr.type == MSG_NO_WORK)
     {
-      printf("Server shutting down or no work available\n");
+      printf("No work available\n");
       break;
     }
     
+    if(hdr.type == MSG_SHUTDOWN)
+    {
+      printf("Server shutting down\n");
+      pthread_mutex_lock(&g_send_lock);
+      link_lost();
+      pthread_mutex_unlock(&g_send_lock);
+      continue;
+    }
+    
     if(hdr.type != MSG_WORK_ASSIGNMENT)
     {
       fprintf(stderr, "Unexpected message type: %u\n", hdr.type);
@@ -338,11 +1324,52 @@ int main(int argc, char **argv)
     }
     
     work_assignment_t *work = (work_assignment_t *)buffer;
-    process_work(sock, work, n_threads, custom_string);
+    const u08_t *template_bytes = NULL;
+    uint32_t template_id = 0;
+    if((g_features & DETI_CAP_TEMPLATES) && hdr.length >= sizeof(work_assignment_ext_t))
+    {
+      work_assignment_ext_t *ext = (work_assignment_ext_t *)buffer;
+      printf("Template %u: \"%.*s\"\n", ext->template_id, DETI_TEMPLATE_BYTES, (const char *)ext->template_bytes);
+      template_bytes = ext->template_bytes;
+      template_id = ext->template_id;
+    }
+    pthread_mutex_unlock(&g_recv_lock);
+    process_work(work, template_id, template_bytes, n_cpu_threads, custom_string);
+    pthread_mutex_lock(&g_recv_lock);
   }
+  pthread_mutex_unlock(&g_recv_lock);
+  
+  __atomic_store_n(&g_io_running, 0, __ATOMIC_RELEASE);
+  sem_post(&g_coin_wakeup);
+  pthread_join(io_thread, NULL);
+  drain_coin_reports();
+  sem_destroy(&g_coin_wakeup);
+  aad_queue_destroy(&g_coin_queue);
+  free(g_progress.claims.in_flight);
+#ifdef DETI_WITH_OPENCL
+  aad_opencl_close_devices(g_devices, g_n_devices);
+#endif
   
   printf("\nDisconnecting...\n");
-  close(sock);
+  pthread_mutex_lock(&g_send_lock);
+  close_link();
+  pthread_mutex_unlock(&g_send_lock);
+  if(g_spool.fd >= 0)
+  {
+    if(g_spool.pending > 0)
+      printf("%lu messages left in %s, they are sent after the next connection\n", (unsigned long)g_spool.pending,
+             g_spool.path);
+    else
+      unlink(g_spool.path);
+    close(g_spool.fd);
+  }
+  
+  // one line that scripts (bench_cluster) can parse
+  double wall = now_seconds() - work_start;
+  printf("Summary: nonces=%lu seconds=%.3f hashing_seconds=%.3f idle_seconds=%.3f ranges=%u messages_sent=%lu messages_received=%lu rate=%.0f\n",
+         (unsigned long)g_totals.nonces, wall, g_totals.hashing_seconds, wall - g_totals.hashing_seconds,
+         g_totals.ranges, (unsigned long)g_totals.messages_sent, (unsigned long)g_totals.messages_received,
+         (wall > 0.0) ? (double)g_totals.nonces / wall : 0.0);
   
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//
+// sends commands to the admin socket of a running server (see ./server -A) and prints the replies
+//
+//   ./deti_admin <socket> <command> [args...]   runs one command
+//   ./deti_admin <socket>                       runs one command per line of the standard input
+//
+// the exit status is 1 if any reply is an error
+//
+
+static int send_all(int sock, const char *data, size_t len)
+{
+  while(len > 0)
+  {
+    ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+    if(n <= 0)
+      return -1;
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  char line[512];
+
+  if(argc < 2)
+  {
+    fprintf(stderr, "Usage: %s <socket> [command [args...]]\n", argv[0]);
+    return 2;
+  }
+  if(strlen(argv[1]) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+    return 2;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, argv[1]);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror(argv[1]);
+    return 2;
+  }
+
+  // the server answers every line in order, so send everything, end with quit, and read until it hangs up
+  int failed = 0;
+  if(argc > 2)
+  {
+    size_t len = 0;
+    for(int i = 2; i < argc; i++)
+    {
+      int n = snprintf(&line[len], sizeof(line) - len, "%s%s", (i > 2) ? " " : "", argv[i]);
+      if(n < 0 || (size_t)n >= sizeof(line) - len - 1)
+      {
+        fprintf(stderr, "Command too long\n");
+        return 2;
+      }
+      len += (size_t)n;
+    }
+    line[len++] = '\n';
+    failed |= send_all(sock, line, len) < 0;
+  }
+  else
+    while(!failed && fgets(line, sizeof(line) - 1, stdin) != NULL)
+    {
+      size_t len = strlen(line);
+      if(len == 0 || line[len - 1] != '\n')
+        line[len++] = '\n', line[len] = '\0';
+      failed |= send_all(sock, line, len) < 0;
+    }
+  if(failed || send_all(sock, "quit\n", 5) < 0)
+  {
+    perror("send");
+    close(sock);
+    return 2;
+  }
+
+  FILE *in = fdopen(sock, "r");
+  int error = 0;
+  while(in != NULL && fgets(line, sizeof(line), in) != NULL)
+  {
+    fputs(line, stdout);
+    if(strncmp(line, "error:", 6) == 0)
+      error = 1;
+  }
+  if(in != NULL)
+    fclose(in);
+  return error;
+}
@@ -0,0 +1,765 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "aad_data_types.h"
+#include "aad_utilities.h"
+#include "aad_sha1_cpu.h"
+#include "aad_distributed.h"
+
+//
+// simulated clients: thousands of connections that speak the protocol of client.c, pretend to hash at a
+// given rate, and report genuine coins taken from a fixture set (a vault file); run the server with -D
+// so the replayed coins are verified but not stored again (they belong to no lease, so they are announced as
+// synthetic, which only a dry run accepts; other servers are not sent any)
+//
+
+#define DEFAULT_N_CONNECTIONS 1000
+#define DEFAULT_DURATION 30.0
+#define DEFAULT_HASH_RATE 10e6
+#define DEFAULT_COIN_RATE 0.05
+#define DEFAULT_FIXTURE_FILE "deti_coins_v2_vault.txt"
+#define DEFAULT_RESULTS_FILE "loadgen_results.csv"
+#define MAX_FIXTURES 4096
+#define RX_BUFFER_SIZE 8192
+#define TX_BUFFER_SIZE 8192
+#define NO_WORK_RETRY_SECONDS 1.0
+#define MAX_EVENTS 256
+
+typedef enum {
+  CONN_CONNECTING,
+  CONN_HELLO,      // CLIENT_HELLO sent, waiting for SERVER_HELLO
+  CONN_WAITING,    // REQUEST_WORK sent, waiting for an assignment
+  CONN_WORKING,    // "hashing" a range
+  CONN_IDLE,       // got MSG_NO_WORK, asks again later
+  CONN_CLOSED
+} conn_state_t;
+
+typedef struct {
+  int fd;
+  conn_state_t state;
+  uint32_t features;
+  uint16_t frame_version;
+  uint32_t timer_generation;  // bumped to cancel the pending timer
+  double requested_at;
+  double started_at;
+  work_assignment_t work;
+  uint32_t coins_in_range;
+  size_t rx_len;
+  size_t tx_len;
+  u08_t rx[RX_BUFFER_SIZE] __attribute__((aligned(8)));
+  u08_t tx[TX_BUFFER_SIZE];
+} conn_t;
+
+// a min-heap of (time, connection) timers; stale ones are recognized by their generation
+typedef struct {
+  double at;
+  int conn;
+  uint32_t generation;
+  int is_coin;
+} timer_t_;
+
+typedef struct {
+  timer_t_ *items;
+  size_t n;
+  size_t capacity;
+} timer_heap_t;
+
+static conn_t *g_conns;
+static int g_n_conns;
+static int g_epoll;
+static timer_heap_t g_timers;
+
+static coin_report_t g_fixtures[MAX_FIXTURES];
+static int g_n_fixtures;
+static int g_warned_synthetic;
+
+static double g_hash_rate = DEFAULT_HASH_RATE;
+static double g_coin_rate = DEFAULT_COIN_RATE;
+
+static struct {
+  uint64_t messages_sent;
+  uint64_t messages_received;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t assignments;
+  uint64_t no_work;
+  uint64_t completions;
+  uint64_t coins_reported;
+  uint64_t connect_failures;
+  uint64_t disconnects;
+  double *latencies;
+  size_t n_latencies;
+  size_t latencies_capacity;
+} g_stats;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//
+// timers
+//
+
+static void timer_push(double at, int conn, int is_coin)
+{
+  if(g_timers.n == g_timers.capacity)
+  {
+    g_timers.capacity = (g_timers.capacity == 0) ? 1024 : 2 * g_timers.capacity;
+    g_timers.items = realloc(g_timers.items, g_timers.capacity * sizeof(timer_t_));
+    if(g_timers.items == NULL)
+    {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  size_t i = g_timers.n++;
+  timer_t_ t = { at, conn, g_conns[conn].timer_generation, is_coin };
+  while(i > 0 && g_timers.items[(i - 1) / 2].at > at)
+  {
+    g_timers.items[i] = g_timers.items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  g_timers.items[i] = t;
+}
+
+static timer_t_ timer_pop(void)
+{
+  timer_t_ top = g_timers.items[0];
+  timer_t_ last = g_timers.items[--g_timers.n];
+  size_t i = 0;
+
+  for(;;)
+  {
+    size_t child = 2 * i + 1;
+    if(child >= g_timers.n)
+      break;
+    if(child + 1 < g_timers.n && g_timers.items[child + 1].at < g_timers.items[child].at)
+      child++;
+    if(g_timers.items[child].at >= last.at)
+      break;
+    g_timers.items[i] = g_timers.items[child];
+    i = child;
+  }
+  if(g_timers.n > 0)
+    g_timers.items[i] = last;
+  return top;
+}
+
+static double exponential_delay(double rate)
+{
+  double u = ((double)rand() + 1.0) / ((double)RAND_MAX + 2.0);
+  return -log(u) / rate;
+}
+
+//
+// fixture coins: the genuine coins of a vault file ("Vnn:" followed by the 55 coin bytes)
+//
+
+static int load_fixtures(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+
+  if(fp == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+  while(g_n_fixtures < MAX_FIXTURES && (len = getline(&line, &line_size, fp)) > 0)
+  {
+    if(len != 4 + 55 || line[0] != 'V' || line[3] != ':')
+      continue;
+    coin_report_t *r = &g_fixtures[g_n_fixtures];
+    u08_t *coin = (u08_t *)r->coin_data;
+    for(int k = 0; k < 55; k++)
+      coin[k ^ 3] = (u08_t)line[4 + k];
+    coin[55 ^ 3] = (u08_t)0x80;
+    sha1(r->coin_data, r->hash);
+    if(r->hash[0] != 0xAAD20250u)
+      continue;
+    uint32_t zeros;
+    for(zeros = 0; zeros < 128u; zeros++)
+      if(((r->hash[1u + zeros / 32u] >> (31u - zeros % 32u)) & 1u) != 0u)
+        break;
+    r->zeros = (zeros > 99u) ? 99u : zeros;
+    g_n_fixtures++;
+  }
+  free(line);
+  fclose(fp);
+  return g_n_fixtures;
+}
+
+//
+// connections
+//
+
+static void close_conn(int i)
+{
+  conn_t *c = &g_conns[i];
+  if(c->state == CONN_CLOSED)
+    return;
+  close(c->fd);
+  c->state = CONN_CLOSED;
+  c->timer_generation++;
+  g_stats.disconnects++;
+}
+
+static void flush_conn(int i)
+{
+  conn_t *c = &g_conns[i];
+  size_t sent = 0;
+
+  while(sent < c->tx_len)
+  {
+    ssize_t n = send(c->fd, &c->tx[sent], c->tx_len - sent, MSG_NOSIGNAL);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        close_conn(i);
+        return;
+      }
+      break;
+    }
+    sent += (size_t)n;
+    g_stats.bytes_sent += (uint64_t)n;
+  }
+  memmove(c->tx, &c->tx[sent], c->tx_len - sent);
+  c->tx_len -= sent;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | ((c->tx_len > 0) ? EPOLLOUT : 0);
+  ev.data.u32 = (uint32_t)i;
+  epoll_ctl(g_epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void queue_message(int i, uint16_t frame_version, message_type_t type, const void *payload, uint32_t len)
+{
+  conn_t *c = &g_conns[i];
+  message_header_t hdr;
+
+  if(c->state == CONN_CLOSED)
+    return;
+  if(c->tx_len + sizeof(hdr) + len > sizeof(c->tx))
+  { // the server is not keeping up with this connection
+    close_conn(i);
+    return;
+  }
+  init_message_header(&hdr, type, len);
+  seal_message_header(&hdr, frame_version, payload);
+  memcpy(&c->tx[c->tx_len], &hdr, sizeof(hdr));
+  if(len > 0)
+    memcpy(&c->tx[c->tx_len + sizeof(hdr)], payload, len);
+  c->tx_len += sizeof(hdr) + len;
+  g_stats.messages_sent++;
+  flush_conn(i);
+}
+
+static void request_work(int i, double now)
+{
+  conn_t *c = &g_conns[i];
+  c->state = CONN_WAITING;
+  c->requested_at = now;
+  queue_message(i, c->frame_version, MSG_REQUEST_WORK, NULL, 0);
+}
+
+// the plain hello, and the simulated rate once the server asked for it (as the real client does)
+static void fill_client_info(int i, client_info_ext_t *info)
+{
+  memset(info, 0, sizeof(*info));
+  snprintf(info->base.hostname, sizeof(info->base.hostname), "loadgen-%d", i);
+  snprintf(info->base.client_type, sizeof(info->base.client_type), "loadgen");
+  info->base.capabilities = 1u | DETI_CAP_BATCH_REPORTS | DETI_CAP_CRC32C | DETI_CAP_TEMPLATES | DETI_CAP_CLIENT_INFO |
+                            DETI_CAP_SYNTHETIC;
+  info->base.version = DETI_PROTOCOL_VERSION;
+  info->benchmark_rate = g_hash_rate;
+  snprintf(info->isa, sizeof(info->isa), "simulated");
+}
+
+static void send_hello(int i)
+{
+  client_info_ext_t info;
+
+  fill_client_info(i, &info);
+  g_conns[i].state = CONN_HELLO;
+  queue_message(i, DETI_FRAME_VERSION_LEGACY, MSG_CLIENT_HELLO, &info.base, sizeof(info.base));
+}
+
+static void record_latency(double seconds)
+{
+  if(g_stats.n_latencies == g_stats.latencies_capacity)
+  {
+    g_stats.latencies_capacity = (g_stats.latencies_capacity == 0) ? 65536 : 2 * g_stats.latencies_capacity;
+    g_stats.latencies = realloc(g_stats.latencies, g_stats.latencies_capacity * sizeof(double));
+    if(g_stats.latencies == NULL)
+    {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  g_stats.latencies[g_stats.n_latencies++] = seconds;
+}
+
+static void handle_message(int i, const message_header_t *hdr, const u08_t *payload, double now)
+{
+  conn_t *c = &g_conns[i];
+
+  g_stats.messages_received++;
+  switch(hdr->type)
+  {
+    case MSG_SERVER_HELLO:
+    {
+      const server_info_t *info = (const server_info_t *)payload;
+      if(c->state != CONN_HELLO || hdr->length < sizeof(*info))
+      {
+        close_conn(i);
+        return;
+      }
+      c->features = info->capabilities & (DETI_CAP_BATCH_REPORTS | DETI_CAP_CRC32C | DETI_CAP_TEMPLATES | DETI_CAP_CLIENT_INFO |
+                                          DETI_CAP_SYNTHETIC);
+      if(!(c->features & DETI_CAP_SYNTHETIC) && g_coin_rate > 0.0 && !g_warned_synthetic)
+      {
+        fprintf(stderr, "The server is not on a dry run (-D), so no coins are reported\n");
+        g_warned_synthetic = 1;
+      }
+      c->frame_version = (c->features & DETI_CAP_CRC32C) ? DETI_FRAME_VERSION_CRC32C : DETI_FRAME_VERSION_LEGACY;
+      if(c->features & DETI_CAP_CLIENT_INFO)
+      {
+        client_info_ext_t client_info;
+        fill_client_info(i, &client_info);
+        queue_message(i, c->frame_version, MSG_CLIENT_INFO, &client_info, sizeof(client_info));
+      }
+      request_work(i, now);
+      break;
+    }
+
+    case MSG_WORK_ASSIGNMENT:
+    {
+      if(c->state != CONN_WAITING || hdr->length < sizeof(work_assignment_t))
+      {
+        close_conn(i);
+        return;
+      }
+      memcpy(&c->work, payload, sizeof(c->work));
+      record_latency(now - c->requested_at);
+      g_stats.assignments++;
+      c->state = CONN_WORKING;
+      c->started_at = now;
+      c->coins_in_range = 0;
+      c->timer_generation++;
+      timer_push(now + (double)(c->work.end_nonce - c->work.start_nonce) / g_hash_rate, i, 0);
+      if(g_coin_rate > 0.0 && g_n_fixtures > 0 && (c->features & DETI_CAP_SYNTHETIC))
+        timer_push(now + exponential_delay(g_coin_rate), i, 1);
+      break;
+    }
+
+    case MSG_NO_WORK:
+      g_stats.no_work++;
+      c->state = CONN_IDLE;
+      c->timer_generation++;
+      timer_push(now + NO_WORK_RETRY_SECONDS, i, 0);
+      break;
+
+    case MSG_SHUTDOWN:
+      close_conn(i);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void read_conn(int i, double now)
+{
+  conn_t *c = &g_conns[i];
+
+  for(;;)
+  {
+    ssize_t n = recv(c->fd, &c->rx[c->rx_len], sizeof(c->rx) - c->rx_len, 0);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+      close_conn(i);
+      return;
+    }
+    if(n < 0)
+      break;
+    g_stats.bytes_received += (uint64_t)n;
+    c->rx_len += (size_t)n;
+
+    size_t used = 0;
+    while(c->rx_len - used >= sizeof(message_header_t))
+    {
+      message_header_t hdr;
+      memcpy(&hdr, &c->rx[used], sizeof(hdr));
+      if(hdr.magic != PROTOCOL_MAGIC || hdr.length > sizeof(c->rx) - sizeof(hdr))
+      {
+        close_conn(i);
+        return;
+      }
+      if(c->rx_len - used < sizeof(hdr) + hdr.length)
+        break;
+      u08_t *payload = &c->rx[used + sizeof(hdr)];
+      if(hdr.length > 0 && frame_checksum(hdr.version, payload, hdr.length) != hdr.checksum)
+      {
+        fprintf(stderr, "Connection %d: checksum mismatch\n", i);
+        close_conn(i);
+        return;
+      }
+      handle_message(i, &hdr, payload, now);
+      if(c->state == CONN_CLOSED)
+        return;
+      used += sizeof(hdr) + hdr.length;
+    }
+    memmove(c->rx, &c->rx[used], c->rx_len - used);
+    c->rx_len -= used;
+  }
+}
+
+static void fire_timer(const timer_t_ *t, double now)
+{
+  conn_t *c = &g_conns[t->conn];
+
+  if(c->state == CONN_CLOSED || t->generation != c->timer_generation)
+    return;
+  if(c->state == CONN_IDLE)
+    request_work(t->conn, now);
+  else if(c->state == CONN_WORKING && t->is_coin)
+  {
+    coin_report_t report = g_fixtures[rand() % g_n_fixtures];
+    uint64_t size = c->work.end_nonce - c->work.start_nonce;
+    report.work_id = c->work.work_id;
+    report.nonce = c->work.start_nonce + (uint64_t)((now - c->started_at) * g_hash_rate) % size;
+    if(c->features & DETI_CAP_BATCH_REPORTS)
+    {
+      u08_t buffer[COIN_BATCH_SIZE(1)] __attribute__((aligned(8)));
+      coin_batch_t *batch = (coin_batch_t *)buffer;
+      batch->count = 1;
+      batch->reserved = 0;
+      batch->reports[0] = report;
+      queue_message(t->conn, c->frame_version, MSG_REPORT_COINS, batch, (uint32_t)COIN_BATCH_SIZE(1));
+    }
+    else
+      queue_message(t->conn, c->frame_version, MSG_REPORT_COIN, &report, sizeof(report));
+    c->coins_in_range++;
+    g_stats.coins_reported++;
+    timer_push(now + exponential_delay(g_coin_rate), t->conn, 1);
+  }
+  else if(c->state == CONN_WORKING)
+  {
+    work_completion_t completion;
+    memset(&completion, 0, sizeof(completion));
+    completion.work_id = c->work.work_id;
+    completion.nonces_tested = c->work.end_nonce - c->work.start_nonce;
+    completion.coins_found = c->coins_in_range;
+    completion.elapsed_time = now - c->started_at;
+    queue_message(t->conn, c->frame_version, MSG_WORK_COMPLETE, &completion, sizeof(completion));
+    g_stats.completions++;
+    c->timer_generation++;
+    request_work(t->conn, now);
+  }
+}
+
+static int open_conn(int i, const struct sockaddr_in *addr)
+{
+  conn_t *c = &g_conns[i];
+  int one = 1;
+
+  memset(c, 0, offsetof(conn_t, rx));
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(c->fd < 0)
+  {
+    c->state = CONN_CLOSED;
+    return -1;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if(connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS)
+  {
+    close(c->fd);
+    c->state = CONN_CLOSED;
+    return -1;
+  }
+  c->state = CONN_CONNECTING;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.u32 = (uint32_t)i;
+  epoll_ctl(g_epoll, EPOLL_CTL_ADD, c->fd, &ev);
+  return 0;
+}
+
+//
+// reporting
+//
+
+// user + system CPU seconds of a process, from /proc/<pid>/stat (negative if unavailable)
+static double process_cpu_seconds(int pid)
+{
+  char path[64], text[1024];
+  unsigned long utime, stime;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    return -1.0;
+  size_t len = fread(text, 1, sizeof(text) - 1, fp);
+  fclose(fp);
+  text[len] = '\0';
+
+  // fields 14 and 15, counted after the parenthesized command name (which may contain spaces)
+  char *p = strrchr(text, ')');
+  if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1.0;
+  return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+  if(g_stats.n_latencies == 0)
+    return 0.0;
+  size_t k = (size_t)(p * (double)(g_stats.n_latencies - 1) + 0.5);
+  return g_stats.latencies[k];
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void handle_sigint(int sig)
+{
+  (void)sig;
+  g_stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+  const char *host = "localhost";
+  int port = DETI_DEFAULT_PORT;
+  int n_conns = DEFAULT_N_CONNECTIONS;
+  double duration = DEFAULT_DURATION;
+  int server_pid = 0;
+  const char *fixture_file = DEFAULT_FIXTURE_FILE;
+  const char *results_file = DEFAULT_RESULTS_FILE;
+  const char *label = "run";
+  int pos_arg_index = 0;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      n_conns = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+      duration = atof(argv[++i]);
+    else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      g_hash_rate = atof(argv[++i]);
+    else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      g_coin_rate = atof(argv[++i]);
+    else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      server_pid = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+      fixture_file = argv[++i];
+    else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      results_file = argv[++i];
+    else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+      label = argv[++i];
+    else if(strcmp(argv[i], "-h") == 0)
+    {
+      printf("Usage: %s [host] [port] [-n connections] [-d seconds] [-r hashes/s per connection]\n"
+             "          [-c coins/s per connection] [-p server pid] [-f fixture vault] [-o results.csv] [-l label]\n", argv[0]);
+      return 0;
+    }
+    else if(pos_arg_index == 0)
+    {
+      host = argv[i];
+      pos_arg_index++;
+    }
+    else if(pos_arg_index == 1)
+    {
+      port = atoi(argv[i]);
+      pos_arg_index++;
+    }
+  }
+  if(n_conns < 1 || g_hash_rate <= 0.0)
+  {
+    fprintf(stderr, "Bad arguments\n");
+    return 1;
+  }
+
+  if(g_coin_rate > 0.0 && load_fixtures(fixture_file) <= 0)
+  {
+    fprintf(stderr, "No genuine coins in %s, not reporting coins\n", fixture_file);
+    g_coin_rate = 0.0;
+  }
+
+  struct hostent *he = gethostbyname(host);
+  if(he == NULL)
+  {
+    fprintf(stderr, "Cannot resolve %s\n", host);
+    return 1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  memcpy(&addr.sin_addr, he->h_addr_list[0], sizeof(addr.sin_addr));
+
+  // every connection needs a descriptor
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)n_conns + 64)
+  {
+    rl.rlim_cur = (rl.rlim_max < (rlim_t)n_conns + 64) ? rl.rlim_max : (rlim_t)n_conns + 64;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  g_conns = calloc((size_t)n_conns, sizeof(conn_t));
+  g_n_conns = n_conns;
+  g_epoll = epoll_create1(0);
+  if(g_conns == NULL || g_epoll < 0)
+  {
+    perror("setup");
+    return 1;
+  }
+  signal(SIGINT, handle_sigint);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("DETI load generator: %d connections to %s:%d for %.0f s\n", n_conns, host, port, duration);
+  printf("Simulated rate: %.2f MH/s and %.3f coins/s per connection (%d fixture coins)\n",
+         g_hash_rate / 1e6, g_coin_rate, g_n_fixtures);
+
+  double server_cpu0 = (server_pid > 0) ? process_cpu_seconds(server_pid) : -1.0;
+  struct rusage ru0;
+  getrusage(RUSAGE_SELF, &ru0);
+  double t0 = now_seconds();
+
+  for(int i = 0; i < n_conns; i++)
+    if(open_conn(i, &addr) < 0)
+      g_stats.connect_failures++;
+
+  struct epoll_event events[MAX_EVENTS];
+  double end_time = t0 + duration;
+  double next_report = t0 + 5.0;
+  while(!g_stop)
+  {
+    double now = now_seconds();
+    if(now >= end_time)
+      break;
+    while(g_timers.n > 0 && g_timers.items[0].at <= now)
+    {
+      timer_t_ t = timer_pop();
+      fire_timer(&t, now);
+    }
+
+    double wait = end_time - now;
+    if(g_timers.n > 0 && g_timers.items[0].at - now < wait)
+      wait = g_timers.items[0].at - now;
+    int n = epoll_wait(g_epoll, events, MAX_EVENTS, (int)(wait * 1000.0) + 1);
+    now = now_seconds();
+    for(int e = 0; e < n; e++)
+    {
+      int i = (int)events[e].data.u32;
+      conn_t *c = &g_conns[i];
+      if(c->state == CONN_CLOSED)
+        continue;
+      if(events[e].events & (EPOLLERR | EPOLLHUP))
+      {
+        if(c->state == CONN_CONNECTING)
+          g_stats.connect_failures++;
+        close_conn(i);
+        continue;
+      }
+      if(c->state == CONN_CONNECTING && (events[e].events & EPOLLOUT))
+        send_hello(i);
+      else if(events[e].events & EPOLLOUT)
+        flush_conn(i);
+      if(c->state != CONN_CLOSED && (events[e].events & EPOLLIN))
+        read_conn(i, now);
+    }
+
+    if(now >= next_report)
+    {
+      int n_open = 0;
+      for(int i = 0; i < n_conns; i++)
+        n_open += g_conns[i].state != CONN_CLOSED;
+      printf("  %5.1f s: %d connections, %lu assignments, %lu completions, %lu coins\n", now - t0, n_open,
+             (unsigned long)g_stats.assignments, (unsigned long)g_stats.completions, (unsigned long)g_stats.coins_reported);
+      fflush(stdout);
+      next_report += 5.0;
+    }
+  }
+
+  double elapsed = now_seconds() - t0;
+  double server_cpu = (server_cpu0 >= 0.0) ? process_cpu_seconds(server_pid) - server_cpu0 : -1.0;
+  struct rusage ru1;
+  getrusage(RUSAGE_SELF, &ru1);
+  double own_cpu = (double)(ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec + ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) +
+                   1e-6 * (double)(ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec + ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+
+  int n_open = 0;
+  for(int i = 0; i < n_conns; i++)
+    if(g_conns[i].state != CONN_CLOSED)
+    {
+      n_open++;
+      close(g_conns[i].fd);
+    }
+
+  qsort(g_stats.latencies, g_stats.n_latencies, sizeof(double), compare_doubles);
+  double msgs = (double)(g_stats.messages_sent + g_stats.messages_received);
+
+  printf("\nResults (%s)\n", label);
+  printf("  Connections open at the end: %d of %d (%lu connect failures)\n", n_open, n_conns,
+         (unsigned long)g_stats.connect_failures);
+  printf("  Assignments:      %lu (%.0f/s), %lu MSG_NO_WORK\n", (unsigned long)g_stats.assignments,
+         (double)g_stats.assignments / elapsed, (unsigned long)g_stats.no_work);
+  printf("  Completions:      %lu\n", (unsigned long)g_stats.completions);
+  printf("  Coins reported:   %lu\n", (unsigned long)g_stats.coins_reported);
+  printf("  Messages:         %.0f/s (%.2f MB/s sent, %.2f MB/s received)\n", msgs / elapsed,
+         (double)g_stats.bytes_sent / elapsed / 1e6, (double)g_stats.bytes_received / elapsed / 1e6);
+  printf("  Assign latency:   p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  max %.3f ms\n",
+         1e3 * percentile(0.5), 1e3 * percentile(0.9), 1e3 * percentile(0.99), 1e3 * percentile(0.999),
+         1e3 * percentile(1.0));
+  if(server_cpu >= 0.0)
+    printf("  Server CPU:       %.2f s (%.1f%% of one core)\n", server_cpu, 100.0 * server_cpu / elapsed);
+  printf("  Load generator CPU: %.2f s (%.1f%% of one core)\n", own_cpu, 100.0 * own_cpu / elapsed);
+
+  FILE *csv = fopen(results_file, "a");
+  if(csv == NULL)
+  {
+    perror(results_file);
+    return 1;
+  }
+  if(ftell(csv) == 0)
+    fprintf(csv, "Label,Connections,Seconds,Assignments,AssignmentsPerSecond,MessagesPerSecond,CoinsReported,"
+                 "P50Ms,P90Ms,P99Ms,P999Ms,MaxMs,ServerCpuPercent,ConnectFailures\n");
+  fprintf(csv, "%s,%d,%.3f,%lu,%.0f,%.0f,%lu,%.4f,%.4f,%.4f,%.4f,%.4f,%.1f,%lu\n", label, n_conns, elapsed,
+          (unsigned long)g_stats.assignments, (double)g_stats.assignments / elapsed, msgs / elapsed,
+          (unsigned long)g_stats.coins_reported, 1e3 * percentile(0.5), 1e3 * percentile(0.9), 1e3 * percentile(0.99),
+          1e3 * percentile(0.999), 1e3 * percentile(1.0), (server_cpu >= 0.0) ? 100.0 * server_cpu / elapsed : -1.0,
+          (unsigned long)g_stats.connect_failures);
+  fclose(csv);
+  printf("Results appended to %s\n", results_file);
+  return 0;
+}
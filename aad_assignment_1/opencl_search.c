@@ -9,6 +9,10 @@
 #include "aad_utilities.h"
 #include "aad_sha1_cpu.h"
 #include "aad_vault.h"
+#include "aad_tuning.h"
+
+#define PROGRAM "opencl_search"
+#define MAX_FOUND 1024
 
 static volatile sig_atomic_t stop_requested = 0;
 
@@ -69,10 +73,95 @@ static unsigned long long decode_nonce_from_coin(const u08_t *coin_bytes)
   return value;
 }
 
+// one launch of the kernel over coins_per_batch nonces from base_nonce (kernel arguments 2 to 5 are already
+// set); the coins found are printed and saved, and their number returned
+static int search_batch(cl_command_queue queue, cl_kernel kernel, cl_mem d_found_coins, cl_mem d_found_count, u32_t *h_found_coins,
+                        unsigned long long base_nonce, size_t coins_per_batch, size_t local_work_size)
+{
+  const size_t global_work_size = ((coins_per_batch + local_work_size - 1) / local_work_size) * local_work_size;
+  int h_found_count = 0;
+  cl_int err;
+
+  err = clEnqueueWriteBuffer(queue, d_found_count, CL_FALSE, 0, 
+                             sizeof(int), &h_found_count, 0, NULL, NULL);
+  check_opencl_error(err, "clEnqueueWriteBuffer found_count");
+  
+  cl_ulong cl_base_nonce = (cl_ulong)base_nonce;
+  cl_ulong cl_num_coins = (cl_ulong)coins_per_batch;
+  
+  err = clSetKernelArg(kernel, 0, sizeof(cl_ulong), &cl_base_nonce);
+  check_opencl_error(err, "clSetKernelArg 0");
+  err = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &cl_num_coins);
+  check_opencl_error(err, "clSetKernelArg 1");
+  
+  err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_work_size, 
+                               &local_work_size, 0, NULL, NULL);
+  check_opencl_error(err, "clEnqueueNDRangeKernel");
+  
+  err = clEnqueueReadBuffer(queue, d_found_count, CL_TRUE, 0, 
+                            sizeof(int), &h_found_count, 0, NULL, NULL);
+  check_opencl_error(err, "clEnqueueReadBuffer found_count");
+  
+  if(h_found_count > 0)
+  {
+    if(h_found_count > MAX_FOUND)
+      h_found_count = MAX_FOUND;
+    
+    err = clEnqueueReadBuffer(queue, d_found_coins, CL_TRUE, 0, 
+                              h_found_count * 14 * sizeof(u32_t), 
+                              h_found_coins, 0, NULL, NULL);
+    check_opencl_error(err, "clEnqueueReadBuffer found_coins");
+    
+    for(int i = 0; i < h_found_count; i++)
+    {
+      u32_t *coin = &h_found_coins[i * 14];
+      u08_t *coin_bytes = (u08_t*)coin;
+      
+      u32_t hash[5];
+      sha1(coin, hash);
+      
+      unsigned long long decoded_nonce = decode_nonce_from_coin(coin_bytes);
+      printf("Found DETI coin: nonce=%llu\n", decoded_nonce);
+      printf("Coin Content: \"");
+      for(int b = 0; b < 55; b++)
+      {
+        unsigned char ch = coin_bytes[b ^ 3];
+        putchar((ch >= 32 && ch <= 126) ? (int)ch : '.');
+      }
+      printf("\"\n");
+      
+      save_coin(coin);
+    }
+    
+    save_coin(NULL);
+  }
+  return h_found_count;
+}
+
+// launches with one configuration for (at least) seconds, from *base_nonce on; returns the nonces per second
+static double measure(cl_command_queue queue, cl_kernel kernel, cl_mem d_found_coins, cl_mem d_found_count, u32_t *h_found_coins,
+                      unsigned long long *base_nonce, size_t coins_per_batch, size_t local_work_size, double seconds)
+{
+  unsigned long long done = 0ULL;
+  double elapsed = 0.0;
+
+  time_measurement();
+  while(elapsed < seconds && !stop_requested)
+  {
+    (void)search_batch(queue, kernel, d_found_coins, d_found_count, h_found_coins, *base_nonce, coins_per_batch, local_work_size);
+    *base_nonce += coins_per_batch;
+    done += coins_per_batch;
+    time_measurement();
+    elapsed += wall_time_delta();
+  }
+  return (elapsed > 0.0) ? (double)done / elapsed : 0.0;
+}
+
 int main(int argc, char **argv)
 {
   unsigned long long n_batches = 0ULL;
   const char *custom_string = NULL;
+  double tune_seconds = 0.0;
 
   for (int i = 1; i < argc; i++)
   {
@@ -88,6 +177,10 @@ int main(int argc, char **argv)
         return 1;
       }
     }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      tune_seconds = atof(argv[++i]);
+    }
     else
     {
       n_batches = strtoull(argv[i], NULL, 10);
@@ -153,10 +246,12 @@ int main(int argc, char **argv)
   
   free(kernel_source);
   
-  const size_t local_work_size = 256;
-  const size_t coins_per_batch = 1048576;
-  const size_t global_work_size = ((coins_per_batch + local_work_size - 1) / local_work_size) * local_work_size;
-  const int max_found = 1024;
+  size_t local_work_size = 256;
+  size_t coins_per_batch = 1048576;
+  const int max_found = MAX_FOUND;
+  size_t max_local_work_size = 0;
+  err = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_local_work_size), &max_local_work_size, NULL);
+  check_opencl_error(err, "clGetKernelWorkGroupInfo");
   
   srand((unsigned int)time(NULL));
   unsigned long long base_nonce = ((unsigned long long)rand() << 32) | (unsigned long long)rand();
@@ -206,83 +301,92 @@ int main(int argc, char **argv)
   check_opencl_error(err, "clCreateBuffer found_count");
   
   u32_t *h_found_coins = (u32_t*)malloc(max_found * 14 * sizeof(u32_t));
-  int h_found_count;
   unsigned long long batches_done = 0ULL;
   unsigned long long total_iterations = 0ULL;
   unsigned long long last_report_iter = 0ULL;
   unsigned long long coins_found = 0ULL;
   double total_elapsed_time = 0.0;
   
-  time_measurement();
-  
-  fprintf(stderr, "Starting OpenCL search with %zu coins per batch, local work size %zu\n",
-          coins_per_batch, local_work_size);
+  err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_static_template);
+  check_opencl_error(err, "clSetKernelArg 2");
+  err = clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_found_coins);
+  check_opencl_error(err, "clSetKernelArg 3");
+  err = clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_found_count);
+  check_opencl_error(err, "clSetKernelArg 4");
+  err = clSetKernelArg(kernel, 5, sizeof(int), &max_found);
+  check_opencl_error(err, "clSetKernelArg 5");
   
-  while((n_batches == 0ULL || batches_done < n_batches) && !stop_requested)
+  // the work group size first (with the default batch), then the batch size with the best work group size; the
+  // coins found while tuning are saved as usual, but not counted below
+  long value;
+  if(tune_seconds > 0.0)
   {
-    h_found_count = 0;
-    err = clEnqueueWriteBuffer(queue, d_found_count, CL_FALSE, 0, 
-                               sizeof(int), &h_found_count, 0, NULL, NULL);
-    check_opencl_error(err, "clEnqueueWriteBuffer found_count");
-    
-    cl_ulong cl_base_nonce = (cl_ulong)base_nonce;
-    cl_ulong cl_num_coins = (cl_ulong)coins_per_batch;
+    static const size_t local_sizes[] = { 32, 64, 128, 256, 512, 1024 };
+    size_t best_local_work_size = local_work_size, best_coins_per_batch = coins_per_batch;
+    double best_rate = 0.0;
     
-    err = clSetKernelArg(kernel, 0, sizeof(cl_ulong), &cl_base_nonce);
-    check_opencl_error(err, "clSetKernelArg 0");
-    err = clSetKernelArg(kernel, 1, sizeof(cl_ulong), &cl_num_coins);
-    check_opencl_error(err, "clSetKernelArg 1");
-    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_static_template);
-    check_opencl_error(err, "clSetKernelArg 2");
-    err = clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_found_coins);
-    check_opencl_error(err, "clSetKernelArg 3");
-    err = clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_found_count);
-    check_opencl_error(err, "clSetKernelArg 4");
-    err = clSetKernelArg(kernel, 5, sizeof(int), &max_found);
-    check_opencl_error(err, "clSetKernelArg 5");
-    
-    err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_work_size, 
-                                 &local_work_size, 0, NULL, NULL);
-    check_opencl_error(err, "clEnqueueNDRangeKernel");
-    
-    err = clEnqueueReadBuffer(queue, d_found_count, CL_TRUE, 0, 
-                              sizeof(int), &h_found_count, 0, NULL, NULL);
-    check_opencl_error(err, "clEnqueueReadBuffer found_count");
-    
-    if(h_found_count > 0)
+    fprintf(stderr, "Tuning: %.1f seconds per candidate\n", tune_seconds);
+    (void)measure(queue, kernel, d_found_coins, d_found_count, h_found_coins, &base_nonce, coins_per_batch,
+                  (local_work_size <= max_local_work_size) ? local_work_size : max_local_work_size, tune_seconds);
+    for(size_t i = 0; i < sizeof(local_sizes) / sizeof(local_sizes[0]) && local_sizes[i] <= max_local_work_size && !stop_requested; i++)
     {
-      if(h_found_count > max_found)
-        h_found_count = max_found;
-      
-      err = clEnqueueReadBuffer(queue, d_found_coins, CL_TRUE, 0, 
-                                h_found_count * 14 * sizeof(u32_t), 
-                                h_found_coins, 0, NULL, NULL);
-      check_opencl_error(err, "clEnqueueReadBuffer found_coins");
-      
-      for(int i = 0; i < h_found_count; i++)
+      double rate = measure(queue, kernel, d_found_coins, d_found_count, h_found_coins, &base_nonce, coins_per_batch,
+                            local_sizes[i], tune_seconds);
+      fprintf(stderr, "  local work size %4zu  coins per batch %9zu  %9.2f MH/s\n", local_sizes[i], coins_per_batch, rate / 1000000.0);
+      if(rate > best_rate)
       {
-        u32_t *coin = &h_found_coins[i * 14];
-        u08_t *coin_bytes = (u08_t*)coin;
-        
-        u32_t hash[5];
-        sha1(coin, hash);
-        
-        unsigned long long decoded_nonce = decode_nonce_from_coin(coin_bytes);
-        printf("Found DETI coin: nonce=%llu\n", decoded_nonce);
-        printf("Coin Content: \"");
-        for(int b = 0; b < 55; b++)
-        {
-          unsigned char ch = coin_bytes[b ^ 3];
-          putchar((ch >= 32 && ch <= 126) ? (int)ch : '.');
-        }
-        printf("\"\n");
-        
-        save_coin(coin);
-        coins_found++;
+        best_rate = rate;
+        best_local_work_size = local_sizes[i];
       }
-      
-      save_coin(NULL);
     }
+    for(size_t coins = 262144; coins <= 67108864 && !stop_requested; coins *= 4)
+    {
+      if(coins == coins_per_batch)
+        continue;
+      double rate = measure(queue, kernel, d_found_coins, d_found_count, h_found_coins, &base_nonce, coins,
+                            best_local_work_size, tune_seconds);
+      fprintf(stderr, "  local work size %4zu  coins per batch %9zu  %9.2f MH/s\n", best_local_work_size, coins, rate / 1000000.0);
+      if(rate > best_rate)
+      {
+        best_rate = rate;
+        best_coins_per_batch = coins;
+      }
+    }
+    if(stop_requested)
+      return 1;
+    local_work_size = best_local_work_size;
+    coins_per_batch = best_coins_per_batch;
+    fprintf(stderr, "Tuning: best is local work size %zu, %zu coins per batch (%.2f MH/s)\n", local_work_size, coins_per_batch,
+            best_rate / 1000000.0);
+    if(aad_profile_set(PROGRAM, "local_work_size", (long)local_work_size) < 0 ||
+       aad_profile_set(PROGRAM, "coins_per_batch", (long)coins_per_batch) < 0)
+      fprintf(stderr, "Failed to save the tuning profile %s\n", aad_profile_name());
+    else
+      fprintf(stderr, "Tuning profile saved to %s\n", aad_profile_name());
+  }
+  else
+  {
+    int loaded = 0;
+    if(aad_profile_get(PROGRAM, "local_work_size", &value) && value > 0 && (size_t)value <= max_local_work_size)
+      local_work_size = (size_t)value, loaded = 1;
+    // a power of two, so that the speed is still reported every 2^32 nonces
+    if(aad_profile_get(PROGRAM, "coins_per_batch", &value) && value > 0 && (value & (value - 1)) == 0 && value <= 0x100000000L)
+      coins_per_batch = (size_t)value, loaded = 1;
+    if(loaded)
+      fprintf(stderr, "Tuning profile %s loaded\n", aad_profile_name());
+  }
+  if(local_work_size > max_local_work_size)
+    local_work_size = max_local_work_size;
+  
+  time_measurement();
+  
+  fprintf(stderr, "Starting OpenCL search with %zu coins per batch, local work size %zu\n",
+          coins_per_batch, local_work_size);
+  
+  while((n_batches == 0ULL || batches_done < n_batches) && !stop_requested)
+  {
+    coins_found += (unsigned long long)search_batch(queue, kernel, d_found_coins, d_found_count, h_found_coins,
+                                                    base_nonce, coins_per_batch, local_work_size);
     
     base_nonce += coins_per_batch;
     batches_done++;
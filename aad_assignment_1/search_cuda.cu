@@ -7,11 +7,15 @@
 #include "aad_data_types.h"
 #include "aad_utilities.h"
 #include "aad_sha1.h"
+#include "aad_tuning.h"
 
 extern "C" void save_coin_wrapper(u32_t *coin);
 extern "C" void save_coin_flush(void);
 
 #define NONCES_PER_THREAD 8
+#define THREADS_PER_BLOCK 256
+#define MAX_FOUND_PER_BATCH 1024
+#define PROGRAM "cuda_search"
 
 __constant__ u32_t c_static_words[16];
 __constant__ u08_t c_base_nonce_digits[10];
@@ -88,10 +92,11 @@ __global__ void search_coins_kernel(
   unsigned long long num_coins,
   u32_t *found_coins,
   int *found_count,
-  int max_found)
+  int max_found,
+  int nonces_per_thread)
 {
   unsigned long long thread_id = blockIdx.x * blockDim.x + threadIdx.x;
-  unsigned long long first_nonce_index = thread_id * (unsigned long long)NONCES_PER_THREAD;
+  unsigned long long first_nonce_index = thread_id * (unsigned long long)nonces_per_thread;
   if(first_nonce_index >= num_coins)
     return;
 
@@ -104,7 +109,7 @@ __global__ void search_coins_kernel(
   u32_t coin_words[16];
   u08_t *coin_bytes = (u08_t *)coin_words;
 
-  for(int iter = 0; iter < NONCES_PER_THREAD && current_index < num_coins; ++iter, ++current_index)
+  for(int iter = 0; iter < nonces_per_thread && current_index < num_coins; ++iter, ++current_index)
   {
     #pragma unroll
     for(int i = 0; i < 16; i++)
@@ -139,10 +144,75 @@ __global__ void search_coins_kernel(
   }
 }
 
+// one launch of the kernel over coins_per_batch nonces from base_nonce; the coins found are saved, and their
+// number returned (-1 on a CUDA error)
+static int search_batch(unsigned long long base_nonce, unsigned long long coins_per_batch, int threads_per_block,
+                        int nonces_per_thread, u32_t *d_found_coins, int *d_found_count, u32_t *h_found_coins)
+{
+  int h_found_count = 0;
+  cudaMemcpy(d_found_count, &h_found_count, sizeof(int), cudaMemcpyHostToDevice);
+
+  u08_t h_base_digits[10];
+  nonce_to_base95_host(base_nonce, h_base_digits);
+  cudaMemcpyToSymbol(c_base_nonce_digits, h_base_digits, sizeof(h_base_digits), 0, cudaMemcpyHostToDevice);
+  
+  unsigned long long threads_needed = (coins_per_batch + nonces_per_thread - 1ULL) / (unsigned long long)nonces_per_thread;
+  int num_blocks = (int)((threads_needed + threads_per_block - 1ULL) / threads_per_block);
+  
+  search_coins_kernel<<<num_blocks, threads_per_block>>>(
+    coins_per_batch, d_found_coins, d_found_count, MAX_FOUND_PER_BATCH, nonces_per_thread);
+  cudaDeviceSynchronize();
+  
+  cudaError_t err = cudaGetLastError();
+  if(err != cudaSuccess)
+  {
+    fprintf(stderr, "CUDA error: %s\n", cudaGetErrorString(err));
+    return -1;
+  }
+  
+  cudaMemcpy(&h_found_count, d_found_count, sizeof(int), cudaMemcpyDeviceToHost);
+  
+  int coins_to_process = (h_found_count > MAX_FOUND_PER_BATCH) ? MAX_FOUND_PER_BATCH : h_found_count;
+  if(coins_to_process > 0)
+  {
+    cudaMemcpy(h_found_coins, d_found_coins, 
+               coins_to_process * 16 * sizeof(u32_t), cudaMemcpyDeviceToHost);
+    
+    for(int i = 0; i < coins_to_process; i++)
+    {
+      printf("Found DETI coin! \n");
+      save_coin_wrapper(&h_found_coins[i * 16]);
+    }
+  }
+  return coins_to_process;
+}
+
+// launches with one configuration for (at least) seconds, from *base_nonce on; returns the nonces per second,
+// or a negative number on a CUDA error
+static double measure(unsigned long long *base_nonce, unsigned long long coins_per_batch, int threads_per_block,
+                      int nonces_per_thread, u32_t *d_found_coins, int *d_found_count, u32_t *h_found_coins, double seconds)
+{
+  unsigned long long done = 0ULL;
+  double elapsed = 0.0;
+
+  time_measurement();
+  while(elapsed < seconds && !stop_requested)
+  {
+    if(search_batch(*base_nonce, coins_per_batch, threads_per_block, nonces_per_thread, d_found_coins, d_found_count, h_found_coins) < 0)
+      return -1.0;
+    *base_nonce += coins_per_batch;
+    done += coins_per_batch;
+    time_measurement();
+    elapsed += wall_time_delta();
+  }
+  return (elapsed > 0.0) ? (double)done / elapsed : 0.0;
+}
+
 int main(int argc, char **argv)
 {
   unsigned long long total_batches = 0ULL;
   char *static_string = NULL;
+  double tune_seconds = 0.0;
   
   for(int i = 1; i < argc; i++)
   {
@@ -150,6 +220,10 @@ int main(int argc, char **argv)
     {
       static_string = argv[++i];
     }
+    else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      tune_seconds = atof(argv[++i]);
+    }
     else if(argv[i][0] != '-')
     {
       total_batches = strtoull(argv[i], NULL, 10);
@@ -158,9 +232,10 @@ int main(int argc, char **argv)
   
   (void)signal(SIGINT, handle_sigint);
   
-  const int threads_per_block = 256;
+  int threads_per_block = THREADS_PER_BLOCK;
+  int nonces_per_thread = NONCES_PER_THREAD;
   const unsigned long long coins_per_batch = 32 * 1024 * 1024;
-  const int max_found_per_batch = 1024;
+  const int max_found_per_batch = MAX_FOUND_PER_BATCH;
   
   unsigned long long base_nonce = 0ULL;
   unsigned long long batches_done = 0ULL;
@@ -171,14 +246,8 @@ int main(int argc, char **argv)
 
   srand((unsigned int)time(NULL));
 
-  cudaEvent_t start, stop;
-  cudaEventCreate(&start);
-  cudaEventCreate(&stop);
-  
   base_nonce = ((unsigned long long)rand() << 32) | (unsigned long long)rand();
   
-  time_measurement();
-  
   u32_t h_coin_template[16];
   for(int i = 0; i < 16; i++)
     h_coin_template[i] = 0;
@@ -211,58 +280,86 @@ int main(int argc, char **argv)
   cudaMalloc(&d_found_count, sizeof(int));
 
   u32_t *h_found_coins = (u32_t*)malloc(max_found_per_batch * 16 * sizeof(u32_t));
-  int h_found_count = 0;
   
-  printf("Starting CUDA DETI coin search...\n");
-  printf("Threads per block: %d\n", threads_per_block);
-  printf("Coins per batch: %llu\n", coins_per_batch);
-  
-  while((total_batches == 0ULL || batches_done < total_batches) && !stop_requested)
+  // the nonces per thread first (with the default block size), then the block size with the best of those; the
+  // coins found while tuning are saved as usual, but not counted below
+  long value;
+  if(tune_seconds > 0.0)
   {
-    h_found_count = 0;
-    cudaMemcpy(d_found_count, &h_found_count, sizeof(int), cudaMemcpyHostToDevice);
-
-    u08_t h_base_digits[10];
-    nonce_to_base95_host(base_nonce, h_base_digits);
-    cudaMemcpyToSymbol(c_base_nonce_digits, h_base_digits, sizeof(h_base_digits), 0, cudaMemcpyHostToDevice);
-    
-    unsigned long long threads_needed = (coins_per_batch + NONCES_PER_THREAD - 1ULL) / (unsigned long long)NONCES_PER_THREAD;
-    int num_blocks = (int)((threads_needed + threads_per_block - 1ULL) / threads_per_block);
-    
-    cudaEventRecord(start);
-    search_coins_kernel<<<num_blocks, threads_per_block>>>(
-      coins_per_batch, d_found_coins, d_found_count, max_found_per_batch);
-    cudaEventRecord(stop);
-    cudaEventSynchronize(stop);
-
-    float milliseconds = 0;
-    cudaEventElapsedTime(&milliseconds, start, stop);
-    
-    cudaDeviceSynchronize();
+    static const int nonces_per_thread_list[] = { 1, 2, 4, 8, 16, 32, 64 };
+    static const int threads_per_block_list[] = { 64, 128, 256, 512, 1024 };
+    int best_nonces_per_thread = nonces_per_thread, best_threads_per_block = threads_per_block;
+    double best_rate = 0.0, rate;
     
-    cudaError_t err = cudaGetLastError();
-    if(err != cudaSuccess)
+    fprintf(stderr, "Tuning: %.1f seconds per candidate\n", tune_seconds);
+    if(measure(&base_nonce, coins_per_batch, threads_per_block, nonces_per_thread, d_found_coins, d_found_count, h_found_coins, tune_seconds) < 0.0)
+      return 1;
+    for(size_t i = 0; i < sizeof(nonces_per_thread_list) / sizeof(nonces_per_thread_list[0]) && !stop_requested; i++)
     {
-      fprintf(stderr, "CUDA error: %s\n", cudaGetErrorString(err));
-      break;
+      rate = measure(&base_nonce, coins_per_batch, threads_per_block, nonces_per_thread_list[i], d_found_coins, d_found_count,
+                     h_found_coins, tune_seconds);
+      if(rate < 0.0)
+        return 1;
+      fprintf(stderr, "  nonces per thread %3d  threads per block %5d  %9.2f MH/s\n", nonces_per_thread_list[i], threads_per_block,
+              rate / 1000000.0);
+      if(rate > best_rate)
+      {
+        best_rate = rate;
+        best_nonces_per_thread = nonces_per_thread_list[i];
+      }
     }
-    
-    cudaMemcpy(&h_found_count, d_found_count, sizeof(int), cudaMemcpyDeviceToHost);
-    
-    if(h_found_count > 0)
+    for(size_t i = 0; i < sizeof(threads_per_block_list) / sizeof(threads_per_block_list[0]) && !stop_requested; i++)
     {
-      int coins_to_process = (h_found_count > max_found_per_batch) ? max_found_per_batch : h_found_count;
-      cudaMemcpy(h_found_coins, d_found_coins, 
-                 coins_to_process * 16 * sizeof(u32_t), cudaMemcpyDeviceToHost);
-      
-      for(int i = 0; i < coins_to_process; i++)
+      if(threads_per_block_list[i] == threads_per_block)
+        continue;
+      rate = measure(&base_nonce, coins_per_batch, threads_per_block_list[i], best_nonces_per_thread, d_found_coins, d_found_count,
+                     h_found_coins, tune_seconds);
+      if(rate < 0.0)  // a block size the device cannot run is not an error, just a bad candidate
+        continue;
+      fprintf(stderr, "  nonces per thread %3d  threads per block %5d  %9.2f MH/s\n", best_nonces_per_thread, threads_per_block_list[i],
+              rate / 1000000.0);
+      if(rate > best_rate)
       {
-        printf("Found DETI coin! \n");
-        save_coin_wrapper(&h_found_coins[i * 16]);
+        best_rate = rate;
+        best_threads_per_block = threads_per_block_list[i];
       }
-
-      coins_found += (unsigned long long)coins_to_process;
     }
+    if(stop_requested)
+      return 1;
+    nonces_per_thread = best_nonces_per_thread;
+    threads_per_block = best_threads_per_block;
+    fprintf(stderr, "Tuning: best is %d nonces per thread, %d threads per block (%.2f MH/s)\n", nonces_per_thread, threads_per_block,
+            best_rate / 1000000.0);
+    if(aad_profile_set(PROGRAM, "nonces_per_thread", nonces_per_thread) < 0 ||
+       aad_profile_set(PROGRAM, "threads_per_block", threads_per_block) < 0)
+      fprintf(stderr, "Failed to save the tuning profile %s\n", aad_profile_name());
+    else
+      fprintf(stderr, "Tuning profile saved to %s\n", aad_profile_name());
+  }
+  else
+  {
+    int loaded = 0;
+    if(aad_profile_get(PROGRAM, "nonces_per_thread", &value) && value > 0 && value <= 1024)
+      nonces_per_thread = (int)value, loaded = 1;
+    if(aad_profile_get(PROGRAM, "threads_per_block", &value) && value > 0 && value <= 1024)
+      threads_per_block = (int)value, loaded = 1;
+    if(loaded)
+      fprintf(stderr, "Tuning profile %s loaded\n", aad_profile_name());
+  }
+  
+  time_measurement();
+  
+  printf("Starting CUDA DETI coin search...\n");
+  printf("Threads per block: %d\n", threads_per_block);
+  printf("Nonces per thread: %d\n", nonces_per_thread);
+  printf("Coins per batch: %llu\n", coins_per_batch);
+  
+  while((total_batches == 0ULL || batches_done < total_batches) && !stop_requested)
+  {
+    int coins = search_batch(base_nonce, coins_per_batch, threads_per_block, nonces_per_thread, d_found_coins, d_found_count, h_found_coins);
+    if(coins < 0)
+      break;
+    coins_found += (unsigned long long)coins;
     
     base_nonce += coins_per_batch;
     batches_done++;
@@ -283,8 +380,6 @@ int main(int argc, char **argv)
     }
   }
 
-  cudaEventDestroy(start);
-  cudaEventDestroy(stop);
   cudaFree(d_found_coins);
   cudaFree(d_found_count);
   free(h_found_coins);
@@ -1,264 +1,3525 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include "aad_data_types.h"
 #include "aad_utilities.h"
 #include "aad_sha1_cpu.h"
 #include "aad_distributed.h"
 #include "aad_vault.h"
+#include "aad_queue.h"
+#include "aad_interval_set.h"
+#include "aad_log.h"
+#include "aad_shm_ring.h"
+
+#define MAX_CLIENTS 1024
+#define MAX_HANDLERS (2 * MAX_CLIENTS)   // connections being served, counting those about to be turned away
+#define ACCEPT_POLL_MS 500
+#define MAX_CLIENT_LEASES 4
+#define RECLAIM_CAPACITY 4096
+#define MAX_ORPHAN_LEASES 1024
+
+#define DEFAULT_TARGET_RANGE_SECONDS 60.0
+#define MIN_RANGE_SIZE 1000000ULL
+#define MAX_RANGE_SIZE 1000000000000ULL
+#define RANGE_GRANULE 1000000ULL
+
+#define MAX_CLIENT_CLASSES 32
+#define MAX_PENDING_CANCELS 256
+
+#define DEFAULT_LEASE_SECONDS 600.0
+#define LEASE_SLACK 3.0
+#define LEASE_GRACE_SECONDS 30.0
+#define RATE_STALE_SECONDS 30.0
+#define SPECULATION_MIN_SECONDS 10.0
+#define SPECULATION_GAIN 2.0
+#define ETA_NEVER 1e30
+
+#define NO_TEMPLATE UINT32_MAX
+#define MAX_CAMPAIGNS 16
+#define CAMPAIGN_TEMPLATE_BITS 24                          // campaign k searches the templates from k << 24 on
+#define MAX_CAMPAIGN_STRING (DETI_TEMPLATE_BYTES - 10)     // the rest of a template tells the template ids apart
+#define DEFAULT_TEMPLATE_SPAN 1000000000000000ULL
+#define DEFAULT_STATE_FILE "deti_server_state.txt"
+#define STATE_FILE_MAGIC "deti-server-state"
+#define STATE_FILE_VERSION 5
+#define MAX_LISTED_GAPS 32
+
+#define VERIFY_QUEUE_CAPACITY 16384
+#define DEFAULT_VERIFY_WORKERS 2
+#define MAX_VERIFY_WORKERS 64
+
+#define MAX_COIN_POWER 99
+#define LATENCY_BUCKETS 8
+#define METRICS_REQUEST_SIZE 2048
+#define ADMIN_LINE_SIZE 512
+#define ADMIN_IDLE_SECONDS 60
+#define ADMIN_FLUSH_SECONDS 5.0
+
+#define RELAY_COIN_QUEUE_CAPACITY 16384
+#define RELAY_PREFETCH_SECONDS 30.0
+#define RELAY_WAIT_SECONDS 30.0
+#define RELAY_RETRY_SECONDS 10.0
+#define RELAY_POLL_MS 100
+
+#define SHM_POLL_MS 1000
+
+#define LOG_QUEUE_CAPACITY 65536
+#define DEFAULT_LOG_RATE 200.0
+
+// per-request lines are rate limited, errors, coins and status reports are not
+#define LOG(...)        aad_log_printf(stdout, 0, __VA_ARGS__)
+#define LOG_ALWAYS(...) aad_log_printf(stdout, 1, __VA_ARGS__)
+#define LOG_ERROR(...)  aad_log_printf(stderr, 1, __VA_ARGS__)
+
+#if defined(__AVX512F__)
+# define VERIFY_LANES 16
+#elif defined(__AVX2__)
+# define VERIFY_LANES 8
+#elif defined(__AVX__)
+# define VERIFY_LANES 4
+#else
+# define VERIFY_LANES 1
+#endif
+
+typedef struct {
+  uint32_t template_id;
+  uint64_t start_nonce;
+  uint64_t end_nonce;
+} nonce_range_t;
+
+// a range handed to a client (template_id is NO_TEMPLATE for clients that choose their own templates,
+// whose ranges are not part of the coordinated search); it is kept alive by progress reports and returned to the reclaim
+// list if the client disconnects or stops reporting before its deadline
+typedef struct {
+  int active;
+  uint32_t work_id;
+  uint32_t template_id;
+  uint64_t start_nonce;
+  uint64_t end_nonce;
+  uint64_t nonces_done;
+  double assigned_at;
+  double last_update;
+  double deadline;
+  int speculative;          // a duplicate of the unfinished tail of a straggler's lease
+  int cancelled;            // its twin finished first, so nothing it does from now on is needed
+  int twin_client;          // the other lease of a speculated tail (-1 if there is none)
+  uint32_t twin_generation;
+  uint32_t twin_work_id;
+  uint32_t upstream_work_id;  // relay mode: the upstream block the range is a piece of
+} lease_t;
+
+// a lease that ended unfinished because its client went away (or was too slow); the client may still complete it,
+// from its spool after a reconnect, and only such a completion (from the same client id) is taken as searched
+typedef struct {
+  uint64_t client_id;
+  uint32_t work_id;
+  uint32_t template_id;
+  uint64_t start_nonce;
+  uint64_t end_nonce;
+  uint32_t upstream_work_id;
+} orphan_lease_t;
+
+// clients are grouped by the first rule whose pattern occurs in their client_type (and whose thread
+// count they reach); each class gets a share of the keyspace proportional to its weight, and the
+// classes with the highest priority are the first to get the reclaimed ranges
+typedef struct {
+  char pattern[32];
+  uint32_t min_threads;
+  double weight;
+  uint32_t priority;
+  int n_clients;
+  double virtual_offset;     // virtual nonces = virtual_offset + nonces_assigned / weight
+  uint64_t nonces_assigned;  // (the class furthest behind its share has the fewest virtual nonces)
+} client_class_t;
+
+// a search campaign (-C): campaign k searches its own templates, which start with its custom string, with a cursor
+// of its own (template * template_span + nonce, so a single fetch-add hands out fresh nonces and moves on to the next
+// template when one is used up); fresh ranges go to the campaign furthest behind its weighted share, until its budget
+// runs out (campaign 0, "default", has no custom string, and -e bounds it)
+typedef struct {
+  char name[32];
+  char custom_string[MAX_CAMPAIGN_STRING + 1];
+  double weight;             // 0 pauses the campaign (its reclaimed ranges are still searched)
+  uint64_t cursor;           // the template is counted from the first one of the campaign
+  uint64_t end_cursor;       // 0 for an open-ended campaign
+  uint64_t nonces_assigned;
+  uint64_t nonces_completed; // in this run, not counting nonces searched twice
+  uint64_t coins_found;      // in this run
+} campaign_t;
+
+typedef struct {
+  int in_use;
+  uint32_t generation;
+  int class_index;
+  char addr[64];
+  char hostname[64];
+  char client_type[32];
+  uint32_t threads;
+  uint32_t features;
+  uint64_t client_id;        // 0 if the client did not send one
+  int synthetic;             // a load generator (DETI_CAP_SYNTHETIC, only negotiated on a dry run)
+  int shm;                   // talks through shared memory
+  int draining;              // an operator asked for it to get no more ranges
+  double connected_at;
+  double hash_rate;
+  double rate_updated_at;
+  uint64_t nonces_completed;
+  uint32_t ranges_completed;
+  uint32_t coins_found;
+  uint32_t coins_verified;
+  uint32_t bogus_reports;
+  lease_t leases[MAX_CLIENT_LEASES];
+} client_slot_t;
+
+// a coin report waiting for verification, tagged with the slot (and its generation) that sent it
+// (the lease of the coin is looked up when it is queued: a coin is only genuine if it was found in that range, with
+// its template)
+typedef struct {
+  coin_report_t report;
+  int client_index;
+  uint32_t client_generation;
+  int leased;                // 0 if the work of the coin was not leased to the client
+  int synthetic;             // from a load generator on a dry run, so not checked against the lease
+  uint32_t template_id;      // of the lease (NO_TEMPLATE if the client chose its own templates)
+  int template_known;        // template_bytes are those of template_id (a relay no longer knows finished blocks)
+  uint64_t start_nonce;      // and its range
+  uint64_t end_nonce;
+  uint32_t upstream_work_id; // relay mode: the upstream block of the lease
+  u08_t template_bytes[DETI_TEMPLATE_BYTES];
+  char client_addr[32];
+  double queued_at;
+} verify_item_t;
+
+// every range a client finished, per template; base_nonce is where the search of the template began,
+// so anything between base_nonce and the end of what was handed out (see coverage_end()) that is not in
+// the set still has to be searched
+typedef struct {
+  uint32_t template_id;
+  uint64_t base_nonce;
+  uint64_t next_nonce;       // as loaded from the state file
+  uint64_t duplicate_nonces;
+  aad_interval_set_t done;
+} coverage_t;
+
+// latencies in buckets bounded by latency_bounds[] (the last bucket has no bound); not cumulative, the
+// metrics endpoint accumulates them
+typedef struct {
+  uint64_t count[LATENCY_BUCKETS + 1];
+  uint64_t sum_ns;
+} latency_histogram_t;
+
+// statistics that are written by a single thread each (the handler of a client slot, or a verification
+// worker) and summed by whoever reads them, so the hot paths never write to a shared cache line
+// (every field is a uint64_t, so they are summed as an array)
+typedef struct {
+  uint64_t requests;
+  uint64_t nonces_assigned;
+  uint64_t nonces_completed;
+  uint64_t coins_found;
+  uint64_t bogus_reports;
+  uint64_t coins_by_power[MAX_COIN_POWER + 1];
+  latency_histogram_t assign_latency;   // of assign_work()
+  latency_histogram_t report_latency;   // from queueing a coin report to its verdict
+} __attribute__((aligned(64))) thread_counters_t;
+
+static const double latency_bounds[LATENCY_BUCKETS] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1.0, 10.0 };
+
+// a cancel (or trim) of a lease, for the client that holds it
+typedef struct {
+  int client_index;
+  char client_addr[64];
+  cancel_work_t cancel;
+} pending_cancel_t;
 
 typedef struct {
-  uint64_t next_nonce;
-  uint64_t total_nonces_assigned;
-  uint64_t total_nonces_completed;
-  uint32_t total_coins_found;
+  campaign_t campaigns[MAX_CAMPAIGNS];
+  int n_campaigns;
+  uint64_t template_span;    // nonces searched with each template before moving on to the next
+  uint64_t legacy_next_nonce;
+  uint64_t base_nonces_completed;  // by earlier runs of the server
+  uint64_t base_coins_found;
+  uint64_t total_nonces_reclaimed;
   uint32_t next_work_id;
+  uint32_t leases_expired;
+  uint32_t speculations;
+  uint32_t speculations_won;   // by the duplicate
+  uint64_t speculative_nonces;
+  uint64_t wasted_nonces;
   int n_clients_connected;
-  int n_clients_active;
+  double target_range_seconds;
+  uint64_t min_range_size;
+  uint64_t max_range_size;
+  int paused;                // by an operator: clients that ask for work wait until the resumed condition
+  pthread_cond_t resumed;
+  client_slot_t clients[MAX_CLIENTS];
+  nonce_range_t reclaimed[RECLAIM_CAPACITY];
+  int n_reclaimed;
+  orphan_lease_t orphans[MAX_ORPHAN_LEASES];   // oldest first
+  int n_orphans;
+  coverage_t *coverage;      // one per template ever handed out (grown as needed)
+  int n_templates;
+  int coverage_capacity;
+  client_class_t classes[MAX_CLIENT_CLASSES];
+  int n_classes;
+  pending_cancel_t cancels[MAX_PENDING_CANCELS];   // to be sent once the state lock is released
+  int n_cancels;
   pthread_mutex_t state_lock;
   int running;
 } server_state_t;
 
-static server_state_t g_state;
-static volatile sig_atomic_t g_shutdown_requested = 0;
+// relay mode (-R): fresh nonces come from ranges leased from an upstream server instead of the cursor, and
+// are handed out locally in smaller pieces; each such block is reported upstream as far as its searched
+// prefix goes, so the upstream server sees a single fast client
+typedef struct {
+  int active;
+  uint32_t work_id;          // of the upstream lease
+  uint32_t template_id;
+  u08_t template_bytes[DETI_TEMPLATE_BYTES];   // as the upstream server sent them
+  uint64_t start_nonce;
+  uint64_t end_nonce;
+  uint64_t next_nonce;       // start of what has not been handed out locally yet
+  uint32_t coins_found;
+  double assigned_at;
+  double started_at;         // when its first piece was handed out
+  aad_interval_set_t done;
+} relay_block_t;
+
+typedef struct {
+  int enabled;
+  int running;               // cleared by main() once no thread can find or verify coins any more
+  int connected;
+  char host[256];
+  int port;
+  int sock;
+  int listen_sock;
+  uint16_t frame_version;
+  uint32_t features;
+  int request_pending;
+  double retry_at;
+  relay_block_t blocks[MAX_CLIENT_LEASES];   // the upstream server leases at most this many ranges to a client
+  aad_queue_t coins;         // verified coins waiting to be forwarded upstream
+  pthread_cond_t work_ready; // broadcast (with the state lock held) when a block arrives or the upstream is gone
+  uint32_t blocks_received;
+  uint32_t blocks_completed;
+  uint64_t coins_forwarded;
+  uint64_t messages_sent;
+} relay_state_t;
+
+static server_state_t g_state;
+static relay_state_t g_relay;
+static thread_counters_t g_handler_counters[MAX_CLIENTS];
+static thread_counters_t g_verify_counters[MAX_VERIFY_WORKERS];
+
+static aad_queue_t g_verify_queue;
+static sem_t g_verify_wakeup;
+static int g_verify_running = 0;
+static pthread_mutex_t g_vault_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_dry_run = 0;   // verify coins but keep them out of the vault (for load tests)
+static volatile sig_atomic_t g_shutdown_requested = 0;
+
+static void handle_sigint(int sig)
+{
+  (void)sig;
+  g_shutdown_requested = 1;
+  g_state.running = 0;
+}
+
+static int send_message(int sock, uint16_t frame_version, message_type_t type, const void *payload, uint32_t payload_len)
+{
+  message_header_t hdr;
+  init_message_header(&hdr, type, payload_len);
+  seal_message_header(&hdr, frame_version, payload);
+  
+  return send_all2(sock, &hdr, sizeof(hdr), payload, payload_len);
+}
+
+static int recv_message(int sock, message_header_t *hdr, void *payload, uint32_t max_payload)
+{
+  ssize_t n = recv(sock, hdr, sizeof(*hdr), MSG_WAITALL);
+  if(n != sizeof(*hdr))
+    return -1;
+  
+  if(hdr->magic != PROTOCOL_MAGIC)
+  {
+    fprintf(stderr, "Invalid magic: 0x%x\n", hdr->magic);
+    return -1;
+  }
+  
+  if(hdr->version < DETI_FRAME_VERSION_LEGACY || hdr->version > DETI_FRAME_VERSION_CRC32C)
+  {
+    fprintf(stderr, "Protocol version mismatch: %u\n", hdr->version);
+    return -1;
+  }
+  
+  if(hdr->length > 0)
+  {
+    if(hdr->length > max_payload)
+    {
+      fprintf(stderr, "Payload too large: %u > %u\n", hdr->length, max_payload);
+      return -1;
+    }
+    
+    n = recv(sock, payload, hdr->length, MSG_WAITALL);
+    if(n != (ssize_t)hdr->length)
+      return -1;
+    
+    uint32_t check = frame_checksum(hdr->version, payload, hdr->length);
+    if(check != hdr->checksum)
+    {
+      fprintf(stderr, "Checksum mismatch: 0x%x != 0x%x\n", check, hdr->checksum);
+      return -1;
+    }
+  }
+  
+  return 0;
+}
+
+//
+// the connection of a client: its socket, or the shared-memory rings that replace it once the client
+// attached them (the socket is then only watched, to notice the client going away)
+//
+
+typedef struct {
+  int sock;
+  uint16_t frame_version;
+  aad_shm_segment_t *shm;
+  pthread_mutex_t *send_lock;   // once other threads may send to it too (NULL before)
+} connection_t;
+
+// how threads other than its handler reach a client (to cancel its work); conn is NULL when they cannot
+static struct {
+  pthread_mutex_t lock;
+  connection_t *conn;
+} g_client_links[MAX_CLIENTS];
+
+// the client handler threads, which main() waits for before it tears anything down; their sockets are listed so
+// that main() can cut them off at shutdown, whatever each handler is waiting for
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t exited;
+  int n_running;
+  int socks[MAX_HANDLERS];
+} g_handlers = { .lock = PTHREAD_MUTEX_INITIALIZER, .exited = PTHREAD_COND_INITIALIZER };
+
+// a peer that went away leaves its socket readable, with nothing to read
+static int peer_alive(int sock)
+{
+  struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+  char byte;
+  
+  if(poll(&pfd, 1, 0) <= 0)
+    return 1;
+  return recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+// the caller holds the send lock, if there is one
+static int conn_write(connection_t *conn, message_type_t type, const void *payload, uint32_t payload_len)
+{
+  if(conn->shm == NULL)
+    return send_message(conn->sock, conn->frame_version, type, payload, payload_len);
+  
+  message_header_t hdr;
+  init_message_header(&hdr, type, payload_len);
+  seal_message_header(&hdr, DETI_FRAME_VERSION_SHM, payload);
+  for(;;)
+  {
+    int status = aad_shm_send(&conn->shm->ring[AAD_SHM_TO_CLIENT], &hdr, sizeof(hdr), payload,
+                              (payload != NULL) ? payload_len : 0, SHM_POLL_MS);
+    if(status <= 0)
+      return status;
+    if(!peer_alive(conn->sock))
+      return -1;
+  }
+}
+
+static int conn_send(connection_t *conn, message_type_t type, const void *payload, uint32_t payload_len)
+{
+  if(conn->send_lock == NULL)
+    return conn_write(conn, type, payload, payload_len);
+  pthread_mutex_lock(conn->send_lock);
+  int status = conn_write(conn, type, payload, payload_len);
+  pthread_mutex_unlock(conn->send_lock);
+  return status;
+}
+
+static int conn_recv_bytes(connection_t *conn, void *data, size_t len)
+{
+  for(;;)
+  {
+    int status = aad_shm_recv(&conn->shm->ring[AAD_SHM_TO_SERVER], data, len, SHM_POLL_MS);
+    if(status <= 0)
+      return status;
+    if(!peer_alive(conn->sock))
+      return -1;
+  }
+}
+
+static int conn_recv(connection_t *conn, message_header_t *hdr, void *payload, uint32_t max_payload)
+{
+  if(conn->shm == NULL)
+    return recv_message(conn->sock, hdr, payload, max_payload);
+  
+  if(conn_recv_bytes(conn, hdr, sizeof(*hdr)) < 0)
+    return -1;
+  if(hdr->magic != PROTOCOL_MAGIC || hdr->version != DETI_FRAME_VERSION_SHM || hdr->length > max_payload)
+  {
+    fprintf(stderr, "Bad shared-memory frame: magic 0x%x, version %u, %u bytes\n", hdr->magic, hdr->version, hdr->length);
+    return -1;
+  }
+  if(hdr->length > 0 && conn_recv_bytes(conn, payload, hdr->length) < 0)
+    return -1;
+  return 0;
+}
+
+static void print_coin_report(const char *client_addr, const coin_report_t *report)
+{
+  char coin[56], sha1[41];
+  
+  for(int b = 0; b < 55; b++)
+  {
+    unsigned char ch = ((unsigned char *)report->coin_data)[b ^ 3];
+    coin[b] = (ch >= 32 && ch <= 126) ? (char)ch : '?';
+  }
+  coin[55] = '\0';
+  for(int h = 0; h < 20; h++)
+    snprintf(&sha1[2 * h], 3, "%02x", ((unsigned char *)report->hash)[h ^ 3]);
+  
+  LOG_ALWAYS("[%s] *** COIN FOUND *** work_id=%u nonce=%lu zeros=%u\n", client_addr, report->work_id,
+             (unsigned long)report->nonce, report->zeros);
+  LOG_ALWAYS("    coin: \"%s\"\n    sha1: %s\n", coin, sha1);
+}
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//
+// lock-free statistics
+//
+
+// only the owning thread writes a counter, so a relaxed load and store are enough
+static inline void counter_add(uint64_t *counter, uint64_t value)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static void observe_latency(latency_histogram_t *h, double seconds)
+{
+  int b = 0;
+  while(b < LATENCY_BUCKETS && seconds > latency_bounds[b])
+    b++;
+  counter_add(&h->count[b], 1);
+  counter_add(&h->sum_ns, (uint64_t)(seconds * 1e9));
+}
+
+static void sum_counters(thread_counters_t *total)
+{
+  uint64_t *sum = (uint64_t *)total;
+  
+  memset(total, 0, sizeof(*total));
+  for(int i = 0; i < MAX_CLIENTS + MAX_VERIFY_WORKERS; i++)
+  {
+    thread_counters_t *c = (i < MAX_CLIENTS) ? &g_handler_counters[i] : &g_verify_counters[i - MAX_CLIENTS];
+    for(size_t k = 0; k < sizeof(thread_counters_t) / sizeof(uint64_t); k++)
+      sum[k] += __atomic_load_n(&((uint64_t *)c)[k], __ATOMIC_RELAXED);
+  }
+  total->nonces_completed += g_state.base_nonces_completed;
+  total->coins_found += g_state.base_coins_found;
+}
+
+//
+// search campaigns (set up by main(); their cursors only move with atomics, the rest is updated with the state
+// lock held)
+//
+
+// parses the number at *text, up to the next ':' (an empty field leaves *value as it is), and moves past the ':'
+static int parse_campaign_field(const char **text, double *value)
+{
+  char *end;
+  
+  if(**text != ':' && **text != '\0')
+  {
+    *value = strtod(*text, &end);
+    if(end == *text || (*end != ':' && *end != '\0'))
+      return -1;
+    *text = end;
+  }
+  if(**text == ':')
+    (*text)++;
+  return 0;
+}
+
+// "name[:weight[:budget[:custom string]]]", e.g. "teamA:2:1e12:team A was here" (the budget is in nonces, 0 for
+// none); naming the default campaign changes its weight and budget
+static int parse_campaign(const char *spec)
+{
+  char name[32];
+  double weight = 1.0, budget = 0.0;
+  const char *colon = strchr(spec, ':');
+  size_t len = (colon != NULL) ? (size_t)(colon - spec) : strlen(spec);
+  const char *rest = (colon != NULL) ? colon + 1 : spec + len;
+  
+  if(len == 0 || len >= sizeof(name) || parse_campaign_field(&rest, &weight) < 0 || weight < 0.0 ||
+     parse_campaign_field(&rest, &budget) < 0 || budget < 0.0 || strlen(rest) > MAX_CAMPAIGN_STRING)
+    return -1;
+  memcpy(name, spec, len);
+  name[len] = '\0';
+  // (names go into the state file and the metric labels as they are, and the strings into coins)
+  for(size_t i = 0; i < len; i++)
+    if(!isalnum((unsigned char)name[i]) && strchr("-_.", name[i]) == NULL)
+      return -1;
+  for(const char *p = rest; *p != '\0'; p++)
+    if(*p < ' ' || *p > '~')
+      return -1;
+  
+  campaign_t *cmp = NULL;
+  for(int i = 0; i < g_state.n_campaigns && cmp == NULL; i++)
+    if(strcmp(g_state.campaigns[i].name, name) == 0)
+      cmp = &g_state.campaigns[i];
+  if(cmp == NULL)
+  {
+    if(g_state.n_campaigns == MAX_CAMPAIGNS)
+      return -1;
+    cmp = &g_state.campaigns[g_state.n_campaigns++];
+    snprintf(cmp->name, sizeof(cmp->name), "%s", name);
+  }
+  else if(cmp != &g_state.campaigns[0] || rest[0] != '\0')
+    return -1;
+  snprintf(cmp->custom_string, sizeof(cmp->custom_string), "%s", rest);
+  cmp->weight = weight;
+  cmp->end_cursor = (uint64_t)budget;
+  return 0;
+}
+
+// returns -1 if there is no such campaign, and in relay mode (where the templates are those of the upstream server)
+static int campaign_index(uint32_t template_id)
+{
+  uint32_t k = template_id >> CAMPAIGN_TEMPLATE_BITS;
+  
+  if(g_relay.enabled || template_id == NO_TEMPLATE || k >= (uint32_t)g_state.n_campaigns)
+    return -1;
+  return (int)k;
+}
+
+static campaign_t *campaign_of(uint32_t template_id)
+{
+  int k = campaign_index(template_id);
+  return (k >= 0) ? &g_state.campaigns[k] : NULL;
+}
+
+// the template that a cursor of the campaign is in
+static uint32_t campaign_template(const campaign_t *cmp, uint64_t cursor)
+{
+  return ((uint32_t)(cmp - g_state.campaigns) << CAMPAIGN_TEMPLATE_BITS) + (uint32_t)(cursor / g_state.template_span);
+}
+
+static int campaign_has_fresh(const campaign_t *cmp)
+{
+  return cmp->weight > 0.0 &&
+         (cmp->end_cursor == 0 || __atomic_load_n(&cmp->cursor, __ATOMIC_RELAXED) < cmp->end_cursor);
+}
+
+// the campaign furthest behind its weighted share among those with fresh nonces left (NULL if there is none)
+static campaign_t *pick_campaign(void)
+{
+  campaign_t *best = NULL;
+  double best_virtual = 0.0;
+  
+  for(int i = 0; i < g_state.n_campaigns; i++)
+  {
+    campaign_t *cmp = &g_state.campaigns[i];
+    if(!campaign_has_fresh(cmp))
+      continue;
+    double virtual_nonces = (double)__atomic_load_n(&cmp->nonces_assigned, __ATOMIC_RELAXED) / cmp->weight;
+    if(best == NULL || virtual_nonces < best_virtual)
+    {
+      best = cmp;
+      best_virtual = virtual_nonces;
+    }
+  }
+  return best;
+}
+
+// a campaign's custom string comes first, followed by the start of the plain template (whose first 10 bytes tell the
+// template ids apart); a relay hands out the bytes it got from the upstream server, and returns -1 if it has no
+// block of the template any more
+static int template_bytes_for(uint32_t template_id, u08_t bytes[DETI_TEMPLATE_BYTES])
+{
+  u08_t plain[DETI_TEMPLATE_BYTES];
+  
+  for(int i = 0; i < MAX_CLIENT_LEASES && g_relay.enabled; i++)
+    if(g_relay.blocks[i].active && g_relay.blocks[i].template_id == template_id)
+    {
+      memcpy(bytes, g_relay.blocks[i].template_bytes, DETI_TEMPLATE_BYTES);
+      return 0;
+    }
+  if(g_relay.enabled)
+    return -1;
+  
+  const campaign_t *cmp = campaign_of(template_id);
+  const char *custom = (cmp != NULL) ? cmp->custom_string : "";
+  size_t len = strlen(custom);
+  deti_template_bytes(template_id, plain);
+  memcpy(bytes, custom, len);
+  memcpy(&bytes[len], plain, DETI_TEMPLATE_BYTES - len);
+  return 0;
+}
+
+//
+// the leases of the clients, and those that ended unfinished (also called with the state lock held)
+//
+
+// leases are only activated by the handler of their client, which does that without taking the state
+// lock; every other thread only deactivates them, with the lock held
+static int lease_active(const lease_t *lease)
+{
+  return __atomic_load_n(&lease->active, __ATOMIC_ACQUIRE);
+}
+
+static lease_t *find_lease(client_slot_t *c, uint32_t work_id)
+{
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+    if(lease_active(&c->leases[i]) && c->leases[i].work_id == work_id)
+      return &c->leases[i];
+  return NULL;
+}
+
+// the active lease work_id of any connection of client_id (a client that reconnects may report a lease of its old
+// connection before the server noticed that it is gone)
+static lease_t *find_lease_of(uint64_t client_id, uint32_t work_id)
+{
+  if(client_id == 0)
+    return NULL;
+  for(int i = 0; i < MAX_CLIENTS; i++)
+    if(g_state.clients[i].in_use && g_state.clients[i].client_id == client_id)
+    {
+      lease_t *lease = find_lease(&g_state.clients[i], work_id);
+      if(lease != NULL)
+        return lease;
+    }
+  return NULL;
+}
+
+// remembers the lease of c that is about to end unfinished (the oldest orphan is forgotten if there is no room)
+static void orphan_lease(const client_slot_t *c, const lease_t *lease)
+{
+  if(c->client_id == 0)
+    return;
+  if(g_state.n_orphans == MAX_ORPHAN_LEASES)
+  {
+    memmove(&g_state.orphans[0], &g_state.orphans[1], (MAX_ORPHAN_LEASES - 1) * sizeof(orphan_lease_t));
+    g_state.n_orphans--;
+  }
+  orphan_lease_t *orphan = &g_state.orphans[g_state.n_orphans++];
+  orphan->client_id = c->client_id;
+  orphan->work_id = lease->work_id;
+  orphan->template_id = lease->template_id;
+  orphan->start_nonce = lease->start_nonce;
+  orphan->end_nonce = lease->end_nonce;
+  orphan->upstream_work_id = lease->upstream_work_id;
+}
+
+static orphan_lease_t *find_orphan(uint64_t client_id, uint32_t work_id)
+{
+  if(client_id == 0)
+    return NULL;
+  for(int i = g_state.n_orphans - 1; i >= 0; i--)
+    if(g_state.orphans[i].client_id == client_id && g_state.orphans[i].work_id == work_id)
+      return &g_state.orphans[i];
+  return NULL;
+}
+
+static void forget_orphan(orphan_lease_t *orphan)
+{
+  int i = (int)(orphan - g_state.orphans);
+  memmove(orphan, orphan + 1, (size_t)(g_state.n_orphans - i - 1) * sizeof(orphan_lease_t));
+  g_state.n_orphans--;
+}
+
+//
+// coin verification: the network threads only queue the reports; a pool of workers re-hashes them
+// VERIFY_LANES at a time and forwards the genuine ones to the vault
+//
+
+// the lease of a coin is one of the client's: the client reports the coins of a range before it reports the range
+// as done, so it is still there, unless the coins were replayed from the spool after a reconnect (then it is a lease
+// of the old connection, as for the completions)
+static void queue_coin_reports(client_slot_t *c, const coin_report_t *reports, uint32_t n)
+{
+  verify_item_t item;
+  
+  memset(&item, 0, sizeof(item));
+  item.client_index = (int)(c - g_state.clients);
+  item.client_generation = c->generation;
+  item.synthetic = c->synthetic;
+  snprintf(item.client_addr, sizeof(item.client_addr), "%.*s", (int)sizeof(item.client_addr) - 1, c->addr);
+  item.queued_at = now_seconds();
+  for(uint32_t i = 0; i < n; i++)
+  {
+    item.report = reports[i];
+    pthread_mutex_lock(&g_state.state_lock);
+    lease_t *lease = find_lease(c, reports[i].work_id);
+    orphan_lease_t *orphan = NULL;
+    if(lease == NULL)
+      lease = find_lease_of(c->client_id, reports[i].work_id);
+    if(lease == NULL)
+      orphan = find_orphan(c->client_id, reports[i].work_id);
+    item.leased = lease != NULL || orphan != NULL;
+    item.template_id = (lease != NULL) ? lease->template_id : (orphan != NULL) ? orphan->template_id : NO_TEMPLATE;
+    item.start_nonce = (lease != NULL) ? lease->start_nonce : (orphan != NULL) ? orphan->start_nonce : 0;
+    item.end_nonce = (lease != NULL) ? lease->end_nonce : (orphan != NULL) ? orphan->end_nonce : 0;
+    item.upstream_work_id = (lease != NULL) ? lease->upstream_work_id : (orphan != NULL) ? orphan->upstream_work_id : 0;
+    item.template_known = item.template_id != NO_TEMPLATE && template_bytes_for(item.template_id, item.template_bytes) == 0;
+    pthread_mutex_unlock(&g_state.state_lock);
+    while(aad_queue_push(&g_verify_queue, &item) < 0)
+      sched_yield();
+  }
+  sem_post(&g_verify_wakeup);
+}
+
+// in relay mode, genuine coins go to the upstream server, which keeps the vault (they are tagged with the upstream
+// work recorded in the lease they were found in, so that it can tell their campaign even if the block has been
+// reported since); returns 0 if the coin has to be saved here instead (not a relay, or the upstream connection is gone)
+static int relay_forward_coin(const coin_report_t *report, uint32_t upstream_work_id)
+{
+  coin_report_t forwarded = *report;
+  
+  if(!g_relay.enabled || !__atomic_load_n(&g_relay.connected, __ATOMIC_ACQUIRE))
+    return 0;
+  forwarded.work_id = upstream_work_id;
+  return aad_queue_push(&g_relay.coins, &forwarded) == 0;
+}
+
+static void save_coins_locally(const coin_report_t *reports, int n)
+{
+  pthread_mutex_lock(&g_vault_lock);
+  for(int i = 0; i < n; i++)
+    save_coin((u32_t *)reports[i].coin_data);
+  save_coin(NULL);
+  pthread_mutex_unlock(&g_vault_lock);
+}
+
+// returns NULL for a genuine coin of the lease of item, or the reason it was rejected
+static const char *check_coin(const verify_item_t *item, u32_t hash[5][VERIFY_LANES], int lane)
+{
+  static const char header[] = "DETI coin 2 ";
+  const coin_report_t *report = &item->report;
+  const u08_t *coin = (const u08_t *)report->coin_data;
+  unsigned int zeros;
+  uint64_t nonce = 0;
+  
+  for(int i = 0; i < 12; i++)
+    if(coin[i ^ 3] != (u08_t)header[i])
+      return "bad header";
+  for(int i = 12; i < 54; i++)
+    if(coin[i ^ 3] == (u08_t)'\n')
+      return "newline inside the coin";
+  if(coin[54 ^ 3] != (u08_t)'\n' || coin[55 ^ 3] != (u08_t)0x80)
+    return "bad trailer";
+  if(hash[0][lane] != 0xAAD20250u)
+    return "bad signature";
+  for(int t = 0; t < 5; t++)
+    if(report->hash[t] != hash[t][lane])
+      return "hash mismatch";
+  for(zeros = 0u; zeros < 128u; zeros++)
+    if(((hash[1u + zeros / 32u][lane] >> (31u - zeros % 32u)) & 1u) != 0u)
+      break;
+  if(zeros > MAX_COIN_POWER)
+    zeros = MAX_COIN_POWER;
+  if(report->zeros != zeros)
+    return "wrong power";
+  if(item->synthetic)
+    return NULL;
+  // the coin has to be in the range that was leased, with its template (and its nonce has to be the one encoded)
+  if(!item->leased)
+    return "work not leased to the client";
+  for(int i = 0; i < DETI_TEMPLATE_BYTES && item->template_known; i++)
+    if(coin[(DETI_TEMPLATE_OFFSET + i) ^ 3] != item->template_bytes[i])
+      return "wrong template";
+  for(int j = DETI_NONCE_DIGITS - 1; j >= 0; j--)
+  {
+    u08_t digit = coin[(DETI_NONCE_OFFSET + j) ^ 3];
+    if(digit < 32u || digit > 126u)
+      return "wrong nonce";
+    nonce = nonce * 95ULL + (uint64_t)(digit - 32u);
+  }
+  if(nonce != report->nonce || nonce < item->start_nonce || nonce >= item->end_nonce)
+    return "wrong nonce";
+  return NULL;
+}
+
+static void verify_coin_reports(verify_item_t *items, int n, thread_counters_t *counters)
+{
+  u32_t data[14][VERIFY_LANES] __attribute__((aligned(64)));
+  u32_t hash[5][VERIFY_LANES] __attribute__((aligned(64)));
+  const char *reason[VERIFY_LANES];
+  int save[VERIFY_LANES];
+  int n_valid = 0, n_saved = 0;
+  
+  // unused lanes hash a copy of the first report
+  for(int idx = 0; idx < 14; idx++)
+    for(int lane = 0; lane < VERIFY_LANES; lane++)
+      data[idx][lane] = items[(lane < n) ? lane : 0].report.coin_data[idx];
+  
+#if defined(__AVX512F__)
+  sha1_avx512f((v16si *)&data[0], (v16si *)&hash[0]);
+#elif defined(__AVX2__)
+  sha1_avx2((v8si *)&data[0], (v8si *)&hash[0]);
+#elif defined(__AVX__)
+  sha1_avx((v4si *)&data[0], (v4si *)&hash[0]);
+#else
+  sha1(items[0].report.coin_data, &hash[0][0]);
+#endif
+  
+  for(int lane = 0; lane < n; lane++)
+  {
+    reason[lane] = check_coin(&items[lane], hash, lane);
+    observe_latency(&counters->report_latency, now_seconds() - items[lane].queued_at);
+    if(reason[lane] == NULL)
+    {
+      if(!g_dry_run)
+        print_coin_report(items[lane].client_addr, &items[lane].report);
+      counter_add(&counters->coins_by_power[items[lane].report.zeros], 1);
+      n_valid++;
+    }
+    else
+      LOG_ERROR("[%s] Rejected coin report (%s): work_id=%u nonce=%lu zeros=%u\n",
+                items[lane].client_addr, reason[lane], items[lane].report.work_id,
+                (unsigned long)items[lane].report.nonce, items[lane].report.zeros);
+    save[lane] = reason[lane] == NULL && !g_dry_run && !relay_forward_coin(&items[lane].report, items[lane].upstream_work_id);
+    n_saved += save[lane];
+  }
+  
+  if(n_saved > 0)
+  {
+    pthread_mutex_lock(&g_vault_lock);
+    for(int lane = 0; lane < n; lane++)
+      if(save[lane])
+        save_coin(items[lane].report.coin_data);
+    save_coin(NULL);
+    pthread_mutex_unlock(&g_vault_lock);
+  }
+  
+  counter_add(&counters->coins_found, (uint64_t)n_valid);
+  counter_add(&counters->bogus_reports, (uint64_t)(n - n_valid));
+  
+  pthread_mutex_lock(&g_state.state_lock);
+  for(int lane = 0; lane < n; lane++)
+  {
+    client_slot_t *c = &g_state.clients[items[lane].client_index];
+    campaign_t *cmp = campaign_of(items[lane].template_id);
+    if(reason[lane] == NULL && cmp != NULL)
+      cmp->coins_found++;
+    if(!c->in_use || c->generation != items[lane].client_generation)
+      continue;
+    if(reason[lane] == NULL)
+      c->coins_verified++;
+    else
+      c->bogus_reports++;
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+}
+
+static void *verify_worker(void *arg)
+{
+  thread_counters_t *counters = &g_verify_counters[(intptr_t)arg];
+  verify_item_t items[VERIFY_LANES];
+  
+  for(;;)
+  {
+    int n = 0;
+    while(n < VERIFY_LANES && aad_queue_pop(&g_verify_queue, &items[n]) == 0)
+      n++;
+    
+    if(n > 0)
+    {
+      verify_coin_reports(items, n, counters);
+      continue;
+    }
+    if(!__atomic_load_n(&g_verify_running, __ATOMIC_ACQUIRE))
+      break;
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    sem_timedwait(&g_verify_wakeup, &deadline);
+  }
+  
+  return NULL;
+}
+
+//
+// client slots, leases and range sizing (all of these must be called with the state lock held)
+//
+
+static client_slot_t *acquire_client_slot(void)
+{
+  for(int i = 0; i < MAX_CLIENTS; i++)
+    if(!g_state.clients[i].in_use)
+    {
+      uint32_t generation = g_state.clients[i].generation + 1;
+      memset(&g_state.clients[i], 0, sizeof(g_state.clients[i]));
+      g_state.clients[i].in_use = 1;
+      g_state.clients[i].generation = generation;
+      return &g_state.clients[i];
+    }
+  return NULL;
+}
+
+static coverage_t *coverage_for(uint32_t template_id, uint64_t base_nonce)
+{
+  for(int i = 0; i < g_state.n_templates; i++)
+    if(g_state.coverage[i].template_id == template_id)
+      return &g_state.coverage[i];
+  if(g_state.n_templates == g_state.coverage_capacity)
+  { // (nobody keeps a coverage_t pointer across a call of this function, so the array may move)
+    int capacity = (g_state.coverage_capacity > 0) ? 2 * g_state.coverage_capacity : 64;
+    coverage_t *grown = (coverage_t *)realloc(g_state.coverage, (size_t)capacity * sizeof(coverage_t));
+    if(grown == NULL)
+      return NULL;
+    g_state.coverage = grown;
+    g_state.coverage_capacity = capacity;
+  }
+  
+  coverage_t *cov = &g_state.coverage[g_state.n_templates++];
+  cov->template_id = template_id;
+  cov->base_nonce = base_nonce;
+  cov->next_nonce = base_nonce;
+  cov->duplicate_nonces = 0;
+  aad_interval_set_init(&cov->done);
+  return cov;
+}
+
+static void reclaim_range(uint32_t template_id, uint64_t start_nonce, uint64_t end_nonce)
+{
+  if(start_nonce >= end_nonce || template_id == NO_TEMPLATE)
+    return;
+  if(g_state.n_reclaimed == RECLAIM_CAPACITY)
+  {
+    LOG_ERROR("Reclaim list full, nonces %lu-%lu are lost\n",
+              (unsigned long)start_nonce, (unsigned long)end_nonce);
+    return;
+  }
+  g_state.reclaimed[g_state.n_reclaimed].template_id = template_id;
+  g_state.reclaimed[g_state.n_reclaimed].start_nonce = start_nonce;
+  g_state.reclaimed[g_state.n_reclaimed].end_nonce = end_nonce;
+  __atomic_store_n(&g_state.n_reclaimed, g_state.n_reclaimed + 1, __ATOMIC_RELAXED);
+  g_state.total_nonces_reclaimed += end_nonce - start_nonce;
+}
+
+// takes [start_nonce,end_nonce) off the reclaim list, once a client that lost its connection reports it searched
+// it after all
+static void drop_reclaimed(uint32_t template_id, uint64_t start_nonce, uint64_t end_nonce)
+{
+  for(int i = g_state.n_reclaimed - 1; i >= 0; i--)
+  {
+    nonce_range_t *r = &g_state.reclaimed[i];
+    if(r->template_id != template_id || r->end_nonce <= start_nonce || r->start_nonce >= end_nonce)
+      continue;
+    uint64_t tail_start = end_nonce, tail_end = r->end_nonce;
+    if(r->start_nonce < start_nonce)
+      r->end_nonce = start_nonce;
+    else
+    { // nothing is left before the range, so the entry is removed (or keeps only what is after it)
+      *r = g_state.reclaimed[g_state.n_reclaimed - 1];
+      __atomic_store_n(&g_state.n_reclaimed, g_state.n_reclaimed - 1, __ATOMIC_RELAXED);
+    }
+    if(tail_start < tail_end)
+    { // (not counted as reclaimed a second time)
+      g_state.total_nonces_reclaimed -= tail_end - tail_start;
+      reclaim_range(template_id, tail_start, tail_end);
+    }
+  }
+}
+
+// returns the number of nonces of [start_nonce,end_nonce) that had already been searched; these count as
+// wasted work for ranges that were speculatively duplicated, and as duplicates otherwise
+static uint64_t record_completed_range(uint32_t template_id, uint64_t start_nonce, uint64_t end_nonce, int speculative)
+{
+  if(template_id == NO_TEMPLATE || start_nonce >= end_nonce)
+    return 0;
+  
+  // every template but the first one of a fresh search is searched from nonce 0
+  coverage_t *cov = coverage_for(template_id, 0);
+  if(cov == NULL)
+  {
+    LOG_ERROR("Out of memory, nonces %lu-%lu of template %u not recorded\n",
+              (unsigned long)start_nonce, (unsigned long)end_nonce, template_id);
+    return 0;
+  }
+  
+  uint64_t duplicates = aad_interval_set_add(&cov->done, start_nonce, end_nonce);
+  if(duplicates == UINT64_MAX)
+  {
+    LOG_ERROR("Out of memory, nonces %lu-%lu of template %u not recorded\n",
+              (unsigned long)start_nonce, (unsigned long)end_nonce, template_id);
+    return 0;
+  }
+  campaign_t *cmp = campaign_of(template_id);
+  if(cmp != NULL)
+    cmp->nonces_completed += end_nonce - start_nonce - duplicates;
+  if(speculative)
+    g_state.wasted_nonces += duplicates;
+  else if(duplicates > 0)
+  {
+    LOG_ERROR("%lu nonces of %lu-%lu (template %u) were searched twice\n", (unsigned long)duplicates,
+              (unsigned long)start_nonce, (unsigned long)end_nonce, template_id);
+    cov->duplicate_nonces += duplicates;
+  }
+  return duplicates;
+}
+
+// puts back whatever part of [start_nonce,end_nonce) has not been searched yet
+static void reclaim_unsearched(uint32_t template_id, uint64_t start_nonce, uint64_t end_nonce)
+{
+  aad_interval_t gaps[16];
+  coverage_t *cov = NULL;
+  
+  if(template_id == NO_TEMPLATE || start_nonce >= end_nonce)
+    return;
+  for(int i = 0; i < g_state.n_templates && cov == NULL; i++)
+    if(g_state.coverage[i].template_id == template_id)
+      cov = &g_state.coverage[i];
+  if(cov == NULL)
+  {
+    reclaim_range(template_id, start_nonce, end_nonce);
+    return;
+  }
+  
+  size_t n_gaps = aad_interval_set_gaps(&cov->done, start_nonce, end_nonce, gaps, 16);
+  if(n_gaps > 16)
+  { // too fragmented to be worth splitting up
+    reclaim_range(template_id, start_nonce, end_nonce);
+    return;
+  }
+  for(size_t i = n_gaps; i > 0; i--)
+    reclaim_range(template_id, gaps[i - 1].start, gaps[i - 1].end);
+}
+
+static int add_client_class(const char *pattern, uint32_t min_threads, double weight, uint32_t priority)
+{
+  if(g_state.n_classes == MAX_CLIENT_CLASSES || weight <= 0.0)
+    return -1;
+  client_class_t *cls = &g_state.classes[g_state.n_classes++];
+  snprintf(cls->pattern, sizeof(cls->pattern), "%s", pattern);
+  cls->min_threads = min_threads;
+  cls->weight = weight;
+  cls->priority = priority;
+  return 0;
+}
+
+// "pattern[@min_threads]=weight[:priority]", e.g. "AVX2=2:1" or "CPU@32=2"
+static int parse_client_class(const char *spec)
+{
+  char pattern[32];
+  unsigned int min_threads = 0, priority = 0;
+  double weight;
+  const char *eq = strchr(spec, '=');
+  
+  if(eq == NULL || eq - spec >= (long)sizeof(pattern))
+    return -1;
+  memcpy(pattern, spec, (size_t)(eq - spec));
+  pattern[eq - spec] = '\0';
+  char *at = strchr(pattern, '@');
+  if(at != NULL)
+  {
+    *at = '\0';
+    min_threads = (unsigned int)atoi(at + 1);
+  }
+  if(sscanf(eq + 1, "%lf:%u", &weight, &priority) < 1)
+    return -1;
+  return add_client_class(pattern, min_threads, weight, priority);
+}
+
+// the user rules come first, so they override these
+static void add_default_client_classes(void)
+{
+  add_client_class("CUDA", 0, 8.0, 2);
+  add_client_class("OpenCL", 0, 8.0, 2);
+  add_client_class("GPU", 0, 8.0, 2);
+  add_client_class("AVX2", 0, 2.0, 1);
+  add_client_class("SIMD", 0, 1.0, 1);
+  add_client_class("", 0, 1.0, 0);
+}
+
+static double class_virtual_nonces(const client_class_t *cls)
+{
+  return cls->virtual_offset + (double)__atomic_load_n(&cls->nonces_assigned, __ATOMIC_RELAXED) / cls->weight;
+}
+
+static const char *client_class_name(const client_class_t *cls)
+{
+  return (cls->pattern[0] != '\0') ? cls->pattern : "other";
+}
+
+static void join_client_class(client_slot_t *c)
+{
+  for(c->class_index = 0; c->class_index < g_state.n_classes - 1; c->class_index++)
+  {
+    client_class_t *cls = &g_state.classes[c->class_index];
+    if(strstr(c->client_type, cls->pattern) != NULL && c->threads >= cls->min_threads)
+      break;
+  }
+  
+  // a class that was idle starts level with the others instead of claiming its missed share
+  client_class_t *cls = &g_state.classes[c->class_index];
+  if(cls->n_clients++ == 0)
+  {
+    int first = 1;
+    double floor = 0.0;
+    for(int i = 0; i < g_state.n_classes; i++)
+      if(g_state.classes[i].n_clients > 0 && &g_state.classes[i] != cls &&
+         (first || class_virtual_nonces(&g_state.classes[i]) < floor))
+      {
+        floor = class_virtual_nonces(&g_state.classes[i]);
+        first = 0;
+      }
+    if(!first && class_virtual_nonces(cls) < floor)
+      cls->virtual_offset += floor - class_virtual_nonces(cls);
+  }
+}
+
+// reclaimed ranges go to the highest priority classes, and among those to the one furthest behind its share
+static int prefers_reclaimed(const client_class_t *cls)
+{
+  for(int i = 0; i < g_state.n_classes; i++)
+  {
+    const client_class_t *other = &g_state.classes[i];
+    if(other->n_clients == 0 || other == cls)
+      continue;
+    if(other->priority > cls->priority ||
+       (other->priority == cls->priority && class_virtual_nonces(other) < class_virtual_nonces(cls)))
+      return 0;
+  }
+  return 1;
+}
+
+// in a bounded search, a class may take at most its weighted share of what is left, split among its
+// clients, so that a fast device cannot grab the whole tail while the slower ones sit idle
+// (cmp is the campaign the fresh nonces would come from, NULL if none has any left)
+static uint64_t fair_share_limit(const client_class_t *cls, const campaign_t *cmp)
+{
+  uint64_t remaining = 0;
+  
+  if(g_relay.enabled || (cmp != NULL && cmp->end_cursor == 0))
+    return MAX_RANGE_SIZE;
+  if(cmp != NULL)
+  {
+    uint64_t cursor = __atomic_load_n(&cmp->cursor, __ATOMIC_RELAXED);
+    remaining = (cursor < cmp->end_cursor) ? cmp->end_cursor - cursor : 0;
+  }
+  for(int i = 0; i < g_state.n_reclaimed; i++)
+    remaining += g_state.reclaimed[i].end_nonce - g_state.reclaimed[i].start_nonce;
+  
+  double total_weight = 0.0;
+  for(int i = 0; i < g_state.n_classes; i++)
+    if(g_state.classes[i].n_clients > 0)
+      total_weight += g_state.classes[i].weight;
+  
+  double share = (double)remaining * cls->weight / total_weight / (double)cls->n_clients;
+  if(share < (double)MIN_RANGE_SIZE)
+    return MIN_RANGE_SIZE;
+  return ((uint64_t)share + RANGE_GRANULE - 1) / RANGE_GRANULE * RANGE_GRANULE;
+}
+
+// sized so that the client finishes it in about target_range_seconds
+static uint64_t range_size_for(const client_slot_t *c)
+{
+  if(c->hash_rate <= 0.0)
+    return WORK_RANGE_SIZE;
+  
+  double size = c->hash_rate * g_state.target_range_seconds;
+  if(size < (double)g_state.min_range_size)
+    size = (double)g_state.min_range_size;
+  if(size > (double)g_state.max_range_size)
+    size = (double)g_state.max_range_size;
+  return ((uint64_t)size + RANGE_GRANULE - 1) / RANGE_GRANULE * RANGE_GRANULE;
+}
+
+static double lease_deadline(const client_slot_t *c, uint64_t nonces_left, double now)
+{
+  if(c->hash_rate <= 0.0)
+    return now + DEFAULT_LEASE_SECONDS;
+  return now + LEASE_SLACK * (double)nonces_left / c->hash_rate + LEASE_GRACE_SECONDS;
+}
+
+static lease_t *free_lease(client_slot_t *c)
+{
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+    if(!lease_active(&c->leases[i]))
+      return &c->leases[i];
+  return NULL;
+}
+
+// fills in the rest of the assignment and publishes the lease (the range, template and speculation
+// fields must already be set)
+static void install_lease(client_slot_t *c, lease_t *lease, work_assignment_ext_t *ext, double now)
+{
+  work_assignment_t *work = &ext->base;
+  
+  work->work_id = __atomic_fetch_add(&g_state.next_work_id, 1, __ATOMIC_RELAXED);
+  work->priority = g_state.classes[c->class_index].priority;
+  ext->reserved = 0;
+  template_bytes_for(ext->template_id, ext->template_bytes);
+  
+  lease->work_id = work->work_id;
+  lease->template_id = ext->template_id;
+  lease->start_nonce = work->start_nonce;
+  lease->end_nonce = work->end_nonce;
+  lease->nonces_done = 0;
+  lease->assigned_at = now;
+  lease->last_update = now;
+  lease->deadline = lease_deadline(c, work->end_nonce - work->start_nonce, now);
+  __atomic_store_n(&lease->active, 1, __ATOMIC_RELEASE);
+}
+
+static void count_assigned(client_slot_t *c, uint32_t template_id, uint64_t n_nonces)
+{
+  campaign_t *cmp = campaign_of(template_id);
+  
+  counter_add(&g_handler_counters[c - g_state.clients].nonces_assigned, n_nonces);
+  __atomic_fetch_add(&g_state.classes[c->class_index].nonces_assigned, n_nonces, __ATOMIC_RELAXED);
+  if(cmp != NULL)
+    __atomic_fetch_add(&cmp->nonces_assigned, n_nonces, __ATOMIC_RELAXED);
+}
+
+// claims up to size fresh nonces of a campaign; a claim never goes past the end of a bounded campaign, nor
+// past the end of a template (it is cut short there, and the nonces of the next template it took are
+// returned in *spill, to be reclaimed); a claim is at most one template long, so that what spills over fits
+// in the next template
+// a campaign has 2^CAMPAIGN_TEMPLATE_BITS template ids, after which it is done even if it is open-ended (the
+// next ids are those of the next campaign)
+static int take_fresh_range(campaign_t *cmp, uint64_t size, uint32_t *template_id, uint64_t *start_nonce,
+                            uint64_t *end_nonce, uint64_t *spill)
+{
+  uint64_t span = g_state.template_span;
+  uint64_t cursor;
+  
+  if(size > span)
+    size = span;
+  if(cmp->end_cursor == 0)
+    cursor = __atomic_fetch_add(&cmp->cursor, size, __ATOMIC_RELAXED);
+  else
+  {
+    cursor = __atomic_load_n(&cmp->cursor, __ATOMIC_RELAXED);
+    do
+    {
+      if(cursor >= cmp->end_cursor)
+        return -1;
+      if(size > cmp->end_cursor - cursor)
+        size = cmp->end_cursor - cursor;
+    }
+    while(!__atomic_compare_exchange_n(&cmp->cursor, &cursor, cursor + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  }
+  
+  if(cursor / span >= (1ULL << CAMPAIGN_TEMPLATE_BITS))
+    return -1;
+  
+  *template_id = campaign_template(cmp, cursor);
+  *start_nonce = cursor % span;
+  *end_nonce = *start_nonce + size;
+  *spill = 0;
+  if(*end_nonce >= span)
+  {
+    *spill = *end_nonce - span;
+    *end_nonce = span;
+    if(cursor / span + 1 < (1ULL << CAMPAIGN_TEMPLATE_BITS))
+      LOG_ALWAYS("Template %u done, moving on to template %u\n", *template_id, *template_id + 1);
+    else
+    {
+      *spill = 0;
+      LOG_ALWAYS("Template %u done, campaign %s has used all of its template ids\n", *template_id, cmp->name);
+    }
+  }
+  return 0;
+}
+
+//
+// straggler mitigation: once nothing is left to hand out, an idle client may get a duplicate of the
+// unfinished tail of the lease that is expected to finish last; whichever copy finishes first wins
+//
+
+static lease_t *find_twin(const lease_t *lease)
+{
+  if(lease->twin_client < 0)
+    return NULL;
+  client_slot_t *c = &g_state.clients[lease->twin_client];
+  if(!c->in_use || c->generation != lease->twin_generation)
+    return NULL;
+  return find_lease(c, lease->twin_work_id);
+}
+
+// seconds until the lease is expected to be finished (stalled leases and unknown rates never finish)
+static double lease_eta(const client_slot_t *c, const lease_t *lease, double now)
+{
+  uint64_t left = lease->end_nonce - lease->start_nonce - lease->nonces_done;
+  
+  if(c->hash_rate <= 0.0 || now - lease->last_update > RATE_STALE_SECONDS)
+    return ETA_NEVER;
+  return (double)left / c->hash_rate - (now - lease->last_update);
+}
+
+static int speculate_tail(client_slot_t *c, lease_t *lease, work_assignment_ext_t *ext, double now)
+{
+  client_slot_t *slow_client = NULL;
+  lease_t *slow = NULL;
+  double slow_eta = SPECULATION_MIN_SECONDS;
+  
+  if(!(c->features & DETI_CAP_TEMPLATES))
+    return -1;
+  for(int i = 0; i < MAX_CLIENTS; i++)
+  {
+    client_slot_t *other = &g_state.clients[i];
+    if(!other->in_use || other == c)
+      continue;
+    for(int j = 0; j < MAX_CLIENT_LEASES; j++)
+    {
+      lease_t *candidate = &other->leases[j];
+      if(!lease_active(candidate) || candidate->speculative || candidate->cancelled || find_twin(candidate) != NULL ||
+         candidate->template_id == NO_TEMPLATE)
+        continue;
+      double eta = lease_eta(other, candidate, now);
+      if(eta > slow_eta)
+      {
+        slow_eta = eta;
+        slow = candidate;
+        slow_client = other;
+      }
+    }
+  }
+  if(slow == NULL)
+    return -1;
+  
+  uint64_t tail_start = slow->start_nonce + slow->nonces_done;
+  uint64_t tail = slow->end_nonce - tail_start;
+  if(tail == 0 || (c->hash_rate > 0.0 && SPECULATION_GAIN * (double)tail / c->hash_rate > slow_eta))
+    return -1;
+  
+  work_assignment_t *work = &ext->base;
+  work->start_nonce = tail_start;
+  work->end_nonce = slow->end_nonce;
+  ext->template_id = slow->template_id;
+  lease->speculative = 1;
+  lease->cancelled = 0;
+  lease->twin_client = (int)(slow_client - g_state.clients);
+  lease->twin_generation = slow_client->generation;
+  lease->twin_work_id = slow->work_id;
+  lease->upstream_work_id = slow->upstream_work_id;
+  install_lease(c, lease, ext, now);
+  slow->twin_client = (int)(c - g_state.clients);
+  slow->twin_generation = c->generation;
+  slow->twin_work_id = work->work_id;
+  
+  g_state.speculations++;
+  g_state.speculative_nonces += tail;
+  LOG_ALWAYS("[%s] Work %u %s, duplicating nonces %lu-%lu as work %u\n", slow_client->addr, slow->work_id,
+             (slow_eta >= ETA_NEVER) ? "stalled" : "straggling", (unsigned long)tail_start,
+             (unsigned long)slow->end_nonce, work->work_id);
+  return 0;
+}
+
+// tells the client holding the lease that it may stop at the lease's (new) end, or at once if it was cancelled;
+// the message goes out with send_pending_cancels(), as sending may block
+static void queue_cancel(int client_index, const lease_t *lease)
+{
+  client_slot_t *c = &g_state.clients[client_index];
+  
+  if(!(c->features & DETI_CAP_CANCEL))
+    return;
+  if(g_state.n_cancels == MAX_PENDING_CANCELS)
+  {
+    LOG_ERROR("[%s] Too many pending cancels, work %u runs to its end\n", c->addr, lease->work_id);
+    return;
+  }
+  pending_cancel_t *p = &g_state.cancels[g_state.n_cancels++];
+  p->client_index = client_index;
+  memcpy(p->client_addr, c->addr, sizeof(p->client_addr));
+  p->cancel.work_id = lease->work_id;
+  p->cancel.reserved = 0;
+  p->cancel.end_nonce = lease->cancelled ? lease->start_nonce : lease->end_nonce;
+}
+
+static void send_pending_cancels(void)
+{
+  pending_cancel_t cancels[MAX_PENDING_CANCELS];
+  
+  pthread_mutex_lock(&g_state.state_lock);
+  int n = g_state.n_cancels;
+  memcpy(cancels, g_state.cancels, (size_t)n * sizeof(pending_cancel_t));
+  g_state.n_cancels = 0;
+  pthread_mutex_unlock(&g_state.state_lock);
+  
+  for(int i = 0; i < n; i++)
+  {
+    int status = -1;
+    pthread_mutex_lock(&g_client_links[cancels[i].client_index].lock);
+    if(g_client_links[cancels[i].client_index].conn != NULL)
+      status = conn_write(g_client_links[cancels[i].client_index].conn, MSG_CANCEL_WORK, &cancels[i].cancel,
+                          sizeof(cancel_work_t));
+    pthread_mutex_unlock(&g_client_links[cancels[i].client_index].lock);
+    if(status == 0)
+      LOG("[%s] Work %u cancelled from nonce %lu on\n", cancels[i].client_addr, cancels[i].cancel.work_id,
+          (unsigned long)cancels[i].cancel.end_nonce);
+  }
+}
+
+// the lease is over after searching [start_nonce, start_nonce + done); anything else it held that
+// neither its twin nor anyone else has searched goes back to the reclaim list
+static void finish_lease(lease_t *lease, uint64_t done)
+{
+  lease_t *twin = find_twin(lease);
+  uint64_t end = lease->start_nonce + done;
+  uint64_t reclaim_end = lease->end_nonce;
+  
+  if(lease->cancelled)
+    reclaim_end = end;
+  else if(twin != NULL && !twin->cancelled && twin->start_nonce < reclaim_end)
+    reclaim_end = (twin->start_nonce > end) ? twin->start_nonce : end;
+  if(end < reclaim_end)
+    reclaim_unsearched(lease->template_id, end, reclaim_end);
+  
+  // the first copy of a speculated tail to cover it wins; the other one is no longer needed
+  if(twin != NULL && !twin->cancelled && done == lease->end_nonce - lease->start_nonce && !lease->cancelled)
+  {
+    if(lease->speculative)
+    { // the straggler keeps the part before the tail
+      g_state.speculations_won++;
+      twin->end_nonce = lease->start_nonce;
+      if(twin->nonces_done > twin->end_nonce - twin->start_nonce)
+        twin->nonces_done = twin->end_nonce - twin->start_nonce;
+      if(twin->end_nonce == twin->start_nonce)
+        twin->cancelled = 1;
+    }
+    else
+      twin->cancelled = 1;
+    queue_cancel(lease->twin_client, twin);
+  }
+  __atomic_store_n(&lease->active, 0, __ATOMIC_RELEASE);
+}
+
+// a draining client stops each of its leases where its last progress report got to, and the rest is searched
+// again by the others (a speculated tail is left to the other copy, which no longer has a twin); the client may
+// finish the chunks it has already claimed, and what it searches past that point counts as wasted
+static void drain_leases(client_slot_t *c)
+{
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+  {
+    lease_t *lease = &c->leases[i];
+    if(!lease_active(lease) || lease->cancelled)
+      continue;
+    lease_t *twin = find_twin(lease);
+    uint64_t end = lease->start_nonce + lease->nonces_done;
+    uint64_t reclaim_end = lease->end_nonce;
+    if(end >= lease->end_nonce)
+      continue;
+    if(twin != NULL && !twin->cancelled && twin->start_nonce < reclaim_end)
+      reclaim_end = (twin->start_nonce > end) ? twin->start_nonce : end;
+    reclaim_unsearched(lease->template_id, end, reclaim_end);
+    if(twin != NULL)
+      twin->twin_client = -1;
+    lease->twin_client = -1;
+    lease->end_nonce = end;
+    lease->cancelled = (end == lease->start_nonce);
+    queue_cancel((int)(c - g_state.clients), lease);
+  }
+}
+
+//
+// relay mode: the blocks leased from the upstream server (also called with the state lock held)
+//
+
+static uint64_t relay_nonces_left(void)
+{
+  uint64_t left = 0;
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+    if(g_relay.blocks[i].active)
+      left += g_relay.blocks[i].end_nonce - g_relay.blocks[i].next_nonce;
+  return left;
+}
+
+// the oldest block is handed out first, so that blocks are finished (and reported upstream) one at a time
+static int relay_take_range(uint64_t size, uint32_t *work_id, uint32_t *template_id, uint64_t *start_nonce,
+                            uint64_t *end_nonce)
+{
+  relay_block_t *block = NULL;
+  
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+  {
+    relay_block_t *b = &g_relay.blocks[i];
+    if(b->active && b->next_nonce < b->end_nonce && (block == NULL || b->assigned_at < block->assigned_at))
+      block = b;
+  }
+  if(block == NULL)
+    return -1;
+  
+  if(block->next_nonce == block->start_nonce)
+    block->started_at = now_seconds();
+  *work_id = block->work_id;
+  *template_id = block->template_id;
+  *start_nonce = block->next_nonce;
+  *end_nonce = (block->end_nonce - block->next_nonce > size) ? block->next_nonce + size : block->end_nonce;
+  block->next_nonce = *end_nonce;
+  return 0;
+}
+
+// the nonces searched from the start of the block on, without a gap
+static uint64_t relay_block_prefix(const relay_block_t *block)
+{
+  if(block->done.n_runs == 0 || block->done.runs[0].start > block->start_nonce)
+    return 0;
+  return block->done.runs[0].end - block->start_nonce;
+}
+
+// the block a reclaimed range was handed out from (it stays active until it has been searched, or the relay stops)
+static relay_block_t *relay_block_of(uint32_t template_id, uint64_t start_nonce)
+{
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+  {
+    relay_block_t *b = &g_relay.blocks[i];
+    if(b->active && b->template_id == template_id && start_nonce >= b->start_nonce && start_nonce < b->next_nonce)
+      return b;
+  }
+  return NULL;
+}
+
+// a range of a block that has already been reported upstream is not recorded (the upstream server has the rest of
+// the block searched again)
+static void relay_record_done(uint32_t upstream_work_id, uint64_t start_nonce, uint64_t end_nonce, uint32_t coins_found)
+{
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+  {
+    relay_block_t *b = &g_relay.blocks[i];
+    if(!b->active || b->work_id != upstream_work_id || start_nonce < b->start_nonce || start_nonce >= b->end_nonce)
+      continue;
+    if(end_nonce > b->end_nonce)
+      end_nonce = b->end_nonce;
+    if(aad_interval_set_add(&b->done, start_nonce, end_nonce) == UINT64_MAX)
+      LOG_ERROR("Out of memory, nonces %lu-%lu of upstream work %u not recorded\n",
+                (unsigned long)start_nonce, (unsigned long)end_nonce, b->work_id);
+    b->coins_found += coins_found;
+    return;
+  }
+}
+
+// each range is a (template, nonces) pair: reclaimed ranges go out first, then fresh nonces of the current
+// template; once template_span nonces of it have been handed out, an open-ended search moves on to the
+// next template, so the keyspace is 95^32 templates of 95^10 nonces
+// (a relay hands out the blocks it got from upstream instead, and prefers reclaimed ranges so that they
+// are finished sooner)
+// returns -1 if the client already holds too many leases and -2 if the whole search has been handed out
+static int assign_work(client_slot_t *c, work_assignment_ext_t *ext)
+{
+  work_assignment_t *work = &ext->base;
+  lease_t *lease = free_lease(c);
+  if(lease == NULL)
+    return -1;
+  
+  client_class_t *cls = &g_state.classes[c->class_index];
+  campaign_t *cmp = g_relay.enabled ? NULL : pick_campaign();
+  uint64_t size = range_size_for(c);
+  uint64_t limit = fair_share_limit(cls, cmp);
+  if(size > limit)
+    size = limit;
+  
+  int fresh_left = g_relay.enabled ? relay_nonces_left() > 0 : cmp != NULL;
+  double now = now_seconds();
+  if(!fresh_left && g_state.n_reclaimed == 0)
+    return (speculate_tail(c, lease, ext, now) == 0) ? 0 : -2;
+  
+  lease->upstream_work_id = 0;
+  if(!(c->features & DETI_CAP_TEMPLATES))
+  { // the client picks its own templates, so its nonces only need to be different from the other such clients
+    ext->template_id = NO_TEMPLATE;
+    work->start_nonce = __atomic_fetch_add(&g_state.legacy_next_nonce, size, __ATOMIC_RELAXED);
+    work->end_nonce = work->start_nonce + size;
+  }
+  else if(g_state.n_reclaimed > 0 && (!fresh_left || g_relay.enabled || prefers_reclaimed(cls)))
+  {
+    nonce_range_t *r = &g_state.reclaimed[g_state.n_reclaimed - 1];
+    if(g_relay.enabled)
+    {
+      relay_block_t *block = relay_block_of(r->template_id, r->start_nonce);
+      if(block == NULL)
+      { // (only once the relay is stopping) nobody upstream needs it any more
+        __atomic_store_n(&g_state.n_reclaimed, g_state.n_reclaimed - 1, __ATOMIC_RELAXED);
+        return -2;
+      }
+      lease->upstream_work_id = block->work_id;
+      if(size > block->end_nonce - r->start_nonce)   // (a gap may go on into the next block)
+        size = block->end_nonce - r->start_nonce;
+    }
+    ext->template_id = r->template_id;
+    work->start_nonce = r->start_nonce;
+    if(r->end_nonce - r->start_nonce > size)
+    {
+      work->end_nonce = r->start_nonce + size;
+      r->start_nonce = work->end_nonce;
+    }
+    else
+    {
+      work->end_nonce = r->end_nonce;
+      __atomic_store_n(&g_state.n_reclaimed, g_state.n_reclaimed - 1, __ATOMIC_RELAXED);
+    }
+  }
+  else if(g_relay.enabled)
+  {
+    if(relay_take_range(size, &lease->upstream_work_id, &ext->template_id, &work->start_nonce, &work->end_nonce) < 0)
+      return -2;
+  }
+  else
+  {
+    uint64_t spill;
+    if(take_fresh_range(cmp, size, &ext->template_id, &work->start_nonce, &work->end_nonce, &spill) < 0)
+      return -2;
+    reclaim_range(ext->template_id + 1, 0, spill);
+  }
+  
+  lease->speculative = 0;
+  lease->cancelled = 0;
+  lease->twin_client = -1;
+  install_lease(c, lease, ext, now);
+  count_assigned(c, ext->template_id, work->end_nonce - work->start_nonce);
+  return 0;
+}
+
+// the common case, a single open-ended campaign with nothing to reclaim, needs no lock at all
+// returns -3 if assign_work() has to be used instead
+static int assign_work_fast(client_slot_t *c, work_assignment_ext_t *ext)
+{
+  work_assignment_t *work = &ext->base;
+  campaign_t *cmp = &g_state.campaigns[0];
+  uint64_t spill = 0;
+  
+  if(g_relay.enabled || g_state.n_campaigns > 1 || cmp->end_cursor != 0 || cmp->weight <= 0.0 ||
+     __atomic_load_n(&g_state.n_reclaimed, __ATOMIC_RELAXED) > 0)
+    return -3;
+  lease_t *lease = free_lease(c);
+  if(lease == NULL)
+    return -1;
+  
+  uint64_t size = range_size_for(c);
+  if(!(c->features & DETI_CAP_TEMPLATES))
+  {
+    ext->template_id = NO_TEMPLATE;
+    work->start_nonce = __atomic_fetch_add(&g_state.legacy_next_nonce, size, __ATOMIC_RELAXED);
+    work->end_nonce = work->start_nonce + size;
+  }
+  else if(take_fresh_range(cmp, size, &ext->template_id, &work->start_nonce, &work->end_nonce, &spill) < 0)
+    return -3;
+  if(spill > 0)
+  {
+    pthread_mutex_lock(&g_state.state_lock);
+    reclaim_range(ext->template_id + 1, 0, spill);
+    pthread_mutex_unlock(&g_state.state_lock);
+  }
+  
+  lease->speculative = 0;
+  lease->cancelled = 0;
+  lease->twin_client = -1;
+  lease->upstream_work_id = 0;
+  install_lease(c, lease, ext, now_seconds());
+  count_assigned(c, ext->template_id, work->end_nonce - work->start_nonce);
+  return 0;
+}
+
+// a relay keeps a client waiting, rather than telling it there is no work, while the upstream server is
+// connected but has not leased it the next block yet
+static int relay_wait_for_work(client_slot_t *c, work_assignment_ext_t *ext)
+{
+  struct timespec deadline;
+  int status = -2;
+  
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)RELAY_WAIT_SECONDS;
+  while(status == -2 && g_state.running && __atomic_load_n(&g_relay.connected, __ATOMIC_ACQUIRE))
+  {
+    int timed_out = pthread_cond_timedwait(&g_relay.work_ready, &g_state.state_lock, &deadline) == ETIMEDOUT;
+    status = assign_work(c, ext);
+    if(timed_out)
+      break;
+  }
+  return status;
+}
+
+// while an operator has the assignments paused, a client that asks for work waits for them to resume, rather than
+// being told that there is none (which would make it leave)
+static void wait_while_paused(void)
+{
+  pthread_mutex_lock(&g_state.state_lock);
+  while(g_state.paused && g_state.running)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_cond_timedwait(&g_state.resumed, &g_state.state_lock, &deadline);
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+}
+
+static void release_leases(client_slot_t *c)
+{
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+    if(lease_active(&c->leases[i]))
+    {
+      orphan_lease(c, &c->leases[i]);
+      finish_lease(&c->leases[i], 0);
+    }
+}
+
+static void expire_leases(double now)
+{
+  for(int i = 0; i < MAX_CLIENTS; i++)
+  {
+    client_slot_t *c = &g_state.clients[i];
+    if(!c->in_use)
+      continue;
+    for(int j = 0; j < MAX_CLIENT_LEASES; j++)
+    {
+      lease_t *lease = &c->leases[j];
+      if(lease_active(lease) && now > lease->deadline)
+      {
+        LOG_ALWAYS("[%s] Lease of work %u expired, reclaiming nonces %lu-%lu\n", c->addr, lease->work_id,
+                   (unsigned long)lease->start_nonce, (unsigned long)lease->end_nonce);
+        orphan_lease(c, lease);
+        finish_lease(lease, 0);
+        g_state.leases_expired++;
+      }
+    }
+  }
+}
+
+// live hashes/s of the whole cluster, from the latest progress or completion of each client
+static double cluster_hash_rate(double now)
+{
+  double rate = 0.0;
+  for(int i = 0; i < MAX_CLIENTS; i++)
+    if(g_state.clients[i].in_use && now - g_state.clients[i].rate_updated_at < RATE_STALE_SECONDS)
+      rate += g_state.clients[i].hash_rate;
+  return rate;
+}
+
+//
+// keyspace coverage and its persistence (also called with the state lock held)
+//
+
+// end of the nonces of a template that have been handed out
+static uint64_t coverage_end(const coverage_t *cov)
+{
+  const campaign_t *cmp = campaign_of(cov->template_id);
+  uint64_t end = cov->next_nonce;
+  
+  if(cmp == NULL)
+    return end;
+  uint64_t cursor = __atomic_load_n(&cmp->cursor, __ATOMIC_RELAXED);
+  uint32_t current = campaign_template(cmp, cursor);
+  if(cov->template_id < current && end < g_state.template_span)
+    end = g_state.template_span;
+  else if(cov->template_id == current && end < cursor % g_state.template_span)
+    end = cursor % g_state.template_span;
+  return end;
+}
+
+// serialized with the state lock held, but written out (to a temporary file first, so a crash while saving
+// leaves the previous state intact) after releasing it
+static int save_state(const char *path)
+{
+  char *text = NULL;
+  size_t text_size = 0;
+  FILE *mem = open_memstream(&text, &text_size);
+  if(mem == NULL)
+  {
+    perror("open_memstream");
+    return -1;
+  }
+  
+  thread_counters_t totals;
+  pthread_mutex_lock(&g_state.state_lock);
+  uint64_t cursor = __atomic_load_n(&g_state.campaigns[0].cursor, __ATOMIC_RELAXED);
+  sum_counters(&totals);
+  fprintf(mem, "%s %d\n", STATE_FILE_MAGIC, STATE_FILE_VERSION);
+  fprintf(mem, "template_span %lu\n", (unsigned long)g_state.template_span);
+  fprintf(mem, "current_template %u\n", (uint32_t)(cursor / g_state.template_span));
+  fprintf(mem, "next_nonce %lu\n", (unsigned long)(cursor % g_state.template_span));
+  fprintf(mem, "next_work_id %u\n", __atomic_load_n(&g_state.next_work_id, __ATOMIC_RELAXED));
+  fprintf(mem, "total_nonces_completed %lu\n", (unsigned long)totals.nonces_completed);
+  fprintf(mem, "total_coins_found %lu\n", (unsigned long)totals.coins_found);
+  for(int k = 1; k < g_state.n_campaigns; k++)
+  {
+    campaign_t *cmp = &g_state.campaigns[k];
+    cursor = __atomic_load_n(&cmp->cursor, __ATOMIC_RELAXED);
+    fprintf(mem, "campaign %d %s %lu %lu\n", k, cmp->name, (unsigned long)(cursor / g_state.template_span),
+            (unsigned long)(cursor % g_state.template_span));
+  }
+  for(int i = 0; i < g_state.n_templates; i++)
+  {
+    coverage_t *cov = &g_state.coverage[i];
+    fprintf(mem, "template %u %lu %lu %lu %zu\n", cov->template_id, (unsigned long)cov->base_nonce,
+            (unsigned long)coverage_end(cov), (unsigned long)cov->duplicate_nonces, cov->done.n_runs);
+    for(size_t j = 0; j < cov->done.n_runs; j++)
+      fprintf(mem, "%lu %lu\n", (unsigned long)cov->done.runs[j].start, (unsigned long)cov->done.runs[j].end);
+  }
+  // the leases still out are orphans after a restart, which their clients may still complete
+  for(int i = 0; i < g_state.n_orphans; i++)
+  {
+    orphan_lease_t *orphan = &g_state.orphans[i];
+    fprintf(mem, "orphan %lu %u %u %lu %lu\n", (unsigned long)orphan->client_id, orphan->work_id, orphan->template_id,
+            (unsigned long)orphan->start_nonce, (unsigned long)orphan->end_nonce);
+  }
+  for(int i = 0; i < MAX_CLIENTS; i++)
+    for(int j = 0; j < MAX_CLIENT_LEASES && g_state.clients[i].in_use && g_state.clients[i].client_id != 0; j++)
+    {
+      lease_t *lease = &g_state.clients[i].leases[j];
+      if(lease_active(lease))
+        fprintf(mem, "orphan %lu %u %u %lu %lu\n", (unsigned long)g_state.clients[i].client_id, lease->work_id,
+                lease->template_id, (unsigned long)lease->start_nonce, (unsigned long)lease->end_nonce);
+    }
+  fprintf(mem, "end\n");
+  pthread_mutex_unlock(&g_state.state_lock);
+  fclose(mem);
+  
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *fp = fopen(tmp_path, "w");
+  if(fp == NULL)
+  {
+    perror(tmp_path);
+    free(text);
+    return -1;
+  }
+  fwrite(text, 1, text_size, fp);
+  free(text);
+  if(fflush(fp) != 0 || fsync(fileno(fp)) != 0 || ferror(fp))
+  {
+    perror(tmp_path);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  if(rename(tmp_path, path) != 0)
+  {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// returns 1 if the state was loaded, 0 if there is no state file, and -1 if it is corrupt (or was saved with
+// another template span, or with other campaigns: they have to be given again, in the same order, since their
+// templates depend on it)
+static int load_state(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    return 0;
+  
+  char word[64];
+  int version;
+  unsigned long value;
+  unsigned int u32;
+  uint32_t current_template = 0;
+  uint64_t current_next_nonce = 0;
+  int status = -1;
+  
+  // version 1 files have a single template and no per-template next nonce
+  if(fscanf(fp, "%63s %d", word, &version) != 2 || strcmp(word, STATE_FILE_MAGIC) != 0 ||
+     version < 1 || version > STATE_FILE_VERSION)
+    goto done;
+  while(fscanf(fp, "%63s", word) == 1)
+  {
+    if(strcmp(word, "end") == 0)
+    {
+      status = 1;
+      break;
+    }
+    else if(strcmp(word, "template_span") == 0 && fscanf(fp, "%lu", &value) == 1)
+    { // (files older than version 4 do not say, and are taken to have the span of this run)
+      if(value != g_state.template_span)
+      {
+        fprintf(stderr, "%s: saved with %lu nonces per template, not %lu\n", path, value,
+                (unsigned long)g_state.template_span);
+        goto done;
+      }
+    }
+    else if(strcmp(word, "next_nonce") == 0 && fscanf(fp, "%lu", &value) == 1)
+      current_next_nonce = value;
+    else if(strcmp(word, "current_template") == 0 && fscanf(fp, "%u", &u32) == 1)
+      current_template = u32;
+    else if(strcmp(word, "next_work_id") == 0 && fscanf(fp, "%u", &u32) == 1)
+      g_state.next_work_id = u32;
+    else if(strcmp(word, "total_nonces_completed") == 0 && fscanf(fp, "%lu", &value) == 1)
+      g_state.base_nonces_completed = value;
+    else if(strcmp(word, "total_coins_found") == 0 && fscanf(fp, "%lu", &value) == 1)
+      g_state.base_coins_found = value;
+    else if(strcmp(word, "campaign") == 0)
+    {
+      int k;
+      unsigned long next_nonce;
+      if(fscanf(fp, "%d %63s %u %lu", &k, word, &u32, &next_nonce) != 4)
+        goto done;
+      if(k < 1 || k >= g_state.n_campaigns || strcmp(g_state.campaigns[k].name, word) != 0)
+      {
+        fprintf(stderr, "%s: campaign %d is \"%s\", which is not campaign %d of this run\n", path, k, word, k);
+        goto done;
+      }
+      g_state.campaigns[k].cursor = (uint64_t)u32 * g_state.template_span + next_nonce;
+    }
+    else if(strcmp(word, "template") == 0)
+    {
+      unsigned long base_nonce, next_nonce, duplicates, start, end;
+      size_t n_runs;
+      if(fscanf(fp, "%u %lu", &u32, &base_nonce) != 2)
+        goto done;
+      if(version == 1)
+        next_nonce = current_next_nonce;
+      else if(fscanf(fp, "%lu", &next_nonce) != 1)
+        goto done;
+      if(fscanf(fp, "%lu %zu", &duplicates, &n_runs) != 2 || base_nonce > next_nonce)
+        goto done;
+      coverage_t *cov = coverage_for(u32, base_nonce);
+      if(cov == NULL)
+        goto done;
+      cov->next_nonce = next_nonce;
+      cov->duplicate_nonces = duplicates;
+      for(size_t j = 0; j < n_runs; j++)
+        if(fscanf(fp, "%lu %lu", &start, &end) != 2 || start < base_nonce || start >= end || end > next_nonce ||
+           aad_interval_set_add(&cov->done, start, end) != 0)
+          goto done;
+    }
+    else if(strcmp(word, "orphan") == 0)
+    { // (version 5 on)
+      unsigned long client_id, start, end;
+      unsigned int template_id;
+      if(fscanf(fp, "%lu %u %u %lu %lu", &client_id, &u32, &template_id, &start, &end) != 5 || client_id == 0 ||
+         start >= end)
+        goto done;
+      client_slot_t owner = { .client_id = client_id };
+      lease_t lease = { .work_id = u32, .template_id = template_id, .start_nonce = start, .end_nonce = end };
+      orphan_lease(&owner, &lease);
+    }
+    else
+      goto done;
+  }
+  g_state.campaigns[0].cursor = (uint64_t)current_template * g_state.template_span + current_next_nonce;
+  
+done:
+  fclose(fp);
+  return status;
+}
+
+// writes a summary line (and, if asked, the gaps) of the coverage of a template into text
+static void format_coverage(char *text, size_t text_size, const coverage_t *cov, int list_gaps)
+{
+  aad_interval_t gaps[MAX_LISTED_GAPS];
+  uint64_t end = coverage_end(cov);
+  uint64_t span = (end > cov->base_nonce) ? end - cov->base_nonce : 0;
+  size_t n_gaps = aad_interval_set_gaps(&cov->done, cov->base_nonce, end, gaps, MAX_LISTED_GAPS);
+  size_t len = 0;
+  
+  len += snprintf(&text[len], text_size - len,
+                  "Template %u: %lu of %lu nonces searched (%.4f%%) in %zu runs, %zu gaps, %lu duplicate nonces\n",
+                  cov->template_id, (unsigned long)cov->done.covered, (unsigned long)span,
+                  (span > 0) ? 100.0 * (double)cov->done.covered / (double)span : 100.0,
+                  cov->done.n_runs, n_gaps, (unsigned long)cov->duplicate_nonces);
+  if(list_gaps)
+    for(size_t i = 0; i < n_gaps && i < MAX_LISTED_GAPS && len < text_size; i++)
+      len += snprintf(&text[len], text_size - len, "  gap %lu-%lu (%lu nonces)\n", (unsigned long)gaps[i].start,
+                      (unsigned long)gaps[i].end, (unsigned long)(gaps[i].end - gaps[i].start));
+  if(list_gaps && n_gaps > MAX_LISTED_GAPS && len < text_size)
+    snprintf(&text[len], text_size - len, "  ... and %zu more\n", n_gaps - MAX_LISTED_GAPS);
+}
+
+static void print_coverage(const coverage_t *cov, int list_gaps)
+{
+  char text[64 * (MAX_LISTED_GAPS + 2)];
+  
+  format_coverage(text, sizeof(text), cov, list_gaps);
+  fputs(text, stdout);
+}
+
+// whatever was assigned before a restart but never completed is searched again
+static void reclaim_coverage_gaps(void)
+{
+  for(int i = 0; i < g_state.n_templates; i++)
+  {
+    coverage_t *cov = &g_state.coverage[i];
+    uint64_t end = coverage_end(cov);
+    size_t n_gaps = aad_interval_set_gaps(&cov->done, cov->base_nonce, end, NULL, 0);
+    aad_interval_t *gaps = malloc((n_gaps + 1) * sizeof(aad_interval_t));
+    if(gaps == NULL)
+      continue;
+    aad_interval_set_gaps(&cov->done, cov->base_nonce, end, gaps, n_gaps);
+    for(size_t j = n_gaps; j > 0; j--)
+      reclaim_range(cov->template_id, gaps[j - 1].start, gaps[j - 1].end);
+    free(gaps);
+  }
+}
+
+// returns -1 if there are too many connections to serve (the caller closes sock)
+static int handler_register(int sock)
+{
+  int status = -1;
+  
+  pthread_mutex_lock(&g_handlers.lock);
+  if(g_handlers.n_running < MAX_HANDLERS)
+  {
+    g_handlers.socks[g_handlers.n_running++] = sock;
+    status = 0;
+  }
+  pthread_mutex_unlock(&g_handlers.lock);
+  return status;
+}
+
+// the last thing a handler does (sock is closed under the lock, so that main() never shuts down a reused descriptor)
+static void handler_exit(int sock)
+{
+  pthread_mutex_lock(&g_handlers.lock);
+  for(int i = 0; i < g_handlers.n_running; i++)
+    if(g_handlers.socks[i] == sock)
+    {
+      g_handlers.socks[i] = g_handlers.socks[--g_handlers.n_running];
+      break;
+    }
+  close(sock);
+  pthread_cond_broadcast(&g_handlers.exited);
+  pthread_mutex_unlock(&g_handlers.lock);
+}
+
+// at shutdown: wakes the handlers waiting for work, cuts off the clients still connected, and waits until every
+// handler is gone (they use the state, the verification queue and the logger)
+static void stop_handlers(void)
+{
+  pthread_mutex_lock(&g_state.state_lock);
+  pthread_cond_broadcast(&g_state.resumed);
+  if(g_relay.enabled)
+    pthread_cond_broadcast(&g_relay.work_ready);
+  pthread_mutex_unlock(&g_state.state_lock);
+  
+  pthread_mutex_lock(&g_handlers.lock);
+  for(int i = 0; i < g_handlers.n_running; i++)
+    shutdown(g_handlers.socks[i], SHUT_RDWR);
+  while(g_handlers.n_running > 0)
+    pthread_cond_wait(&g_handlers.exited, &g_handlers.lock);
+  pthread_mutex_unlock(&g_handlers.lock);
+}
+
+static void *client_handler(void *arg)
+{
+  int client_sock = *(int *)arg;
+  free(arg);
+  
+  char client_addr[64];
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  getpeername(client_sock, (struct sockaddr *)&addr, &addr_len);
+  snprintf(client_addr, sizeof(client_addr), "%s:%d", 
+           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+  
+  LOG("[%s] Client connected\n", client_addr);
+  
+  client_slot_t *client = NULL;
+  thread_counters_t *counters = NULL;
+  
+  __atomic_fetch_add(&g_state.n_clients_connected, 1, __ATOMIC_RELAXED);
+  
+  message_header_t hdr;
+  client_info_ext_t hello;
+  client_info_t client_info;
+  
+  memset(&hello, 0, sizeof(hello));
+  if(recv_message(client_sock, &hdr, &hello, sizeof(hello)) < 0 || hdr.type != MSG_CLIENT_HELLO ||
+     hdr.length < sizeof(client_info_t))
+  {
+    LOG_ERROR("[%s] Failed to receive CLIENT_HELLO\n", client_addr);
+    goto cleanup;
+  }
+  
+  // load generators are only taken on a dry run, as their coins are not checked against their leases
+  client_info = hello.base;
+  uint32_t capabilities = DETI_SERVER_CAPABILITIES | (g_dry_run ? DETI_CAP_SYNTHETIC : 0u);
+  uint32_t features = 0;
+  if(client_info.version >= 2)
+    features = client_info.capabilities & capabilities & ~DETI_CAP_THREADS_MASK;
+  
+  LOG("[%s] Client: %.64s, type: %.32s, protocol v%u%s%s%s%s\n", client_addr,
+      client_info.hostname, client_info.client_type, client_info.version,
+      (features & DETI_CAP_BATCH_REPORTS) ? ", batched reports" : "",
+      (features & DETI_CAP_CRC32C) ? ", crc32c" : "",
+      (features & DETI_CAP_SHM) ? ", shared memory" : "",
+      (features & DETI_CAP_SYNTHETIC) ? ", synthetic" : "");
+  // (protocol versions 8 and 9 sent the rate and the ISA in the hello, but no client id)
+  if(hdr.length < offsetof(client_info_ext_t, client_id))
+    hello.benchmark_rate = 0.0;
+  hello.client_id = 0;
+  
+  server_info_t server_info;
+  server_info.version = DETI_PROTOCOL_VERSION;
+  server_info.capabilities = capabilities;
+  
+  if(send_message(client_sock, DETI_FRAME_VERSION_LEGACY, MSG_SERVER_HELLO, &server_info, sizeof(server_info)) < 0)
+  {
+    LOG_ERROR("[%s] Failed to send SERVER_HELLO\n", client_addr);
+    goto cleanup;
+  }
+  
+  connection_t conn;
+  conn.sock = client_sock;
+  conn.frame_version = (features & DETI_CAP_CRC32C) ? DETI_FRAME_VERSION_CRC32C : DETI_FRAME_VERSION_LEGACY;
+  conn.shm = NULL;
+  conn.send_lock = NULL;
+  
+  // the rest of what the client has to say about itself follows the handshake, in the negotiated frames
+  if(features & DETI_CAP_CLIENT_INFO)
+  {
+    client_info_ext_t info;
+    memset(&info, 0, sizeof(info));
+    if(conn_recv(&conn, &hdr, &info, sizeof(info)) < 0 || hdr.type != MSG_CLIENT_INFO || hdr.length < sizeof(info))
+    {
+      LOG_ERROR("[%s] Failed to receive CLIENT_INFO\n", client_addr);
+      goto cleanup;
+    }
+    hello.benchmark_rate = info.benchmark_rate;
+    memcpy(hello.isa, info.isa, sizeof(hello.isa));
+    hello.client_id = info.client_id;
+  }
+  if(!(hello.benchmark_rate > 0.0))
+    hello.benchmark_rate = 0.0;
+  else
+    LOG("[%s] Benchmark: %.2f MH/s (%.16s)\n", client_addr, hello.benchmark_rate / 1e6, hello.isa);
+  
+  pthread_mutex_lock(&g_state.state_lock);
+  client = acquire_client_slot();
+  if(client != NULL)
+  {
+    snprintf(client->addr, sizeof(client->addr), "%s", client_addr);
+    snprintf(client->hostname, sizeof(client->hostname), "%.*s", (int)sizeof(client_info.hostname), client_info.hostname);
+    snprintf(client->client_type, sizeof(client->client_type), "%.*s", (int)sizeof(client_info.client_type), client_info.client_type);
+    client->threads = client_info.capabilities & DETI_CAP_THREADS_MASK;
+    client->features = features;
+    client->client_id = hello.client_id;
+    client->synthetic = (features & DETI_CAP_SYNTHETIC) != 0;
+    client->connected_at = now_seconds();
+    // the first range is sized from the benchmark, until the client reports a rate of its own
+    if(hello.benchmark_rate > 0.0)
+    {
+      client->hash_rate = hello.benchmark_rate;
+      client->rate_updated_at = client->connected_at;
+    }
+    join_client_class(client);
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+  
+  if(client == NULL)
+  {
+    LOG_ERROR("[%s] Too many clients\n", client_addr);
+    goto done;
+  }
+  counters = &g_handler_counters[client - g_state.clients];
+  conn.send_lock = &g_client_links[client - g_state.clients].lock;
+  pthread_mutex_lock(conn.send_lock);
+  g_client_links[client - g_state.clients].conn = &conn;
+  pthread_mutex_unlock(conn.send_lock);
+  LOG("[%s] Scheduling class: %s (weight %.1f, priority %u)\n", client_addr,
+      client_class_name(&g_state.classes[client->class_index]),
+      g_state.classes[client->class_index].weight, g_state.classes[client->class_index].priority);
+  
+  char buffer[8192] __attribute__((aligned(8)));
+  while(g_state.running)
+  {
+    if(conn_recv(&conn, &hdr, buffer, sizeof(buffer)) < 0)
+    {
+      LOG_ERROR("[%s] Connection lost\n", client_addr);
+      break;
+    }
+    
+    switch(hdr.type)
+    {
+      case MSG_REQUEST_WORK:
+      {
+        work_assignment_ext_t ext;
+        work_assignment_t *work = &ext.base;
+        
+        counter_add(&counters->requests, 1);
+        if(__atomic_load_n(&client->draining, __ATOMIC_ACQUIRE))
+        {
+          LOG_ALWAYS("[%s] Drained\n", client_addr);
+          conn_send(&conn, MSG_NO_WORK, NULL, 0);
+          break;
+        }
+        if(__atomic_load_n(&g_state.paused, __ATOMIC_ACQUIRE))
+          wait_while_paused();
+        double requested_at = now_seconds();
+        int status = assign_work_fast(client, &ext);
+        if(status == -3)
+        {
+          pthread_mutex_lock(&g_state.state_lock);
+          status = assign_work(client, &ext);
+          if(status == -2 && g_relay.enabled)
+            status = relay_wait_for_work(client, &ext);
+          pthread_mutex_unlock(&g_state.state_lock);
+        }
+        observe_latency(&counters->assign_latency, now_seconds() - requested_at);
+        
+        if(status < 0)
+        {
+          if(status == -1)
+            LOG_ERROR("[%s] Too many outstanding ranges\n", client_addr);
+          else
+            LOG("[%s] No work left\n", client_addr);
+          conn_send(&conn, MSG_NO_WORK, NULL, 0);
+          break;
+        }
+        
+        if(ext.template_id != NO_TEMPLATE)
+          LOG("[%s] Assigned work %u: template %u, nonces %lu-%lu, priority %u\n", client_addr, work->work_id,
+              ext.template_id, (unsigned long)work->start_nonce, (unsigned long)work->end_nonce, work->priority);
+        else
+          LOG("[%s] Assigned work %u: nonces %lu-%lu, priority %u\n", client_addr, work->work_id,
+              (unsigned long)work->start_nonce, (unsigned long)work->end_nonce, work->priority);
+        
+        int status_send = (features & DETI_CAP_TEMPLATES)
+                          ? conn_send(&conn, MSG_WORK_ASSIGNMENT, &ext, sizeof(ext))
+                          : conn_send(&conn, MSG_WORK_ASSIGNMENT, work, sizeof(*work));
+        if(status_send < 0)
+        {
+          LOG_ERROR("[%s] Failed to send work assignment\n", client_addr);
+          goto done;
+        }
+        break;
+      }
+      
+      case MSG_REPORT_COIN:
+      {
+        if(hdr.length != sizeof(coin_report_t))
+        {
+          LOG_ERROR("[%s] Malformed coin report (%u bytes)\n", client_addr, hdr.length);
+          break;
+        }
+        queue_coin_reports(client, (coin_report_t *)buffer, 1);
+        break;
+      }
+      
+      case MSG_REPORT_COINS:
+      {
+        coin_batch_t *batch = (coin_batch_t *)buffer;
+        
+        if(hdr.length < sizeof(coin_batch_t) || batch->count > MAX_COINS_PER_BATCH ||
+           hdr.length != COIN_BATCH_SIZE(batch->count))
+        {
+          LOG_ERROR("[%s] Malformed coin batch (%u bytes)\n", client_addr, hdr.length);
+          break;
+        }
+        
+        queue_coin_reports(client, batch->reports, batch->count);
+        break;
+      }
+      
+      case MSG_WORK_COMPLETE:
+      {
+        work_completion_t *completion = (work_completion_t *)buffer;
+        double now = now_seconds();
+        
+        if(hdr.length < sizeof(work_completion_t))
+        {
+          LOG_ERROR("[%s] Malformed work completion (%u bytes)\n", client_addr, hdr.length);
+          break;
+        }
+        pthread_mutex_lock(&g_state.state_lock);
+        // a completion replayed from a client's spool after a reconnect is of a lease of its old connection, which
+        // is still active if the server has not noticed yet that the connection is gone, and orphaned otherwise;
+        // whatever was not leased to this client (under its client id) is bogus
+        lease_t *lease = find_lease(client, completion->work_id);
+        orphan_lease_t *orphan = NULL;
+        if(lease == NULL)
+          lease = find_lease_of(client->client_id, completion->work_id);
+        if(lease == NULL)
+          orphan = find_orphan(client->client_id, completion->work_id);
+        if(hdr.length >= sizeof(work_completion_ext_t))
+        {
+          work_completion_ext_t *ext = (work_completion_ext_t *)buffer;
+          if((lease != NULL && (ext->template_id != lease->template_id || ext->start_nonce != lease->start_nonce)) ||
+             (orphan != NULL && (ext->template_id != orphan->template_id || ext->start_nonce != orphan->start_nonce)))
+          {
+            lease = NULL;
+            orphan = NULL;
+          }
+        }
+        if(lease == NULL && orphan == NULL)
+        {
+          client->bogus_reports++;
+          pthread_mutex_unlock(&g_state.state_lock);
+          counter_add(&counters->bogus_reports, 1);
+          LOG_ERROR("[%s] Completion of work %u, which was not leased to it, ignored\n", client_addr,
+                    completion->work_id);
+          break;
+        }
+        counter_add(&counters->nonces_completed, completion->nonces_tested);
+        client->nonces_completed += completion->nonces_tested;
+        client->ranges_completed++;
+        client->coins_found += completion->coins_found;
+        if(completion->elapsed_time > 0.0 && completion->nonces_tested > 0)
+        {
+          client->hash_rate = (double)completion->nonces_tested / completion->elapsed_time;
+          client->rate_updated_at = now;
+        }
+        if(lease != NULL)
+        {
+          // an interrupted client reports the prefix it finished; the rest is searched again
+          // (a straggler whose tail was taken over may report more than what is left of its lease)
+          uint64_t done = completion->nonces_tested;
+          int speculated = lease->speculative || lease->twin_client >= 0;
+          if(done > lease->end_nonce - lease->start_nonce)
+          {
+            g_state.wasted_nonces += done - (lease->end_nonce - lease->start_nonce);
+            done = lease->end_nonce - lease->start_nonce;
+          }
+          record_completed_range(lease->template_id, lease->start_nonce, lease->start_nonce + done, speculated);
+          if(g_relay.enabled)
+            relay_record_done(lease->upstream_work_id, lease->start_nonce, lease->start_nonce + done,
+                              completion->coins_found);
+          finish_lease(lease, done);
+        }
+        else
+        {
+          // the orphan's range was reclaimed, so the part that was searched after all is not handed out again
+          uint64_t done = completion->nonces_tested;
+          if(done > orphan->end_nonce - orphan->start_nonce)
+            done = orphan->end_nonce - orphan->start_nonce;
+          record_completed_range(orphan->template_id, orphan->start_nonce, orphan->start_nonce + done, 0);
+          drop_reclaimed(orphan->template_id, orphan->start_nonce, orphan->start_nonce + done);
+          if(g_relay.enabled)
+            relay_record_done(orphan->upstream_work_id, orphan->start_nonce, orphan->start_nonce + done,
+                              completion->coins_found);
+          forget_orphan(orphan);
+        }
+        pthread_mutex_unlock(&g_state.state_lock);
+        send_pending_cancels();
+        
+        LOG("[%s] Work %u complete: %lu nonces in %.2fs (%.0f nonces/sec), %u coins\n",
+            client_addr, completion->work_id, (unsigned long)completion->nonces_tested,
+            completion->elapsed_time,
+            (double)completion->nonces_tested / completion->elapsed_time,
+            completion->coins_found);
+        break;
+      }
+      
+      case MSG_PROGRESS:
+      {
+        progress_report_t *progress = (progress_report_t *)buffer;
+        double now = now_seconds();
+        
+        if(hdr.length != sizeof(progress_report_t))
+        {
+          LOG_ERROR("[%s] Malformed progress report (%u bytes)\n", client_addr, hdr.length);
+          break;
+        }
+        pthread_mutex_lock(&g_state.state_lock);
+        if(progress->hash_rate > 0.0)
+        {
+          client->hash_rate = progress->hash_rate;
+          client->rate_updated_at = now;
+        }
+        lease_t *lease = find_lease(client, progress->work_id);
+        if(lease != NULL)
+        {
+          uint64_t size = lease->end_nonce - lease->start_nonce;
+          lease->nonces_done = (progress->nonces_done < size) ? progress->nonces_done : size;
+          lease->last_update = now;
+          lease->deadline = lease_deadline(client, size - lease->nonces_done, now);
+        }
+        pthread_mutex_unlock(&g_state.state_lock);
+        break;
+      }
+      
+      case MSG_PING:
+        conn_send(&conn, MSG_PONG, NULL, 0);
+        break;
+      
+      case MSG_SHM_ATTACH:
+      {
+        shm_attach_t *attach = (shm_attach_t *)buffer;
+        
+        // answered on the socket; the client switches over once it has the answer
+        if(conn.shm != NULL || !(features & DETI_CAP_SHM) || hdr.length != sizeof(*attach))
+        {
+          LOG_ERROR("[%s] Unexpected shared-memory attach request\n", client_addr);
+          break;
+        }
+        aad_shm_segment_t *seg = aad_shm_attach(attach->name, attach->token);
+        attach->status = (seg != NULL) ? 0 : 1;
+        if(send_message(client_sock, conn.frame_version, MSG_SHM_ATTACH, attach, sizeof(*attach)) < 0)
+        {
+          if(seg != NULL)
+            aad_shm_close(seg);
+          LOG_ERROR("[%s] Failed to answer the shared-memory attach request\n", client_addr);
+          goto done;
+        }
+        if(seg == NULL)
+        {
+          LOG_ERROR("[%s] Cannot attach shared memory %.64s, staying on TCP\n", client_addr, attach->name);
+          break;
+        }
+        pthread_mutex_lock(conn.send_lock);
+        conn.shm = seg;
+        pthread_mutex_unlock(conn.send_lock);
+        pthread_mutex_lock(&g_state.state_lock);
+        client->shm = 1;
+        pthread_mutex_unlock(&g_state.state_lock);
+        LOG("[%s] Switched to shared memory (%.64s)\n", client_addr, attach->name);
+        break;
+      }
+      
+      default:
+        LOG_ERROR("[%s] Unknown message type: %u\n", client_addr, hdr.type);
+        break;
+    }
+  }
+  
+done:
+  conn_send(&conn, MSG_SHUTDOWN, NULL, 0);
+  if(conn.send_lock != NULL)
+  {
+    pthread_mutex_lock(conn.send_lock);
+    g_client_links[client - g_state.clients].conn = NULL;
+    pthread_mutex_unlock(conn.send_lock);
+  }
+  if(conn.shm != NULL)
+    aad_shm_close(conn.shm);
+  
+cleanup:
+  pthread_mutex_lock(&g_state.state_lock);
+  if(client != NULL)
+  {
+    release_leases(client);
+    g_state.classes[client->class_index].n_clients--;
+    client->in_use = 0;
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+  __atomic_fetch_sub(&g_state.n_clients_connected, 1, __ATOMIC_RELAXED);
+  
+  LOG("[%s] Client disconnected\n", client_addr);
+  handler_exit(client_sock);
+  return NULL;
+}
+
+//
+// relay mode: the upstream connection, which only the upstream thread uses once it is open
+//
+
+static int relay_connect(void)
+{
+  struct hostent *he = gethostbyname(g_relay.host);
+  if(he == NULL)
+  {
+    fprintf(stderr, "Unknown host: %s\n", g_relay.host);
+    return -1;
+  }
+  
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(sock < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(g_relay.port);
+  memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
+  if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror("connect");
+    close(sock);
+    return -1;
+  }
+  set_tcp_nodelay(sock);
+  
+  // the thread count (and the rate) of the clients behind the relay is not known yet, so none is announced
+  client_info_t client_info;
+  memset(&client_info, 0, sizeof(client_info));
+  gethostname(client_info.hostname, sizeof(client_info.hostname));
+  strncpy(client_info.client_type, "relay", sizeof(client_info.client_type) - 1);
+  client_info.capabilities = DETI_SERVER_CAPABILITIES & ~(DETI_CAP_SHM | DETI_CAP_CLIENT_INFO);
+  client_info.version = DETI_PROTOCOL_VERSION;
+  
+  message_header_t hdr;
+  char buffer[256] __attribute__((aligned(8)));
+  if(send_message(sock, DETI_FRAME_VERSION_LEGACY, MSG_CLIENT_HELLO, &client_info, sizeof(client_info)) < 0 ||
+     recv_message(sock, &hdr, buffer, sizeof(buffer)) < 0 || hdr.type != MSG_SERVER_HELLO ||
+     hdr.length < sizeof(server_info_t))
+  {
+    fprintf(stderr, "Handshake with %s:%d failed\n", g_relay.host, g_relay.port);
+    close(sock);
+    return -1;
+  }
+  
+  g_relay.features = ((server_info_t *)buffer)->capabilities & DETI_SERVER_CAPABILITIES & ~DETI_CAP_THREADS_MASK;
+  if(!(g_relay.features & DETI_CAP_TEMPLATES))
+  { // the local clients could not be told which templates the upstream ranges belong to
+    fprintf(stderr, "%s:%d does not assign templates, it cannot be relayed\n", g_relay.host, g_relay.port);
+    close(sock);
+    return -1;
+  }
+  g_relay.frame_version = (g_relay.features & DETI_CAP_CRC32C) ? DETI_FRAME_VERSION_CRC32C : DETI_FRAME_VERSION_LEGACY;
+  g_relay.sock = sock;
+  __atomic_store_n(&g_relay.connected, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int relay_send(message_type_t type, const void *payload, uint32_t payload_len)
+{
+  if(send_message(g_relay.sock, g_relay.frame_version, type, payload, payload_len) < 0)
+    return -1;
+  __atomic_fetch_add(&g_relay.messages_sent, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void relay_add_block(const work_assignment_ext_t *ext, uint32_t length, double now)
+{
+  relay_block_t *block = NULL;
+  
+  if(length < sizeof(*ext))
+  {
+    LOG_ERROR("Malformed upstream work assignment (%u bytes)\n", length);
+    return;
+  }
+  pthread_mutex_lock(&g_state.state_lock);
+  for(int i = 0; i < MAX_CLIENT_LEASES && block == NULL; i++)
+    if(!g_relay.blocks[i].active)
+      block = &g_relay.blocks[i];
+  if(block != NULL)
+  {
+    block->work_id = ext->base.work_id;
+    block->template_id = ext->template_id;
+    memcpy(block->template_bytes, ext->template_bytes, DETI_TEMPLATE_BYTES);
+    block->start_nonce = ext->base.start_nonce;
+    block->end_nonce = ext->base.end_nonce;
+    block->next_nonce = ext->base.start_nonce;
+    block->coins_found = 0;
+    block->assigned_at = now;
+    block->started_at = 0.0;
+    aad_interval_set_init(&block->done);
+    block->active = 1;
+    g_relay.blocks_received++;
+    pthread_cond_broadcast(&g_relay.work_ready);
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+  
+  if(block == NULL)
+    LOG_ERROR("No room for upstream work %u, it will expire upstream\n", ext->base.work_id);
+  else
+    LOG_ALWAYS("Upstream work %u: template %u, nonces %lu-%lu\n", ext->base.work_id, ext->template_id,
+               (unsigned long)ext->base.start_nonce, (unsigned long)ext->base.end_nonce);
+}
+
+// the upstream server no longer needs what is past end_nonce of a block: the part not handed out yet is dropped,
+// and the block is reported as soon as what was handed out has been searched
+static void relay_cancel_block(const cancel_work_t *cancel)
+{
+  pthread_mutex_lock(&g_state.state_lock);
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+  {
+    relay_block_t *b = &g_relay.blocks[i];
+    if(!b->active || b->work_id != cancel->work_id || cancel->end_nonce >= b->end_nonce)
+      continue;
+    b->end_nonce = (cancel->end_nonce > b->next_nonce) ? cancel->end_nonce : b->next_nonce;
+    LOG_ALWAYS("Upstream work %u cancelled from nonce %lu on\n", b->work_id, (unsigned long)b->end_nonce);
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+}
+
+// forwards the queued coins, up to MAX_COINS_PER_BATCH per message; those that cannot be sent are saved here
+static int relay_flush_coins(void)
+{
+  char batch_buffer[COIN_BATCH_SIZE(MAX_COINS_PER_BATCH)] __attribute__((aligned(8)));
+  coin_batch_t *batch = (coin_batch_t *)batch_buffer;
+  int status = 0;
+  
+  for(;;)
+  {
+    batch->count = 0;
+    batch->reserved = 0;
+    while(batch->count < MAX_COINS_PER_BATCH && aad_queue_pop(&g_relay.coins, &batch->reports[batch->count]) == 0)
+      batch->count++;
+    if(batch->count == 0)
+      return status;
+    
+    if(status == 0 && (g_relay.features & DETI_CAP_BATCH_REPORTS))
+      status = relay_send(MSG_REPORT_COINS, batch, (uint32_t)COIN_BATCH_SIZE(batch->count));
+    else
+      for(uint32_t i = 0; i < batch->count && status == 0; i++)
+        status = relay_send(MSG_REPORT_COIN, &batch->reports[i], sizeof(coin_report_t));
+    if(status < 0)
+    {
+      LOG_ERROR("Failed to forward %u coins upstream, saving them to the local vault\n", batch->count);
+      save_coins_locally(batch->reports, (int)batch->count);
+    }
+    else
+      __atomic_fetch_add(&g_relay.coins_forwarded, batch->count, __ATOMIC_RELAXED);
+  }
+}
+
+// reports the blocks that have been searched and, if asked, the searched prefix of the others (which keeps
+// their upstream leases alive); when the relay stops, the others are reported as complete up to their
+// prefix, so the upstream server gets the rest searched again
+static int relay_report_blocks(double now, int send_progress, int final)
+{
+  work_completion_t completions[MAX_CLIENT_LEASES];
+  progress_report_t progress[MAX_CLIENT_LEASES];
+  int n_completions = 0, n_progress = 0;
+  
+  memset(completions, 0, sizeof(completions));
+  memset(progress, 0, sizeof(progress));
+  pthread_mutex_lock(&g_state.state_lock);
+  double rate = cluster_hash_rate(now);
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+  {
+    relay_block_t *b = &g_relay.blocks[i];
+    if(!b->active)
+      continue;
+    uint64_t prefix = relay_block_prefix(b);
+    if(prefix >= b->end_nonce - b->start_nonce || final)
+    {
+      work_completion_t *completion = &completions[n_completions++];
+      completion->work_id = b->work_id;
+      completion->nonces_tested = prefix;
+      completion->coins_found = b->coins_found;
+      completion->elapsed_time = (b->started_at > 0.0) ? now - b->started_at : 0.0;
+      if(prefix == b->end_nonce - b->start_nonce)
+        g_relay.blocks_completed++;
+      aad_interval_set_destroy(&b->done);
+      b->active = 0;
+    }
+    else if(send_progress && (g_relay.features & DETI_CAP_PROGRESS))
+    {
+      progress_report_t *p = &progress[n_progress++];
+      p->work_id = b->work_id;
+      p->nonces_done = prefix;
+      p->hash_rate = rate;
+      p->elapsed_time = (b->started_at > 0.0) ? now - b->started_at : 0.0;
+    }
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+  
+  for(int i = 0; i < n_completions; i++)
+  {
+    if(relay_send(MSG_WORK_COMPLETE, &completions[i], sizeof(completions[i])) < 0)
+      return -1;
+    LOG_ALWAYS("Upstream work %u reported: %lu nonces in %.2fs, %u coins\n", completions[i].work_id,
+               (unsigned long)completions[i].nonces_tested, completions[i].elapsed_time, completions[i].coins_found);
+  }
+  for(int i = 0; i < n_progress; i++)
+    if(relay_send(MSG_PROGRESS, &progress[i], sizeof(progress[i])) < 0)
+      return -1;
+  return 0;
+}
+
+// keeps about RELAY_PREFETCH_SECONDS of work for the local clients (or a single block, until their rate is
+// known), one upstream request at a time
+static int relay_request_work(double now)
+{
+  if(g_relay.request_pending || now < g_relay.retry_at)
+    return 0;
+  
+  int n_blocks = 0;
+  pthread_mutex_lock(&g_state.state_lock);
+  for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+    n_blocks += g_relay.blocks[i].active;
+  uint64_t left = relay_nonces_left();
+  double rate = cluster_hash_rate(now);
+  pthread_mutex_unlock(&g_state.state_lock);
+  
+  if(n_blocks == MAX_CLIENT_LEASES || (left > 0 && (rate <= 0.0 || (double)left >= rate * RELAY_PREFETCH_SECONDS)))
+    return 0;
+  if(relay_send(MSG_REQUEST_WORK, NULL, 0) < 0)
+    return -1;
+  g_relay.request_pending = 1;
+  return 0;
+}
+
+static void *relay_upstream(void *arg)
+{
+  char buffer[8192] __attribute__((aligned(8)));
+  double last_progress = now_seconds();
+  int lost = 0;
+  
+  (void)arg;
+  while(!lost && __atomic_load_n(&g_relay.running, __ATOMIC_ACQUIRE))
+  {
+    double now = now_seconds();
+    int send_progress = now - last_progress >= DETI_DEFAULT_PROGRESS_INTERVAL;
+    if(send_progress)
+      last_progress = now;
+    if(relay_flush_coins() < 0 || relay_report_blocks(now, send_progress, 0) < 0 || relay_request_work(now) < 0)
+    {
+      lost = 1;
+      break;
+    }
+    
+    struct pollfd pfd = { .fd = g_relay.sock, .events = POLLIN, .revents = 0 };
+    int ready = poll(&pfd, 1, RELAY_POLL_MS);
+    if(ready < 0 && errno != EINTR)
+      lost = 1;
+    if(ready <= 0)
+      continue;
+    
+    message_header_t hdr;
+    if(recv_message(g_relay.sock, &hdr, buffer, sizeof(buffer)) < 0)
+    {
+      lost = 1;
+      break;
+    }
+    switch(hdr.type)
+    {
+      case MSG_WORK_ASSIGNMENT:
+        g_relay.request_pending = 0;
+        relay_add_block((work_assignment_ext_t *)buffer, hdr.length, now_seconds());
+        break;
+      
+      case MSG_NO_WORK:
+        g_relay.request_pending = 0;
+        g_relay.retry_at = now_seconds() + RELAY_RETRY_SECONDS;
+        LOG_ALWAYS("Upstream server has no work, asking again in %.0f s\n", RELAY_RETRY_SECONDS);
+        break;
+      
+      case MSG_SHUTDOWN:
+        LOG_ALWAYS("Upstream server is shutting down\n");
+        lost = 1;
+        break;
+      
+      case MSG_CANCEL_WORK:
+        if(hdr.length == sizeof(cancel_work_t))
+          relay_cancel_block((cancel_work_t *)buffer);
+        break;
+      
+      case MSG_PONG:
+        break;
+      
+      default:
+        LOG_ERROR("Unknown upstream message type: %u\n", hdr.type);
+        break;
+    }
+  }
+  
+  // main() has already stopped everything that could still search or find coins
+  if(!lost && (relay_flush_coins() < 0 || relay_report_blocks(now_seconds(), 0, 1) < 0))
+    lost = 1;
+  __atomic_store_n(&g_relay.connected, 0, __ATOMIC_RELEASE);
+  close(g_relay.sock);
+  
+  if(lost)
+  { // without the upstream server there is nothing to hand out, nor anyone to report to
+    LOG_ERROR("Lost the upstream server %s:%d, shutting down\n", g_relay.host, g_relay.port);
+    g_state.running = 0;
+    shutdown(g_relay.listen_sock, SHUT_RDWR);
+  }
+  pthread_mutex_lock(&g_state.state_lock);
+  pthread_cond_broadcast(&g_relay.work_ready);
+  pthread_mutex_unlock(&g_state.state_lock);
+  return NULL;
+}
+
+// waits for the upstream thread to report what was done; coins it could no longer forward are saved here
+static void relay_stop(pthread_t upstream_thread)
+{
+  coin_report_t report;
+  int n_saved = 0;
+  
+  __atomic_store_n(&g_relay.running, 0, __ATOMIC_RELEASE);
+  pthread_join(upstream_thread, NULL);
+  while(aad_queue_pop(&g_relay.coins, &report) == 0)
+  {
+    save_coins_locally(&report, 1);
+    n_saved++;
+  }
+  if(n_saved > 0)
+    LOG_ERROR("%d coins could not be forwarded upstream, saved to the local vault\n", n_saved);
+  aad_queue_destroy(&g_relay.coins);
+  pthread_cond_destroy(&g_relay.work_ready);
+}
+
+// "host:port"
+static int parse_upstream(const char *spec)
+{
+  const char *colon = strrchr(spec, ':');
+  if(colon == NULL || colon == spec || (size_t)(colon - spec) >= sizeof(g_relay.host) || atoi(colon + 1) <= 0)
+    return -1;
+  snprintf(g_relay.host, sizeof(g_relay.host), "%.*s", (int)(colon - spec), spec);
+  g_relay.port = atoi(colon + 1);
+  g_relay.enabled = 1;
+  return 0;
+}
+
+static const char *g_state_path = DEFAULT_STATE_FILE;
+
+//
+// Prometheus metrics, served over plain HTTP on their own port (-m)
+//
+
+static void metric_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+  fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// label values come from the clients, so backslashes, quotes and newlines have to be escaped
+static void metric_label(FILE *fp, const char *value)
+{
+  for(; *value != '\0'; value++)
+    if(*value == '\\' || *value == '"')
+      fprintf(fp, "\\%c", *value);
+    else if(*value == '\n')
+      fputs("\\n", fp);
+    else
+      fputc(*value, fp);
+}
+
+static void metric_histogram(FILE *fp, const char *name, const char *help, const latency_histogram_t *h)
+{
+  uint64_t cumulative = 0;
+  
+  metric_header(fp, name, "histogram", help);
+  for(int b = 0; b < LATENCY_BUCKETS; b++)
+  {
+    cumulative += h->count[b];
+    fprintf(fp, "%s_bucket{le=\"%g\"} %lu\n", name, latency_bounds[b], (unsigned long)cumulative);
+  }
+  cumulative += h->count[LATENCY_BUCKETS];
+  fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)cumulative);
+  fprintf(fp, "%s_sum %.9f\n", name, (double)h->sum_ns * 1e-9);
+  fprintf(fp, "%s_count %lu\n", name, (unsigned long)cumulative);
+}
+
+static void write_metrics(FILE *fp)
+{
+  thread_counters_t totals;
+  double now = now_seconds();
+  uint64_t outstanding = 0;
+  
+  sum_counters(&totals);
+  metric_header(fp, "deti_work_requests_total", "counter", "Work requests received.");
+  fprintf(fp, "deti_work_requests_total %lu\n", (unsigned long)totals.requests);
+  metric_header(fp, "deti_nonces_assigned_total", "counter", "Nonces assigned (speculative duplicates excluded).");
+  fprintf(fp, "deti_nonces_assigned_total %lu\n", (unsigned long)totals.nonces_assigned);
+  metric_header(fp, "deti_nonces_completed_total", "counter", "Nonces reported as searched, including earlier runs.");
+  fprintf(fp, "deti_nonces_completed_total %lu\n", (unsigned long)totals.nonces_completed);
+  metric_header(fp, "deti_bogus_reports_total", "counter", "Coin reports that failed verification, and completions of ranges not leased to their client.");
+  fprintf(fp, "deti_bogus_reports_total %lu\n", (unsigned long)totals.bogus_reports);
+  metric_header(fp, "deti_coins_total", "counter", "Verified coins found in this run, by power.");
+  for(int z = 0; z <= MAX_COIN_POWER; z++)
+    if(totals.coins_by_power[z] > 0)
+      fprintf(fp, "deti_coins_total{power=\"%d\"} %lu\n", z, (unsigned long)totals.coins_by_power[z]);
+  metric_header(fp, "deti_verify_queue_depth", "gauge", "Coin reports waiting for verification.");
+  fprintf(fp, "deti_verify_queue_depth %zu\n", aad_queue_size(&g_verify_queue));
+  metric_histogram(fp, "deti_assign_latency_seconds", "Time taken to assign a range to a work request.",
+                   &totals.assign_latency);
+  metric_histogram(fp, "deti_report_latency_seconds", "Time from receiving a coin report to its verdict.",
+                   &totals.report_latency);
+  
+  pthread_mutex_lock(&g_state.state_lock);
+  metric_header(fp, "deti_clients_connected", "gauge", "Connected clients.");
+  fprintf(fp, "deti_clients_connected %d\n", __atomic_load_n(&g_state.n_clients_connected, __ATOMIC_RELAXED));
+  metric_header(fp, "deti_cluster_hash_rate", "gauge", "Live hashes per second of the whole cluster.");
+  fprintf(fp, "deti_cluster_hash_rate %.0f\n", cluster_hash_rate(now));
+  metric_header(fp, "deti_reclaimed_ranges", "gauge", "Ranges waiting to be searched again.");
+  fprintf(fp, "deti_reclaimed_ranges %d\n", g_state.n_reclaimed);
+  metric_header(fp, "deti_leases_expired_total", "counter", "Leases that expired.");
+  fprintf(fp, "deti_leases_expired_total %u\n", g_state.leases_expired);
+  metric_header(fp, "deti_wasted_nonces_total", "counter", "Nonces searched twice because of speculation.");
+  fprintf(fp, "deti_wasted_nonces_total %lu\n", (unsigned long)g_state.wasted_nonces);
+  if(!g_relay.enabled)
+  {
+    metric_header(fp, "deti_campaign_nonces_assigned_total", "counter", "Nonces assigned in this run, by campaign.");
+    for(int i = 0; i < g_state.n_campaigns; i++)
+      fprintf(fp, "deti_campaign_nonces_assigned_total{campaign=\"%s\"} %lu\n", g_state.campaigns[i].name,
+              (unsigned long)__atomic_load_n(&g_state.campaigns[i].nonces_assigned, __ATOMIC_RELAXED));
+    metric_header(fp, "deti_campaign_nonces_searched_total", "counter",
+                  "Nonces searched in this run (not counting those searched twice), by campaign.");
+    for(int i = 0; i < g_state.n_campaigns; i++)
+      fprintf(fp, "deti_campaign_nonces_searched_total{campaign=\"%s\"} %lu\n", g_state.campaigns[i].name,
+              (unsigned long)g_state.campaigns[i].nonces_completed);
+    metric_header(fp, "deti_campaign_coins_total", "counter", "Verified coins found in this run, by campaign.");
+    for(int i = 0; i < g_state.n_campaigns; i++)
+      fprintf(fp, "deti_campaign_coins_total{campaign=\"%s\"} %lu\n", g_state.campaigns[i].name,
+              (unsigned long)g_state.campaigns[i].coins_found);
+    metric_header(fp, "deti_campaign_nonces_left", "gauge", "Fresh nonces left in the budget of each bounded campaign.");
+    for(int i = 0; i < g_state.n_campaigns; i++)
+    {
+      uint64_t campaign_cursor = __atomic_load_n(&g_state.campaigns[i].cursor, __ATOMIC_RELAXED);
+      if(g_state.campaigns[i].end_cursor != 0)
+        fprintf(fp, "deti_campaign_nonces_left{campaign=\"%s\"} %lu\n", g_state.campaigns[i].name,
+                (unsigned long)((campaign_cursor < g_state.campaigns[i].end_cursor)
+                                ? g_state.campaigns[i].end_cursor - campaign_cursor : 0));
+    }
+  }
+  if(g_relay.enabled)
+  {
+    metric_header(fp, "deti_relay_connected", "gauge", "Whether the upstream connection is up.");
+    fprintf(fp, "deti_relay_connected %d\n", __atomic_load_n(&g_relay.connected, __ATOMIC_ACQUIRE));
+    metric_header(fp, "deti_relay_ranges_completed_total", "counter", "Upstream ranges searched and reported.");
+    fprintf(fp, "deti_relay_ranges_completed_total %u\n", g_relay.blocks_completed);
+    metric_header(fp, "deti_relay_nonces_unassigned", "gauge", "Nonces of upstream ranges not handed out yet.");
+    fprintf(fp, "deti_relay_nonces_unassigned %lu\n", (unsigned long)relay_nonces_left());
+    metric_header(fp, "deti_relay_coins_forwarded_total", "counter", "Verified coins forwarded upstream.");
+    fprintf(fp, "deti_relay_coins_forwarded_total %lu\n",
+            (unsigned long)__atomic_load_n(&g_relay.coins_forwarded, __ATOMIC_RELAXED));
+    metric_header(fp, "deti_relay_messages_sent_total", "counter", "Messages sent upstream.");
+    fprintf(fp, "deti_relay_messages_sent_total %lu\n",
+            (unsigned long)__atomic_load_n(&g_relay.messages_sent, __ATOMIC_RELAXED));
+  }
+  
+  metric_header(fp, "deti_client_hash_rate", "gauge", "Latest hashes per second of each client (0 if stale).");
+  for(int i = 0; i < MAX_CLIENTS; i++)
+  {
+    client_slot_t *c = &g_state.clients[i];
+    if(!c->in_use)
+      continue;
+    fprintf(fp, "deti_client_hash_rate{client=\"%s\",type=\"", c->addr);
+    metric_label(fp, c->client_type);
+    fprintf(fp, "\",class=\"%s\"} %.0f\n", client_class_name(&g_state.classes[c->class_index]),
+            (now - c->rate_updated_at < RATE_STALE_SECONDS) ? c->hash_rate : 0.0);
+  }
+  metric_header(fp, "deti_client_leases", "gauge", "Outstanding leases of each client.");
+  for(int i = 0; i < MAX_CLIENTS; i++)
+  {
+    client_slot_t *c = &g_state.clients[i];
+    int n_leases = 0;
+    if(!c->in_use)
+      continue;
+    for(int j = 0; j < MAX_CLIENT_LEASES; j++)
+      if(lease_active(&c->leases[j]))
+      {
+        n_leases++;
+        if(!c->leases[j].speculative)
+          outstanding += c->leases[j].end_nonce - c->leases[j].start_nonce - c->leases[j].nonces_done;
+      }
+    fprintf(fp, "deti_client_leases{client=\"%s\"} %d\n", c->addr, n_leases);
+  }
+  pthread_mutex_unlock(&g_state.state_lock);
+  metric_header(fp, "deti_nonces_outstanding", "gauge", "Nonces assigned but not yet reported as searched.");
+  fprintf(fp, "deti_nonces_outstanding %lu\n", (unsigned long)outstanding);
+}
+
+static void serve_metrics_request(int sock)
+{
+  char request[METRICS_REQUEST_SIZE];
+  size_t len = 0;
+  struct timeval timeout = { 2, 0 };
+  
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while(len < sizeof(request) - 1)
+  {
+    ssize_t n = recv(sock, &request[len], sizeof(request) - 1 - len, 0);
+    if(n <= 0)
+      return;
+    len += (size_t)n;
+    request[len] = '\0';
+    if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+      break;
+  }
+  request[len] = '\0';
+  
+  char *body = NULL;
+  size_t body_size = 0;
+  FILE *fp = open_memstream(&body, &body_size);
+  if(fp == NULL)
+    return;
+  const char *status = "200 OK";
+  if(strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0)
+    write_metrics(fp);
+  else
+  {
+    status = "404 Not Found";
+    fputs("try /metrics\n", fp);
+  }
+  fclose(fp);
+  
+  char header[256];
+  int header_len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_size);
+  send_all2(sock, header, (size_t)header_len, body, body_size);
+  free(body);
+}
+
+// one scrape at a time is plenty for a monitoring system
+static void *metrics_server(void *arg)
+{
+  int listen_sock = (int)(intptr_t)arg;
+  
+  while(g_state.running)
+  {
+    int sock = accept(listen_sock, NULL, NULL);
+    if(sock < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+    serve_metrics_request(sock);
+    close(sock);
+  }
+  return NULL;
+}
+
+static int open_metrics_port(int port)
+{
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  int opt = 1;
+  struct sockaddr_in addr;
+  
+  if(sock < 0)
+    return -1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0)
+  {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+//
+// admin socket (-A): a UNIX-domain socket, only for the user running the server, that takes one command per line
+// and answers each with some lines of text and then "ok" or "error: <reason>", e.g. echo pause | nc -U <path>
+//
 
-static void handle_sigint(int sig)
+static const char admin_help[] =
+  "pause                        stop assigning ranges (clients that ask for one wait)\n"
+  "resume                       assign ranges again\n"
+  "set range_seconds <seconds>  size new ranges to take about this long\n"
+  "set min_range <nonces>       smallest range handed out\n"
+  "set max_range <nonces>       largest range handed out\n"
+  "set weight <campaign> <w>    change the share of a campaign (0 pauses it)\n"
+  "clients                      list the connected clients\n"
+  "leases                       list the outstanding leases\n"
+  "drain <client>               no more ranges for a client, which stops its ranges where it has got to\n"
+  "                             (the rest is searched again) and leaves once it asks for one\n"
+  "kick <client>                disconnect a client now (its ranges are searched again)\n"
+  "flush                        verify the queued coins, then flush the vault and save the state file\n"
+  "(a client is given by its number in the clients list or by its address)\n";
+
+// returns the slot of the client, or -1 (called with the state lock held)
+static int admin_find_client(const char *arg)
 {
-  (void)sig;
-  g_shutdown_requested = 1;
-  g_state.running = 0;
+  char *end;
+  long index = strtol(arg, &end, 10);
+  
+  if(end != arg && *end == '\0')
+    return (index >= 0 && index < MAX_CLIENTS && g_state.clients[index].in_use) ? (int)index : -1;
+  for(int i = 0; i < MAX_CLIENTS; i++)
+    if(g_state.clients[i].in_use && strcmp(g_state.clients[i].addr, arg) == 0)
+      return i;
+  return -1;
 }
 
-static int send_message(int sock, message_type_t type, const void *payload, uint32_t payload_len)
+// "set <parameter> <value>" or "set weight <campaign> <w>"; returns NULL on success, or the reason it failed
+static const char *admin_set(char *const *args, int n_args)
 {
-  message_header_t hdr;
-  init_message_header(&hdr, type, payload_len);
+  int weight = n_args > 1 && strcmp(args[1], "weight") == 0;
+  char *end;
   
-  if(payload && payload_len > 0)
-    hdr.checksum = simple_checksum(payload, payload_len);
-  
-  if(send(sock, &hdr, sizeof(hdr), 0) != sizeof(hdr))
-    return -1;
+  if(n_args != (weight ? 4 : 3))
+    return weight ? "usage: set weight <campaign> <w>" : "usage: set <parameter> <value>";
+  const char *value = args[n_args - 1];
+  double x = strtod(value, &end);
+  if(end == value || *end != '\0' || !(x >= 0.0))
+    return "expected a non-negative number";
   
-  if(payload && payload_len > 0)
+  if(weight)
   {
-    if(send(sock, payload, payload_len, 0) != (ssize_t)payload_len)
-      return -1;
+    for(int k = 0; k < g_state.n_campaigns; k++)
+      if(strcmp(g_state.campaigns[k].name, args[2]) == 0)
+      {
+        g_state.campaigns[k].weight = x;
+        return NULL;
+      }
+    return "no such campaign";
   }
-  
-  return 0;
+  if(strcmp(args[1], "range_seconds") == 0 && x > 0.0)
+    g_state.target_range_seconds = x;
+  else if(strcmp(args[1], "min_range") == 0 && x >= (double)RANGE_GRANULE && x <= (double)g_state.max_range_size)
+    g_state.min_range_size = (uint64_t)x;
+  else if(strcmp(args[1], "max_range") == 0 && x >= (double)g_state.min_range_size && x <= (double)MAX_RANGE_SIZE)
+    g_state.max_range_size = (uint64_t)x;
+  else
+    return "unknown parameter, or a value out of range";
+  return NULL;
 }
 
-static int recv_message(int sock, message_header_t *hdr, void *payload, uint32_t max_payload)
+static void admin_list_clients(FILE *out, double now)
 {
-  ssize_t n = recv(sock, hdr, sizeof(*hdr), MSG_WAITALL);
-  if(n != sizeof(*hdr))
-    return -1;
-  
-  if(hdr->magic != PROTOCOL_MAGIC)
+  for(int i = 0; i < MAX_CLIENTS; i++)
   {
-    fprintf(stderr, "Invalid magic: 0x%x\n", hdr->magic);
-    return -1;
-  }
-  
-  if(hdr->version != DETI_PROTOCOL_VERSION)
-  {
-    fprintf(stderr, "Protocol version mismatch: %u\n", hdr->version);
-    return -1;
+    client_slot_t *c = &g_state.clients[i];
+    int n_leases = 0;
+    if(!c->in_use)
+      continue;
+    for(int j = 0; j < MAX_CLIENT_LEASES; j++)
+      n_leases += lease_active(&c->leases[j]);
+    fprintf(out, "%4d [%s] %-24s %-8s %9.2f MH/s  %d leases  %lu nonces  %u coins%s%s%s\n", i, c->addr, c->client_type,
+            client_class_name(&g_state.classes[c->class_index]), c->hash_rate / 1e6, n_leases,
+            (unsigned long)c->nonces_completed, c->coins_verified,
+            (now - c->rate_updated_at < RATE_STALE_SECONDS) ? "" : " (stale)", c->shm ? " (shm)" : "",
+            c->draining ? " (draining)" : "");
   }
-  
-  if(hdr->length > 0)
+}
+
+static void admin_list_leases(FILE *out, double now)
+{
+  for(int i = 0; i < MAX_CLIENTS; i++)
   {
-    if(hdr->length > max_payload)
-    {
-      fprintf(stderr, "Payload too large: %u > %u\n", hdr->length, max_payload);
-      return -1;
-    }
-    
-    n = recv(sock, payload, hdr->length, MSG_WAITALL);
-    if(n != (ssize_t)hdr->length)
-      return -1;
-    
-    uint32_t check = simple_checksum(payload, hdr->length);
-    if(check != hdr->checksum)
+    client_slot_t *c = &g_state.clients[i];
+    if(!c->in_use)
+      continue;
+    for(int j = 0; j < MAX_CLIENT_LEASES; j++)
     {
-      fprintf(stderr, "Checksum mismatch: 0x%x != 0x%x\n", check, hdr->checksum);
-      return -1;
+      lease_t *lease = &c->leases[j];
+      if(!lease_active(lease))
+        continue;
+      fprintf(out, "[%s] work %u: template %u, nonces %lu-%lu, %.1f%% done, deadline in %.0f s%s%s\n", c->addr,
+              lease->work_id, lease->template_id, (unsigned long)lease->start_nonce, (unsigned long)lease->end_nonce,
+              100.0 * (double)lease->nonces_done / (double)(lease->end_nonce - lease->start_nonce),
+              lease->deadline - now, lease->speculative ? " (speculative)" : "", lease->cancelled ? " (cancelled)" : "");
     }
   }
-  
-  return 0;
 }
 
-static void *client_handler(void *arg)
+// the queued coin reports are given some time to be verified (and saved) first
+static void admin_flush(FILE *out)
 {
-  int client_sock = *(int *)arg;
-  free(arg);
-  
-  char client_addr[64];
-  struct sockaddr_in addr;
-  socklen_t addr_len = sizeof(addr);
-  getpeername(client_sock, (struct sockaddr *)&addr, &addr_len);
-  snprintf(client_addr, sizeof(client_addr), "%s:%d", 
-           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-  
-  printf("[%s] Client connected\n", client_addr);
-  
-  pthread_mutex_lock(&g_state.state_lock);
-  g_state.n_clients_connected++;
-  pthread_mutex_unlock(&g_state.state_lock);
-  
-  message_header_t hdr;
-  client_info_t client_info;
+  double give_up = now_seconds() + ADMIN_FLUSH_SECONDS;
   
-  if(recv_message(client_sock, &hdr, &client_info, sizeof(client_info)) < 0 ||
-     hdr.type != MSG_CLIENT_HELLO)
+  while(aad_queue_size(&g_verify_queue) > 0 && now_seconds() < give_up)
+    usleep(10000);
+  if(aad_queue_size(&g_verify_queue) > 0)
+    fprintf(out, "%zu coin reports are still waiting for verification\n", aad_queue_size(&g_verify_queue));
+  pthread_mutex_lock(&g_vault_lock);
+  save_coin(NULL);
+  pthread_mutex_unlock(&g_vault_lock);
+  if(!g_relay.enabled)
   {
-    fprintf(stderr, "[%s] Failed to receive CLIENT_HELLO\n", client_addr);
-    close(client_sock);
-    goto cleanup;
+    if(save_state(g_state_path) == 0)
+      fprintf(out, "state saved to %s\n", g_state_path);
+    else
+      fprintf(out, "could not save the state to %s\n", g_state_path);
   }
+}
+
+static void admin_command(char *line, FILE *out)
+{
+  char command[ADMIN_LINE_SIZE];
+  char *args[4] = { NULL, NULL, NULL, NULL };
+  char *save = NULL;
+  const char *error = NULL;
+  int n_args = 0;
   
-  printf("[%s] Client: %s, type: %s\n", client_addr, 
-         client_info.hostname, client_info.client_type);
-  
-  if(send_message(client_sock, MSG_SERVER_HELLO, NULL, 0) < 0)
+  snprintf(command, sizeof(command), "%s", line);
+  for(char *word = strtok_r(line, " \t\r", &save); word != NULL; word = strtok_r(NULL, " \t\r", &save))
+    if(n_args < 4)
+      args[n_args++] = word;
+    else
+      error = "too many arguments";
+  if(n_args == 0 || error != NULL)
   {
-    fprintf(stderr, "[%s] Failed to send SERVER_HELLO\n", client_addr);
-    close(client_sock);
-    goto cleanup;
+    if(error != NULL)
+      fprintf(out, "error: %s\n", error);
+    return;
   }
   
-  char buffer[8192];
-  while(g_state.running)
+  double now = now_seconds();
+  if(strcmp(args[0], "help") == 0)
+    fputs(admin_help, out);
+  else if(strcmp(args[0], "flush") == 0)
+    admin_flush(out);
+  else
   {
-    if(recv_message(client_sock, &hdr, buffer, sizeof(buffer)) < 0)
+    pthread_mutex_lock(&g_state.state_lock);
+    if(strcmp(args[0], "pause") == 0 || strcmp(args[0], "resume") == 0)
     {
-      fprintf(stderr, "[%s] Connection lost\n", client_addr);
-      break;
+      g_state.paused = args[0][0] == 'p';
+      pthread_cond_broadcast(&g_state.resumed);
     }
-    
-    switch(hdr.type)
+    else if(strcmp(args[0], "set") == 0)
+      error = admin_set(args, n_args);
+    else if(strcmp(args[0], "clients") == 0)
+      admin_list_clients(out, now);
+    else if(strcmp(args[0], "leases") == 0)
+      admin_list_leases(out, now);
+    else if((strcmp(args[0], "drain") == 0 || strcmp(args[0], "kick") == 0) && n_args == 2)
     {
-      case MSG_REQUEST_WORK:
-      {
-        work_assignment_t work;
-        
-        pthread_mutex_lock(&g_state.state_lock);
-        work.work_id = g_state.next_work_id++;
-        work.start_nonce = g_state.next_nonce;
-        work.end_nonce = g_state.next_nonce + WORK_RANGE_SIZE;
-        work.priority = 0;
-        g_state.next_nonce = work.end_nonce;
-        g_state.total_nonces_assigned += WORK_RANGE_SIZE;
-        pthread_mutex_unlock(&g_state.state_lock);
-        
-        printf("[%s] Assigned work %u: nonces %lu-%lu\n", 
-               client_addr, work.work_id, (unsigned long)work.start_nonce, (unsigned long)work.end_nonce);
-        
-        if(send_message(client_sock, MSG_WORK_ASSIGNMENT, &work, sizeof(work)) < 0)
-        {
-          fprintf(stderr, "[%s] Failed to send work assignment\n", client_addr);
-          goto done;
-        }
-        break;
-      }
-      
-      case MSG_REPORT_COIN:
+      int i = admin_find_client(args[1]);
+      if(i < 0)
+        error = "no such client";
+      else if(args[0][0] == 'd')
       {
-        coin_report_t *report = (coin_report_t *)buffer;
-        
-        printf("[%s] *** COIN FOUND *** work_id=%u nonce=%lu zeros=%u\n",
-               client_addr, report->work_id, (unsigned long)report->nonce, report->zeros);
-        
-        printf("    coin: \"");
-        for(int b = 0; b < 55; b++)
-        {
-          unsigned char ch = ((unsigned char *)report->coin_data)[b ^ 3];
-          if(ch >= 32 && ch <= 126) putchar((int)ch); else putchar('?');
-        }
-        printf("\"\n");
-        
-        printf("    sha1: ");
-        for(int h = 0; h < 20; h++)
-          printf("%02x", ((unsigned char *)report->hash)[h ^ 3]);
-        printf("\n");
-        
-        pthread_mutex_lock(&g_state.state_lock);
-        save_coin(report->coin_data);
-        save_coin(NULL);
-        g_state.total_coins_found++;
-        pthread_mutex_unlock(&g_state.state_lock);
-        
-        break;
+        __atomic_store_n(&g_state.clients[i].draining, 1, __ATOMIC_RELEASE);
+        drain_leases(&g_state.clients[i]);
       }
-      
-      case MSG_WORK_COMPLETE:
-      {
-        work_completion_t *completion = (work_completion_t *)buffer;
-        
-        pthread_mutex_lock(&g_state.state_lock);
-        g_state.total_nonces_completed += completion->nonces_tested;
-        pthread_mutex_unlock(&g_state.state_lock);
-        
-        printf("[%s] Work %u complete: %lu nonces in %.2fs (%.0f nonces/sec), %u coins\n",
-               client_addr, completion->work_id, (unsigned long)completion->nonces_tested,
-               completion->elapsed_time, 
-               (double)completion->nonces_tested / completion->elapsed_time,
-               completion->coins_found);
-        break;
+      else
+      { // its handler notices that the connection is gone, and reclaims its leases
+        pthread_mutex_lock(&g_client_links[i].lock);
+        if(g_client_links[i].conn != NULL)
+          shutdown(g_client_links[i].conn->sock, SHUT_RDWR);
+        pthread_mutex_unlock(&g_client_links[i].lock);
       }
-      
-      case MSG_PING:
-        send_message(client_sock, MSG_PONG, NULL, 0);
-        break;
-      
-      default:
-        fprintf(stderr, "[%s] Unknown message type: %u\n", client_addr, hdr.type);
-        break;
     }
+    else
+      error = "unknown command (try help)";
+    pthread_mutex_unlock(&g_state.state_lock);
+    send_pending_cancels();
   }
   
-done:
-  send_message(client_sock, MSG_SHUTDOWN, NULL, 0);
-  close(client_sock);
+  if(error != NULL)
+    fprintf(out, "error: %s\n", error);
+  else
+  {
+    fprintf(out, "ok\n");
+    LOG_ALWAYS("Admin: %s\n", command);
+  }
+}
+
+static void serve_admin_connection(int sock)
+{
+  char line[ADMIN_LINE_SIZE];
+  size_t len = 0;
+  struct timeval timeout = { ADMIN_IDLE_SECONDS, 0 };
   
-cleanup:
-  pthread_mutex_lock(&g_state.state_lock);
-  g_state.n_clients_connected--;
-  pthread_mutex_unlock(&g_state.state_lock);
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  for(;;)
+  {
+    ssize_t n = recv(sock, &line[len], sizeof(line) - 1 - len, 0);
+    if(n <= 0)
+      return;
+    len += (size_t)n;
+    line[len] = '\0';
+    
+    char *newline;
+    while((newline = strchr(line, '\n')) != NULL)
+    {
+      char *reply = NULL;
+      size_t reply_size = 0;
+      FILE *out = open_memstream(&reply, &reply_size);
+      if(out == NULL)
+        return;
+      *newline = '\0';
+      int quit = strcmp(line, "quit") == 0;
+      if(!quit)
+        admin_command(line, out);
+      fclose(out);
+      int sent = send_all(sock, reply, reply_size);
+      free(reply);
+      if(quit || sent < 0)
+        return;
+      len -= (size_t)(newline + 1 - line);
+      memmove(line, newline + 1, len + 1);
+    }
+    if(len == sizeof(line) - 1)
+    {
+      static const char too_long[] = "error: line too long\n";
+      send_all(sock, too_long, sizeof(too_long) - 1);
+      return;
+    }
+  }
+}
+
+// one operator at a time
+static void *admin_server(void *arg)
+{
+  int listen_sock = (int)(intptr_t)arg;
   
-  printf("[%s] Client disconnected\n", client_addr);
+  while(g_state.running)
+  {
+    int sock = accept(listen_sock, NULL, NULL);
+    if(sock < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+    serve_admin_connection(sock);
+    close(sock);
+  }
   return NULL;
 }
 
+// a stale socket left by a server that crashed is replaced, but not one that a running server still answers on
+static int open_admin_socket(const char *path)
+{
+  struct sockaddr_un addr;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  
+  if(sock < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path))
+  {
+    close(sock);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+  {
+    close(probe);
+    close(sock);
+    errno = EADDRINUSE;
+    return -1;
+  }
+  if(probe >= 0)
+    close(probe);
+  struct stat st;
+  if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  mode_t old_mask = umask(0077);
+  int status = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+  if(status < 0 || listen(sock, 4) < 0)
+  {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
 static void *status_reporter(void *arg)
 {
   (void)arg;
   
   while(g_state.running)
   {
-    sleep(10);
+    for(int i = 0; i < 10 && g_state.running; i++)
+      sleep(1);
+    if(!g_state.running)
+      break;
+    
+    double now = now_seconds();
+    
+    thread_counters_t totals;
+    char text[64 * (MAX_LISTED_GAPS + 2)];
     
     pthread_mutex_lock(&g_state.state_lock);
-    printf("\n=== Server Status ===\n");
-    printf("Clients connected: %d\n", g_state.n_clients_connected);
-    printf("Next nonce: %lu\n", (unsigned long)g_state.next_nonce);
-    printf("Total assigned: %lu\n", (unsigned long)g_state.total_nonces_assigned);
-    printf("Total completed: %lu\n", (unsigned long)g_state.total_nonces_completed);
-    printf("Total coins found: %u\n", g_state.total_coins_found);
-    printf("=====================\n\n");
+    expire_leases(now);
+    sum_counters(&totals);
+    uint64_t cursor = __atomic_load_n(&g_state.campaigns[0].cursor, __ATOMIC_RELAXED);
+    
+    LOG_ALWAYS("\n=== Server Status ===\n");
+    LOG_ALWAYS("Clients connected: %d\n", __atomic_load_n(&g_state.n_clients_connected, __ATOMIC_RELAXED));
+    LOG_ALWAYS("Cluster rate: %.2f MH/s\n", cluster_hash_rate(now) / 1e6);
+    if(g_relay.enabled)
+      LOG_ALWAYS("Upstream %s:%d%s: %u ranges received, %u completed, %lu coins forwarded, %lu messages\n",
+                 g_relay.host, g_relay.port, __atomic_load_n(&g_relay.connected, __ATOMIC_ACQUIRE) ? "" : " (disconnected)",
+                 g_relay.blocks_received, g_relay.blocks_completed,
+                 (unsigned long)__atomic_load_n(&g_relay.coins_forwarded, __ATOMIC_RELAXED),
+                 (unsigned long)__atomic_load_n(&g_relay.messages_sent, __ATOMIC_RELAXED));
+    else
+      LOG_ALWAYS("Template %lu, next nonce: %lu\n", (unsigned long)(cursor / g_state.template_span),
+                 (unsigned long)(cursor % g_state.template_span));
+    LOG_ALWAYS("Work requests: %lu\n", (unsigned long)totals.requests);
+    LOG_ALWAYS("Total assigned: %lu\n", (unsigned long)totals.nonces_assigned);
+    LOG_ALWAYS("Total completed: %lu\n", (unsigned long)totals.nonces_completed);
+    LOG_ALWAYS("Reclaimed ranges pending: %d\n", g_state.n_reclaimed);
+    for(int i = 0; i < g_state.n_campaigns && g_state.n_campaigns > 1; i++)
+    {
+      campaign_t *cmp = &g_state.campaigns[i];
+      uint64_t campaign_cursor = __atomic_load_n(&cmp->cursor, __ATOMIC_RELAXED);
+      size_t len = snprintf(text, sizeof(text), "  campaign %-12s weight %4.1f  template %u, next nonce %lu  assigned %lu  "
+                            "searched %lu  coins %lu", cmp->name, cmp->weight, campaign_template(cmp, campaign_cursor),
+                            (unsigned long)(campaign_cursor % g_state.template_span),
+                            (unsigned long)__atomic_load_n(&cmp->nonces_assigned, __ATOMIC_RELAXED),
+                            (unsigned long)cmp->nonces_completed, (unsigned long)cmp->coins_found);
+      if(cmp->end_cursor != 0 && len < sizeof(text))
+        snprintf(&text[len], sizeof(text) - len, "  (%.1f%% of its budget handed out)",
+                 100.0 * (double)((campaign_cursor < cmp->end_cursor) ? campaign_cursor : cmp->end_cursor) /
+                 (double)cmp->end_cursor);
+      LOG_ALWAYS("%s\n", text);
+    }
+    for(int i = 0; i < g_state.n_templates && !g_relay.enabled; i++)
+    {
+      format_coverage(text, sizeof(text), &g_state.coverage[i], 0);
+      LOG_ALWAYS("%s", text);
+    }
+    for(int i = 0; i < MAX_CLIENT_LEASES; i++)
+    {
+      relay_block_t *b = &g_relay.blocks[i];
+      uint64_t size = b->end_nonce - b->start_nonce;
+      if(b->active)
+        LOG_ALWAYS("  upstream work %u: template %u, nonces %lu-%lu, %.1f%% handed out, %.1f%% searched\n",
+                   b->work_id, b->template_id, (unsigned long)b->start_nonce, (unsigned long)b->end_nonce,
+                   100.0 * (double)(b->next_nonce - b->start_nonce) / (double)size,
+                   100.0 * (double)b->done.covered / (double)size);
+    }
+    LOG_ALWAYS("Leases expired: %u\n", g_state.leases_expired);
+    LOG_ALWAYS("Speculative tails: %u (%u won by the duplicate), %lu nonces duplicated, %lu wasted\n",
+               g_state.speculations, g_state.speculations_won, (unsigned long)g_state.speculative_nonces,
+               (unsigned long)g_state.wasted_nonces);
+    LOG_ALWAYS("Total coins found: %lu\n", (unsigned long)totals.coins_found);
+    LOG_ALWAYS("Bogus reports: %lu\n", (unsigned long)totals.bogus_reports);
+    LOG_ALWAYS("Verification queue: %zu\n", aad_queue_size(&g_verify_queue));
+    for(int i = 0; i < g_state.n_classes; i++)
+    {
+      client_class_t *cls = &g_state.classes[i];
+      uint64_t assigned = __atomic_load_n(&cls->nonces_assigned, __ATOMIC_RELAXED);
+      if(cls->n_clients > 0 || assigned > 0)
+        LOG_ALWAYS("  class %-10s weight %4.1f  priority %u  clients %3d  assigned %lu (%.1f%%)\n",
+                   client_class_name(cls), cls->weight, cls->priority, cls->n_clients, (unsigned long)assigned,
+                   (totals.nonces_assigned > 0) ? 100.0 * (double)assigned / (double)totals.nonces_assigned : 0.0);
+    }
+    for(int i = 0; i < MAX_CLIENTS; i++)
+    {
+      client_slot_t *c = &g_state.clients[i];
+      if(!c->in_use)
+        continue;
+      size_t len = snprintf(text, sizeof(text), "  [%s] %-24s %-8s %9.2f MH/s  coins %u  bogus %u%s%s", c->addr,
+                            c->client_type, client_class_name(&g_state.classes[c->class_index]), c->hash_rate / 1e6,
+                            c->coins_verified, c->bogus_reports,
+                            (now - c->rate_updated_at < RATE_STALE_SECONDS) ? "" : " (stale)", c->shm ? " (shm)" : "");
+      for(int j = 0; j < MAX_CLIENT_LEASES && len < sizeof(text); j++)
+      {
+        lease_t *lease = &c->leases[j];
+        if(lease_active(lease) && lease->cancelled)
+          len += snprintf(&text[len], sizeof(text) - len, "  work %u cancelled", lease->work_id);
+        else if(lease_active(lease))
+          len += snprintf(&text[len], sizeof(text) - len, "  work %u %.1f%%%s", lease->work_id,
+                          100.0 * (double)lease->nonces_done / (double)(lease->end_nonce - lease->start_nonce),
+                          lease->speculative ? " (speculative)" : "");
+      }
+      LOG_ALWAYS("%s\n", text);
+    }
+    LOG_ALWAYS("=====================\n\n");
     pthread_mutex_unlock(&g_state.state_lock);
+    if(!g_relay.enabled)
+      save_state(g_state_path);
   }
   
   return NULL;
@@ -268,26 +3529,186 @@ int main(int argc, char **argv)
 {
   int port = DETI_DEFAULT_PORT;
   uint64_t start_nonce = 0;
+  double target_range_seconds = DEFAULT_TARGET_RANGE_SECONDS;
+  int n_verify_workers = DEFAULT_VERIFY_WORKERS;
+  int query_only = 0;
+  uint64_t end_nonce = 0;
+  uint64_t template_span = DEFAULT_TEMPLATE_SPAN;
+  double log_rate = DEFAULT_LOG_RATE;
+  int metrics_port = 0;
+  const char *admin_path = NULL;
+  
+  memset(&g_state, 0, sizeof(g_state));
+  snprintf(g_state.campaigns[0].name, sizeof(g_state.campaigns[0].name), "default");
+  g_state.campaigns[0].weight = 1.0;
+  g_state.n_campaigns = 1;
+  
+  int pos_arg_index = 0;
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      target_range_seconds = atof(argv[++i]);
+    else if(strcmp(argv[i], "-v") == 0 && i + 1 < argc)
+      n_verify_workers = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+      g_state_path = argv[++i];
+    else if(strcmp(argv[i], "-q") == 0)
+      query_only = 1;
+    else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+      end_nonce = strtoull(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      template_span = strtoull(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+      log_rate = atof(argv[++i]);
+    else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+      metrics_port = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-D") == 0)
+      g_dry_run = 1;
+    else if(strcmp(argv[i], "-A") == 0 && i + 1 < argc)
+      admin_path = argv[++i];
+    else if(strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+    {
+      if(parse_upstream(argv[++i]) < 0)
+      {
+        fprintf(stderr, "Bad upstream server \"%s\" (expected host:port)\n", argv[i]);
+        return 1;
+      }
+    }
+    else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+    {
+      if(parse_client_class(argv[++i]) < 0)
+      {
+        fprintf(stderr, "Bad client class \"%s\" (expected pattern[@threads]=weight[:priority])\n", argv[i]);
+        return 1;
+      }
+    }
+    else if(strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+    {
+      if(parse_campaign(argv[++i]) < 0)
+      {
+        fprintf(stderr, "Bad campaign \"%s\" (expected name[:weight[:budget[:custom string]]], with at most %d "
+                "printable characters in the string, none for the default campaign)\n", argv[i], MAX_CAMPAIGN_STRING);
+        return 1;
+      }
+    }
+    else if(pos_arg_index == 0)
+    {
+      port = atoi(argv[i]);
+      pos_arg_index++;
+    }
+    else if(pos_arg_index == 1)
+    {
+      start_nonce = strtoull(argv[i], NULL, 10);
+      pos_arg_index++;
+    }
+  }
+  
+  if(g_relay.enabled && g_state.n_campaigns > 1)
+  {
+    fprintf(stderr, "A relay searches the campaigns of its upstream server, -C is not for relays\n");
+    return 1;
+  }
+  add_default_client_classes();
+  g_state.template_span = (template_span > 0) ? template_span : DEFAULT_TEMPLATE_SPAN;
+  g_state.campaigns[0].cursor = start_nonce;
+  // (a campaign that runs out of template ids is done, rather than going on into those of the next one: with
+  // more than one campaign they are all bounded by that, and take_fresh_range() stops an open-ended one)
+  for(int k = 0; k < g_state.n_campaigns && g_state.n_campaigns > 1 && g_state.template_span < (1ULL << 40); k++)
+  {
+    uint64_t limit = g_state.template_span << CAMPAIGN_TEMPLATE_BITS;
+    if(g_state.campaigns[k].end_cursor == 0 || g_state.campaigns[k].end_cursor > limit)
+      g_state.campaigns[k].end_cursor = limit;
+  }
+  
+  // the positional starting nonce only applies to a fresh search (a relay has no search of its own, so
+  // it neither starts one nor keeps a state file)
+  int loaded = g_relay.enabled ? 0 : load_state(g_state_path);
+  if(loaded < 0)
+  {
+    fprintf(stderr, "%s: corrupt state file\n", g_state_path);
+    return 1;
+  }
+  uint32_t current_template = (uint32_t)(g_state.campaigns[0].cursor / g_state.template_span);
+  if(!g_relay.enabled && g_state.campaigns[0].cursor / g_state.template_span < (1ULL << CAMPAIGN_TEMPLATE_BITS))
+    coverage_for(current_template, loaded ? 0 : start_nonce % g_state.template_span);
+  if(end_nonce != 0 && !g_relay.enabled)
+    g_state.campaigns[0].end_cursor = (uint64_t)current_template * g_state.template_span + end_nonce;
+  
+  thread_counters_t totals;
+  if(query_only)
+  {
+    sum_counters(&totals);
+    printf("State file: %s%s\n", g_state_path, loaded ? "" : " (not found)");
+    printf("Template %u, next nonce: %lu\n", current_template,
+           (unsigned long)(g_state.campaigns[0].cursor % g_state.template_span));
+    printf("Total completed: %lu\n", (unsigned long)totals.nonces_completed);
+    for(int i = 0; i < g_state.n_templates; i++)
+      print_coverage(&g_state.coverage[i], 1);
+    return 0;
+  }
   
-  if(argc > 1)
-    port = atoi(argv[1]);
-  if(argc > 2)
-    start_nonce = strtoull(argv[2], NULL, 10);
+  reclaim_coverage_gaps();
   
   printf("DETI Coin Search Server\n");
   printf("=======================\n");
   printf("Port: %d\n", port);
-  printf("Starting nonce: %lu\n", (unsigned long)start_nonce);
+  if(g_relay.enabled)
+    printf("Relaying for %s:%d\n", g_relay.host, g_relay.port);
+  else
+  {
+    if(loaded)
+      printf("Resuming from %s: template %u, next nonce %lu, %d ranges to search again\n", g_state_path, current_template,
+             (unsigned long)(g_state.campaigns[0].cursor % g_state.template_span), g_state.n_reclaimed);
+    else
+      printf("Starting nonce: %lu\n", (unsigned long)start_nonce);
+    if(end_nonce != 0)
+      printf("Search ends at nonce %lu of template %u\n", (unsigned long)end_nonce, current_template);
+    else
+      printf("Nonces per template: %lu\n", (unsigned long)g_state.template_span);
+    for(int k = 0; k < g_state.n_campaigns && g_state.n_campaigns > 1; k++)
+    {
+      campaign_t *cmp = &g_state.campaigns[k];
+      printf("Campaign %s: weight %.1f, template %u, next nonce %lu", cmp->name, cmp->weight,
+             campaign_template(cmp, cmp->cursor), (unsigned long)(cmp->cursor % g_state.template_span));
+      if(cmp->end_cursor != 0)
+        printf(", %lu nonces left of its budget",
+               (unsigned long)((cmp->cursor < cmp->end_cursor) ? cmp->end_cursor - cmp->cursor : 0));
+      if(cmp->custom_string[0] != '\0')
+        printf(", string \"%s\"", cmp->custom_string);
+      printf("\n");
+    }
+  }
+  printf("Target range duration: %.0f s\n", target_range_seconds);
+  printf("Verification workers: %d (%d lanes)\n", n_verify_workers, VERIFY_LANES);
+  printf("Log rate limit: %.0f lines/s\n", log_rate);
+  if(metrics_port > 0)
+    printf("Metrics: http://localhost:%d/metrics\n", metrics_port);
+  if(admin_path != NULL)
+    printf("Admin socket: %s\n", admin_path);
+  if(g_dry_run)
+    printf("Dry run: verified coins are not saved to the vault\n");
   printf("\n");
   
-  memset(&g_state, 0, sizeof(g_state));
-  g_state.next_nonce = start_nonce;
+  g_state.target_range_seconds = target_range_seconds;
+  g_state.min_range_size = MIN_RANGE_SIZE;
+  g_state.max_range_size = MAX_RANGE_SIZE;
   g_state.running = 1;
   pthread_mutex_init(&g_state.state_lock, NULL);
+  pthread_cond_init(&g_state.resumed, NULL);
+  for(int i = 0; i < MAX_CLIENTS; i++)
+    pthread_mutex_init(&g_client_links[i].lock, NULL);
   
   signal(SIGINT, handle_sigint);
   signal(SIGPIPE, SIG_IGN);
   
+  if(g_relay.enabled)
+  {
+    if(relay_connect() < 0)
+      return 1;
+    printf("Connected to the upstream server %s:%d%s\n", g_relay.host, g_relay.port,
+           (g_relay.frame_version == DETI_FRAME_VERSION_CRC32C) ? " (crc32c frames)" : "");
+  }
+  
   int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
   if(listen_sock < 0)
   {
@@ -320,23 +3741,100 @@ int main(int argc, char **argv)
   
   printf("Server listening on port %d\n", port);
   printf("Waiting for clients...\n\n");
+  fflush(stdout);
+  
+  if(aad_log_init(LOG_QUEUE_CAPACITY, log_rate) < 0)
+  {
+    fprintf(stderr, "Failed to start the logger\n");
+    close(listen_sock);
+    return 1;
+  }
+  if(n_verify_workers < 1)
+    n_verify_workers = 1;
+  if(n_verify_workers > MAX_VERIFY_WORKERS)
+    n_verify_workers = MAX_VERIFY_WORKERS;
+  if(aad_queue_init(&g_verify_queue, VERIFY_QUEUE_CAPACITY, sizeof(verify_item_t)) < 0)
+  {
+    fprintf(stderr, "Failed to allocate the verification queue\n");
+    close(listen_sock);
+    return 1;
+  }
+  sem_init(&g_verify_wakeup, 0, 0);
+  __atomic_store_n(&g_verify_running, 1, __ATOMIC_RELEASE);
+  pthread_t *verify_threads = malloc((size_t)n_verify_workers * sizeof(pthread_t));
+  for(int i = 0; i < n_verify_workers; i++)
+    pthread_create(&verify_threads[i], NULL, verify_worker, (void *)(intptr_t)i);
+  
+  pthread_t upstream_thread;
+  if(g_relay.enabled)
+  {
+    if(aad_queue_init(&g_relay.coins, RELAY_COIN_QUEUE_CAPACITY, sizeof(coin_report_t)) < 0)
+    {
+      fprintf(stderr, "Failed to allocate the relay queue\n");
+      close(listen_sock);
+      return 1;
+    }
+    pthread_cond_init(&g_relay.work_ready, NULL);
+    g_relay.listen_sock = listen_sock;
+    __atomic_store_n(&g_relay.running, 1, __ATOMIC_RELEASE);
+    pthread_create(&upstream_thread, NULL, relay_upstream, NULL);
+  }
   
   pthread_t status_thread;
   pthread_create(&status_thread, NULL, status_reporter, NULL);
   
+  int metrics_sock = -1;
+  if(metrics_port > 0)
+  {
+    metrics_sock = open_metrics_port(metrics_port);
+    if(metrics_sock < 0)
+      LOG_ERROR("Cannot listen for metrics on port %d: %s\n", metrics_port, strerror(errno));
+    else
+    {
+      pthread_t metrics_thread;
+      pthread_create(&metrics_thread, NULL, metrics_server, (void *)(intptr_t)metrics_sock);
+      pthread_detach(metrics_thread);
+    }
+  }
+  
+  int admin_sock = -1;
+  if(admin_path != NULL)
+  {
+    admin_sock = open_admin_socket(admin_path);
+    if(admin_sock < 0)
+      LOG_ERROR("Cannot open the admin socket %s: %s\n", admin_path, strerror(errno));
+    else
+    {
+      pthread_t admin_thread;
+      pthread_create(&admin_thread, NULL, admin_server, (void *)(intptr_t)admin_sock);
+      pthread_detach(admin_thread);
+    }
+  }
+  
   while(g_state.running)
   {
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     
+    // SIGINT may interrupt any thread, so accept() is not left waiting for a connection that never comes
+    struct pollfd pfd = { .fd = listen_sock, .events = POLLIN, .revents = 0 };
+    if(poll(&pfd, 1, ACCEPT_POLL_MS) <= 0)
+      continue;
     int client_sock = accept(listen_sock, (struct sockaddr *)&client_addr, &client_len);
     if(client_sock < 0)
     {
-      if(errno == EINTR)
+      if(errno == EINTR || !g_state.running)
         continue;
       perror("accept");
       break;
     }
+    set_tcp_nodelay(client_sock);
+    if(handler_register(client_sock) < 0)
+    {
+      LOG_ERROR("Too many connections, one refused\n");
+      close(client_sock);
+      continue;
+    }
     
     pthread_t thread;
     int *sock_ptr = malloc(sizeof(int));
@@ -345,20 +3843,65 @@ int main(int argc, char **argv)
     pthread_detach(thread);
   }
   
-  printf("\nShutdown requested, waiting for clients to disconnect...\n");
+  LOG_ALWAYS("\nShutdown requested, waiting for clients to disconnect...\n");
+  close(listen_sock);
   
-  for(int i = 0; i < 50 && g_state.n_clients_connected > 0; i++)
+  for(int i = 0; i < 50 && __atomic_load_n(&g_state.n_clients_connected, __ATOMIC_RELAXED) > 0; i++)
   {
     usleep(100000);
   }
   
-  close(listen_sock);
+  // the clients still connected are cut off; nothing the handlers use goes away before the last one has exited
+  stop_handlers();
+  pthread_join(status_thread, NULL);
+  if(metrics_sock >= 0)
+    shutdown(metrics_sock, SHUT_RDWR);
+  if(admin_sock >= 0)
+  {
+    shutdown(admin_sock, SHUT_RDWR);
+    unlink(admin_path);
+  }
+  
+  __atomic_store_n(&g_verify_running, 0, __ATOMIC_RELEASE);
+  for(int i = 0; i < n_verify_workers; i++)
+    sem_post(&g_verify_wakeup);
+  for(int i = 0; i < n_verify_workers; i++)
+    pthread_join(verify_threads[i], NULL);
+  free(verify_threads);
+  sem_destroy(&g_verify_wakeup);
+  aad_queue_destroy(&g_verify_queue);
+  if(g_relay.enabled)
+    relay_stop(upstream_thread);
+  
+  aad_log_shutdown();
+  if(!g_relay.enabled && save_state(g_state_path) == 0)
+    printf("State saved to %s\n", g_state_path);
   pthread_mutex_destroy(&g_state.state_lock);
   
+  sum_counters(&totals);
   printf("\nFinal statistics:\n");
-  printf("Total nonces assigned: %lu\n", (unsigned long)g_state.total_nonces_assigned);
-  printf("Total nonces completed: %lu\n", (unsigned long)g_state.total_nonces_completed);
-  printf("Total coins found: %u\n", g_state.total_coins_found);
+  printf("Work requests: %lu\n", (unsigned long)totals.requests);
+  printf("Total nonces assigned: %lu\n", (unsigned long)totals.nonces_assigned);
+  printf("Total nonces completed: %lu\n", (unsigned long)totals.nonces_completed);
+  printf("Total coins found: %lu\n", (unsigned long)totals.coins_found);
+  printf("Bogus reports: %lu\n", (unsigned long)totals.bogus_reports);
+  printf("Speculative tails: %u (%u won by the duplicate), %lu nonces wasted\n",
+         g_state.speculations, g_state.speculations_won, (unsigned long)g_state.wasted_nonces);
+  if(g_relay.enabled)
+    printf("Upstream: %u ranges received, %u completed, %lu coins forwarded, %lu messages sent\n",
+           g_relay.blocks_received, g_relay.blocks_completed, (unsigned long)g_relay.coins_forwarded,
+           (unsigned long)g_relay.messages_sent);
+  for(int k = 0; k < g_state.n_campaigns && g_state.n_campaigns > 1; k++)
+    printf("Campaign %s: %lu nonces assigned, %lu searched, %lu coins\n", g_state.campaigns[k].name,
+           (unsigned long)g_state.campaigns[k].nonces_assigned, (unsigned long)g_state.campaigns[k].nonces_completed,
+           (unsigned long)g_state.campaigns[k].coins_found);
+  for(int i = 0; i < g_state.n_templates; i++)
+  {
+    if(!g_relay.enabled)
+      print_coverage(&g_state.coverage[i], 0);
+    aad_interval_set_destroy(&g_state.coverage[i].done);
+  }
+  free(g_state.coverage);
   
   return 0;
 }
@@ -1,13 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 #include <omp.h>
 #include "aad_data_types.h"
 #include "aad_utilities.h"
 #include "aad_sha1_cpu.h"
 #include "aad_vault.h"
+#include "aad_affinity.h"
+#include "aad_tuning.h"
+#include "aad_arena.h"
 
 static volatile sig_atomic_t stop_requested = 0;
 
@@ -32,6 +37,91 @@ static void handle_sigint(int sig)
 #endif
 
 #define BATCH_SIZE 256
+#define REPORT_SECONDS 1.0
+#define PROGRAM "simd_openmp_search"
+
+// how the search runs (the defaults, or what the tuning profile of the host or the command line says)
+typedef struct
+{
+  int batch_size;   // messages per lane between two updates of the nonces
+  int streams;      // 1: a message word is one vector of N_LANES lanes, 2: two of them, hashed side by side
+  int threads;
+}
+search_params_t;
+
+// what a hashing thread has done so far; each thread only writes its own, with plain stores, and the reporter
+// reads them without locks (a cache line each, so that the threads never share one)
+typedef struct
+{
+  unsigned long long hashes;
+  unsigned long long coins;
+  unsigned long long nonce;   // the next base nonce
+  unsigned long long ns;      // when hashes was last updated (CLOCK_MONOTONIC)
+  unsigned long long tlb_misses;
+}
+__attribute__((aligned(64))) thread_stats_t;
+
+static thread_stats_t *stats;
+static int n_stats;
+static volatile int reporter_running;
+
+static unsigned long long monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static unsigned long long total_stat(size_t offset)
+{
+  unsigned long long total = 0ULL;
+  for(int t = 0; t < n_stats; ++t)
+    total += __atomic_load_n((unsigned long long *)((char *)&stats[t] + offset), __ATOMIC_RELAXED);
+  return total;
+}
+
+// prints the speed every REPORT_SECONDS, summing the rate of each thread over its own last interval (so that
+// neither the hashing threads nor the time at which the reporter wakes up change it)
+static void *reporter(void *arg)
+{
+  unsigned long long *last_hashes = (unsigned long long *)calloc((size_t)n_stats, sizeof(unsigned long long));
+  unsigned long long *last_ns = (unsigned long long *)calloc((size_t)n_stats, sizeof(unsigned long long));
+  unsigned long long start_ns = monotonic_ns();
+  struct timespec tick = { 0, 100000000L };
+  (void)arg;
+
+  if(last_hashes == NULL || last_ns == NULL)
+    return NULL;
+  for(int t = 0; t < n_stats; ++t)
+    last_ns[t] = start_ns;
+  unsigned long long next_report = start_ns + (unsigned long long)(REPORT_SECONDS * 1e9);
+  while(reporter_running)
+  {
+    nanosleep(&tick, NULL);
+    if(monotonic_ns() < next_report)
+      continue;
+    next_report += (unsigned long long)(REPORT_SECONDS * 1e9);
+
+    double fps = 0.0;
+    for(int t = 0; t < n_stats; ++t)
+    {
+      unsigned long long ns = __atomic_load_n(&stats[t].ns, __ATOMIC_ACQUIRE);
+      unsigned long long hashes = __atomic_load_n(&stats[t].hashes, __ATOMIC_RELAXED);
+      if(ns > last_ns[t])
+        fps += (double)(hashes - last_hashes[t]) / ((double)(ns - last_ns[t]) * 1e-9);
+      last_hashes[t] = hashes;
+      last_ns[t] = (ns > last_ns[t]) ? ns : last_ns[t];
+    }
+    fprintf(stderr, "Speed: %.2f MH/s (%.2f M/min) | Nonce: %llx | Coins: %llu\n",
+            fps / 1000000.0,
+            (fps * 60.0) / 1000000.0,
+            __atomic_load_n(&stats[0].nonce, __ATOMIC_RELAXED),
+            total_stat(offsetof(thread_stats_t, coins)));
+  }
+  free(last_hashes);
+  free(last_ns);
+  return NULL;
+}
 
 static inline void to_base95_10(unsigned long long value, u08_t digits[10])
 {
@@ -59,248 +149,453 @@ static inline int base95_add(u08_t digits[10], unsigned long long delta)
   return highest_changed;
 }
 
-static inline void write_lane_byte(u32_t interleaved_data[14][N_LANES], int lane, int offset, u08_t value)
+static inline void write_lane_byte(int lanes, u32_t interleaved_data[14][lanes], int lane, int offset, u08_t value)
 {
   u08_t *word_bytes = (u08_t *)&interleaved_data[offset / 4][lane];
   word_bytes[(offset & 3) ^ 3] = value;
 }
 
-static inline void write_nonce_bytes(u32_t interleaved_data[14][N_LANES], int lane, const u08_t digits[10], int max_digit)
+static inline void write_nonce_bytes(int lanes, u32_t interleaved_data[14][lanes], int lane, const u08_t digits[10], int max_digit)
 {
   if(max_digit < 0) return;
   if(max_digit > 9) max_digit = 9;
   for(int j = 0; j <= max_digit; ++j)
-    write_lane_byte(interleaved_data, lane, 12 + j, (u08_t)(digits[j] + 32u));
+    write_lane_byte(lanes, interleaved_data, lane, 12 + j, (u08_t)(digits[j] + 32u));
 }
 
-static inline void gather_lane_words(u32_t dst[14], u32_t interleaved_data[14][N_LANES], int lane)
+static inline void gather_lane_words(int lanes, u32_t dst[14], u32_t interleaved_data[14][lanes], int lane)
 {
   for(int idx = 0; idx < 14; ++idx)
     dst[idx] = interleaved_data[idx][lane];
 }
 
-int main(int argc, char **argv)
+// the dual stream kernel: a message word is a vector of 2 * N_LANES lanes, which the compiler splits into two
+// native vectors, so every step of the hash comes as two independent instructions the core can overlap
+typedef u32_t dual_t __attribute__((vector_size(2 * N_LANES * sizeof(u32_t))));
+
+static void sha1_dual(dual_t *interleaved_data, dual_t *interleaved_hash)
 {
-  unsigned long long n_batches = 0ULL;
-  const char *custom_string = NULL;
-  int custom_string_len = 0;
+# define T            dual_t
+# define C(c)         ((dual_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  (((x) << (n)) | ((x) >> (32 - (n))))
+# define DATA(idx)    interleaved_data[idx]
+# define HASH(idx)    interleaved_hash[idx]
+  CUSTOM_SHA1_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef HASH
+}
 
-  for(int i = 1; i < argc; ++i)
+static const char *custom_string = NULL;
+static int custom_string_len = 0;
+static const char *policy = NULL;
+static aad_placement_t placement;
+static const char *page_mode = "hugetlb";
+static int *thread_cpu;
+static int *buffer_node;
+static int *buffer_pages;        // what backs the batch buffers of each thread (AAD_ARENA_*)
+static volatile int tlb_counted; // cleared if a thread could not count its dTLB misses
+
+static void report_placement(int nth)
+{
+  fprintf(stderr, "Placement: %s, %d CPUs, %d packages, %d nodes, %d cores, %d threads per core\n", placement.policy,
+          placement.n_cpus, placement.n_packages, placement.n_nodes, placement.n_cores, placement.smt);
+  for(int t = 0; t < nth; ++t)
   {
-    if(argv[i][0] == '-' && argv[i][1] == 's' && i + 1 < argc)
-    {
-      custom_string = argv[i + 1];
-      custom_string_len = (int)strlen(custom_string);
-      if(custom_string_len > 32)
-        custom_string_len = 32;
-      ++i;
-    }
-    else if(argv[i][0] != '-')
-    {
-      n_batches = strtoull(argv[i], NULL, 10);
-    }
+    const aad_cpu_t *c = aad_placement_cpu(&placement, t);
+    fprintf(stderr, "  thread %3d: cpu %3d%s  node %d  package %d  core %3d  smt %d  buffers on node %d (%s pages)\n", t, c->cpu,
+            (thread_cpu[t] < 0) ? " (not pinned)" : "", c->node, c->package, c->core, c->smt, buffer_node[t],
+            aad_arena_kind_name(buffer_pages[t]));
   }
+}
 
-  (void)signal(SIGINT, handle_sigint);
-
+// the work of one thread; lanes is a constant at each call, so that each stream count gets its own code
+static inline __attribute__((always_inline)) void search_thread(const int lanes, int batch_size, unsigned long long n_batches,
+                                                                 unsigned long long deadline_ns, int report)
+{
+  const int tid = omp_get_thread_num();
+  const int nth = omp_get_num_threads();
   const char *hdr = "DETI coin 2 ";
 
-  time_measurement();
-  double total_elapsed_time = 0.0;
-  unsigned long long total_iterations = 0ULL;
-  unsigned long long last_report_iter = 0ULL;
-  unsigned long long global_batches = 0ULL;
-  unsigned long long coins_found = 0ULL;
-
-  #pragma omp parallel
+  const size_t data_size = (size_t)batch_size * sizeof(u32_t[14][lanes]);
+  const size_t hash_size = (size_t)batch_size * sizeof(u32_t[5][lanes]);
+  // (the dual stream kernel takes the rows of the buffers as dual_t, which is 128-byte aligned with AVX-512)
+  const size_t alignment = (_Alignof(dual_t) > 64) ? _Alignof(dual_t) : 64;
+  aad_arena_t arena;
+  if(aad_arena_init(&arena, data_size + hash_size + 2 * alignment, page_mode) < 0)
+  {
+    fprintf(stderr, "Failed to allocate the batch buffers of thread %d\n", tid);
+    exit(1);
+  }
+  u32_t (*interleaved_data)[14][lanes] = (u32_t (*)[14][lanes])aad_arena_alloc(&arena, data_size, alignment);
+  u32_t (*interleaved_hash)[5][lanes] = (u32_t (*)[5][lanes])aad_arena_alloc(&arena, hash_size, alignment);
+  buffer_node[tid] = aad_page_node(interleaved_data);
+  buffer_pages[tid] = arena.kind;
+
+  #pragma omp barrier
+  #pragma omp master
+  if(report)
+    report_placement(nth);
+
+  u08_t ascii95_lut[256];
+  for(int i = 0; i < 256; ++i)
+    ascii95_lut[i] = (u08_t)((i % 95) + 32);
+
+  u08_t static_tail[lanes][32];
+  for(int lane = 0; lane < lanes; ++lane)
   {
-    const int tid = omp_get_thread_num();
-    const int nth = omp_get_num_threads();
+    for(int j = 0; j < 32; ++j)
+      static_tail[lane][j] = ascii95_lut[random_byte()];
+    
+    if(custom_string != NULL)
+    {
+      for(int j = 0; j < custom_string_len; ++j)
+        static_tail[lane][j] = (u08_t)custom_string[j];
+    }
+  }
 
-    u32_t interleaved_data[BATCH_SIZE][14][N_LANES] __attribute__((aligned(64)));
-    u32_t interleaved_hash[BATCH_SIZE][5][N_LANES] __attribute__((aligned(64)));
+  unsigned long long thread_seed = (unsigned long long)time(NULL) ^ (0x9E3779B97F4A7C15ULL * (unsigned long long)(tid + 1));
+  unsigned long long base_nonce = ((thread_seed & 0xFFFFFFFFULL) << 32) | ((thread_seed >> 32) & 0xFFFFFFFFULL);
+  base_nonce = base_nonce + (unsigned long long)tid * 0x100000000ULL;
 
-    u08_t ascii95_lut[256];
-    for(int i = 0; i < 256; ++i)
-      ascii95_lut[i] = (u08_t)((i % 95) + 32);
+  for(int batch_idx = 0; batch_idx < batch_size; ++batch_idx)
+  {
+    for(int idx = 0; idx < 14; ++idx)
+      for(int lane = 0; lane < lanes; ++lane)
+        interleaved_data[batch_idx][idx][lane] = 0u;
 
-    u08_t static_tail[N_LANES][32];
-    for(int lane = 0; lane < N_LANES; ++lane)
+    for(int lane = 0; lane < lanes; ++lane)
     {
-      for(int j = 0; j < 32; ++j)
-        static_tail[lane][j] = ascii95_lut[random_byte()];
-      
+      for(int k = 0; k < 12; ++k)
+        write_lane_byte(lanes, interleaved_data[batch_idx], lane, k, (u08_t)hdr[k]);
+
       if(custom_string != NULL)
       {
-        for(int j = 0; j < custom_string_len; ++j)
-          static_tail[lane][j] = (u08_t)custom_string[j];
+        for(int j = 0; j < custom_string_len && j < 32; ++j)
+          write_lane_byte(lanes, interleaved_data[batch_idx], lane, 12 + j, (u08_t)custom_string[j]);
+        for(int j = custom_string_len; j < 32; ++j)
+          write_lane_byte(lanes, interleaved_data[batch_idx], lane, 12 + j, static_tail[lane][j]);
       }
-    }
-
-    unsigned long long thread_seed = (unsigned long long)time(NULL) ^ (0x9E3779B97F4A7C15ULL * (unsigned long long)(tid + 1));
-    unsigned long long base_nonce = ((thread_seed & 0xFFFFFFFFULL) << 32) | ((thread_seed >> 32) & 0xFFFFFFFFULL);
-    base_nonce = base_nonce + (unsigned long long)tid * 0x100000000ULL;
-
-    for(int batch_idx = 0; batch_idx < BATCH_SIZE; ++batch_idx)
-    {
-      for(int idx = 0; idx < 14; ++idx)
-        for(int lane = 0; lane < N_LANES; ++lane)
-          interleaved_data[batch_idx][idx][lane] = 0u;
-
-      for(int lane = 0; lane < N_LANES; ++lane)
+      else
       {
-        for(int k = 0; k < 12; ++k)
-          write_lane_byte(interleaved_data[batch_idx], lane, k, (u08_t)hdr[k]);
-
-        if(custom_string != NULL)
-        {
-          for(int j = 0; j < custom_string_len && j < 32; ++j)
-            write_lane_byte(interleaved_data[batch_idx], lane, 12 + j, (u08_t)custom_string[j]);
-          for(int j = custom_string_len; j < 32; ++j)
-            write_lane_byte(interleaved_data[batch_idx], lane, 12 + j, static_tail[lane][j]);
-        }
-        else
-        {
-          for(int j = 0; j < 32; ++j)
-            write_lane_byte(interleaved_data[batch_idx], lane, 12 + j, static_tail[lane][j]);
-        }
-
-        write_lane_byte(interleaved_data[batch_idx], lane, 54, (u08_t)'\n');
-        write_lane_byte(interleaved_data[batch_idx], lane, 55, (u08_t)0x80);
+        for(int j = 0; j < 32; ++j)
+          write_lane_byte(lanes, interleaved_data[batch_idx], lane, 12 + j, static_tail[lane][j]);
       }
-    }
 
-    u08_t lane_digits[N_LANES][10];
-    for(int lane = 0; lane < N_LANES; ++lane)
-    {
-      unsigned long long lane_nonce = base_nonce + (unsigned long long)lane;
-      to_base95_10(lane_nonce, lane_digits[lane]);
+      write_lane_byte(lanes, interleaved_data[batch_idx], lane, 54, (u08_t)'\n');
+      write_lane_byte(lanes, interleaved_data[batch_idx], lane, 55, (u08_t)0x80);
     }
+  }
 
-    const unsigned long long stride = (unsigned long long)N_LANES * (unsigned long long)nth;
-    unsigned long long batches_done = 0ULL;
-    unsigned long long local_coins_found = 0ULL;
+  u08_t lane_digits[lanes][10];
+  for(int lane = 0; lane < lanes; ++lane)
+  {
+    unsigned long long lane_nonce = base_nonce + (unsigned long long)lane;
+    to_base95_10(lane_nonce, lane_digits[lane]);
+  }
 
-    unsigned long long report_interval = 0x1FFFFFFULL;
+  const unsigned long long stride = (unsigned long long)lanes * (unsigned long long)nth;
+  unsigned long long batches_done = 0ULL;
+  unsigned long long local_coins_found = 0ULL;
+  unsigned long long now = monotonic_ns();
+  int tlb_counter = aad_tlb_counter_open();
 
-    while(!stop_requested && (n_batches == 0ULL || batches_done < n_batches))
+  while(!stop_requested && (n_batches == 0ULL || batches_done < n_batches) && (deadline_ns == 0ULL || now < deadline_ns))
+  {
+    for(int batch_idx = 0; batch_idx < batch_size; ++batch_idx)
     {
-      for(int batch_idx = 0; batch_idx < BATCH_SIZE; ++batch_idx)
+      for(int lane = 0; lane < lanes; ++lane)
       {
-        for(int lane = 0; lane < N_LANES; ++lane)
-        {
-          for(int j = 0; j < 10; ++j)
-            write_lane_byte(interleaved_data[batch_idx], lane, 44 + j, (u08_t)(lane_digits[lane][j] + 32u));
-          base95_add(lane_digits[lane], stride);
-        }
+        for(int j = 0; j < 10; ++j)
+          write_lane_byte(lanes, interleaved_data[batch_idx], lane, 44 + j, (u08_t)(lane_digits[lane][j] + 32u));
+        base95_add(lane_digits[lane], stride);
       }
+    }
 
-      for(int batch_idx = 0; batch_idx < BATCH_SIZE; ++batch_idx)
+    for(int batch_idx = 0; batch_idx < batch_size; ++batch_idx)
+    {
+      if(lanes == 2 * N_LANES)
+        sha1_dual((dual_t *)&interleaved_data[batch_idx][0], (dual_t *)&interleaved_hash[batch_idx][0]);
+      else
       {
-        #if defined(USE_AVX512)
-          sha1_avx512f((v16si *)&interleaved_data[batch_idx][0], (v16si *)&interleaved_hash[batch_idx][0]);
-        #elif defined(USE_AVX2)
-          sha1_avx2((v8si *)&interleaved_data[batch_idx][0], (v8si *)&interleaved_hash[batch_idx][0]);
-        #elif defined(USE_AVX)
-          sha1_avx((v4si *)&interleaved_data[batch_idx][0], (v4si *)&interleaved_hash[batch_idx][0]);
-        #else
-          for(int lane = 0; lane < N_LANES; ++lane)
-          {
-            u32_t lane_words[14];
-            u32_t htmp[5];
-            gather_lane_words(lane_words, interleaved_data[batch_idx], lane);
-            sha1(lane_words, htmp);
-            for(int t = 0; t < 5; ++t)
-              interleaved_hash[batch_idx][t][lane] = htmp[t];
-          }
-        #endif
+      #if defined(USE_AVX512)
+        sha1_avx512f((v16si *)&interleaved_data[batch_idx][0], (v16si *)&interleaved_hash[batch_idx][0]);
+      #elif defined(USE_AVX2)
+        sha1_avx2((v8si *)&interleaved_data[batch_idx][0], (v8si *)&interleaved_hash[batch_idx][0]);
+      #elif defined(USE_AVX)
+        sha1_avx((v4si *)&interleaved_data[batch_idx][0], (v4si *)&interleaved_hash[batch_idx][0]);
+      #else
+        for(int lane = 0; lane < lanes; ++lane)
+        {
+          u32_t lane_words[14];
+          u32_t htmp[5];
+          gather_lane_words(lanes, lane_words, interleaved_data[batch_idx], lane);
+          sha1(lane_words, htmp);
+          for(int t = 0; t < 5; ++t)
+            interleaved_hash[batch_idx][t][lane] = htmp[t];
+        }
+      #endif
       }
+    }
 
-      for(int batch_idx = 0; batch_idx < BATCH_SIZE; ++batch_idx)
+    for(int batch_idx = 0; batch_idx < batch_size; ++batch_idx)
+    {
+      for(int lane = 0; lane < lanes; ++lane)
       {
-        for(int lane = 0; lane < N_LANES; ++lane)
+        u32_t h0 = interleaved_hash[batch_idx][0][lane];
+        if(__builtin_expect(h0 == 0xAAD20250u, 0))
         {
-          u32_t h0 = interleaved_hash[batch_idx][0][lane];
-          if(__builtin_expect(h0 == 0xAAD20250u, 0))
+          u32_t hash[5];
+          for(int t = 0; t < 5; ++t)
+            hash[t] = interleaved_hash[batch_idx][t][lane];
+          
+          unsigned int zeros = __builtin_clz(hash[1]);
+          if((hash[1] & ((1u << (31u - zeros)) - 1u)) == 0u)
           {
-            u32_t hash[5];
-            for(int t = 0; t < 5; ++t)
-              hash[t] = interleaved_hash[batch_idx][t][lane];
-            
-            unsigned int zeros = __builtin_clz(hash[1]);
-            if((hash[1] & ((1u << (31u - zeros)) - 1u)) == 0u)
+            for(unsigned int word = 2; word < 5 && zeros < 128u; ++word)
             {
-              for(unsigned int word = 2; word < 5 && zeros < 128u; ++word)
+              if(hash[word] == 0u)
+                zeros += 32u;
+              else
               {
-                if(hash[word] == 0u)
-                  zeros += 32u;
-                else
-                {
-                  zeros += __builtin_clz(hash[word]);
-                  break;
-                }
+                zeros += __builtin_clz(hash[word]);
+                break;
               }
             }
-            if(zeros > 99u) zeros = 99u;
+          }
+          if(zeros > 99u) zeros = 99u;
 
-            unsigned long long found_nonce = base_nonce + (unsigned long long)(batch_idx * stride) + (unsigned long long)lane - (unsigned long long)(BATCH_SIZE * stride);
+          unsigned long long found_nonce = base_nonce + (unsigned long long)batch_idx * stride + (unsigned long long)lane - (unsigned long long)batch_size * stride;
 
-            u32_t coin_words[14];
-            gather_lane_words(coin_words, interleaved_data[batch_idx], lane);
+          u32_t coin_words[14];
+          gather_lane_words(lanes, coin_words, interleaved_data[batch_idx], lane);
 
-            #pragma omp critical(aad_vault)
-            {
-              save_coin(coin_words);
-              coins_found++;
-            }
+          #pragma omp critical(aad_vault)
+          save_coin(coin_words);
 
-            local_coins_found++;
+          local_coins_found++;
+          __atomic_store_n(&stats[tid].coins, local_coins_found, __ATOMIC_RELAXED);
 
-            #pragma omp critical(console)
-            printf("Found DETI coin (OPT): tid=%d nonce=%llu zeros=%u\n", tid, found_nonce, zeros);
-          }
+          #pragma omp critical(console)
+          printf("Found DETI coin (OPT): tid=%d nonce=%llu zeros=%u\n", tid, found_nonce, zeros);
         }
       }
+    }
 
-      base_nonce += stride * BATCH_SIZE;
-      batches_done += BATCH_SIZE;
-      
-      #pragma omp atomic
-      global_batches += BATCH_SIZE;
+    base_nonce += stride * (unsigned long long)batch_size;
+    batches_done += (unsigned long long)batch_size;
+    now = monotonic_ns();
+    
+    __atomic_store_n(&stats[tid].hashes, batches_done * (unsigned long long)lanes, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats[tid].nonce, base_nonce, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats[tid].ns, now, __ATOMIC_RELEASE);
+  }
 
-      #pragma omp master
-      {
-        unsigned long long batches_snapshot;
-        #pragma omp atomic read
-        batches_snapshot = global_batches;
-        unsigned long long current_total = batches_snapshot * (unsigned long long)N_LANES;
-        
-        if((current_total & report_interval) == 0ULL && current_total != total_iterations)
-        {
-          total_iterations = current_total;
-          time_measurement();
-          double delta = wall_time_delta();
-          total_elapsed_time += delta;
-          double fps = (delta > 0.0) ? (double)(total_iterations - last_report_iter) / delta : 0.0;
-          last_report_iter = total_iterations;
-          
-          fprintf(stderr, "Speed: %.2f MH/s (%.2f M/min) | Nonce: %llx | Coins: %llu\n", 
-                  fps / 1000000.0, 
-                  (fps * 60.0) / 1000000.0, 
-                  base_nonce,
-                  coins_found);
-        }
-      }
+  long long tlb_misses = aad_tlb_counter_close(tlb_counter);
+  if(tlb_misses >= 0LL)
+    __atomic_store_n(&stats[tid].tlb_misses, (unsigned long long)tlb_misses, __ATOMIC_RELAXED);
+  else
+    tlb_counted = 0;
+  aad_arena_free(&arena);
+}
+
+// searches with params until every thread has done n_batches batches (0 for no limit), seconds have passed (0
+// for no limit) or SIGINT arrives; starts stats[] from zero, and returns the time taken
+static double search(const search_params_t *params, unsigned long long n_batches, double seconds, int report)
+{
+  memset(stats, 0, (size_t)n_stats * sizeof(thread_stats_t));
+  tlb_counted = 1;
+  unsigned long long start_ns = monotonic_ns();
+  unsigned long long deadline_ns = (seconds > 0.0) ? start_ns + (unsigned long long)(seconds * 1e9) : 0ULL;
+
+  #pragma omp parallel num_threads(params->threads)
+  {
+    // pinned first, so that the batch buffers are touched first (and so placed) on the thread's node
+    if(policy != NULL)
+      thread_cpu[omp_get_thread_num()] = aad_pin_thread(&placement, omp_get_thread_num());
+    if(params->streams == 2)
+      search_thread(2 * N_LANES, params->batch_size, n_batches, deadline_ns, report && policy != NULL);
+    else
+      search_thread(N_LANES, params->batch_size, n_batches, deadline_ns, report && policy != NULL);
+  }
+  return (double)(monotonic_ns() - start_ns) * 1e-9;
+}
+
+// sweeps the batch size and the stream count with every thread, then the thread count with the best of those,
+// seconds per candidate; leaves the fastest in params, and returns 0, or -1 if interrupted
+static int tune(search_params_t *params, double seconds, int max_threads)
+{
+  static const int batch_sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+  search_params_t p = { 0, 0, max_threads };
+  double best_rate = 0.0;
+
+  fprintf(stderr, "Tuning: %.1f seconds per candidate, %d lanes\n", seconds, N_LANES);
+  p.batch_size = BATCH_SIZE, p.streams = 1;
+  (void)search(&p, 0ULL, seconds, 0);  // a warm up, so that the first candidate is not the one to pay for it
+  for(p.streams = 1; p.streams <= 2 && !stop_requested; ++p.streams)
+    for(int i = 0; i < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])) && !stop_requested; ++i)
+    {
+      p.batch_size = batch_sizes[i];
+      double rate = (double)total_stat(offsetof(thread_stats_t, hashes)) / search(&p, 0ULL, seconds, 0);
+      fprintf(stderr, "  batch %5d  %s stream  %3d threads  %8.2f MH/s\n", p.batch_size, (p.streams == 2) ? "dual  " : "single",
+              p.threads, rate / 1000000.0);
+      if(rate > best_rate)
+        best_rate = rate, *params = p;
     }
+  p = *params;
+  for(int t = 1; t < max_threads && !stop_requested; t = (2 * t < max_threads) ? 2 * t : max_threads)
+  {
+    p.threads = t;
+    double rate = (double)total_stat(offsetof(thread_stats_t, hashes)) / search(&p, 0ULL, seconds, 0);
+    fprintf(stderr, "  batch %5d  %s stream  %3d threads  %8.2f MH/s\n", p.batch_size, (p.streams == 2) ? "dual  " : "single",
+            p.threads, rate / 1000000.0);
+    if(rate > best_rate)
+      best_rate = rate, *params = p;
   }
+  if(stop_requested)
+    return -1;
+  fprintf(stderr, "Tuning: best is batch %d, %s stream, %d threads (%.2f MH/s)\n", params->batch_size,
+          (params->streams == 2) ? "dual" : "single", params->threads, best_rate / 1000000.0);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long long n_batches = 0ULL;
+  double tune_seconds = 0.0;
+  int batch_size = 0, streams = 0, threads = 0;
+
+  for(int i = 1; i < argc; ++i)
+  {
+    if(argv[i][0] == '-' && argv[i][1] == 's' && i + 1 < argc)
+    {
+      custom_string = argv[i + 1];
+      custom_string_len = (int)strlen(custom_string);
+      if(custom_string_len > 32)
+        custom_string_len = 32;
+      ++i;
+    }
+    else if(argv[i][0] == '-' && argv[i][1] == 'a' && i + 1 < argc)
+    {
+      policy = argv[++i];
+    }
+    else if(argv[i][0] == '-' && argv[i][1] == 'b' && i + 1 < argc)
+    {
+      batch_size = atoi(argv[++i]);
+    }
+    else if(argv[i][0] == '-' && argv[i][1] == 'k' && i + 1 < argc)
+    {
+      streams = atoi(argv[++i]);
+    }
+    else if(argv[i][0] == '-' && argv[i][1] == 'n' && i + 1 < argc)
+    {
+      threads = atoi(argv[++i]);
+    }
+    else if(argv[i][0] == '-' && argv[i][1] == 'p' && i + 1 < argc)
+    {
+      page_mode = argv[++i];
+    }
+    else if(argv[i][0] == '-' && argv[i][1] == 't' && i + 1 < argc)
+    {
+      tune_seconds = atof(argv[++i]);
+    }
+    else if(argv[i][0] != '-')
+    {
+      n_batches = strtoull(argv[i], NULL, 10);
+    }
+  }
+  if(batch_size < 0 || batch_size > 65536 || streams < 0 || streams > 2 || threads < 0 || tune_seconds < 0.0 ||
+     (strcmp(page_mode, "hugetlb") != 0 && strcmp(page_mode, "thp") != 0 && strcmp(page_mode, "small") != 0))
+  {
+    fprintf(stderr, "Usage: %s [-s string] [-a policy] [-b batch_size] [-k 1|2] [-n threads] [-p hugetlb|thp|small] [-t seconds] [n_batches]\n",
+            argv[0]);
+    return 1;
+  }
+
+  (void)signal(SIGINT, handle_sigint);
+
+  // with a placement policy every thread is pinned to its own CPU (nosmt may leave fewer CPUs than threads)
+  if(policy != NULL)
+  {
+    if(aad_placement_init(&placement, policy) < 0)
+    {
+      fprintf(stderr, "Unknown placement policy \"%s\" (compact, scatter, cores or nosmt), or no topology\n", policy);
+      return 1;
+    }
+    if(omp_get_max_threads() > placement.n_cpus)
+      omp_set_num_threads(placement.n_cpus);
+  }
+  const int max_threads = omp_get_max_threads();
+  thread_cpu = (int *)calloc((size_t)max_threads, sizeof(int));
+  buffer_node = (int *)calloc((size_t)max_threads, sizeof(int));
+  buffer_pages = (int *)calloc((size_t)max_threads, sizeof(int));
+
+  n_stats = max_threads;
+  stats = (thread_stats_t *)aligned_alloc(sizeof(thread_stats_t), (size_t)n_stats * sizeof(thread_stats_t));
+  if(stats == NULL)
+  {
+    fprintf(stderr, "Failed to allocate the thread statistics\n");
+    return 1;
+  }
+
+  // the tuning profile of the host, if it was made for the same vector width; the command line has the last word
+  search_params_t params = { BATCH_SIZE, 1, max_threads };
+  long value;
+  if(tune_seconds > 0.0)
+  {
+    if(tune(&params, tune_seconds, max_threads) < 0)
+      return 1;
+    if(aad_profile_set(PROGRAM, "lanes", N_LANES) < 0 || aad_profile_set(PROGRAM, "batch_size", params.batch_size) < 0 ||
+       aad_profile_set(PROGRAM, "streams", params.streams) < 0 || aad_profile_set(PROGRAM, "threads", params.threads) < 0)
+      fprintf(stderr, "Failed to save the tuning profile %s\n", aad_profile_name());
+    else
+      fprintf(stderr, "Tuning profile saved to %s\n", aad_profile_name());
+  }
+  else if(aad_profile_get(PROGRAM, "lanes", &value) && value == N_LANES)
+  {
+    if(aad_profile_get(PROGRAM, "batch_size", &value) && value > 0 && value <= 65536)
+      params.batch_size = (int)value;
+    if(aad_profile_get(PROGRAM, "streams", &value) && (value == 1 || value == 2))
+      params.streams = (int)value;
+    if(aad_profile_get(PROGRAM, "threads", &value) && value > 0)
+      params.threads = (value < max_threads) ? (int)value : max_threads;
+    fprintf(stderr, "Tuning profile %s loaded\n", aad_profile_name());
+  }
+  if(batch_size > 0)
+    params.batch_size = batch_size;
+  if(streams > 0)
+    params.streams = streams;
+  if(threads > 0)
+    params.threads = (threads < max_threads) ? threads : max_threads;
+  fprintf(stderr, "Search: batch %d, %s stream (%d lanes), %d threads\n", params.batch_size,
+          (params.streams == 2) ? "dual" : "single", params.streams * N_LANES, params.threads);
+
+  time_measurement();
+  pthread_t reporter_thread;
+  reporter_running = 1;
+  pthread_create(&reporter_thread, NULL, reporter, NULL);
+
+  (void)search(&params, n_batches, 0.0, 1);
 
-  save_coin(NULL);
-  
   time_measurement();
-  double final_time = wall_time_delta();
-  total_elapsed_time += final_time;
+  double total_elapsed_time = wall_time_delta();
+  reporter_running = 0;
+  pthread_join(reporter_thread, NULL);
+  save_coin(NULL);
   
-  unsigned long long final_total_hashes = global_batches * (unsigned long long)N_LANES;
+  unsigned long long final_total_hashes = total_stat(offsetof(thread_stats_t, hashes));
+  unsigned long long coins_found = total_stat(offsetof(thread_stats_t, coins));
+  unsigned long long tlb_misses = total_stat(offsetof(thread_stats_t, tlb_misses));
+  int n_huge = 0;
+  for(int t = 0; t < params.threads; ++t)
+    n_huge += buffer_pages[t] != AAD_ARENA_SMALL;
+  const char *pages = aad_arena_kind_name(buffer_pages[0]);
+  free(thread_cpu);
+  free(buffer_node);
+  free(buffer_pages);
+  free(stats);
   double avg_hashes_per_sec = (total_elapsed_time > 0.0) ? (double)final_total_hashes / total_elapsed_time : 0.0;
   double avg_hashes_per_min = avg_hashes_per_sec * 60.0;
   double hashes_per_coin = (coins_found > 0ULL) ? (double)final_total_hashes / (double)coins_found : 0.0;
@@ -313,6 +608,12 @@ int main(int argc, char **argv)
   printf("Total time:           %.2f seconds\n", total_elapsed_time);
   printf("Average speed:        %.2f MH/s\n", avg_hashes_per_sec / 1000000.0);
   printf("Average speed:        %.2f M/min\n", avg_hashes_per_min / 1000000.0);
+  printf("Batch buffer pages:   %s (%d of %d threads on huge pages)\n", pages, n_huge, params.threads);
+  if(tlb_counted)
+    printf("dTLB load misses:     %llu (%.3f per million hashes)\n", tlb_misses,
+           (final_total_hashes > 0ULL) ? (double)tlb_misses * 1e6 / (double)final_total_hashes : 0.0);
+  else
+    printf("dTLB load misses:     N/A (no perf events)\n");
   if(coins_found > 0ULL)
     printf("Hashes per coin:      %.2f\n", hashes_per_coin);
   else
@@ -320,4 +621,4 @@ int main(int argc, char **argv)
   printf("========================================\n");
   
   return 0;
-}
\ No newline at end of file
+}